@@ -5,10 +5,19 @@
 #include <chrono>
 #include <functional>
 #include <map>
+#include <memory>
 #include <queue>
+#include <vector>
+#include "utils/latency_histogram.h"
+#include "utils/mpsc_queue.h"
 #include "transport/protocol_transport.h"
 #include "protocol/haier_message.h"
 
+// Default number of messages that can wait in the thread safe intake
+#ifndef HAIER_MESSAGE_INTAKE_SIZE
+    #define HAIER_MESSAGE_INTAKE_SIZE 16
+#endif
+
 namespace haier_protocol
 {
 
@@ -44,10 +53,38 @@ using AnswerHandler = std::function<HandlerError(FrameType, FrameType, const uin
 // return: Result of processing
 using TimeoutHandler = std::function<HandlerError(FrameType)>;
 
+// Intake wakeup handler type.
+// Called by post_message in the posting thread after the message is queued,
+// should wake up the thread that runs the loop (write to eventfd, notify condition, etc.)
+using IntakeWakeupHandler = std::function<void()>;
+
+// Address discovery result handler type.
+// argument 1: Unit addresses (UNADDRESSED and BROADCAST_ADDRESS are skipped)
+// argument 2: Number of addresses
+using AddressesHandler = std::function<void(const uint8_t*, size_t)>;
+
 HandlerError default_message_handler(FrameType message_type, const uint8_t* data, size_t data_size);
 HandlerError default_answer_handler(FrameType message_type, FrameType request_type, const uint8_t* data, size_t data_size);
 HandlerError default_timeout_handler(FrameType message_type);
 
+struct ProtocolStatistics
+{
+    StatCounter         frames_dropped;         // extra incoming frames dropped in IDLE state and answers from wrong address
+    StatCounter         messages_sent;          // requests including retries
+    StatCounter         retries;
+    StatCounter         answers_received;
+    FrameTypeCounters   answer_timeouts;        // by request frame type
+    StatCounter         outgoing_queue_high_water_mark;
+};
+
+// Allocated only when enabled with ProtocolHandler::enable_latency_statistics
+struct LatencyStatistics
+{
+    FrameTypeTable<LatencyHistogram>    answer_latency;     // by request frame type, from request sent till answer start
+    LatencyHistogram                    queue_wait;         // from adding to outgoing queue till first transmission
+    LatencyHistogram                    dispatch_delay;     // from incoming frame parsed till handler call
+};
+
 class ProtocolHandler 
 {
 public:
@@ -56,7 +93,8 @@ public:
     ProtocolHandler& operator=(const ProtocolHandler&) = delete;
     explicit ProtocolHandler(ProtocolStream&) noexcept;
     ProtocolHandler(ProtocolStream&, size_t) noexcept;
-    size_t get_outgoing_queue_size() const noexcept {return this->outgoing_messages_.size(); };
+    size_t get_outgoing_queue_size() const noexcept {return this->outgoing_messages_count_; };
+    size_t get_outgoing_queue_size(uint8_t address) const noexcept;
     bool is_waiting_for_answer() const {return (this->state_ == ProtocolState::WAITING_FOR_ANSWER); };
     void set_answer_timeout(long long answer_timeout_miliseconds);
     void set_answer_timeout(std::chrono::milliseconds answer_timeout);
@@ -64,6 +102,36 @@ public:
     void set_cooldown_interval(std::chrono::milliseconds answer_timeout);
     void send_message(const HaierMessage& message, bool use_crc, uint8_t num_retries = 0, std::chrono::milliseconds interval = std::chrono::milliseconds::zero());
     void send_message_without_answer(const HaierMessage& message, bool use_crc);
+    // Multi-unit bus. Every unit address has its own outgoing queue, queues take turns so
+    // a slow or silent unit doesn't hold messages for other units. Group message is sent
+    // once to BROADCAST_ADDRESS, all units process it and nobody answers.
+    void send_message_to(uint8_t address, const HaierMessage& message, bool use_crc, uint8_t num_retries = 0, std::chrono::milliseconds interval = std::chrono::milliseconds::zero());
+    void send_group_message(const HaierMessage& message, bool use_crc);
+    // Request addresses of all units, GET_ALL_ADDRESSES goes without address and is answered by the bus master unit,
+    // answer data is the list of addresses (one byte per unit). Handler is called when answer is received.
+    // Discovery sets its own GET_ALL_ADDRESSES answer handler, it replaces the one set by set_answer_handler.
+    void discover_addresses(bool use_crc, AddressesHandler handler = nullptr, uint8_t num_retries = 0);
+    // Addresses from the last discovery answer
+    const std::vector<uint8_t>& get_known_addresses() const noexcept { return this->known_addresses_; };
+    // Unit side: own address (UNADDRESSED by default - the only unit on the line, also used by module side).
+    // Unit with address gets only frames for this address and broadcasts, its frames carry the address.
+    void set_address(uint8_t address);
+    uint8_t get_address() const noexcept { return this->address_; };
+    // Make this unit bus master: it also gets frames without address and answers
+    // GET_ALL_ADDRESSES with the list of units. Empty list removes master role.
+    void set_bus_addresses(const uint8_t* addresses, size_t count);
+    // Address of the frame that is handled now, use in message and answer handlers
+    uint8_t get_incoming_address() const noexcept { return this->incoming_address_; };
+    // Thread safe submission: post_message can be called from any thread while another one runs loop(),
+    // posted messages go to the outgoing queue at the beginning of the next loop().
+    // Intake is allocated by enable_message_intake, call it before other threads start posting.
+    // Return false if intake is not enabled or full. post_message_to and post_group_message are
+    // thread safe versions of send_message_to and send_group_message.
+    void enable_message_intake(size_t capacity = HAIER_MESSAGE_INTAKE_SIZE, IntakeWakeupHandler wakeup_handler = nullptr);
+    bool post_message(const HaierMessage& message, bool use_crc, uint8_t num_retries = 0, std::chrono::milliseconds interval = std::chrono::milliseconds::zero());
+    bool post_message_without_answer(const HaierMessage& message, bool use_crc);
+    bool post_message_to(uint8_t address, const HaierMessage& message, bool use_crc, uint8_t num_retries = 0, std::chrono::milliseconds interval = std::chrono::milliseconds::zero());
+    bool post_group_message(const HaierMessage& message, bool use_crc);
     void send_answer(const HaierMessage& answer);
     void send_answer(const HaierMessage& answer, bool use_crc);
     // Use this function to suppress warning if you don't answer an appliance request on purpose
@@ -77,9 +145,34 @@ public:
     void set_timeout_handler(FrameType message_type, TimeoutHandler handler);
     void remove_timeout_handler(FrameType message_type);
     void set_default_timeout_handler(TimeoutHandler handler);
+    FlightRecorder& get_flight_recorder() noexcept { return this->transport_.get_flight_recorder(); };
+    const FlightRecorder& get_flight_recorder() const noexcept { return this->transport_.get_flight_recorder(); };
+    // Statistics can be read from any thread without stopping the loop
+    const ProtocolStatistics& get_statistics() const noexcept { return this->statistics_; };
+    const TransportStatistics& get_transport_statistics() const noexcept { return this->transport_.get_statistics(); };
+    // Latency histograms take about 10KB so they are disabled by default.
+    // Enable before reading statistics from other threads.
+    void enable_latency_statistics();
+    // Return nullptr if latency statistics is not enabled
+    const LatencyStatistics* get_latency_statistics() const noexcept { return this->latency_statistics_.get(); };
+    // Baud rate switching (used for OTA). Appliance requests the new rate with CHANGE_BAUD_RATE frame,
+    // data is 32 bit big endian baud rate. Handler answers with CHANGE_BAUD_RATE_RESPONSE containing
+    // the rate it is going to use and switches the stream right after the answer is transmitted.
+    // Requests above max_baud_rate are answered with the current rate, 0 (default) disables switching.
+    void set_max_baud_rate(uint32_t max_baud_rate);
+    // Switch stream to the new rate (call only between frames), answer timeout is scaled to the new rate
+    bool set_baud_rate(uint32_t baud_rate);
+    // Return 0 if stream doesn't support baud rate switching
+    uint32_t get_baud_rate() const noexcept { return this->transport_.get_baud_rate(); };
     virtual void loop();
 protected:
-    bool write_message_(const HaierMessage& message, bool use_crc);
+    bool write_message_(const HaierMessage& message, bool use_crc, uint8_t address);
+    void enqueue_message_(uint8_t address, const HaierMessage& message, bool use_crc, bool no_answer, uint8_t num_retries, std::chrono::milliseconds interval, std::chrono::steady_clock::time_point enqueue_time_point);
+    bool post_(uint8_t address, const HaierMessage& message, bool use_crc, bool no_answer, uint8_t num_retries, std::chrono::milliseconds interval);
+    void process_intake_();
+    HandlerError change_baud_rate_handler_(FrameType message_type, const uint8_t* data, size_t data_size);
+    HandlerError get_addresses_handler_(FrameType message_type, const uint8_t* data, size_t data_size);
+    HandlerError addresses_answer_handler_(FrameType request_type, FrameType message_type, const uint8_t* data, size_t data_size);
     enum class ProtocolState
     {
         IDLE,
@@ -92,13 +185,30 @@ protected:
         bool no_answer;
         int number_of_retries;
         std::chrono::milliseconds retry_interval;
+        std::chrono::steady_clock::time_point enqueue_time_point;
+        bool transmitted;
     };
     using OutgoingQueue = std::queue<OutgoingQueueItem>;
+    // Next non empty queue after the one that was served last, outgoing queues should not be empty
+    OutgoingQueue& select_queue_();
+    void pop_message_();
+    struct PostedMessage
+    {
+        uint8_t address;
+        HaierMessage message;
+        bool use_crc;
+        bool no_answer;
+        uint8_t number_of_retries;
+        std::chrono::milliseconds retry_interval;
+        std::chrono::steady_clock::time_point enqueue_time_point;
+    };
     TransportLevelHandler                   transport_;
     std::map<FrameType, MessageHandler>     message_handlers_map_;
     std::map<FrameType, AnswerHandler>      answer_handlers_map_;
     std::map<FrameType, TimeoutHandler>     timeout_handlers_map_;
-    OutgoingQueue                           outgoing_messages_;
+    std::map<uint8_t, OutgoingQueue>        outgoing_queues_;       // by address
+    size_t                                  outgoing_messages_count_;
+    uint8_t                                 current_address_;       // queue of the message that was sent last
     MessageHandler                          default_message_handler_;
     AnswerHandler                           default_answer_handler_;
     TimeoutHandler                          default_timeout_handler_;
@@ -108,10 +218,22 @@ protected:
     bool                                    answer_sent_;
     FrameType                               last_message_type_;
     std::chrono::milliseconds               answer_timeout_interval_;
+    std::chrono::milliseconds               scaled_answer_timeout_;     // answer_timeout_interval_ for current baud rate
     std::chrono::milliseconds               cooldown_interval_;
     std::chrono::steady_clock::time_point   cooldown_time_point_;
     std::chrono::steady_clock::time_point   answer_time_point_;
     std::chrono::steady_clock::time_point   retry_time_point_;
+    std::chrono::steady_clock::time_point   last_message_sent_;
+    ProtocolStatistics                      statistics_;
+    std::unique_ptr<LatencyStatistics>      latency_statistics_;
+    std::unique_ptr<MpscQueue<PostedMessage>> message_intake_;
+    IntakeWakeupHandler                     intake_wakeup_handler_;
+    uint32_t                                max_baud_rate_;
+    uint8_t                                 address_;
+    uint8_t                                 incoming_address_;
+    std::vector<uint8_t>                    bus_addresses_;
+    std::vector<uint8_t>                    known_addresses_;
+    AddressesHandler                        addresses_handler_;
 };
 
 
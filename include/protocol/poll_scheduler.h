@@ -0,0 +1,118 @@
+#ifndef POLL_SCHEDULER_H
+#define POLL_SCHEDULER_H
+
+#include <stdint.h>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+#include "protocol/haier_protocol.h"
+
+namespace haier_protocol
+{
+
+using PollId = size_t;
+
+struct PollStatistics
+{
+    StatCounter         requests_sent;
+    StatCounter         answers_received;
+    StatCounter         answer_timeouts;
+};
+
+// Owns periodic requests of one device (status, big data, alarms, network status) and
+// decides when each of them goes to the bus:
+//  - first request of every poll is sent at random phase of its interval and every next
+//    interval is jittered, so devices that share a host don't poll at the same moment
+//  - answer timeout doubles poll interval (up to max backoff), next answer restores it
+//  - after a command polls that have fast interval use it during fast poll window
+//  - with bus budget request is sent only when link has time for the request and its answer.
+//    When several polls are due the one that is late the most (relative to its interval)
+//    per byte on the wire goes first.
+// Request is sent only when protocol handler has nothing else to send, so polls never delay
+// commands. Scheduler should be used from the thread that runs protocol handler loop.
+class PollScheduler
+{
+public:
+    PollScheduler() = delete;
+    PollScheduler(const PollScheduler&) = delete;
+    PollScheduler& operator=(const PollScheduler&) = delete;
+    explicit PollScheduler(ProtocolHandler& protocol_handler);
+    // Seed of interval jitter, the first constructor uses random device
+    PollScheduler(ProtocolHandler& protocol_handler, uint32_t seed);
+    // fast_interval zero means that poll doesn't speed up after commands
+    PollId add_poll(const HaierMessage& request, bool use_crc, std::chrono::milliseconds interval, std::chrono::milliseconds fast_interval = std::chrono::milliseconds::zero());
+    // Replace request data (network status report for example), frame type should stay the same
+    void set_request(PollId poll, const HaierMessage& request);
+    // Intervals are randomized by +-ratio, default is 0.1
+    void set_jitter(float ratio);
+    // Maximal interval multiplier after timeouts, default is 16
+    void set_max_backoff(uint8_t factor);
+    // Time after command when fast intervals are used, default is 10 seconds
+    void set_fast_poll_window(std::chrono::milliseconds window);
+    // Share of link time (0..1) for polls and commands, 0 disables budget.
+    // baud_rate 0 means the current rate of protocol handler stream.
+    void set_bus_budget(float utilization, uint32_t baud_rate = 0);
+    // Send command through protocol handler, command bytes are taken from the budget
+    void send_command(const HaierMessage& command, bool use_crc, uint8_t num_retries = 0, std::chrono::milliseconds interval = std::chrono::milliseconds::zero());
+    // Install answer and timeout handlers for frame types of all polls (call after polls are added),
+    // handlers pass everything to next handlers. Integrators that have own handlers for these
+    // frame types can call process_answer and process_timeout from them instead.
+    void register_handlers(AnswerHandler next_answer_handler = default_answer_handler, TimeoutHandler next_timeout_handler = default_timeout_handler);
+    void process_answer(FrameType request_type, size_t data_size);
+    void process_timeout(FrameType request_type);
+    void loop(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+    size_t get_polls_count() const noexcept { return this->polls_.size(); };
+    const PollStatistics& get_poll_statistics(PollId poll) const noexcept { return this->polls_[poll]->statistics; };
+    // Current interval with backoff and fast polling
+    std::chrono::milliseconds get_interval(PollId poll, std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) const;
+    std::chrono::steady_clock::time_point get_next_request(PollId poll) const noexcept { return this->polls_[poll]->next_request; };
+    // Default time_point if poll was never answered
+    std::chrono::steady_clock::time_point get_last_answer(PollId poll) const noexcept { return this->polls_[poll]->last_answer; };
+    // Number of times due poll had to wait for bus budget
+    uint32_t get_budget_waits() const noexcept { return this->budget_waits_.get(); };
+protected:
+    struct Poll
+    {
+        HaierMessage                            request;
+        bool                                    use_crc;
+        std::chrono::milliseconds               interval;
+        std::chrono::milliseconds               fast_interval;
+        uint8_t                                 backoff;
+        // Estimated bytes on the wire for request and answer
+        size_t                                  request_size;
+        size_t                                  answer_size;
+        std::chrono::steady_clock::time_point   next_request;
+        std::chrono::steady_clock::time_point   last_request;
+        std::chrono::steady_clock::time_point   last_answer;
+        PollStatistics                          statistics;
+    };
+    static constexpr PollId NO_POLL = (PollId) -1;
+    bool is_fast_(const Poll& poll, std::chrono::steady_clock::time_point now) const;
+    std::chrono::milliseconds get_interval_(const Poll& poll, std::chrono::steady_clock::time_point now) const;
+    std::chrono::steady_clock::duration get_jittered_(std::chrono::milliseconds interval);
+    void schedule_next_(Poll& poll, std::chrono::steady_clock::time_point now);
+    // Bytes per second, 0 if there is no budget
+    float get_budget_rate_() const;
+    // Unused budget is accumulated up to this number of bytes
+    float get_budget_limit_(float rate) const;
+    void update_budget_(std::chrono::steady_clock::time_point now);
+    ProtocolHandler&                        protocol_handler_;
+    std::vector<std::unique_ptr<Poll>>      polls_;
+    std::minstd_rand                        random_;
+    float                                   jitter_;
+    uint8_t                                 max_backoff_;
+    std::chrono::milliseconds               fast_poll_window_;
+    std::chrono::steady_clock::time_point   last_command_;
+    float                                   budget_utilization_;
+    uint32_t                                budget_baud_rate_;
+    // Bytes that can be sent now, negative after commands
+    float                                   budget_bytes_;
+    std::chrono::steady_clock::time_point   budget_time_point_;
+    PollId                                  poll_in_flight_;
+    bool                                    waiting_for_budget_;
+    StatCounter                             budget_waits_;
+};
+
+} // haier_protocol
+#endif // POLL_SCHEDULER_H
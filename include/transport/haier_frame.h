@@ -12,6 +12,11 @@ constexpr uint8_t SEPARATOR_BYTE          = 0xFF;
 constexpr uint8_t SEPARATOR_POST_BYTE     = 0x55;
 constexpr uint8_t FRAME_SEPARATORS_COUNT  = 0x02;
 constexpr uint8_t PURE_HEADER_SIZE        = FRAME_HEADER_SIZE - FRAME_SEPARATORS_COUNT;
+// Unit address on multi-unit bus (first of reserved header bytes).
+// Frames without address are for the only unit on the line (or for bus master),
+// broadcast frames are processed by all units and never answered.
+constexpr uint8_t UNADDRESSED             = 0x00;
+constexpr uint8_t BROADCAST_ADDRESS       = 0xFE;
 
 enum class FrameStatus
 {
@@ -35,6 +40,13 @@ enum class FrameError
     UNKNOWN_DATA,
 };
 
+constexpr size_t FRAME_ERRORS_COUNT = (size_t) FrameError::UNKNOWN_DATA + 1;
+
+// CRC-16/ARC of the data
+uint16_t crc16(const uint8_t* const data, size_t size, uint16_t initial_val = 0);
+// Sum of all data bytes
+uint8_t checksum(const uint8_t* const data, size_t size, uint8_t initial_val = 0);
+
 class HaierFrame
 {
 public:
@@ -42,12 +54,13 @@ public:
     HaierFrame(const HaierFrame&) = delete;
     HaierFrame& operator=(const HaierFrame&) = delete;
     HaierFrame& operator=(HaierFrame&&) noexcept;
-    HaierFrame(uint8_t frame_type, const uint8_t* const data, uint8_t data_size, bool use_crc = true);
+    HaierFrame(uint8_t frame_type, const uint8_t* const data, uint8_t data_size, bool use_crc = true, uint8_t address = UNADDRESSED);
     HaierFrame(HaierFrame&&) noexcept;
     virtual ~HaierFrame() noexcept;
     FrameStatus         get_status() const { return this->status_; };
     uint8_t             get_frame_type() const { return this->frame_type_; };
     bool                get_use_crc() const { return this->use_crc_; };
+    uint8_t             get_address() const { return this->address_; };
     uint8_t             get_data_size() const { return this->data_size_; };
     uint8_t             get_checksum() const { return this->checksum_; };
     uint16_t            get_crc() const { return this->crc_; };
@@ -59,6 +72,7 @@ public:
 protected:
     uint8_t             frame_type_;
     bool                use_crc_;
+    uint8_t             address_;
     uint8_t             data_size_;
     uint8_t             checksum_;
     uint16_t            crc_;
@@ -6,6 +6,8 @@
 #include "utils/haier_log.h"
 #include "utils/circular_buffer.h"
 #include "utils/protocol_stream.h"
+#include "utils/flight_recorder.h"
+#include "utils/haier_statistics.h"
 #include "transport/haier_frame.h"
 
 namespace haier_protocol
@@ -14,7 +16,23 @@ namespace haier_protocol
 struct TimestampedFrame
 {
     HaierFrame frame;
-    std::chrono::steady_clock::time_point timestamp;
+    std::chrono::steady_clock::time_point timestamp;            // frame start found
+    std::chrono::steady_clock::time_point complete_timestamp;   // frame parsed
+};
+
+// Timeouts are set for DEFAULT_BAUD_RATE, scale them to another rate (not less than min_timeout)
+std::chrono::milliseconds scale_timeout(std::chrono::milliseconds timeout, uint32_t baud_rate, std::chrono::milliseconds min_timeout);
+
+struct TransportStatistics
+{
+    StatCounter bytes_read;
+    StatCounter bytes_dropped;
+    StatCounter frames_parsed;
+    StatCounter frames_sent;
+    StatCounter frame_errors[FRAME_ERRORS_COUNT];   // by FrameError
+    StatCounter buffer_overflows;
+    StatCounter frame_timeouts;
+    StatCounter frames_filtered;                    // for other units of multi-unit bus
 };
 
 class TransportLevelHandler
@@ -23,7 +41,7 @@ public:
     TransportLevelHandler(const TransportLevelHandler&) = delete;
     TransportLevelHandler& operator=(const TransportLevelHandler&) = delete;
     explicit TransportLevelHandler(ProtocolStream& stream, size_t buffer_size) noexcept;
-    uint8_t send_data(uint8_t frameType, const uint8_t* data, size_t data_size, bool use_crc=true);
+    uint8_t send_data(uint8_t frameType, const uint8_t* data, size_t data_size, bool use_crc=true, uint8_t address=UNADDRESSED);
     size_t read_data();
     void process_data();
     size_t get_buffer_size() noexcept { return this->buffer_.get_capacity(); };
@@ -31,10 +49,23 @@ public:
     bool pop(TimestampedFrame& tframe);
     void drop(size_t frames_count);
     void reset_protocol() noexcept;
+    // Unit side of multi-unit bus: keep only frames for this address and broadcasts,
+    // frames without address are kept if accept_unaddressed is set. UNADDRESSED keeps everything.
+    void set_address_filter(uint8_t address, bool accept_unaddressed) noexcept;
+    // Return 0 if stream doesn't support baud rate switching
+    uint32_t get_baud_rate() const noexcept { return this->stream_.get_baud_rate(); };
+    bool supports_baud_rate(uint32_t baud_rate) const noexcept { return this->stream_.supports_baud_rate(baud_rate); };
+    // Switch stream to the new rate after all outgoing data is sent, frame timeout is scaled to the new rate
+    bool set_baud_rate(uint32_t baud_rate) noexcept;
+    FlightRecorder& get_flight_recorder() noexcept { return this->flight_recorder_; };
+    const FlightRecorder& get_flight_recorder() const noexcept { return this->flight_recorder_; };
+    // Can be read from any thread
+    const TransportStatistics& get_statistics() const noexcept { return this->statistics_; };
     virtual ~TransportLevelHandler();
 protected:
     void clear_();
     void drop_bytes_(size_t size);
+    void frame_error_(FrameError err);
     ProtocolStream&                 stream_;
     CircularBuffer<uint8_t>         buffer_;
     size_t                          pos_;
@@ -42,7 +73,12 @@ protected:
     bool                            frame_start_found_;
     HaierFrame                      current_frame_;
     std::chrono::steady_clock::time_point   frame_start_;
+    std::chrono::milliseconds       frame_timeout_;
+    uint8_t                         address_filter_;
+    bool                            accept_unaddressed_;
     std::queue<TimestampedFrame>    incoming_queue_;
+    FlightRecorder                  flight_recorder_;
+    TransportStatistics             statistics_;
 };
 
 } // HaierProtocol
@@ -22,6 +22,13 @@ public:
   size_t push(const T* items, size_t size);
   size_t pop(T* items, size_t size);
   T* reserve(size_t& size);
+  // Free space as up to two contiguous segments starting from the tail,
+  // items written there are added to the buffer with commit()
+  size_t get_free_segments(T*& segment1, size_t& size1, T*& segment2, size_t& size2);
+  size_t commit(size_t size);
+  // Stored items as up to two contiguous segments starting from the head,
+  // consumed items are removed with drop()
+  size_t get_data_segments(const T*& segment1, size_t& size1, const T*& segment2, size_t& size2) const;
   void clear();
   size_t drop(size_t size);
   bool empty() const { return is_empty_; };
@@ -161,6 +168,38 @@ T* CircularBuffer<T>::reserve(size_t& size)
     return result;
 }
 
+template<class T>
+size_t CircularBuffer<T>::get_free_segments(T*& segment1, size_t& size1, T*& segment2, size_t& size2)
+{
+  size_t space = this->get_space();
+  segment1 = this->buffer_ + this->tail_;
+  size1 = std::min(space, this->capacity_ - this->tail_);
+  segment2 = this->buffer_;
+  size2 = space - size1;
+  return space;
+}
+
+template<class T>
+size_t CircularBuffer<T>::commit(size_t size)
+{
+  size = std::min(size, this->get_space());
+  this->tail_ = (this->tail_ + size) % this->capacity_;
+  if (size > 0)
+    this->is_empty_ = false;
+  return size;
+}
+
+template<class T>
+size_t CircularBuffer<T>::get_data_segments(const T*& segment1, size_t& size1, const T*& segment2, size_t& size2) const
+{
+  size_t size = this->get_size();
+  segment1 = this->buffer_ + this->head_;
+  size1 = std::min(size, this->capacity_ - this->head_);
+  segment2 = this->buffer_;
+  size2 = size - size1;
+  return size;
+}
+
 template<class T>
 void CircularBuffer<T>::clear()
 {
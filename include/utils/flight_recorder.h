@@ -0,0 +1,85 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <atomic>
+#include <functional>
+#include "utils/haier_log.h"
+#include "utils/seqlock.h"
+
+// Number of the last events kept by the recorder
+#ifndef HAIER_FLIGHT_RECORDER_SIZE
+    #define HAIER_FLIGHT_RECORDER_SIZE 32
+#endif
+// Number of the frame data bytes kept for every frame event
+#ifndef HAIER_FLIGHT_RECORDER_PAYLOAD
+    #define HAIER_FLIGHT_RECORDER_PAYLOAD 8
+#endif
+
+namespace haier_protocol
+{
+
+enum class FlightEvent : uint8_t
+{
+    FRAME_RECEIVED,
+    FRAME_SENT,
+    FRAME_ERROR,        // error field contains FrameError
+    FRAME_TIMEOUT,
+    BUFFER_OVERFLOW,
+    BYTES_DROPPED,      // size field contains number of dropped bytes
+    FRAMES_DROPPED,     // size field contains number of dropped frames
+    ANSWER_TIMEOUT,     // frame_type field contains request type
+};
+
+constexpr uint8_t FLIGHT_RECORD_CRC_FLAG = 0x01;
+
+struct FlightRecord
+{
+    uint32_t    timestamp;      // steady clock, milliseconds
+    FlightEvent event;
+    uint8_t     frame_type;
+    uint8_t     flags;
+    uint8_t     error;
+    uint16_t    size;
+    uint8_t     payload_size;
+    uint8_t     payload[HAIER_FLIGHT_RECORDER_PAYLOAD];
+};
+
+class FlightRecorder;
+
+// Called from the protocol loop when error event is recorded
+using FlightRecorderTrigger = std::function<void(const FlightRecorder&, const FlightRecord&)>;
+
+// Fixed size ring of the last events, overwrites the oldest one.
+// Writing is allowed only from one thread (the one that runs protocol loop),
+// snapshot can be taken from any thread without locking.
+class FlightRecorder
+{
+public:
+    FlightRecorder() noexcept;
+    FlightRecorder(const FlightRecorder&) = delete;
+    FlightRecorder& operator=(const FlightRecorder&) = delete;
+    void record_frame(FlightEvent event, uint8_t frame_type, bool use_crc, const uint8_t* data, size_t data_size) noexcept;
+    void record_event(FlightEvent event, uint8_t frame_type = 0, uint8_t error = 0, size_t size = 0) noexcept;
+    // Copy up to max_records last events to records (oldest first), return the number of copied events
+    size_t snapshot(FlightRecord* records, size_t max_records) const noexcept;
+    // Total number of events recorded since creation
+    uint32_t get_events_count() const noexcept { return this->head_.load(std::memory_order_acquire); };
+    void dump(HaierLogLevel level = HaierLogLevel::LEVEL_WARNING) const;
+    void set_error_trigger(FlightRecorderTrigger trigger);
+    void reset_error_trigger();
+    static constexpr size_t get_capacity() { return HAIER_FLIGHT_RECORDER_SIZE; };
+private:
+    void push_(const FlightRecord& record) noexcept;
+    bool read_(uint32_t index, FlightRecord& record) const noexcept;
+    // Snapshot can copy a slot while it is overwritten
+    Seqlock<FlightRecord>   slots_[HAIER_FLIGHT_RECORDER_SIZE];
+    std::atomic<uint32_t>   head_;
+    FlightRecorderTrigger   error_trigger_;
+};
+
+const char* flight_event_to_string(FlightEvent event);
+
+} // haier_protocol
+#endif // FLIGHT_RECORDER_H
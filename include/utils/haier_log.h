@@ -1,6 +1,7 @@
 #ifndef HAIER_LOG_H
 #define HAIER_LOG_H
 
+#include <atomic>
 #include <functional>
 #include <string>
 #include <stdint.h> 
@@ -11,43 +12,59 @@ extern const char hex_map[];
     #define HAIER_LOG_LEVEL 0
 #endif
 
+#ifndef HAIER_LOG_TAG
+    #define HAIER_LOG_TAG "haier.protocol"
+#endif
+
+// Compile time check (HAIER_LOG_LEVEL) followed by runtime check (set_log_level).
+// Arguments of the logging macros are evaluated only if both checks passed.
+#define HAIER_LOG_COMPILED(level)   ((uint8_t)(level) - ((uint8_t)(level) > 3 ? 1 : 0) <= HAIER_LOG_LEVEL)
+#define HAIER_LOG_ENABLED(level)    (HAIER_LOG_COMPILED(level) && haier_protocol::is_log_level_enabled(level, HAIER_LOG_TAG))
+#define HAIER_LOG_IF_ENABLED_(level, call)  do { if (HAIER_LOG_ENABLED(level)) call; } while (0)
+#define HAIER_LOG_(level, ...)      HAIER_LOG_IF_ENABLED_(level, haier_protocol::log_haier_tagged(level, HAIER_LOG_TAG, __VA_ARGS__))
+#define HAIER_BUF_(level, header, buffer, size) \
+            HAIER_LOG_IF_ENABLED_(level, haier_protocol::log_haier_buffers_tagged(level, HAIER_LOG_TAG, header, buffer, size, nullptr, 0))
+
 #if (HAIER_LOG_LEVEL > 0)
-    #define HAIER_LOGE(...)	log_haier(haier_protocol::HaierLogLevel::LEVEL_ERROR, __VA_ARGS__)
-    #define HAIER_BUFE(header, buffer, size)	log_haier_buffer(haier_protocol::HaierLogLevel::LEVEL_ERROR, header, buffer, size)
+    #define HAIER_LOGE(...)	HAIER_LOG_(haier_protocol::HaierLogLevel::LEVEL_ERROR, __VA_ARGS__)
+    #define HAIER_BUFE(header, buffer, size)	HAIER_BUF_(haier_protocol::HaierLogLevel::LEVEL_ERROR, header, buffer, size)
 #else
     #define HAIER_LOGE(...)
     #define HAIER_BUFE(header, buffer, size)
 #endif
 #if (HAIER_LOG_LEVEL > 1)
-    #define HAIER_LOGW(...)	log_haier(haier_protocol::HaierLogLevel::LEVEL_WARNING, __VA_ARGS__)
-    #define HAIER_BUFW(header, buffer, size)	log_haier_buffer(haier_protocol::HaierLogLevel::LEVEL_WARNING, header, buffer, size)
+    #define HAIER_LOGW(...)	HAIER_LOG_(haier_protocol::HaierLogLevel::LEVEL_WARNING, __VA_ARGS__)
+    #define HAIER_BUFW(header, buffer, size)	HAIER_BUF_(haier_protocol::HaierLogLevel::LEVEL_WARNING, header, buffer, size)
 #else
     #define HAIER_LOGW(...)
     #define HAIER_BUFW(header, buffer, size)
 #endif
 #if (HAIER_LOG_LEVEL > 2)
-    #define HAIER_LOGI(...)	log_haier(haier_protocol::HaierLogLevel::LEVEL_INFO, __VA_ARGS__)
-    #define HAIER_BUFI(header, buffer, size)	log_haier_buffer(haier_protocol::HaierLogLevel::LEVEL_INFO, header, buffer, size)
+    #define HAIER_LOGI(...)	HAIER_LOG_(haier_protocol::HaierLogLevel::LEVEL_INFO, __VA_ARGS__)
+    #define HAIER_BUFI(header, buffer, size)	HAIER_BUF_(haier_protocol::HaierLogLevel::LEVEL_INFO, header, buffer, size)
 #else
     #define HAIER_LOGI(...)
     #define HAIER_BUFI(header, buffer, size)
 #endif
 #if (HAIER_LOG_LEVEL > 3)
-    #define HAIER_LOGD(...)	log_haier(haier_protocol::HaierLogLevel::LEVEL_DEBUG, __VA_ARGS__)
-    #define HAIER_BUFD(header, buffer, size)	log_haier_buffer(haier_protocol::HaierLogLevel::LEVEL_DEBUG, header, buffer, size)
+    #define HAIER_LOGD(...)	HAIER_LOG_(haier_protocol::HaierLogLevel::LEVEL_DEBUG, __VA_ARGS__)
+    #define HAIER_BUFD(header, buffer, size)	HAIER_BUF_(haier_protocol::HaierLogLevel::LEVEL_DEBUG, header, buffer, size)
 #else
     #define HAIER_LOGD(...)
     #define HAIER_BUFD(header, buffer, size)
 #endif
 #if (HAIER_LOG_LEVEL > 4)
-    #define HAIER_LOGV(...)	log_haier(haier_protocol::HaierLogLevel::LEVEL_VERBOSE, __VA_ARGS__)
-    #define HAIER_BUFV(header, buffer, size)	log_haier_buffer(haier_protocol::HaierLogLevel::LEVEL_VERBOSE, header, buffer, size)
+    #define HAIER_LOGV(...)	HAIER_LOG_(haier_protocol::HaierLogLevel::LEVEL_VERBOSE, __VA_ARGS__)
+    #define HAIER_BUFV(header, buffer, size)	HAIER_BUF_(haier_protocol::HaierLogLevel::LEVEL_VERBOSE, header, buffer, size)
 #else
     #define HAIER_LOGV(...)
     #define HAIER_BUFV(header, buffer, size)
 #endif
 
 std::string buf_to_hex(const uint8_t* message, size_t size);
+// Writes "AA BB CC" representation of the buffer to dst (zero terminated), returns number of characters written.
+// Only whole bytes are printed, the output is truncated if dst_size is less than 3 * size.
+size_t buf_to_hex(const uint8_t* message, size_t size, char* dst, size_t dst_size);
 
 namespace haier_protocol
 {
@@ -64,11 +81,37 @@ enum class HaierLogLevel
                                    // <log_level>,       <tag>,   <message>
 using LogHandler = std::function<void(HaierLogLevel, const char*, const char*)>;
 
+constexpr size_t MAX_LOG_TAG_OVERRIDES = 8;
+constexpr size_t MAX_LOG_TAG_LENGTH = 32;
+
+// Highest level that can pass the runtime filter for any tag (LEVEL_NONE if there is no log handler)
+extern std::atomic<HaierLogLevel> global_log_level_threshold;
+// Number of tags with their own log level
+extern std::atomic<size_t> global_log_tag_overrides;
+
+bool check_tag_log_level(HaierLogLevel level, const char* tag);
+
+// Fast runtime check, should be used before preparing arguments of the log message
+inline bool is_log_level_enabled(HaierLogLevel level, const char* tag)
+{
+    if ((level == HaierLogLevel::LEVEL_NONE) || (level > global_log_level_threshold.load(std::memory_order_relaxed)))
+        return false;
+    return (global_log_tag_overrides.load(std::memory_order_acquire) == 0) || check_tag_log_level(level, tag);
+}
+
 size_t log_haier(HaierLogLevel level, const char* format, ...);
+size_t log_haier_tagged(HaierLogLevel level, const char* tag, const char* format, ...);
 size_t log_haier_buffer(HaierLogLevel level, const char* header, const uint8_t* buffer, size_t size);
 size_t log_haier_buffers(HaierLogLevel level, const char* header, const uint8_t* buffer1, size_t size1, const uint8_t* buffer2, size_t size2);
+size_t log_haier_buffers_tagged(HaierLogLevel level, const char* tag, const char* header, const uint8_t* buffer1, size_t size1, const uint8_t* buffer2, size_t size2);
 void set_log_handler(LogHandler);
 void reset_log_handler();
+// Runtime log level for all tags (default is LEVEL_VERBOSE, so only HAIER_LOG_LEVEL limits the output)
+void set_log_level(HaierLogLevel level);
+// Runtime log level for one tag, overrides global level. Returns false if there are too many tags.
+bool set_log_level(const char* tag, HaierLogLevel level);
+HaierLogLevel get_log_level();
+HaierLogLevel get_log_level(const char* tag);
 
 }
 #endif // HAIER_LOG_H
@@ -0,0 +1,96 @@
+#ifndef HAIER_STATISTICS_H
+#define HAIER_STATISTICS_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <atomic>
+
+// Number of different frame types with own counters,
+// other types are counted together
+#ifndef HAIER_STATISTICS_FRAME_TYPES
+    #define HAIER_STATISTICS_FRAME_TYPES 8
+#endif
+
+namespace haier_protocol
+{
+
+// Counter updated only from one thread (the one that runs protocol loop) and
+// readable from any other thread. Doesn't use read-modify-write operations
+// so it is cheap on MCUs without atomic instructions.
+class StatCounter
+{
+public:
+    StatCounter() noexcept : value_(0) {};
+    StatCounter(const StatCounter&) = delete;
+    StatCounter& operator=(const StatCounter&) = delete;
+    void increment(uint32_t delta = 1) noexcept { this->value_.store(this->value_.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed); };
+    void update_max(uint32_t value) noexcept { if (value > this->value_.load(std::memory_order_relaxed)) this->value_.store(value, std::memory_order_relaxed); };
+    uint32_t get() const noexcept { return this->value_.load(std::memory_order_relaxed); };
+private:
+    std::atomic<uint32_t>   value_;
+};
+
+// Table of per frame type items. First HAIER_STATISTICS_FRAME_TYPES types get
+// own item, all the rest share the "other" one. Items are added only from the
+// writer thread, readers can access the table at any time.
+template<class T>
+class FrameTypeTable
+{
+public:
+    FrameTypeTable() noexcept : types_count_(0) {};
+    FrameTypeTable(const FrameTypeTable&) = delete;
+    FrameTypeTable& operator=(const FrameTypeTable&) = delete;
+    // Writer side, returns item for frame type (adds new one if there is space)
+    T& get_item(uint8_t frame_type) noexcept;
+    // Returns nullptr if frame type has no own item
+    const T* find(uint8_t frame_type) const noexcept;
+    const T& get_other() const noexcept { return this->other_; };
+    // Number of frame types with own item
+    size_t get_types_count() const noexcept { return this->types_count_.load(std::memory_order_acquire); };
+    // Frame type and its item by index (index < get_types_count())
+    uint8_t get_type_at(size_t index) const noexcept { return this->types_[index]; };
+    const T& get_at(size_t index) const noexcept { return this->items_[index]; };
+private:
+    uint8_t                 types_[HAIER_STATISTICS_FRAME_TYPES];
+    T                       items_[HAIER_STATISTICS_FRAME_TYPES];
+    T                       other_;
+    std::atomic<size_t>     types_count_;
+};
+
+template<class T>
+T& FrameTypeTable<T>::get_item(uint8_t frame_type) noexcept
+{
+    size_t count = this->types_count_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count; i++)
+        if (this->types_[i] == frame_type)
+            return this->items_[i];
+    if (count < HAIER_STATISTICS_FRAME_TYPES)
+    {
+        this->types_[count] = frame_type;
+        this->types_count_.store(count + 1, std::memory_order_release);
+        return this->items_[count];
+    }
+    return this->other_;
+}
+
+template<class T>
+const T* FrameTypeTable<T>::find(uint8_t frame_type) const noexcept
+{
+    size_t count = this->get_types_count();
+    for (size_t i = 0; i < count; i++)
+        if (this->types_[i] == frame_type)
+            return &this->items_[i];
+    return nullptr;
+}
+
+// Counters by frame type
+class FrameTypeCounters : public FrameTypeTable<StatCounter>
+{
+public:
+    void increment(uint8_t frame_type) noexcept { this->get_item(frame_type).increment(); };
+    uint32_t get(uint8_t frame_type) const noexcept;
+    uint32_t get_total() const noexcept;
+};
+
+} // haier_protocol
+#endif // HAIER_STATISTICS_H
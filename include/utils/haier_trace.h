@@ -0,0 +1,34 @@
+#ifndef HAIER_TRACE_H
+#define HAIER_TRACE_H
+
+// Static tracepoints (USDT) for perf/bpftrace/systemtap, provider name "haier".
+// Enabled with HAIER_USE_TRACEPOINTS (requires <sys/sdt.h> from systemtap-sdt-dev),
+// every probe is a single nop instruction until a tracer is attached.
+// Without HAIER_USE_TRACEPOINTS probes are removed completely and their
+// arguments are not evaluated. Arguments should be integers or pointers.
+//
+// Probes:
+//   frame_start()                                      frame start separator found
+//   header_parse(error, frame_type, data_size)         frame header parsed
+//   frame_complete(frame_type, data_size, use_crc)     frame parsed successfully
+//   frame_error(error)                                 frame dropped because of error (FrameError)
+//   frame_enqueue(frame_type, queue_size)              frame added to incoming queue
+//   dispatch_start(frame_type, request_type)           message or answer handler called (request_type is 0 for messages)
+//   dispatch_end(frame_type, result)                   handler returned (HandlerError)
+//   write_message(frame_type, size, success)           message written to stream
+//   answer_timeout(request_type, retries_left)         no answer for the request
+
+#ifdef HAIER_USE_TRACEPOINTS
+    #include <sys/sdt.h>
+    #define HAIER_TRACE0(name)                  DTRACE_PROBE(haier, name)
+    #define HAIER_TRACE1(name, a1)              DTRACE_PROBE1(haier, name, a1)
+    #define HAIER_TRACE2(name, a1, a2)          DTRACE_PROBE2(haier, name, a1, a2)
+    #define HAIER_TRACE3(name, a1, a2, a3)      DTRACE_PROBE3(haier, name, a1, a2, a3)
+#else
+    #define HAIER_TRACE0(name)                  do {} while (0)
+    #define HAIER_TRACE1(name, a1)              do {} while (0)
+    #define HAIER_TRACE2(name, a1, a2)          do {} while (0)
+    #define HAIER_TRACE3(name, a1, a2, a3)      do {} while (0)
+#endif
+
+#endif // HAIER_TRACE_H
@@ -0,0 +1,46 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <chrono>
+#include "utils/haier_statistics.h"
+
+namespace haier_protocol
+{
+
+// Fixed memory log-linear histogram of microsecond values (HDR-style).
+// Values below 16us are exact, above that every power of two is split into
+// 8 buckets, so relative error is below 12.5% for the whole uint32_t range.
+// Single writer, percentiles can be read from any thread.
+class LatencyHistogram
+{
+public:
+    static constexpr size_t LINEAR_BUCKETS_BITS = 4;
+    static constexpr size_t LINEAR_BUCKETS      = 1 << LINEAR_BUCKETS_BITS;
+    static constexpr size_t SUB_BUCKETS_BITS    = 3;
+    static constexpr size_t SUB_BUCKETS         = 1 << SUB_BUCKETS_BITS;
+    static constexpr size_t BUCKETS_COUNT       = LINEAR_BUCKETS + (32 - LINEAR_BUCKETS_BITS) * SUB_BUCKETS;
+    LatencyHistogram() noexcept {};
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+    void record(uint32_t value_us) noexcept;
+    void record(std::chrono::steady_clock::duration duration) noexcept;
+    // Add all values from other histogram (writer side, other can be updated concurrently)
+    void merge(const LatencyHistogram& other) noexcept;
+    uint32_t get_count() const noexcept;
+    uint32_t get_max() const noexcept { return this->max_.get(); };
+    // Number of values in the bucket (index < BUCKETS_COUNT)
+    uint32_t get_bucket_count(size_t index) const noexcept { return this->buckets_[index].get(); };
+    // Highest value that is equivalent to the percentile (0..100), 0 if histogram is empty
+    uint32_t get_percentile(float percentile) const noexcept;
+    static size_t get_bucket_index(uint32_t value) noexcept;
+    // Highest value that falls into the bucket
+    static uint32_t get_bucket_upper_bound(size_t index) noexcept;
+private:
+    StatCounter     buckets_[BUCKETS_COUNT];
+    StatCounter     max_;
+};
+
+} // haier_protocol
+#endif // LATENCY_HISTOGRAM_H
@@ -0,0 +1,126 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <atomic>
+#include <new>
+#include <utility>
+
+namespace haier_protocol
+{
+
+// Bounded lock-free queue, any number of threads can push, only one thread pops.
+// Every cell has a sequence number that tells whose turn it is: producers claim
+// cells by advancing the write position with compare-and-swap and publish the item
+// by setting the sequence, consumer reads the item and hands the cell to the next lap.
+// Capacity is rounded up to a power of two, push fails when the queue is full.
+template<class T>
+class MpscQueue
+{
+public:
+    MpscQueue() = delete;
+    explicit MpscQueue(size_t capacity);
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+    ~MpscQueue() noexcept;
+    size_t get_capacity() const noexcept { return this->mask_ + 1; };
+    // Any thread, return false if the queue is full
+    bool push(const T& item) { return this->emplace(item); };
+    bool push(T&& item) { return this->emplace(std::move(item)); };
+    template<class... Args>
+    bool emplace(Args&&... args);
+    // Consumer thread only, return false if the queue is empty
+    bool pop(T& item);
+    // Approximate if producers are running
+    bool empty() const noexcept;
+private:
+    struct Cell
+    {
+        std::atomic<size_t>     sequence;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+    T* get_item_(Cell& cell) noexcept { return reinterpret_cast<T*>(cell.storage); };
+    Cell*                   cells_;
+    size_t                  mask_;
+    std::atomic<size_t>     write_position_;
+    size_t                  read_position_;
+};
+
+template<class T>
+MpscQueue<T>::MpscQueue(size_t capacity) :
+    cells_(nullptr),
+    mask_(1),
+    write_position_(0),
+    read_position_(0)
+{
+    size_t size = 2;
+    while (size < capacity)
+        size <<= 1;
+    this->mask_ = size - 1;
+    this->cells_ = new Cell[size];
+    for (size_t i = 0; i < size; i++)
+        this->cells_[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+template<class T>
+MpscQueue<T>::~MpscQueue() noexcept
+{
+    while (!this->empty())
+    {
+        Cell& cell = this->cells_[this->read_position_ & this->mask_];
+        this->get_item_(cell)->~T();
+        this->read_position_++;
+    }
+    delete[] this->cells_;
+}
+
+template<class T>
+template<class... Args>
+bool MpscQueue<T>::emplace(Args&&... args)
+{
+    size_t position = this->write_position_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true)
+    {
+        cell = &this->cells_[position & this->mask_];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+        if (difference == 0)
+        {
+            // Cell is free on this lap, try to claim it (position is updated on failure)
+            if (this->write_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (difference < 0)
+            return false;
+        else
+            position = this->write_position_.load(std::memory_order_relaxed);
+    }
+    new (cell->storage) T(std::forward<Args>(args)...);
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+template<class T>
+bool MpscQueue<T>::pop(T& item)
+{
+    Cell& cell = this->cells_[this->read_position_ & this->mask_];
+    if (cell.sequence.load(std::memory_order_acquire) != this->read_position_ + 1)
+        return false;
+    T* stored = this->get_item_(cell);
+    item = std::move(*stored);
+    stored->~T();
+    cell.sequence.store(this->read_position_ + this->mask_ + 1, std::memory_order_release);
+    this->read_position_++;
+    return true;
+}
+
+template<class T>
+bool MpscQueue<T>::empty() const noexcept
+{
+    return this->cells_[this->read_position_ & this->mask_].sequence.load(std::memory_order_acquire) != this->read_position_ + 1;
+}
+
+} // haier_protocol
+#endif // MPSC_QUEUE_H
@@ -0,0 +1,61 @@
+#ifndef PAYLOAD_DELTA_H
+#define PAYLOAD_DELTA_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+
+namespace haier_protocol
+{
+
+// Named part of a fixed layout payload (status packet). Multibyte fields are big endian.
+// Bit field is one byte with mask of its bits, whole byte fields have mask 0xFF.
+struct PayloadField
+{
+    const char* name;
+    uint16_t    offset;
+    uint8_t     size;
+    uint8_t     mask;
+};
+
+// Compact change event, field is index in the layout
+struct FieldChange
+{
+    uint16_t    field;
+    uint32_t    old_value;
+    uint32_t    new_value;
+};
+
+constexpr size_t MAX_DELTA_PAYLOAD_SIZE = 256;
+constexpr size_t DELTA_MASK_WORDS = MAX_DELTA_PAYLOAD_SIZE / 32;
+
+// Set bit N of changed_mask if byte N differs, changed_mask should have (size + 31) / 32 words.
+// Payloads are compared 16 bytes at a time (SSE2 or NEON) or by machine words,
+// only blocks that differ are looked at byte by byte. Return false if payloads are equal.
+bool find_changed_bytes(const uint8_t* previous, const uint8_t* current, size_t size, uint32_t* changed_mask) noexcept;
+
+// Maps changed bytes of a payload to fields of its layout.
+// Fields should be sorted by offset and should not overlap (bit fields of one byte can share it).
+class PayloadDelta
+{
+public:
+    PayloadDelta() = delete;
+    PayloadDelta(const PayloadField* fields, size_t fields_count, size_t payload_size);
+    size_t get_payload_size() const noexcept { return this->payload_size_; };
+    size_t get_fields_count() const noexcept { return this->fields_count_; };
+    const PayloadField& get_field(size_t index) const noexcept { return this->fields_[index]; };
+    // Compare two payloads of get_payload_size() bytes, write up to max_changes events
+    // in layout order and return their number. Bytes that are not covered by fields are ignored.
+    size_t compare(const uint8_t* previous, const uint8_t* current, FieldChange* changes, size_t max_changes) const noexcept;
+    uint32_t get_value(size_t field, const uint8_t* payload) const noexcept;
+private:
+    const PayloadField*     fields_;
+    size_t                  fields_count_;
+    size_t                  payload_size_;
+    // First and past the last field that cover every byte of payload
+    std::vector<uint16_t>   first_field_;
+    std::vector<uint16_t>   end_field_;
+};
+
+} // haier_protocol
+#endif // PAYLOAD_DELTA_H
@@ -0,0 +1,86 @@
+#ifndef PAYLOAD_VIEW_H
+#define PAYLOAD_VIEW_H
+
+#include <stdint.h>
+#include <cstddef>
+
+namespace haier_protocol
+{
+
+// Typed access to fixed layout payloads right in the received buffer. Field position is
+// defined by byte offset and mask of its bits, multibyte fields are big endian (the same
+// description as PayloadField), so layout doesn't depend on compiler bit field allocation
+// and reading a field is a load and a mask without copying the payload.
+
+constexpr unsigned int get_mask_shift(uint8_t mask) noexcept
+{
+    return (mask & 0x01) != 0 ? 0 : 1 + get_mask_shift((uint8_t) (mask >> 1));
+}
+
+// Bits of one byte, value is aligned to bit 0. Whole byte fields have mask 0xFF.
+template<size_t OFFSET, uint8_t MASK = 0xFF>
+struct BitsField
+{
+    static_assert(MASK != 0, "Field should have at least one bit");
+    using value_type = uint8_t;
+    static constexpr size_t         offset = OFFSET;
+    static constexpr size_t         size = 1;
+    static constexpr uint8_t        mask = MASK;
+    static constexpr unsigned int   shift = get_mask_shift(MASK);
+    static constexpr value_type get(const uint8_t* payload) noexcept
+    {
+        return (value_type) ((payload[OFFSET] & MASK) >> shift);
+    };
+    static void set(uint8_t* payload, value_type value) noexcept
+    {
+        payload[OFFSET] = (uint8_t) ((payload[OFFSET] & ~MASK) | ((value << shift) & MASK));
+    };
+};
+
+// Big endian 16 bit value
+template<size_t OFFSET>
+struct Uint16Field
+{
+    using value_type = uint16_t;
+    static constexpr size_t         offset = OFFSET;
+    static constexpr size_t         size = 2;
+    static constexpr uint8_t        mask = 0xFF;
+    static constexpr value_type get(const uint8_t* payload) noexcept
+    {
+        return (value_type) ((payload[OFFSET] << 8) | payload[OFFSET + 1]);
+    };
+    static void set(uint8_t* payload, value_type value) noexcept
+    {
+        payload[OFFSET] = (uint8_t) (value >> 8);
+        payload[OFFSET + 1] = (uint8_t) value;
+    };
+};
+
+// Base of payload views. Byte is uint8_t for views that can change the payload and
+// const uint8_t for read only views. View doesn't own the payload, derived view defines
+// SIZE and buffer should have at least SIZE bytes.
+template<class Byte>
+class PayloadView
+{
+public:
+    explicit constexpr PayloadView(Byte* payload) noexcept : payload_(payload) {};
+    constexpr Byte* data() const noexcept { return this->payload_; };
+    template<class Field>
+    constexpr typename Field::value_type get() const noexcept { return Field::get(this->payload_); };
+    template<class Field>
+    void set(typename Field::value_type value) const noexcept { Field::set(this->payload_, value); };
+protected:
+    Byte*   payload_;
+};
+
+} // haier_protocol
+
+// Named field of a view derived from PayloadView: NAME##_field is the field type,
+// NAME() reads the field and set_NAME() writes it (only for writable views)
+#define HAIER_PAYLOAD_FIELD(NAME, ...) \
+    using NAME##_field = __VA_ARGS__; \
+    static_assert(NAME##_field::offset + NAME##_field::size <= SIZE, #NAME " is out of payload"); \
+    constexpr NAME##_field::value_type NAME() const noexcept { return NAME##_field::get(this->payload_); }; \
+    void set_##NAME(NAME##_field::value_type value) const noexcept { NAME##_field::set(this->payload_, value); }
+
+#endif // PAYLOAD_VIEW_H
@@ -1,9 +1,15 @@
 #ifndef PROTOCOL_STREAM_H
 #define PROTOCOL_STREAM_H
 
+#include <stdint.h>
+#include <cstddef>
+
 namespace haier_protocol
 {
 
+// Haier appliances start communication at this rate, timeouts are tuned for it
+constexpr uint32_t DEFAULT_BAUD_RATE = 9600;
+
 class ProtocolStream
 {
 public:
@@ -13,7 +19,29 @@ public:
     virtual size_t      read_array(uint8_t* data, size_t len) noexcept = 0;
     // Write len bytes from data
     virtual void        write_array(const uint8_t* data, size_t len) noexcept = 0;
+    // Read up to size1 + size2 bytes, first to data1 then to data2 (two segments of a ring buffer),
+    // return the number of bytes read. Streams that can fill both segments with one
+    // system call or copy should override it.
+    virtual size_t      read_into(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept;
+    // Return current baud rate or 0 if the stream doesn't support baud rate switching
+    virtual uint32_t    get_baud_rate() const noexcept { return 0; };
+    // Check if the stream can work at baud_rate
+    virtual bool        supports_baud_rate(uint32_t /* baud_rate */) const noexcept { return false; };
+    // Wait until all written data is transmitted, then switch to the new baud rate.
+    // Should be called only between frames, return false if the rate was not changed.
+    virtual bool        set_baud_rate(uint32_t /* baud_rate */) noexcept { return false; };
 };
 
+inline size_t ProtocolStream::read_into(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept
+{
+    size_t count = this->available();
+    if (count == 0)
+        return 0;
+    size_t result = this->read_array(data1, count < size1 ? count : size1);
+    if ((result == size1) && (count > result) && (size2 > 0))
+        result += this->read_array(data2, count - result < size2 ? count - result : size2);
+    return result;
+}
+
 }
-#endif // PROTOCOL_STREAM_H
\ No newline at end of file
+#endif // PROTOCOL_STREAM_H
@@ -0,0 +1,104 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <atomic>
+#include <type_traits>
+
+namespace haier_protocol
+{
+
+// Value published by one writer thread to any number of reader threads without locks.
+// Sequence is odd while the writer updates the value, reader copies the value and retries
+// if the sequence was odd or changed during the copy. Writer never waits for readers,
+// readers wait only for a store that is in progress.
+// Value is kept in relaxed atomic words, so copying it while it is written is not a data race.
+template<class T>
+class Seqlock
+{
+public:
+    static_assert(std::is_trivially_copyable<T>::value, "Seqlock value should be trivially copyable");
+    Seqlock() noexcept;
+    explicit Seqlock(const T& value) noexcept;
+    Seqlock(const Seqlock&) = delete;
+    Seqlock& operator=(const Seqlock&) = delete;
+    // Writer thread only
+    void store(const T& value) noexcept;
+    // Any thread, one attempt, return false if the value was being updated
+    bool try_load(T& value, uint32_t& version) const noexcept;
+    // Any thread, return version of the value (number of stores)
+    uint32_t load(T& value) const noexcept;
+    uint32_t get_version() const noexcept { return this->sequence_.load(std::memory_order_acquire) / 2; };
+private:
+    using Word = uint32_t;
+    static constexpr size_t WORDS_COUNT = (sizeof(T) + sizeof(Word) - 1) / sizeof(Word);
+    void write_words_(const T& value) noexcept;
+    std::atomic<uint32_t>   sequence_;
+    std::atomic<Word>       words_[WORDS_COUNT];
+};
+
+template<class T>
+Seqlock<T>::Seqlock() noexcept : sequence_(0)
+{
+    for (size_t i = 0; i < WORDS_COUNT; i++)
+        this->words_[i].store(0, std::memory_order_relaxed);
+}
+
+template<class T>
+Seqlock<T>::Seqlock(const T& value) noexcept : sequence_(0)
+{
+    this->write_words_(value);
+}
+
+template<class T>
+void Seqlock<T>::write_words_(const T& value) noexcept
+{
+    Word buffer[WORDS_COUNT];
+    buffer[WORDS_COUNT - 1] = 0;
+    memcpy(buffer, &value, sizeof(T));
+    for (size_t i = 0; i < WORDS_COUNT; i++)
+        this->words_[i].store(buffer[i], std::memory_order_relaxed);
+}
+
+template<class T>
+void Seqlock<T>::store(const T& value) noexcept
+{
+    uint32_t sequence = this->sequence_.load(std::memory_order_relaxed);
+    this->sequence_.store(sequence + 1, std::memory_order_relaxed);
+    // Readers that see any of the new words also see the odd sequence
+    std::atomic_thread_fence(std::memory_order_release);
+    this->write_words_(value);
+    this->sequence_.store(sequence + 2, std::memory_order_release);
+}
+
+template<class T>
+bool Seqlock<T>::try_load(T& value, uint32_t& version) const noexcept
+{
+    uint32_t sequence = this->sequence_.load(std::memory_order_acquire);
+    if ((sequence & 1) != 0)
+        return false;
+    Word buffer[WORDS_COUNT];
+    for (size_t i = 0; i < WORDS_COUNT; i++)
+        buffer[i] = this->words_[i].load(std::memory_order_relaxed);
+    // Words are read before the sequence is checked again
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (this->sequence_.load(std::memory_order_relaxed) != sequence)
+        return false;
+    memcpy(&value, buffer, sizeof(T));
+    version = sequence / 2;
+    return true;
+}
+
+template<class T>
+uint32_t Seqlock<T>::load(T& value) const noexcept
+{
+    uint32_t version;
+    while (!this->try_load(value, version))
+        ;
+    return version;
+}
+
+} // haier_protocol
+#endif // SEQLOCK_H
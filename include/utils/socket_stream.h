@@ -0,0 +1,90 @@
+#ifndef SOCKET_STREAM_H
+#define SOCKET_STREAM_H
+
+#include <stdint.h>
+#include <cstddef>
+#include "utils/protocol_stream.h"
+#include "utils/circular_buffer.h"
+
+// Socket streams use POSIX sockets, on other platforms (MCUs included) this header is empty
+#if __linux__
+
+// Size of the receive buffer and of the queue for data that can't be sent right away
+#ifndef HAIER_SOCKET_BUFFER_SIZE
+    #define HAIER_SOCKET_BUFFER_SIZE 4096
+#endif
+
+namespace haier_protocol
+{
+
+enum class SocketState : uint8_t
+{
+    CLOSED,
+    CONNECTING,     // client, waiting for connection to be established
+    LISTENING,      // server, waiting for a peer
+    CONNECTED,
+};
+
+// Non-blocking TCP or Unix domain socket stream, can be used instead of a serial port
+// to reach the appliance through remote_serial_bridge or to run both sides of the
+// protocol in separate processes.
+// The stream works as a client (connect_*) or as a server (listen_*). The server serves
+// one peer at a time and returns to LISTENING when the peer disconnects, the client
+// goes to CLOSED and should be connected again by the owner.
+// Nothing blocks: data that can't be sent right away is queued and sent by later calls,
+// when the queue is full the rest of the data is dropped. Event loops should wait for
+// get_file_descriptor() (POLLOUT too if wants_write()) and call process_events().
+class SocketStream : public ProtocolStream
+{
+public:
+    explicit SocketStream(size_t buffer_size = HAIER_SOCKET_BUFFER_SIZE);
+    SocketStream(const SocketStream&) = delete;
+    SocketStream& operator=(const SocketStream&) = delete;
+    ~SocketStream() noexcept;
+    // Host can be a name or a numeric address, return false if connection failed right away
+    bool                connect_tcp(const char* host, uint16_t port) noexcept;
+    bool                connect_unix(const char* path) noexcept;
+    // Address nullptr means any interface, existing socket file at path is replaced
+    bool                listen_tcp(uint16_t port, const char* address = nullptr) noexcept;
+    bool                listen_unix(const char* path) noexcept;
+    // Local TCP port, useful when listening on port 0, 0 if unknown
+    uint16_t            get_port() const noexcept;
+    void                close() noexcept;
+    SocketState         get_state() const noexcept { return this->state_; };
+    bool                is_connected() const noexcept { return this->state_ == SocketState::CONNECTED; };
+    // Descriptor to wait on: listening socket while server waits for a peer, -1 if closed
+    int                 get_file_descriptor() const noexcept;
+    // True if the descriptor should be also watched for writing
+    bool                wants_write() const noexcept;
+    // Accept peer, finish connection, receive data and send queued data.
+    // Return false if the stream is closed or the peer is gone.
+    bool                process_events() noexcept;
+    size_t              get_pending_write_size() const noexcept { return this->tx_buffer_.get_size(); };
+    // Bytes that didn't fit to the queue since the stream was created
+    uint64_t            get_dropped_bytes() const noexcept { return this->dropped_bytes_; };
+    // Send or queue up to len bytes, return the number of bytes accepted or -1 if not connected
+    long                write_some(const uint8_t* data, size_t len) noexcept;
+    size_t              available() noexcept override;
+    size_t              read_array(uint8_t* data, size_t len) noexcept override;
+    void                write_array(const uint8_t* data, size_t len) noexcept override;
+    size_t              read_into(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept override;
+private:
+    bool                start_listening_(int handle, const void* address, size_t address_size) noexcept;
+    bool                accept_peer_() noexcept;
+    bool                check_connection_() noexcept;
+    size_t              receive_() noexcept;
+    bool                send_queued_() noexcept;
+    void                peer_closed_() noexcept;
+    SocketState         state_;
+    int                 handle_;
+    int                 listen_handle_;
+    char*               unix_path_;
+    CircularBuffer<uint8_t> rx_buffer_;
+    CircularBuffer<uint8_t> tx_buffer_;
+    uint64_t            dropped_bytes_;
+};
+
+} // haier_protocol
+
+#endif // __linux__
+#endif // SOCKET_STREAM_H
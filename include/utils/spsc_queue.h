@@ -0,0 +1,115 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <atomic>
+#include <new>
+#include <utility>
+
+namespace haier_protocol
+{
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+// Cheaper than MpscQueue: no compare-and-swap, each side writes only its own position
+// (producer and consumer fields are kept on separate cache lines) and reads the other one.
+// Capacity is rounded up to a power of two, push fails when the queue is full.
+template<class T>
+class SpscQueue
+{
+public:
+    SpscQueue() = delete;
+    explicit SpscQueue(size_t capacity);
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+    ~SpscQueue() noexcept;
+    size_t get_capacity() const noexcept { return this->mask_ + 1; };
+    // Producer thread only, return false if the queue is full
+    bool push(const T& item) { return this->emplace(item); };
+    bool push(T&& item) { return this->emplace(std::move(item)); };
+    template<class... Args>
+    bool emplace(Args&&... args);
+    // Consumer thread only, return false if the queue is empty
+    bool pop(T& item);
+    // Exact for the consumer, approximate for other threads
+    bool empty() const noexcept { return this->read_position_.load(std::memory_order_relaxed) == this->write_position_.load(std::memory_order_acquire); };
+private:
+    static constexpr size_t CACHE_LINE_SIZE = 64;
+    struct Cell
+    {
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+    T* get_item_(size_t position) noexcept { return reinterpret_cast<T*>(this->cells_[position & this->mask_].storage); };
+    // Padding instead of alignas: over-aligned types need C++17 operator new
+    Cell*                   cells_;
+    size_t                  mask_;
+    uint8_t                 padding1_[CACHE_LINE_SIZE];
+    std::atomic<size_t>     write_position_;
+    size_t                  read_position_cache_;   // producer's last view of read_position_
+    uint8_t                 padding2_[CACHE_LINE_SIZE];
+    std::atomic<size_t>     read_position_;
+    size_t                  write_position_cache_;  // consumer's last view of write_position_
+    uint8_t                 padding3_[CACHE_LINE_SIZE];
+};
+
+template<class T>
+SpscQueue<T>::SpscQueue(size_t capacity) :
+    cells_(nullptr),
+    mask_(1),
+    write_position_(0),
+    read_position_cache_(0),
+    read_position_(0),
+    write_position_cache_(0)
+{
+    size_t size = 2;
+    while (size < capacity)
+        size <<= 1;
+    this->mask_ = size - 1;
+    this->cells_ = new Cell[size];
+}
+
+template<class T>
+SpscQueue<T>::~SpscQueue() noexcept
+{
+    size_t write_position = this->write_position_.load(std::memory_order_acquire);
+    for (size_t position = this->read_position_.load(std::memory_order_relaxed); position != write_position; position++)
+        this->get_item_(position)->~T();
+    delete[] this->cells_;
+}
+
+template<class T>
+template<class... Args>
+bool SpscQueue<T>::emplace(Args&&... args)
+{
+    size_t position = this->write_position_.load(std::memory_order_relaxed);
+    // Consumer's position is read only when the cached one says the queue is full
+    if (position - this->read_position_cache_ > this->mask_)
+    {
+        this->read_position_cache_ = this->read_position_.load(std::memory_order_acquire);
+        if (position - this->read_position_cache_ > this->mask_)
+            return false;
+    }
+    new (this->get_item_(position)) T(std::forward<Args>(args)...);
+    this->write_position_.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+template<class T>
+bool SpscQueue<T>::pop(T& item)
+{
+    size_t position = this->read_position_.load(std::memory_order_relaxed);
+    if (position == this->write_position_cache_)
+    {
+        this->write_position_cache_ = this->write_position_.load(std::memory_order_acquire);
+        if (position == this->write_position_cache_)
+            return false;
+    }
+    T* stored = this->get_item_(position);
+    item = std::move(*stored);
+    stored->~T();
+    this->read_position_.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+} // haier_protocol
+#endif // SPSC_QUEUE_H
@@ -0,0 +1,146 @@
+#ifndef URING_STREAM_H
+#define URING_STREAM_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include "utils/protocol_stream.h"
+#include "utils/circular_buffer.h"
+
+// Shared event loop for hosts with many ports, on other platforms (MCUs included) this header is empty
+#if __linux__
+
+// Size of one buffer in the shared receive pool, serial ports rarely return more at once
+#ifndef HAIER_URING_BUFFER_SIZE
+    #define HAIER_URING_BUFFER_SIZE 256
+#endif
+#ifndef HAIER_URING_TX_BUFFER_SIZE
+    #define HAIER_URING_TX_BUFFER_SIZE 1024
+#endif
+
+namespace haier_protocol
+{
+
+enum class ReactorBackend : uint8_t
+{
+    POLLING,        // no waiting, every handler is called on every run_once
+    EPOLL,
+    IO_URING,
+};
+
+class UringStream;
+
+// Called by the reactor when new data arrived or the descriptor was closed,
+// usually runs TransportLevelHandler::read_data or ProtocolHandler::loop
+using StreamDataHandler = std::function<void(UringStream&)>;
+
+// One ring (or epoll instance) for all ports of the host.
+// With io_uring reads are armed for every stream all the time and take buffers from
+// a shared pool (provided buffers), so idle ports don't hold memory and new data
+// costs no system calls. Sockets use multishot receive, so a read is armed once.
+// Writes of all streams are submitted together once per run_once, buffers go back
+// to the pool without system calls (buffer ring). Older kernels get single shot reads
+// and buffers returned by submissions. If io_uring is not available at all (old kernel,
+// seccomp) the reactor falls back to epoll, streams work the same way.
+// Not thread safe, streams and reactor should be used from one thread.
+class UringReactor
+{
+public:
+    UringReactor() noexcept;
+    UringReactor(const UringReactor&) = delete;
+    UringReactor& operator=(const UringReactor&) = delete;
+    // All streams should be destroyed before the reactor
+    ~UringReactor() noexcept;
+    // Should be called before streams are created.
+    // Return the backend that is actually used, it can be "lower" than requested
+    ReactorBackend      init(unsigned int max_streams, ReactorBackend backend = ReactorBackend::IO_URING) noexcept;
+    ReactorBackend      get_backend() const noexcept { return this->backend_; };
+    // Send queued writes, wait up to timeout for data and call handlers of the streams that got it.
+    // Return the number of handlers called.
+    unsigned int        run_once(std::chrono::milliseconds timeout) noexcept;
+private:
+    friend class UringStream;
+    struct Ring;
+    bool                init_uring_(unsigned int max_streams) noexcept;
+    void                close_uring_() noexcept;
+    // Check that reads get buffers from the pool
+    bool                check_pool_() noexcept;
+    int                 attach_(UringStream* stream) noexcept;
+    void                detach_(UringStream* stream) noexcept;
+    bool                enter_(unsigned int wait_count, std::chrono::milliseconds timeout) noexcept;
+    // Return the next free submission entry, make sure that count entries are free first
+    // (linked entries should go to the same submission)
+    void*               get_sqe_(unsigned int count = 1) noexcept;
+    void                arm_read_(UringStream* stream) noexcept;
+    void                arm_write_(UringStream* stream, bool wait_for_space) noexcept;
+    void                release_buffer_(uint16_t buffer_id) noexcept;
+    void                process_completions_() noexcept;
+    unsigned int        call_handlers_() noexcept;
+    void                update_watch_(UringStream* stream) noexcept;
+    ReactorBackend      backend_;
+    std::vector<UringStream*> streams_;
+    std::vector<int>    ready_;             // slots of the streams that got data
+    std::vector<int>    starved_;           // slots of the streams that are waiting for pool buffer
+    Ring*               ring_;
+    uint8_t*            pool_;
+    unsigned int        pool_count_;
+    int                 epoll_handle_;
+};
+
+// ProtocolStream over a descriptor (serial port, pty or socket) driven by UringReactor.
+// The descriptor should be non-blocking, it is not closed by the stream.
+// With io_uring received data stays in the shared pool buffer until transport reads it
+// with read_into, so it is copied only once, straight to the transport buffer.
+class UringStream : public ProtocolStream
+{
+public:
+    UringStream(UringReactor& reactor, int file_descriptor, size_t tx_buffer_size = HAIER_URING_TX_BUFFER_SIZE) noexcept;
+    UringStream(const UringStream&) = delete;
+    UringStream& operator=(const UringStream&) = delete;
+    // Waits for the operations in flight to be canceled
+    ~UringStream() noexcept;
+    void                set_data_handler(StreamDataHandler handler) { this->handler_ = handler; };
+    // False after end of file or read error, the owner should close the descriptor
+    bool                is_open() const noexcept { return this->open_; };
+    int                 get_file_descriptor() const noexcept { return this->handle_; };
+    size_t              get_pending_write_size() const noexcept { return this->tx_buffer_.get_size(); };
+    uint64_t            get_dropped_bytes() const noexcept { return this->dropped_bytes_; };
+    size_t              available() noexcept override;
+    size_t              read_array(uint8_t* data, size_t len) noexcept override;
+    void                write_array(const uint8_t* data, size_t len) noexcept override;
+    size_t              read_into(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept override;
+private:
+    friend class UringReactor;
+    size_t              read_direct_(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept;
+    void                flush_() noexcept;
+    void                set_closed_() noexcept;
+    UringReactor&       reactor_;
+    int                 handle_;
+    int                 slot_;
+    bool                open_;
+    bool                socket_;            // send without SIGPIPE
+    uint32_t            watch_events_;      // epoll
+    StreamDataHandler   handler_;
+    // io_uring: pool buffers with data that was not read yet
+    struct PoolChunk
+    {
+        uint16_t        buffer_id;
+        uint16_t        offset;
+        uint16_t        size;
+    };
+    bool                has_chunks_() const noexcept { return this->chunk_head_ < this->chunks_.size(); };
+    std::vector<PoolChunk> chunks_;
+    size_t              chunk_head_;
+    bool                read_armed_;
+    size_t              write_size_;        // bytes in flight
+    unsigned int        operations_;        // submitted and not completed
+    CircularBuffer<uint8_t> tx_buffer_;
+    uint64_t            dropped_bytes_;
+};
+
+} // haier_protocol
+
+#endif // __linux__
+#endif // URING_STREAM_H
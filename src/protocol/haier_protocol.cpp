@@ -1,7 +1,9 @@
+#include <algorithm>
 #include <cstring>
 #include <chrono>
 #include <memory>
 #include "protocol/haier_protocol.h"
+#include "utils/haier_trace.h"
 
 namespace haier_protocol
 {
@@ -9,10 +11,9 @@ namespace haier_protocol
 constexpr uint8_t MAX_PACKET_RETRIES = 9;
 constexpr std::chrono::milliseconds DEFAULT_ANSWER_TIMEOUT = std::chrono::milliseconds(200);
 constexpr std::chrono::milliseconds DEFAULT_COOLDOWN_INTERVAL = std::chrono::milliseconds(400);
-
-#if HAIER_LOG_LEVEL > 3
-  static std::chrono::steady_clock::time_point last_message_sent_;
-#endif
+// Appliance needs some time to process request regardless of baud rate
+constexpr std::chrono::milliseconds MIN_ANSWER_TIMEOUT = std::chrono::milliseconds(50);
+constexpr size_t BAUD_RATE_DATA_SIZE = 4;
 
 ProtocolHandler::ProtocolHandler(ProtocolStream &stream) noexcept : ProtocolHandler(stream, MAX_FRAME_SIZE + 10)
 {
@@ -22,7 +23,9 @@ ProtocolHandler::ProtocolHandler(ProtocolStream& stream, size_t buffer_size) noe
   message_handlers_map_(),
   answer_handlers_map_(),
   timeout_handlers_map_(),
-  outgoing_messages_(),
+  outgoing_queues_(),
+  outgoing_messages_count_(0),
+  current_address_(UNADDRESSED),
   default_message_handler_(default_message_handler),
   default_answer_handler_(default_answer_handler),
   default_timeout_handler_(default_timeout_handler),
@@ -32,13 +35,22 @@ ProtocolHandler::ProtocolHandler(ProtocolStream& stream, size_t buffer_size) noe
   answer_sent_(false),
   last_message_type_(FrameType::UNKNOWN_FRAME_TYPE),
   answer_timeout_interval_(DEFAULT_ANSWER_TIMEOUT),
-  cooldown_interval_(DEFAULT_COOLDOWN_INTERVAL)
+  scaled_answer_timeout_(DEFAULT_ANSWER_TIMEOUT),
+  cooldown_interval_(DEFAULT_COOLDOWN_INTERVAL),
+  latency_statistics_(nullptr),
+  message_intake_(nullptr),
+  intake_wakeup_handler_(nullptr),
+  max_baud_rate_(0),
+  address_(UNADDRESSED),
+  incoming_address_(UNADDRESSED)
 {
   this->cooldown_time_point_ = std::chrono::steady_clock::time_point();
 }
 
 void ProtocolHandler::loop()
 {
+  if (this->message_intake_ != nullptr)
+    this->process_intake_();
   this->transport_.read_data();
   this->transport_.process_data();
   std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
@@ -53,56 +65,67 @@ void ProtocolHandler::loop()
         // Shouldn't get more than 1 message, drop all except last
         HAIER_LOGW("Incoming queue size %d (should be not more than 1). Dropping extra messages", messagesCount);
         this->transport_.drop(messagesCount - 1);
+        this->transport_.get_flight_recorder().record_event(FlightEvent::FRAMES_DROPPED, 0, 0, messagesCount - 1);
+        this->statistics_.frames_dropped.increment((uint32_t) (messagesCount - 1));
         messagesCount = 1;
       }
       if (messagesCount > 0)
       {
         TimestampedFrame frame;
         this->transport_.pop(frame);
+        if (this->latency_statistics_ != nullptr)
+          this->latency_statistics_->dispatch_delay.record(now - frame.complete_timestamp);
         FrameType msg_type = (FrameType) frame.frame.get_frame_type();
         this->incoming_message_crc_status_ = frame.frame.get_use_crc();
+        this->incoming_address_ = frame.frame.get_address();
         std::map<FrameType, MessageHandler>::const_iterator handler = this->message_handlers_map_.find(msg_type);
         this->processing_message_ = true;
         this->answer_sent_ = false;
         HandlerError hres;
+        HAIER_TRACE2(dispatch_start, (uint8_t) msg_type, 0);
         if (handler != this->message_handlers_map_.end())
           hres = handler->second(msg_type, frame.frame.get_data(), frame.frame.get_data_size());
         else
           hres = default_message_handler_(msg_type, frame.frame.get_data(), frame.frame.get_data_size());
+        HAIER_TRACE2(dispatch_end, (uint8_t) msg_type, (int) hres);
         this->processing_message_ = false;
         if (hres != HandlerError::HANDLER_OK)
         {
           HAIER_LOGW("Message handler error, msg=%02X, err=%d", msg_type, hres);
         }
-        else if (!this->answer_sent_)
+        else if (!this->answer_sent_ && (this->incoming_address_ != BROADCAST_ADDRESS))
         {
           HAIER_LOGW("No answer sent in incoming messages handler, message type %02X", msg_type);
         }
       }
       {
-        if ((!this->outgoing_messages_.empty()) && (now >= this->cooldown_time_point_) && (now >= this->retry_time_point_))
+        if ((this->outgoing_messages_count_ > 0) && (now >= this->cooldown_time_point_) && (now >= this->retry_time_point_))
         {
-          // Ready to send next message
-          OutgoingQueueItem &msg = this->outgoing_messages_.front();
+          // Ready to send next message, queues of different addresses take turns
+          OutgoingQueueItem &msg = this->select_queue_().front();
           if (msg.number_of_retries > 0) {
-            if (this->write_message_(msg.message, msg.use_crc))
+            if ((this->latency_statistics_ != nullptr) && !msg.transmitted)
+              this->latency_statistics_->queue_wait.record(now - msg.enqueue_time_point);
+            msg.transmitted = true;
+            if (this->write_message_(msg.message, msg.use_crc, this->current_address_))
             {
+              this->statistics_.messages_sent.increment();
               this->last_message_type_ = msg.message.get_frame_type();
               if (msg.no_answer)
               {
-                this->outgoing_messages_.pop();
+                this->pop_message_();
                 this->retry_time_point_ = now;
               }
               else
               {
                 this->state_ = ProtocolState::WAITING_FOR_ANSWER;
-                this->answer_time_point_ = now + this->answer_timeout_interval_;
+                this->answer_time_point_ = now + this->scaled_answer_timeout_;
                 this->retry_time_point_ = now + msg.retry_interval;
               }
             }
             msg.number_of_retries--;
           } else {
-            this->outgoing_messages_.pop();
+            this->pop_message_();
             this->retry_time_point_ = now;
           }
         }
@@ -114,10 +137,13 @@ void ProtocolHandler::loop()
     if (now > this->answer_time_point_)
     {
       // Answer timeout
-      OutgoingQueueItem& msg = this->outgoing_messages_.front();
+      this->transport_.get_flight_recorder().record_event(FlightEvent::ANSWER_TIMEOUT, (uint8_t) this->last_message_type_);
+      this->statistics_.answer_timeouts.increment((uint8_t) this->last_message_type_);
+      OutgoingQueueItem& msg = this->outgoing_queues_[this->current_address_].front();
+      HAIER_TRACE2(answer_timeout, (uint8_t) this->last_message_type_, msg.number_of_retries);
       if (msg.number_of_retries == 0) {
         // No more retries, remove message
-        this->outgoing_messages_.pop();
+        this->pop_message_();
         this->retry_time_point_ = now;
         HandlerError hres;
         std::map<FrameType, TimeoutHandler>::const_iterator handler = this->timeout_handlers_map_.find(this->last_message_type_);
@@ -129,29 +155,45 @@ void ProtocolHandler::loop()
           HAIER_LOGW("Timeout handler error, msg=%02X, err=%d", this->last_message_type_, hres);
         }
       }
+      else
+        this->statistics_.retries.increment();
       state_ = ProtocolState::IDLE;
       break;
     }
     if (this->transport_.available() > 0)
     {
-#if HAIER_LOG_LEVEL > 3
-      HAIER_LOGD("Answer delay %dms", std::chrono::duration_cast<std::chrono::milliseconds>(now - last_message_sent_));
-#endif
       TimestampedFrame frame;
       this->transport_.pop(frame);
+      if ((this->current_address_ != UNADDRESSED) && (this->current_address_ != BROADCAST_ADDRESS) && (frame.frame.get_address() != this->current_address_))
+      {
+        // Late answer of another unit, keep waiting
+        HAIER_LOGW("Answer from address %02X while waiting for %02X dropped", frame.frame.get_address(), this->current_address_);
+        this->statistics_.frames_dropped.increment();
+        break;
+      }
+      this->incoming_address_ = frame.frame.get_address();
+      HAIER_LOGD("Answer delay %dms", (int) std::chrono::duration_cast<std::chrono::milliseconds>(frame.timestamp - this->last_message_sent_).count());
+      if (this->latency_statistics_ != nullptr)
+      {
+        this->latency_statistics_->answer_latency.get_item((uint8_t) this->last_message_type_).record(frame.timestamp - this->last_message_sent_);
+        this->latency_statistics_->dispatch_delay.record(now - frame.complete_timestamp);
+      }
       FrameType msg_type = (FrameType) frame.frame.get_frame_type();
       HandlerError hres;
       std::map<FrameType, AnswerHandler>::const_iterator handler = this->answer_handlers_map_.find(last_message_type_);
+      HAIER_TRACE2(dispatch_start, (uint8_t) msg_type, (uint8_t) this->last_message_type_);
       if (handler != this->answer_handlers_map_.end())
         hres = handler->second(this->last_message_type_, msg_type, frame.frame.get_data(), frame.frame.get_data_size());
       else
         hres = this->default_answer_handler_(this->last_message_type_, msg_type, frame.frame.get_data(), frame.frame.get_data_size());
+      HAIER_TRACE2(dispatch_end, (uint8_t) msg_type, (int) hres);
       if (hres != HandlerError::HANDLER_OK)
       {
         HAIER_LOGW("Answer handler error, msg=%02X, answ=%02X, err=%d", this->last_message_type_, msg_type, hres);
       }
       // Answer received, remove message
-      this->outgoing_messages_.pop();
+      this->statistics_.answers_received.increment();
+      this->pop_message_();
       this->retry_time_point_ = now;
       state_ = ProtocolState::IDLE;
     }
@@ -159,30 +201,65 @@ void ProtocolHandler::loop()
   }
 }
 
-bool ProtocolHandler::write_message_(const HaierMessage &message, bool use_crc)
+ProtocolHandler::OutgoingQueue& ProtocolHandler::select_queue_()
+{
+  std::map<uint8_t, OutgoingQueue>::iterator queue = this->outgoing_queues_.upper_bound(this->current_address_);
+  for (size_t i = 0; i < this->outgoing_queues_.size(); i++)
+  {
+    if (queue == this->outgoing_queues_.end())
+      queue = this->outgoing_queues_.begin();
+    if (!queue->second.empty())
+      break;
+    ++queue;
+  }
+  this->current_address_ = queue->first;
+  return queue->second;
+}
+
+void ProtocolHandler::pop_message_()
+{
+  this->outgoing_queues_[this->current_address_].pop();
+  this->outgoing_messages_count_--;
+}
+
+size_t ProtocolHandler::get_outgoing_queue_size(uint8_t address) const noexcept
 {
+  std::map<uint8_t, OutgoingQueue>::const_iterator queue = this->outgoing_queues_.find(address);
+  return queue != this->outgoing_queues_.end() ? queue->second.size() : 0;
+}
+
+bool ProtocolHandler::write_message_(const HaierMessage &message, bool use_crc, uint8_t address)
+{
+  // Frames of addressed unit always carry its address
+  if (address == UNADDRESSED)
+    address = this->address_;
   size_t buf_size = message.get_buffer_size();
   bool is_success = true;
   uint8_t frame_type = (uint8_t) message.get_frame_type();
   if (buf_size == 0)
-    is_success = this->transport_.send_data(frame_type, nullptr, 0, use_crc) > 0;
+    is_success = this->transport_.send_data(frame_type, nullptr, 0, use_crc, address) > 0;
   else
   {
     std::unique_ptr<uint8_t[]> buffer(new uint8_t[buf_size]);
-    is_success = (message.fill_buffer(buffer.get(), buf_size) > 0) && (this->transport_.send_data(frame_type, buffer.get(), buf_size, use_crc) > 0);
+    is_success = (message.fill_buffer(buffer.get(), buf_size) > 0) && (this->transport_.send_data(frame_type, buffer.get(), buf_size, use_crc, address) > 0);
   }
+  HAIER_TRACE3(write_message, frame_type, buf_size, is_success);
   if (!is_success)
   {
     HAIER_LOGE("Error sending message: %02X", frame_type);
   }
   std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
-#if HAIER_LOG_LEVEL > 3
-  last_message_sent_ = now;
-#endif
+  this->last_message_sent_ = now;
   this->cooldown_time_point_ = now + this->cooldown_interval_;
   return is_success;
 }
 
+void ProtocolHandler::enable_latency_statistics()
+{
+  if (this->latency_statistics_ == nullptr)
+    this->latency_statistics_.reset(new LatencyStatistics());
+}
+
 void ProtocolHandler::set_answer_timeout(long long answer_timeout_miliseconds)
 {
   this->set_answer_timeout(std::chrono::milliseconds(answer_timeout_miliseconds));
@@ -191,6 +268,51 @@ void ProtocolHandler::set_answer_timeout(long long answer_timeout_miliseconds)
 void ProtocolHandler::set_answer_timeout(std::chrono::milliseconds answer_timeout)
 {
   this->answer_timeout_interval_ = answer_timeout;
+  this->scaled_answer_timeout_ = scale_timeout(answer_timeout, this->transport_.get_baud_rate(), MIN_ANSWER_TIMEOUT);
+}
+
+void ProtocolHandler::set_max_baud_rate(uint32_t max_baud_rate)
+{
+  this->max_baud_rate_ = max_baud_rate;
+  if (max_baud_rate > 0)
+    this->set_message_handler(FrameType::CHANGE_BAUD_RATE, std::bind(&ProtocolHandler::change_baud_rate_handler_, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+  else
+    this->remove_message_handler(FrameType::CHANGE_BAUD_RATE);
+}
+
+bool ProtocolHandler::set_baud_rate(uint32_t baud_rate)
+{
+  if (!this->transport_.set_baud_rate(baud_rate))
+    return false;
+  this->scaled_answer_timeout_ = scale_timeout(this->answer_timeout_interval_, baud_rate, MIN_ANSWER_TIMEOUT);
+  return true;
+}
+
+HandlerError ProtocolHandler::change_baud_rate_handler_(FrameType, const uint8_t* data, size_t data_size)
+{
+  uint32_t current_rate = this->transport_.get_baud_rate();
+  if (current_rate == 0)
+    current_rate = DEFAULT_BAUD_RATE;
+  uint32_t new_rate = current_rate;
+  HandlerError result = HandlerError::HANDLER_OK;
+  if (data_size == BAUD_RATE_DATA_SIZE)
+  {
+    uint32_t requested_rate = ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) | data[3];
+    if ((requested_rate <= this->max_baud_rate_) && this->transport_.supports_baud_rate(requested_rate))
+      new_rate = requested_rate;
+    else
+    {
+      HAIER_LOGW("Requested baud rate %u is not allowed", (unsigned int) requested_rate);
+    }
+  }
+  else
+    result = HandlerError::WRONG_MESSAGE_STRUCTURE;
+  // Answer goes at the old rate, the stream switches after it is transmitted
+  const uint8_t answer[BAUD_RATE_DATA_SIZE] = { (uint8_t) (new_rate >> 24), (uint8_t) (new_rate >> 16), (uint8_t) (new_rate >> 8), (uint8_t) new_rate };
+  this->send_answer(HaierMessage(FrameType::CHANGE_BAUD_RATE_RESPONSE, answer, sizeof(answer)));
+  if ((new_rate != current_rate) && !this->set_baud_rate(new_rate))
+    result = HandlerError::RUNTIME_ERROR;
+  return result;
 }
 
 void ProtocolHandler::set_cooldown_interval(long long answer_timeout_miliseconds)
@@ -205,12 +327,123 @@ void ProtocolHandler::set_cooldown_interval(std::chrono::milliseconds answer_tim
 
 void ProtocolHandler::send_message(const HaierMessage& message, bool use_crc, uint8_t num_repeats, std::chrono::milliseconds interval)
 {
-  this->outgoing_messages_.push({ message, use_crc, false, std::min(num_repeats, MAX_PACKET_RETRIES) + 1, interval });
+  this->enqueue_message_(UNADDRESSED, message, use_crc, false, num_repeats, interval, std::chrono::steady_clock::now());
 }
 
 void ProtocolHandler::send_message_without_answer(const HaierMessage& message, bool use_crc)
 {
-  this->outgoing_messages_.push({ message, use_crc, true, 1, std::chrono::milliseconds::zero() });
+  this->enqueue_message_(UNADDRESSED, message, use_crc, true, 0, std::chrono::milliseconds::zero(), std::chrono::steady_clock::now());
+}
+
+void ProtocolHandler::send_message_to(uint8_t address, const HaierMessage& message, bool use_crc, uint8_t num_repeats, std::chrono::milliseconds interval)
+{
+  this->enqueue_message_(address, message, use_crc, false, num_repeats, interval, std::chrono::steady_clock::now());
+}
+
+void ProtocolHandler::send_group_message(const HaierMessage& message, bool use_crc)
+{
+  this->enqueue_message_(BROADCAST_ADDRESS, message, use_crc, true, 0, std::chrono::milliseconds::zero(), std::chrono::steady_clock::now());
+}
+
+void ProtocolHandler::enqueue_message_(uint8_t address, const HaierMessage& message, bool use_crc, bool no_answer, uint8_t num_repeats, std::chrono::milliseconds interval, std::chrono::steady_clock::time_point enqueue_time_point)
+{
+  this->outgoing_queues_[address].push({ message, use_crc, no_answer, std::min(num_repeats, MAX_PACKET_RETRIES) + 1, interval, enqueue_time_point, false });
+  this->outgoing_messages_count_++;
+  this->statistics_.outgoing_queue_high_water_mark.update_max((uint32_t) this->outgoing_messages_count_);
+}
+
+void ProtocolHandler::discover_addresses(bool use_crc, AddressesHandler handler, uint8_t num_retries)
+{
+  this->addresses_handler_ = handler;
+  this->set_answer_handler(FrameType::GET_ALL_ADDRESSES, std::bind(&ProtocolHandler::addresses_answer_handler_, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
+  this->send_message(HaierMessage(FrameType::GET_ALL_ADDRESSES), use_crc, num_retries);
+}
+
+HandlerError ProtocolHandler::addresses_answer_handler_(FrameType, FrameType message_type, const uint8_t* data, size_t data_size)
+{
+  if (message_type != FrameType::GET_ALL_ADDRESSES_RESPONSE)
+    return HandlerError::INVALID_ANSWER;
+  this->known_addresses_.clear();
+  for (size_t i = 0; i < data_size; i++)
+  {
+    if ((data[i] != UNADDRESSED) && (data[i] != BROADCAST_ADDRESS) && (std::find(this->known_addresses_.begin(), this->known_addresses_.end(), data[i]) == this->known_addresses_.end()))
+      this->known_addresses_.push_back(data[i]);
+  }
+  std::sort(this->known_addresses_.begin(), this->known_addresses_.end());
+  HAIER_LOGD("%d units found on the bus", (int) this->known_addresses_.size());
+  if (this->addresses_handler_)
+    this->addresses_handler_(this->known_addresses_.data(), this->known_addresses_.size());
+  return HandlerError::HANDLER_OK;
+}
+
+void ProtocolHandler::set_address(uint8_t address)
+{
+  this->address_ = address;
+  this->transport_.set_address_filter(address, !this->bus_addresses_.empty());
+}
+
+void ProtocolHandler::set_bus_addresses(const uint8_t* addresses, size_t count)
+{
+  this->bus_addresses_.assign(addresses, addresses + count);
+  if (count > 0)
+    this->set_message_handler(FrameType::GET_ALL_ADDRESSES, std::bind(&ProtocolHandler::get_addresses_handler_, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+  else
+    this->remove_message_handler(FrameType::GET_ALL_ADDRESSES);
+  this->transport_.set_address_filter(this->address_, count > 0);
+}
+
+HandlerError ProtocolHandler::get_addresses_handler_(FrameType, const uint8_t*, size_t)
+{
+  this->send_answer(HaierMessage(FrameType::GET_ALL_ADDRESSES_RESPONSE, this->bus_addresses_.data(), this->bus_addresses_.size()));
+  return HandlerError::HANDLER_OK;
+}
+
+void ProtocolHandler::enable_message_intake(size_t capacity, IntakeWakeupHandler wakeup_handler)
+{
+  if (this->message_intake_ == nullptr)
+    this->message_intake_.reset(new MpscQueue<PostedMessage>(capacity));
+  this->intake_wakeup_handler_ = wakeup_handler;
+}
+
+bool ProtocolHandler::post_message(const HaierMessage& message, bool use_crc, uint8_t num_repeats, std::chrono::milliseconds interval)
+{
+  return this->post_(UNADDRESSED, message, use_crc, false, num_repeats, interval);
+}
+
+bool ProtocolHandler::post_message_without_answer(const HaierMessage& message, bool use_crc)
+{
+  return this->post_(UNADDRESSED, message, use_crc, true, 0, std::chrono::milliseconds::zero());
+}
+
+bool ProtocolHandler::post_message_to(uint8_t address, const HaierMessage& message, bool use_crc, uint8_t num_repeats, std::chrono::milliseconds interval)
+{
+  return this->post_(address, message, use_crc, false, num_repeats, interval);
+}
+
+bool ProtocolHandler::post_group_message(const HaierMessage& message, bool use_crc)
+{
+  return this->post_(BROADCAST_ADDRESS, message, use_crc, true, 0, std::chrono::milliseconds::zero());
+}
+
+bool ProtocolHandler::post_(uint8_t address, const HaierMessage& message, bool use_crc, bool no_answer, uint8_t num_repeats, std::chrono::milliseconds interval)
+{
+  // No logging here, log handlers are not required to be thread safe
+  if (this->message_intake_ == nullptr)
+    return false;
+  // Message is copied before the cell is claimed, so other producers are not delayed by allocation
+  PostedMessage item{ address, message, use_crc, no_answer, num_repeats, interval, std::chrono::steady_clock::now() };
+  if (!this->message_intake_->push(std::move(item)))
+    return false;
+  if (this->intake_wakeup_handler_)
+    this->intake_wakeup_handler_();
+  return true;
+}
+
+void ProtocolHandler::process_intake_()
+{
+  PostedMessage item;
+  while (this->message_intake_->pop(item))
+    this->enqueue_message_(item.address, item.message, item.use_crc, item.no_answer, item.number_of_retries, item.retry_interval, item.enqueue_time_point);
 }
 
 void ProtocolHandler::send_answer(const HaierMessage &answer)
@@ -222,7 +455,11 @@ void ProtocolHandler::send_answer(const HaierMessage& answer, bool use_crc)
 {
     if (this->processing_message_)
     {
-        this->answer_sent_ = this->write_message_(answer, use_crc);
+        // Units don't answer broadcasts, answers would collide on the bus
+        if (this->incoming_address_ == BROADCAST_ADDRESS)
+            this->answer_sent_ = true;
+        else
+            this->answer_sent_ = this->write_message_(answer, use_crc, this->incoming_address_);
     }
     else
     {
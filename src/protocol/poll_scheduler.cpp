@@ -0,0 +1,276 @@
+#include <algorithm>
+#include "protocol/poll_scheduler.h"
+#include "transport/haier_frame.h"
+#include "utils/haier_log.h"
+
+namespace haier_protocol
+{
+
+constexpr float DEFAULT_POLL_JITTER = 0.1f;
+constexpr uint8_t DEFAULT_MAX_BACKOFF = 16;
+constexpr std::chrono::milliseconds DEFAULT_FAST_POLL_WINDOW = std::chrono::milliseconds(10000);
+// Start bit, 8 data bits and stop bit
+constexpr unsigned int BITS_PER_BYTE = 10;
+constexpr float BUDGET_WINDOW_SECONDS = 1.0f;
+
+static size_t get_frame_size_(size_t data_size, bool use_crc)
+{
+  // Separators and header, data, checksum and CRC (escaped 0xFF bytes are not counted)
+  return FRAME_HEADER_SIZE + data_size + 1 + (use_crc ? 2 : 0);
+}
+
+static float get_seconds_(std::chrono::steady_clock::duration duration)
+{
+  return std::chrono::duration_cast<std::chrono::duration<float>>(duration).count();
+}
+
+PollScheduler::PollScheduler(ProtocolHandler& protocol_handler) : PollScheduler(protocol_handler, std::random_device()())
+{
+}
+
+PollScheduler::PollScheduler(ProtocolHandler& protocol_handler, uint32_t seed) :
+  protocol_handler_(protocol_handler),
+  polls_(),
+  random_(seed),
+  jitter_(DEFAULT_POLL_JITTER),
+  max_backoff_(DEFAULT_MAX_BACKOFF),
+  fast_poll_window_(DEFAULT_FAST_POLL_WINDOW),
+  last_command_(),
+  budget_utilization_(0.0f),
+  budget_baud_rate_(0),
+  budget_bytes_(0.0f),
+  budget_time_point_(),
+  poll_in_flight_(NO_POLL),
+  waiting_for_budget_(false)
+{
+}
+
+PollId PollScheduler::add_poll(const HaierMessage& request, bool use_crc, std::chrono::milliseconds interval, std::chrono::milliseconds fast_interval)
+{
+  std::unique_ptr<Poll> poll(new Poll());
+  poll->request = request;
+  poll->use_crc = use_crc;
+  poll->interval = interval;
+  poll->fast_interval = fast_interval;
+  poll->backoff = 1;
+  poll->request_size = get_frame_size_(request.get_buffer_size(), use_crc);
+  // Until the first answer it is expected to be of the same size
+  poll->answer_size = poll->request_size;
+  // Random phase, devices started together don't poll together
+  poll->next_request = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::uniform_int_distribution<long long>(0, interval.count())(this->random_));
+  this->polls_.push_back(std::move(poll));
+  return this->polls_.size() - 1;
+}
+
+void PollScheduler::set_request(PollId poll, const HaierMessage& request)
+{
+  this->polls_[poll]->request = request;
+  this->polls_[poll]->request_size = get_frame_size_(request.get_buffer_size(), this->polls_[poll]->use_crc);
+}
+
+void PollScheduler::set_jitter(float ratio)
+{
+  this->jitter_ = std::min(std::max(ratio, 0.0f), 1.0f);
+}
+
+void PollScheduler::set_max_backoff(uint8_t factor)
+{
+  this->max_backoff_ = std::max(factor, (uint8_t) 1);
+}
+
+void PollScheduler::set_fast_poll_window(std::chrono::milliseconds window)
+{
+  this->fast_poll_window_ = window;
+}
+
+void PollScheduler::set_bus_budget(float utilization, uint32_t baud_rate)
+{
+  this->budget_utilization_ = utilization;
+  this->budget_baud_rate_ = baud_rate;
+  // Start with full budget
+  this->budget_bytes_ = this->get_budget_limit_(this->get_budget_rate_());
+  this->budget_time_point_ = std::chrono::steady_clock::now();
+  this->waiting_for_budget_ = false;
+}
+
+void PollScheduler::send_command(const HaierMessage& command, bool use_crc, uint8_t num_retries, std::chrono::milliseconds interval)
+{
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  this->protocol_handler_.send_message(command, use_crc, num_retries, interval);
+  this->update_budget_(now);
+  // Answer is expected to be of the same size, budget can go below zero
+  if (this->get_budget_rate_() > 0.0f)
+    this->budget_bytes_ -= 2.0f * get_frame_size_(command.get_buffer_size(), use_crc);
+  this->last_command_ = now;
+  for (PollId id = 0; id < this->polls_.size(); id++)
+  {
+    Poll& poll = *this->polls_[id];
+    if ((id != this->poll_in_flight_) && this->is_fast_(poll, now))
+      poll.next_request = std::min(poll.next_request, now + poll.fast_interval * poll.backoff);
+  }
+}
+
+void PollScheduler::register_handlers(AnswerHandler next_answer_handler, TimeoutHandler next_timeout_handler)
+{
+  std::vector<FrameType> frame_types;
+  for (const std::unique_ptr<Poll>& poll : this->polls_)
+  {
+    if (std::find(frame_types.begin(), frame_types.end(), poll->request.get_frame_type()) == frame_types.end())
+      frame_types.push_back(poll->request.get_frame_type());
+  }
+  for (FrameType frame_type : frame_types)
+  {
+    this->protocol_handler_.set_answer_handler(frame_type,
+      [this, next_answer_handler](FrameType request_type, FrameType message_type, const uint8_t* data, size_t size) {
+        this->process_answer(request_type, size);
+        return next_answer_handler(request_type, message_type, data, size);
+      });
+    this->protocol_handler_.set_timeout_handler(frame_type,
+      [this, next_timeout_handler](FrameType request_type) {
+        this->process_timeout(request_type);
+        return next_timeout_handler(request_type);
+      });
+  }
+}
+
+void PollScheduler::process_answer(FrameType request_type, size_t data_size)
+{
+  // Requests are sent only when outgoing queue is empty, so the first answer to this type is ours
+  if ((this->poll_in_flight_ == NO_POLL) || (this->polls_[this->poll_in_flight_]->request.get_frame_type() != request_type))
+    return;
+  Poll& poll = *this->polls_[this->poll_in_flight_];
+  this->poll_in_flight_ = NO_POLL;
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  size_t answer_size = get_frame_size_(data_size, poll.use_crc);
+  // Budget was taken for the estimated answer size
+  if (this->get_budget_rate_() > 0.0f)
+    this->budget_bytes_ -= (float) answer_size - (float) poll.answer_size;
+  poll.answer_size = answer_size;
+  poll.last_answer = now;
+  poll.backoff = 1;
+  poll.statistics.answers_received.increment();
+  this->schedule_next_(poll, now);
+}
+
+void PollScheduler::process_timeout(FrameType request_type)
+{
+  if ((this->poll_in_flight_ == NO_POLL) || (this->polls_[this->poll_in_flight_]->request.get_frame_type() != request_type))
+    return;
+  Poll& poll = *this->polls_[this->poll_in_flight_];
+  this->poll_in_flight_ = NO_POLL;
+  poll.backoff = (uint8_t) std::min((unsigned int) poll.backoff * 2, (unsigned int) this->max_backoff_);
+  poll.statistics.answer_timeouts.increment();
+  HAIER_LOGD("Poll %02X timeout, interval x%u", (uint8_t) request_type, (unsigned int) poll.backoff);
+  this->schedule_next_(poll, std::chrono::steady_clock::now());
+}
+
+void PollScheduler::loop(std::chrono::steady_clock::time_point now)
+{
+  this->update_budget_(now);
+  if (this->protocol_handler_.get_outgoing_queue_size() > 0)
+    return;
+  if (this->poll_in_flight_ != NO_POLL)
+  {
+    // Request is done but handlers were not called (not registered for its frame type)
+    Poll& poll = *this->polls_[this->poll_in_flight_];
+    this->poll_in_flight_ = NO_POLL;
+    this->schedule_next_(poll, now);
+  }
+  float rate = this->get_budget_rate_();
+  PollId next_poll = NO_POLL;
+  float best_priority = 0.0f;
+  for (PollId id = 0; id < this->polls_.size(); id++)
+  {
+    const Poll& poll = *this->polls_[id];
+    if (now < poll.next_request)
+      continue;
+    // Number of intervals since previous request was planned, more than 1 if the poll is late
+    float interval = std::max(get_seconds_(this->get_interval_(poll, now)), 0.001f);
+    float priority = (get_seconds_(now - poll.next_request) + interval) / interval;
+    if (rate > 0.0f)
+      priority /= (float) (poll.request_size + poll.answer_size);
+    if (priority > best_priority)
+    {
+      best_priority = priority;
+      next_poll = id;
+    }
+  }
+  if (next_poll == NO_POLL)
+    return;
+  Poll& poll = *this->polls_[next_poll];
+  if (rate > 0.0f)
+  {
+    float cost = (float) (poll.request_size + poll.answer_size);
+    if (this->budget_bytes_ < cost)
+    {
+      if (!this->waiting_for_budget_)
+        this->budget_waits_.increment();
+      this->waiting_for_budget_ = true;
+      return;
+    }
+    this->budget_bytes_ -= cost;
+  }
+  this->waiting_for_budget_ = false;
+  this->protocol_handler_.send_message(poll.request, poll.use_crc);
+  poll.last_request = now;
+  poll.statistics.requests_sent.increment();
+  this->poll_in_flight_ = next_poll;
+}
+
+std::chrono::milliseconds PollScheduler::get_interval(PollId poll, std::chrono::steady_clock::time_point now) const
+{
+  return this->get_interval_(*this->polls_[poll], now);
+}
+
+bool PollScheduler::is_fast_(const Poll& poll, std::chrono::steady_clock::time_point now) const
+{
+  return (poll.fast_interval > std::chrono::milliseconds::zero()) && (poll.fast_interval < poll.interval) &&
+    (this->last_command_ != std::chrono::steady_clock::time_point()) && (now - this->last_command_ < this->fast_poll_window_);
+}
+
+std::chrono::milliseconds PollScheduler::get_interval_(const Poll& poll, std::chrono::steady_clock::time_point now) const
+{
+  return (this->is_fast_(poll, now) ? poll.fast_interval : poll.interval) * poll.backoff;
+}
+
+std::chrono::steady_clock::duration PollScheduler::get_jittered_(std::chrono::milliseconds interval)
+{
+  float factor = 1.0f;
+  if (this->jitter_ > 0.0f)
+    factor += std::uniform_real_distribution<float>(-this->jitter_, this->jitter_)(this->random_);
+  return std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval * factor);
+}
+
+void PollScheduler::schedule_next_(Poll& poll, std::chrono::steady_clock::time_point now)
+{
+  poll.next_request = poll.last_request + this->get_jittered_(this->get_interval_(poll, now));
+}
+
+float PollScheduler::get_budget_rate_() const
+{
+  if (this->budget_utilization_ <= 0.0f)
+    return 0.0f;
+  uint32_t baud_rate = this->budget_baud_rate_ != 0 ? this->budget_baud_rate_ : this->protocol_handler_.get_baud_rate();
+  if (baud_rate == 0)
+    baud_rate = DEFAULT_BAUD_RATE;
+  return (float) baud_rate / BITS_PER_BYTE * this->budget_utilization_;
+}
+
+float PollScheduler::get_budget_limit_(float rate) const
+{
+  // Big polls should be possible even if they don't fit into the window
+  float limit = rate * BUDGET_WINDOW_SECONDS;
+  for (const std::unique_ptr<Poll>& poll : this->polls_)
+    limit = std::max(limit, (float) (poll->request_size + poll->answer_size));
+  return limit;
+}
+
+void PollScheduler::update_budget_(std::chrono::steady_clock::time_point now)
+{
+  float rate = this->get_budget_rate_();
+  if ((rate > 0.0f) && (now > this->budget_time_point_))
+    this->budget_bytes_ = std::min(this->budget_bytes_ + rate * get_seconds_(now - this->budget_time_point_), this->get_budget_limit_(rate));
+  this->budget_time_point_ = std::max(this->budget_time_point_, now);
+}
+
+} // haier_protocol
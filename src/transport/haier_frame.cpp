@@ -8,6 +8,7 @@ namespace haier_protocol
 constexpr uint8_t USE_CRC_MASK            = 0x40;
 constexpr uint8_t  HEADER_SIZE_POS        = 0x02;
 constexpr uint8_t  HEADER_CRC_FLAG_POS    = 0x03;
+constexpr uint8_t  HEADER_ADDRESS_POS     = 0x04;
 constexpr uint8_t  HEADER_FRAME_TYPE_POS  = 0x09;
 constexpr uint8_t  INITIAL_CRC            = 0x00;
 
@@ -53,7 +54,7 @@ inline uint16_t crc16(const uint8_t data, uint16_t crc = 0)
   return (crc >> 8) ^ crc_table[(crc ^ data) & 0xFF];
 }
 
-uint16_t crc16(const uint8_t* const data, size_t size, uint16_t initial_val = 0)
+uint16_t crc16(const uint8_t* const data, size_t size, uint16_t initial_val)
 {
   const uint8_t* val = data;
   uint16_t crc = initial_val;
@@ -65,7 +66,7 @@ uint16_t crc16(const uint8_t* const data, size_t size, uint16_t initial_val = 0)
   return crc;
 }
 
-uint8_t checksum(const uint8_t* const data, size_t size, uint8_t initial_val = 0)
+uint8_t checksum(const uint8_t* const data, size_t size, uint8_t initial_val)
 {
   uint8_t result = initial_val;
   for (int i = 0; i < size; i++) {
@@ -84,6 +85,8 @@ uint8_t HaierFrame::get_header_byte_(uint8_t pos) const
       return PURE_HEADER_SIZE + this->data_size_;
     case HEADER_CRC_FLAG_POS:
       return  this->use_crc_ ? USE_CRC_MASK : 0;
+    case HEADER_ADDRESS_POS:
+      return this->address_;
     case HEADER_FRAME_TYPE_POS:
       return (uint8_t) this->frame_type_;
     default:
@@ -94,6 +97,7 @@ uint8_t HaierFrame::get_header_byte_(uint8_t pos) const
 haier_protocol::HaierFrame::HaierFrame() noexcept :
   frame_type_(0),
   use_crc_(true),
+  address_(UNADDRESSED),
   data_size_(0),
   checksum_(0),
   crc_(INITIAL_CRC),
@@ -103,9 +107,10 @@ haier_protocol::HaierFrame::HaierFrame() noexcept :
 {
 }
 
-HaierFrame::HaierFrame(uint8_t frame_type, const uint8_t* const data, uint8_t data_size, bool use_crc) :
+HaierFrame::HaierFrame(uint8_t frame_type, const uint8_t* const data, uint8_t data_size, bool use_crc, uint8_t address) :
   frame_type_(frame_type),
   use_crc_(use_crc),
+  address_(address),
   data_size_(data_size),
   checksum_(0),
   crc_(INITIAL_CRC),
@@ -143,6 +148,7 @@ HaierFrame::HaierFrame(uint8_t frame_type, const uint8_t* const data, uint8_t da
 HaierFrame::HaierFrame(HaierFrame&& source) noexcept :
   frame_type_(source.frame_type_),
   use_crc_(source.use_crc_),
+  address_(source.address_),
   data_size_(source.data_size_),
   checksum_(source.checksum_),
   crc_(source.crc_),
@@ -168,6 +174,7 @@ HaierFrame& HaierFrame::operator=(HaierFrame&& source) noexcept
   {
     this->frame_type_ = source.frame_type_;
     this->use_crc_ = source.use_crc_;
+    this->address_ = source.address_;
     this->data_size_ = source.data_size_;
     this->checksum_ = source.checksum_;
     this->crc_ = source.crc_;
@@ -205,6 +212,8 @@ size_t HaierFrame::parse_buffer(const uint8_t* const buffer, size_t size, FrameE
     uint8_t fsize = 0;
     bool use_crc = true;
     uint8_t frame_type = 0;
+    uint8_t address = UNADDRESSED;
+    uint8_t additional_bytes = 0;
     uint8_t chk = 0;
     uint16_t crc = INITIAL_CRC;
     while (lpos < FRAME_HEADER_SIZE)
@@ -219,11 +228,16 @@ size_t HaierFrame::parse_buffer(const uint8_t* const buffer, size_t size, FrameE
         if (!use_crc)
           crc = INITIAL_CRC;
         break;
+      case HEADER_ADDRESS_POS:
+        address = buffer[lpos];
+        break;
       case HEADER_FRAME_TYPE_POS:
         frame_type = buffer[lpos];
-        this->additional_bytes_ = (frame_type == SEPARATOR_BYTE) ? 1 : 0;
         break;
       }
+      // Escaped in the stream, post bytes are counted in checksum
+      if (buffer[lpos] == SEPARATOR_BYTE)
+        ++additional_bytes;
       chk = checksum(buffer + lpos, 1, chk);
       if (use_crc)
         crc = crc16(buffer[lpos], crc);
@@ -241,6 +255,8 @@ size_t HaierFrame::parse_buffer(const uint8_t* const buffer, size_t size, FrameE
     }
     this->frame_type_ = frame_type;
     this->use_crc_ = use_crc;
+    this->address_ = address;
+    this->additional_bytes_ = additional_bytes;
     this->data_size_ = fsize - PURE_HEADER_SIZE;
     this->checksum_ = chk;
     this->crc_ = crc;
@@ -303,6 +319,7 @@ void HaierFrame::reset()
   delete[] this->data_;
   this->frame_type_ = 0;
   this->use_crc_ = true;
+  this->address_ = UNADDRESSED;
   this->data_size_ = 0;
   this->checksum_ = 0;
   this->crc_ = INITIAL_CRC;
@@ -1,77 +1,100 @@
+#include <algorithm>
 #include <memory>
 #include <iomanip>
 #include <sstream>
 #include "transport/protocol_transport.h"
+#include "utils/haier_trace.h"
 
 namespace haier_protocol
 {
 
 constexpr std::chrono::duration<long long, std::milli> FRAME_TIMEOUT(300);
+constexpr std::chrono::milliseconds MIN_FRAME_TIMEOUT(50);
+
+std::chrono::milliseconds scale_timeout(std::chrono::milliseconds timeout, uint32_t baud_rate, std::chrono::milliseconds min_timeout)
+{
+  if ((baud_rate == 0) || (baud_rate == DEFAULT_BAUD_RATE))
+    return timeout;
+  std::chrono::milliseconds result(timeout.count() * DEFAULT_BAUD_RATE / baud_rate);
+  return std::max(result, std::min(timeout, min_timeout));
+}
 
 TransportLevelHandler::TransportLevelHandler(ProtocolStream &stream, size_t buffer_size) noexcept : stream_(stream),
   buffer_(buffer_size),
   pos_(0),
   sep_count_(0),
   frame_start_found_(false),
-  current_frame_()
+  current_frame_(),
+  frame_timeout_(FRAME_TIMEOUT),
+  address_filter_(UNADDRESSED),
+  accept_unaddressed_(true)
 {
 }
 
-uint8_t TransportLevelHandler::send_data(uint8_t frame_type, const uint8_t *data, size_t data_size, bool use_crc)
+uint8_t TransportLevelHandler::send_data(uint8_t frame_type, const uint8_t *data, size_t data_size, bool use_crc, uint8_t address)
 {
   if (data_size > MAX_FRAME_SIZE - PURE_HEADER_SIZE)
     return 0;
 #if (HAIER_LOG_LEVEL > 3)
-  static char _header[]{"Sending frame: type 00, data:"};
-  const char *_p = hex_map + (frame_type * 2);
-  _header[20] = _p[0];
-  _header[21] = _p[1];
-  HAIER_BUFD(_header, data, data_size);
+  if (HAIER_LOG_ENABLED(haier_protocol::HaierLogLevel::LEVEL_DEBUG))
+  {
+    static char _header[]{"Sending frame: type 00, data:"};
+    const char *_p = hex_map + (frame_type * 2);
+    _header[20] = _p[0];
+    _header[21] = _p[1];
+    HAIER_BUFD(_header, data, data_size);
+  }
 #endif
-  HaierFrame frame = HaierFrame(frame_type, data, (uint8_t)data_size, use_crc);
+  HaierFrame frame = HaierFrame(frame_type, data, (uint8_t)data_size, use_crc, address);
   size_t size = frame.get_buffer_size();
   std::unique_ptr<uint8_t[]> tmp_buf(new uint8_t[size]);
   frame.fill_buffer(tmp_buf.get(), size);
   HAIER_BUFV("Sending data:", tmp_buf.get(), size);
   this->stream_.write_array(tmp_buf.get(), size);
+  this->statistics_.frames_sent.increment();
+  this->flight_recorder_.record_frame(FlightEvent::FRAME_SENT, frame_type, use_crc, data, data_size);
   return (uint8_t)size;
 }
 
 size_t TransportLevelHandler::read_data()
 {
-  size_t count = this->stream_.available();
-  if (count >= this->buffer_.get_capacity())
-    count = this->buffer_.get_capacity();
-  // Need to make space
-  size_t available = this->buffer_.get_space();
-  if (count > available)
+  // Buffer is full and parser can't free it, make space for new data
+  if (this->buffer_.get_space() == 0)
   {
-    this->drop_bytes_(count - available);
+    size_t count = this->stream_.available();
+    if (count == 0)
+      return 0;
+    this->drop_bytes_(std::min(count, this->buffer_.get_capacity()));
     if (this->frame_start_found_)
     {
       // Resetting frame because we will lose it start
       HAIER_LOGW("Frame lost because of buffer overflow");
+      this->statistics_.buffer_overflows.increment();
+      this->flight_recorder_.record_event(FlightEvent::BUFFER_OVERFLOW, this->current_frame_.get_frame_type());
       this->pos_ = 0;
       this->sep_count_ = 0;
       this->frame_start_found_ = false;
       this->current_frame_.reset();
     }
   }
-  size_t size1 = count;
-  size_t size2 = 0;
-  uint8_t *buf1 = this->buffer_.reserve(size1);
-  uint8_t *buf2 = nullptr;
-  size1 = this->stream_.read_array(buf1, size1);
+  uint8_t *buf1;
+  uint8_t *buf2;
+  size_t size1, size2;
+  this->buffer_.get_free_segments(buf1, size1, buf2, size2);
+  size_t count = this->buffer_.commit(this->stream_.read_into(buf1, size1, buf2, size2));
+  // Part of the data that went to the second segment
   if (count > size1)
-  {
     size2 = count - size1;
-    buf2 = this->buffer_.reserve(size2);
-    size2 = this->stream_.read_array(buf2, size2);
+  else
+  {
+    size1 = count;
+    size2 = 0;
   }
+  this->statistics_.bytes_read.increment((uint32_t) (size1 + size2));
 #if (HAIER_LOG_LEVEL > 4)
-  if (size1 + size2 > 0)
+  if ((size1 + size2 > 0) && HAIER_LOG_ENABLED(haier_protocol::HaierLogLevel::LEVEL_VERBOSE))
   {
-    log_haier_buffers(haier_protocol::HaierLogLevel::LEVEL_VERBOSE, "Received data:", buf1, size1, buf2, size2);
+    log_haier_buffers_tagged(haier_protocol::HaierLogLevel::LEVEL_VERBOSE, HAIER_LOG_TAG, "Received data:", buf1, size1, buf2, size2);
   }
 #endif
   return size1 + size2;
@@ -82,10 +105,12 @@ void TransportLevelHandler::process_data()
   if (this->current_frame_.get_status() > FrameStatus::FRAME_EMPTY)
   {
     std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
-    if (std::chrono::duration_cast<std::chrono::milliseconds>(now - this->frame_start_) > FRAME_TIMEOUT)
+    if (std::chrono::duration_cast<std::chrono::milliseconds>(now - this->frame_start_) > this->frame_timeout_)
     {
       // Timeout
       HAIER_LOGW("Frame timeout!");
+      this->statistics_.frame_timeouts.increment();
+      this->flight_recorder_.record_event(FlightEvent::FRAME_TIMEOUT, this->current_frame_.get_frame_type());
       this->drop_bytes_(this->pos_);
       this->pos_ = 0;
       this->sep_count_ = 0;
@@ -112,6 +137,8 @@ void TransportLevelHandler::process_data()
           if (this->pos_ - bytes_to_drop == FRAME_SEPARATORS_COUNT)
           {
             this->frame_start_found_ = true;
+            this->frame_start_ = std::chrono::steady_clock::now();
+            HAIER_TRACE0(frame_start);
             if (bytes_to_drop > 0)
             {
               // Dropping garbage
@@ -155,8 +182,8 @@ void TransportLevelHandler::process_data()
             }
             if (!correctFrame)
             {
-              HAIER_LOGW("Frame parsing error: %d", FrameError::WRONG_POST_SEPARATOR_BYTE);
-              buffer_.drop(bPos - 1);
+              this->frame_error_(FrameError::WRONG_POST_SEPARATOR_BYTE);
+              this->drop_bytes_(bPos - 1);
               this->current_frame_.reset();
               pos_ = 0;
               sep_count_ = 0;
@@ -170,9 +197,10 @@ void TransportLevelHandler::process_data()
             sep_count_ = 0;
             FrameError err;
             this->current_frame_.parse_buffer(headerBuffer.get(), hPos, err);
+            HAIER_TRACE3(header_parse, (int) err, this->current_frame_.get_frame_type(), this->current_frame_.get_data_size());
             if (err != FrameError::HEADER_ONLY)
             {
-              HAIER_LOGW("Frame parsing error: %d", err);
+              this->frame_error_(err);
               this->current_frame_.reset();
               this->frame_start_found_ = false;
             }
@@ -200,8 +228,8 @@ void TransportLevelHandler::process_data()
             }
             if (!correctFrame)
             {
-              HAIER_LOGW("Frame parsing error: %d", FrameError::WRONG_POST_SEPARATOR_BYTE);
-              this->buffer_.drop(bPos - 1);
+              this->frame_error_(FrameError::WRONG_POST_SEPARATOR_BYTE);
+              this->drop_bytes_(bPos - 1);
               this->current_frame_.reset();
               this->pos_ = 0;
               this->sep_count_ = 0;
@@ -212,21 +240,37 @@ void TransportLevelHandler::process_data()
             this->buffer_.drop(bPos);
             FrameError err;
             this->current_frame_.parse_buffer(tmp_buf.get(), hPos, err);
-            if (err == FrameError::COMPLETE_FRAME)
+            uint8_t address = this->current_frame_.get_address();
+            if ((err == FrameError::COMPLETE_FRAME) && (this->address_filter_ != UNADDRESSED) && (address != this->address_filter_) &&
+                (address != BROADCAST_ADDRESS) && ((address != UNADDRESSED) || !this->accept_unaddressed_))
+            {
+              // Valid frame for another unit
+              HAIER_LOGV("Frame for address %02X filtered", address);
+              this->statistics_.frames_filtered.increment();
+            }
+            else if (err == FrameError::COMPLETE_FRAME)
             {
 #if (HAIER_LOG_LEVEL > 3)
-              static char _header[]{"Frame found: type 00, data:"};
-              uint8_t _frameType = this->current_frame_.get_frame_type();
-              const char *_p = hex_map + (_frameType * 2);
-              _header[18] = _p[0];
-              _header[19] = _p[1];
-              HAIER_BUFD(_header, tmp_buf.get(), this->current_frame_.get_data_size());
+              if (HAIER_LOG_ENABLED(haier_protocol::HaierLogLevel::LEVEL_DEBUG))
+              {
+                static char _header[]{"Frame found: type 00, data:"};
+                uint8_t _frameType = this->current_frame_.get_frame_type();
+                const char *_p = hex_map + (_frameType * 2);
+                _header[18] = _p[0];
+                _header[19] = _p[1];
+                HAIER_BUFD(_header, tmp_buf.get(), this->current_frame_.get_data_size());
+              }
 #endif
-              this->incoming_queue_.push(TimestampedFrame{std::move(this->current_frame_), frame_start_});
+              HAIER_TRACE3(frame_complete, this->current_frame_.get_frame_type(), this->current_frame_.get_data_size(), this->current_frame_.get_use_crc());
+              this->flight_recorder_.record_frame(FlightEvent::FRAME_RECEIVED, this->current_frame_.get_frame_type(), this->current_frame_.get_use_crc(),
+                                                  this->current_frame_.get_data(), this->current_frame_.get_data_size());
+              this->incoming_queue_.push(TimestampedFrame{std::move(this->current_frame_), this->frame_start_, std::chrono::steady_clock::now()});
+              this->statistics_.frames_parsed.increment();
+              HAIER_TRACE2(frame_enqueue, this->incoming_queue_.back().frame.get_frame_type(), this->incoming_queue_.size());
             }
             else
             {
-              HAIER_LOGW("Frame parsing error: %d", err);
+              this->frame_error_(err);
             }
             this->current_frame_.reset();
             this->pos_ = 0;
@@ -267,6 +311,24 @@ void TransportLevelHandler::reset_protocol() noexcept
   this->frame_start_found_ = false;
 }
 
+void TransportLevelHandler::set_address_filter(uint8_t address, bool accept_unaddressed) noexcept
+{
+  this->address_filter_ = address;
+  this->accept_unaddressed_ = accept_unaddressed;
+}
+
+bool TransportLevelHandler::set_baud_rate(uint32_t baud_rate) noexcept
+{
+  if (!this->stream_.set_baud_rate(baud_rate))
+  {
+    HAIER_LOGW("Can't change baud rate to %u", (unsigned int) baud_rate);
+    return false;
+  }
+  this->frame_timeout_ = scale_timeout(FRAME_TIMEOUT, baud_rate, MIN_FRAME_TIMEOUT);
+  HAIER_LOGI("Baud rate changed to %u, frame timeout %dms", (unsigned int) baud_rate, (int) this->frame_timeout_.count());
+  return true;
+}
+
 bool TransportLevelHandler::pop(TimestampedFrame &tframe)
 {
   if (this->incoming_queue_.empty())
@@ -303,6 +365,21 @@ void TransportLevelHandler::drop_bytes_(size_t size)
 {
   this->buffer_.drop(size);
   HAIER_LOGV("Dropping %d bytes", size);
+  if (size > 0)
+  {
+    this->statistics_.bytes_dropped.increment((uint32_t) size);
+    this->flight_recorder_.record_event(FlightEvent::BYTES_DROPPED, 0, 0, size);
+  }
+}
+
+void TransportLevelHandler::frame_error_(FrameError err)
+{
+  HAIER_LOGW("Frame parsing error: %d", err);
+  HAIER_TRACE1(frame_error, (int) err);
+  if ((size_t) err < FRAME_ERRORS_COUNT)
+    this->statistics_.frame_errors[(size_t) err].increment();
+  // Frame type is not reliable at this point
+  this->flight_recorder_.record_event(FlightEvent::FRAME_ERROR, 0, (uint8_t) err);
 }
 
 } // haier_protocol
\ No newline at end of file
@@ -0,0 +1,152 @@
+#include <chrono>
+#include <cstring>
+#include "utils/flight_recorder.h"
+
+namespace haier_protocol
+{
+
+static uint32_t get_timestamp_()
+{
+  return (uint32_t) std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool is_error_event_(FlightEvent event)
+{
+  switch (event)
+  {
+  case FlightEvent::FRAME_ERROR:
+  case FlightEvent::FRAME_TIMEOUT:
+  case FlightEvent::BUFFER_OVERFLOW:
+  case FlightEvent::ANSWER_TIMEOUT:
+    return true;
+  default:
+    return false;
+  }
+}
+
+FlightRecorder::FlightRecorder() noexcept :
+  head_(0),
+  error_trigger_(nullptr)
+{
+}
+
+void FlightRecorder::record_frame(FlightEvent event, uint8_t frame_type, bool use_crc, const uint8_t* data, size_t data_size) noexcept
+{
+  FlightRecord record;
+  record.timestamp = get_timestamp_();
+  record.event = event;
+  record.frame_type = frame_type;
+  record.flags = use_crc ? FLIGHT_RECORD_CRC_FLAG : 0;
+  record.error = 0;
+  record.size = (uint16_t) data_size;
+  record.payload_size = (uint8_t) (data_size < HAIER_FLIGHT_RECORDER_PAYLOAD ? data_size : HAIER_FLIGHT_RECORDER_PAYLOAD);
+  if ((data != nullptr) && (record.payload_size > 0))
+    memcpy(record.payload, data, record.payload_size);
+  else
+    record.payload_size = 0;
+  this->push_(record);
+}
+
+void FlightRecorder::record_event(FlightEvent event, uint8_t frame_type, uint8_t error, size_t size) noexcept
+{
+  FlightRecord record;
+  record.timestamp = get_timestamp_();
+  record.event = event;
+  record.frame_type = frame_type;
+  record.flags = 0;
+  record.error = error;
+  record.size = (uint16_t) (size < UINT16_MAX ? size : UINT16_MAX);
+  record.payload_size = 0;
+  this->push_(record);
+  if (is_error_event_(event) && (this->error_trigger_ != nullptr))
+    this->error_trigger_(*this, record);
+}
+
+void FlightRecorder::push_(const FlightRecord& record) noexcept
+{
+  uint32_t index = this->head_.load(std::memory_order_relaxed);
+  this->slots_[index % HAIER_FLIGHT_RECORDER_SIZE].store(record);
+  this->head_.store(index + 1, std::memory_order_release);
+}
+
+bool FlightRecorder::read_(uint32_t index, FlightRecord& record) const noexcept
+{
+  // Slot version is the number of records written to it, other version means the record was overwritten
+  uint32_t version;
+  return this->slots_[index % HAIER_FLIGHT_RECORDER_SIZE].try_load(record, version) && (version == index / HAIER_FLIGHT_RECORDER_SIZE + 1);
+}
+
+size_t FlightRecorder::snapshot(FlightRecord* records, size_t max_records) const noexcept
+{
+  uint32_t head = this->head_.load(std::memory_order_acquire);
+  size_t count = head < HAIER_FLIGHT_RECORDER_SIZE ? head : HAIER_FLIGHT_RECORDER_SIZE;
+  if (count > max_records)
+    count = max_records;
+  size_t result = 0;
+  for (uint32_t index = head - (uint32_t) count; index != head; index++)
+    if (this->read_(index, records[result]))
+      ++result;
+  return result;
+}
+
+void FlightRecorder::dump(HaierLogLevel level) const
+{
+  if (!is_log_level_enabled(level, HAIER_LOG_TAG))
+    return;
+  FlightRecord records[HAIER_FLIGHT_RECORDER_SIZE];
+  size_t count = this->snapshot(records, HAIER_FLIGHT_RECORDER_SIZE);
+  log_haier_tagged(level, HAIER_LOG_TAG, "Flight recorder: %u events total, last %u:", this->get_events_count(), (unsigned int) count);
+  char payload[HAIER_FLIGHT_RECORDER_PAYLOAD * 3 + 1];
+  for (size_t i = 0; i < count; i++)
+  {
+    const FlightRecord& record = records[i];
+    bool is_frame = (record.event == FlightEvent::FRAME_RECEIVED) || (record.event == FlightEvent::FRAME_SENT);
+    if (is_frame)
+    {
+      buf_to_hex(record.payload, record.payload_size, payload, sizeof(payload));
+      log_haier_tagged(level, HAIER_LOG_TAG, "  [%u] %s type=%02X size=%u crc=%u data: %s%s", record.timestamp,
+                       flight_event_to_string(record.event), record.frame_type, record.size,
+                       (record.flags & FLIGHT_RECORD_CRC_FLAG) != 0 ? 1 : 0, payload, record.size > record.payload_size ? " ..." : "");
+    }
+    else
+      log_haier_tagged(level, HAIER_LOG_TAG, "  [%u] %s type=%02X size=%u err=%u", record.timestamp,
+                       flight_event_to_string(record.event), record.frame_type, record.size, record.error);
+  }
+}
+
+void FlightRecorder::set_error_trigger(FlightRecorderTrigger trigger)
+{
+  this->error_trigger_ = trigger;
+}
+
+void FlightRecorder::reset_error_trigger()
+{
+  this->error_trigger_ = nullptr;
+}
+
+const char* flight_event_to_string(FlightEvent event)
+{
+  switch (event)
+  {
+  case FlightEvent::FRAME_RECEIVED:
+    return "RECEIVED";
+  case FlightEvent::FRAME_SENT:
+    return "SENT";
+  case FlightEvent::FRAME_ERROR:
+    return "FRAME_ERROR";
+  case FlightEvent::FRAME_TIMEOUT:
+    return "FRAME_TIMEOUT";
+  case FlightEvent::BUFFER_OVERFLOW:
+    return "BUFFER_OVERFLOW";
+  case FlightEvent::BYTES_DROPPED:
+    return "BYTES_DROPPED";
+  case FlightEvent::FRAMES_DROPPED:
+    return "FRAMES_DROPPED";
+  case FlightEvent::ANSWER_TIMEOUT:
+    return "ANSWER_TIMEOUT";
+  default:
+    return "UNKNOWN";
+  }
+}
+
+} // haier_protocol
@@ -1,11 +1,8 @@
 #include <cstdarg>
+#include <cstring>
 #include <stdio.h>
 #include "utils/haier_log.h"
 
-#ifndef HAIER_LOG_TAG
-#define HAIER_LOG_TAG "haier.protocol"
-#endif
-
 const char hex_map[] =
     "00" "01" "02" "03" "04" "05" "06" "07" "08" "09" "0A" "0B" "0C" "0D" "0E" "0F"
     "10" "11" "12" "13" "14" "15" "16" "17" "18" "19" "1A" "1B" "1C" "1D" "1E" "1F"
@@ -24,48 +21,143 @@ const char hex_map[] =
     "E0" "E1" "E2" "E3" "E4" "E5" "E6" "E7" "E8" "E9" "EA" "EB" "EC" "ED" "EE" "EF"
     "F0" "F1" "F2" "F3" "F4" "F5" "F6" "F7" "F8" "F9" "FA" "FB" "FC" "FD" "FE" "FF";
 
+// Nibble to ASCII conversion with table lookup (pshufb on x86, tbl on ARM64),
+// 16 source bytes are converted to 48 characters "AA BB CC ... " per iteration
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HEX_DUMP_SSSE3
+
+__attribute__((target("ssse3")))
+static size_t hex_dump_ssse3_(const uint8_t *src, size_t size, char *dst)
+{
+  const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+  const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+  // Positions of the hex digit pairs in 48 bytes of output, -1 means space
+  const __m128i shuffle0 = _mm_setr_epi8(0, 1, -1, 2, 3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1, 10);
+  const __m128i shuffle1a = _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i shuffle1b = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 0, 1, -1, 2, 3, -1, 4, 5);
+  const __m128i shuffle2 = _mm_setr_epi8(-1, 6, 7, -1, 8, 9, -1, 10, 11, -1, 12, 13, -1, 14, 15, -1);
+  const __m128i spaces0 = _mm_setr_epi8(0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0);
+  const __m128i spaces1 = _mm_setr_epi8(0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0);
+  const __m128i spaces2 = _mm_setr_epi8(' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ');
+  size_t pos = 0;
+  for (; pos + 16 <= size; pos += 16, dst += 48)
+  {
+    __m128i data = _mm_loadu_si128((const __m128i *) (src + pos));
+    __m128i high = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(data, 4), nibble_mask));
+    __m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(data, nibble_mask));
+    __m128i pairs0 = _mm_unpacklo_epi8(high, low);
+    __m128i pairs1 = _mm_unpackhi_epi8(high, low);
+    _mm_storeu_si128((__m128i *) dst, _mm_or_si128(_mm_shuffle_epi8(pairs0, shuffle0), spaces0));
+    _mm_storeu_si128((__m128i *) (dst + 16), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(pairs0, shuffle1a), _mm_shuffle_epi8(pairs1, shuffle1b)), spaces1));
+    _mm_storeu_si128((__m128i *) (dst + 32), _mm_or_si128(_mm_shuffle_epi8(pairs1, shuffle2), spaces2));
+  }
+  return pos;
+}
+
+static bool has_ssse3_()
+{
+#if defined(__SSSE3__)
+  return true;
+#else
+  static const bool supported = __builtin_cpu_supports("ssse3");
+  return supported;
+#endif
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HEX_DUMP_NEON
+
+static size_t hex_dump_neon_(const uint8_t *src, size_t size, char *dst)
+{
+  const uint8x16_t digits = vld1q_u8((const uint8_t *) "0123456789ABCDEF");
+  const uint8x16_t nibble_mask = vdupq_n_u8(0x0F);
+  uint8x16x3_t out;
+  out.val[2] = vdupq_n_u8(' ');
+  size_t pos = 0;
+  for (; pos + 16 <= size; pos += 16, dst += 48)
+  {
+    uint8x16_t data = vld1q_u8(src + pos);
+    out.val[0] = vqtbl1q_u8(digits, vshrq_n_u8(data, 4));
+    out.val[1] = vqtbl1q_u8(digits, vandq_u8(data, nibble_mask));
+    // Interleaving store writes "HL " triplets directly
+    vst3q_u8((uint8_t *) dst, out);
+  }
+  return pos;
+}
+#endif
+
+// Writes 3 * size characters: two hex digits and space for every byte
+static void hex_dump_(const uint8_t *src, size_t size, char *dst)
+{
+  size_t pos = 0;
+#if defined(HEX_DUMP_SSSE3)
+  if (has_ssse3_())
+    pos = hex_dump_ssse3_(src, size, dst);
+#elif defined(HEX_DUMP_NEON)
+  pos = hex_dump_neon_(src, size, dst);
+#endif
+  for (; pos < size; ++pos)
+  {
+    const char *p = hex_map + (src[pos] * 2);
+    dst[3 * pos] = p[0];
+    dst[3 * pos + 1] = p[1];
+    dst[3 * pos + 2] = ' ';
+  }
+}
+
 std::string buf_to_hex(const uint8_t *message, size_t size)
 {
   if (size == 0)
     return "";
-  std::string raw(size * 3 - 1, ' ');
-  for (size_t i = 0; i < size; ++i)
+  std::string raw(size * 3, ' ');
+  hex_dump_(message, size, &raw[0]);
+  raw.resize(size * 3 - 1);
+  return raw;
+}
+
+size_t buf_to_hex(const uint8_t *message, size_t size, char *dst, size_t dst_size)
+{
+  if (dst_size == 0)
+    return 0;
+  // Every byte needs 3 characters, last one uses space of the terminating zero
+  if (size > dst_size / 3)
+    size = dst_size / 3;
+  if (size == 0)
   {
-    const char *p = hex_map + (message[i] * 2);
-    raw[3 * i] = p[0];
-    raw[3 * i + 1] = p[1];
+    dst[0] = '\0';
+    return 0;
   }
-  return raw;
+  hex_dump_(message, size, dst);
+  dst[3 * size - 1] = '\0';
+  return 3 * size - 1;
 }
 
 size_t print_buf(const uint8_t *src_buf, size_t src_size, char *dst_buf, size_t dst_size)
 {
-  size_t bytes_to_print = src_size;
-  bool dots = false;
   size_t pos = 0;
-  if (src_size > 0)
+  if ((src_size > 0) && (dst_size > 0))
   {
     if (src_size * 3 > dst_size)
     {
-      bytes_to_print = (dst_size - 5) / 3;
-      dots = true;
-    }
-    for (size_t i = 0; i < bytes_to_print; i++)
-    {
-      const char *p = hex_map + (src_buf[i] * 2);
-      dst_buf[3 * i] = p[0];
-      dst_buf[3 * i + 1] = p[1];
-      dst_buf[3 * i + 2] = ' ';
-    }
-    pos = 3 * bytes_to_print - 1;
-    if (dots)
-    {
-      pos++;
-      dst_buf[pos++] = '.';
-      dst_buf[pos++] = '.';
-      dst_buf[pos++] = '.';
+      // Not enough space, leaving room for "..."
+      size_t bytes_to_print = dst_size >= 5 ? (dst_size - 5) / 3 : 0;
+      if (bytes_to_print > 0)
+      {
+        hex_dump_(src_buf, bytes_to_print, dst_buf);
+        pos = 3 * bytes_to_print;
+      }
+      if (dst_size - pos >= 4)
+      {
+        dst_buf[pos++] = '.';
+        dst_buf[pos++] = '.';
+        dst_buf[pos++] = '.';
+      }
+      dst_buf[pos] = '\0';
     }
-    dst_buf[pos] = '\0';
+    else
+      pos = buf_to_hex(src_buf, src_size, dst_buf, dst_size);
   }
   return pos;
 }
@@ -79,29 +171,95 @@ char msg_buffer[BUFFER_SIZE];
 
 LogHandler global_log_handler = nullptr;
 
-size_t log_haier(HaierLogLevel level, const char *format, ...)
+std::atomic<HaierLogLevel> global_log_level_threshold{HaierLogLevel::LEVEL_NONE};
+std::atomic<size_t> global_log_tag_overrides{0};
+
+struct TagLogLevel
+{
+  char tag[MAX_LOG_TAG_LENGTH];
+  std::atomic<HaierLogLevel> level;
+};
+
+static std::atomic<HaierLogLevel> global_log_level{HaierLogLevel::LEVEL_VERBOSE};
+static TagLogLevel tag_log_levels[MAX_LOG_TAG_OVERRIDES];
+
+static TagLogLevel* find_tag_log_level(const char* tag)
+{
+  size_t count = global_log_tag_overrides.load(std::memory_order_acquire);
+  for (size_t i = 0; i < count; i++)
+    if (strncmp(tag_log_levels[i].tag, tag, MAX_LOG_TAG_LENGTH - 1) == 0)
+      return &tag_log_levels[i];
+  return nullptr;
+}
+
+static void update_log_level_threshold()
+{
+  HaierLogLevel threshold = HaierLogLevel::LEVEL_NONE;
+  if (global_log_handler != nullptr)
+  {
+    threshold = global_log_level.load(std::memory_order_relaxed);
+    size_t count = global_log_tag_overrides.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; i++)
+    {
+      HaierLogLevel level = tag_log_levels[i].level.load(std::memory_order_relaxed);
+      if (level > threshold)
+        threshold = level;
+    }
+  }
+  global_log_level_threshold.store(threshold, std::memory_order_relaxed);
+}
+
+bool check_tag_log_level(HaierLogLevel level, const char* tag)
+{
+  const TagLogLevel* tag_level = tag != nullptr ? find_tag_log_level(tag) : nullptr;
+  if (tag_level != nullptr)
+    return level <= tag_level->level.load(std::memory_order_relaxed);
+  return level <= global_log_level.load(std::memory_order_relaxed);
+}
+
+static size_t vlog_haier_(HaierLogLevel level, const char* tag, const char *format, va_list args)
 {
   size_t res = 0;
-  if ((global_log_handler != nullptr) && (level != HaierLogLevel::LEVEL_NONE))
+  if ((global_log_handler != nullptr) && is_log_level_enabled(level, tag))
   {
-    va_list args;
-    va_start(args, format);
     res = vsnprintf(msg_buffer, BUFFER_SIZE, format, args);
-    va_end(args);
-    global_log_handler(level, HAIER_LOG_TAG, msg_buffer);
+    global_log_handler(level, tag, msg_buffer);
   }
   return res;
 }
 
+size_t log_haier(HaierLogLevel level, const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  size_t res = vlog_haier_(level, HAIER_LOG_TAG, format, args);
+  va_end(args);
+  return res;
+}
+
+size_t log_haier_tagged(HaierLogLevel level, const char* tag, const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  size_t res = vlog_haier_(level, tag, format, args);
+  va_end(args);
+  return res;
+}
+
 size_t log_haier_buffer(HaierLogLevel level, const char *header, const uint8_t *buffer, size_t size)
 {
-  return log_haier_buffers(level, header, buffer, size, nullptr, 0);
+  return log_haier_buffers_tagged(level, HAIER_LOG_TAG, header, buffer, size, nullptr, 0);
 }
 
 size_t log_haier_buffers(HaierLogLevel level, const char *header, const uint8_t *buffer1, size_t size1, const uint8_t *buffer2, size_t size2)
+{
+  return log_haier_buffers_tagged(level, HAIER_LOG_TAG, header, buffer1, size1, buffer2, size2);
+}
+
+size_t log_haier_buffers_tagged(HaierLogLevel level, const char* tag, const char *header, const uint8_t *buffer1, size_t size1, const uint8_t *buffer2, size_t size2)
 {
   size_t res = 0;
-  if ((global_log_handler != nullptr) && (level != HaierLogLevel::LEVEL_NONE))
+  if ((global_log_handler != nullptr) && is_log_level_enabled(level, tag))
   {
     if (header != nullptr)
     {
@@ -129,7 +287,7 @@ size_t log_haier_buffers(HaierLogLevel level, const char *header, const uint8_t
         }
       }
     }
-    global_log_handler(level, HAIER_LOG_TAG, msg_buffer);
+    global_log_handler(level, tag, msg_buffer);
   }
   return res;
 }
@@ -137,11 +295,53 @@ size_t log_haier_buffers(HaierLogLevel level, const char *header, const uint8_t
 void set_log_handler(LogHandler handler)
 {
   global_log_handler = handler;
+  update_log_level_threshold();
 }
 
 void reset_log_handler()
 {
   global_log_handler = nullptr;
+  update_log_level_threshold();
+}
+
+void set_log_level(HaierLogLevel level)
+{
+  global_log_level.store(level, std::memory_order_relaxed);
+  update_log_level_threshold();
+}
+
+bool set_log_level(const char* tag, HaierLogLevel level)
+{
+  if (tag == nullptr)
+    return false;
+  TagLogLevel* tag_level = find_tag_log_level(tag);
+  if (tag_level == nullptr)
+  {
+    size_t count = global_log_tag_overrides.load(std::memory_order_relaxed);
+    if (count >= MAX_LOG_TAG_OVERRIDES)
+      return false;
+    tag_level = &tag_log_levels[count];
+    strncpy(tag_level->tag, tag, MAX_LOG_TAG_LENGTH - 1);
+    tag_level->tag[MAX_LOG_TAG_LENGTH - 1] = '\0';
+    tag_level->level.store(level, std::memory_order_relaxed);
+    // Publish new tag only after it is filled
+    global_log_tag_overrides.store(count + 1, std::memory_order_release);
+  }
+  else
+    tag_level->level.store(level, std::memory_order_relaxed);
+  update_log_level_threshold();
+  return true;
+}
+
+HaierLogLevel get_log_level()
+{
+  return global_log_level.load(std::memory_order_relaxed);
+}
+
+HaierLogLevel get_log_level(const char* tag)
+{
+  const TagLogLevel* tag_level = tag != nullptr ? find_tag_log_level(tag) : nullptr;
+  return tag_level != nullptr ? tag_level->level.load(std::memory_order_relaxed) : global_log_level.load(std::memory_order_relaxed);
 }
 
 } // haier_protocol
@@ -0,0 +1,21 @@
+#include "utils/haier_statistics.h"
+
+namespace haier_protocol
+{
+
+uint32_t FrameTypeCounters::get(uint8_t frame_type) const noexcept
+{
+  const StatCounter* counter = this->find(frame_type);
+  return counter != nullptr ? counter->get() : 0;
+}
+
+uint32_t FrameTypeCounters::get_total() const noexcept
+{
+  uint32_t result = this->get_other().get();
+  size_t count = this->get_types_count();
+  for (size_t i = 0; i < count; i++)
+    result += this->get_at(i).get();
+  return result;
+}
+
+} // haier_protocol
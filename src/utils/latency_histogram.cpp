@@ -0,0 +1,101 @@
+#include "utils/latency_histogram.h"
+
+namespace haier_protocol
+{
+
+static unsigned int get_msb_(uint32_t value)
+{
+#if defined(__GNUC__)
+  return 31 - __builtin_clz(value);
+#else
+  unsigned int result = 0;
+  while (value >>= 1)
+    result++;
+  return result;
+#endif
+}
+
+size_t LatencyHistogram::get_bucket_index(uint32_t value) noexcept
+{
+  if (value < LINEAR_BUCKETS)
+    return value;
+  unsigned int msb = get_msb_(value);
+  size_t sub_bucket = (value >> (msb - SUB_BUCKETS_BITS)) & (SUB_BUCKETS - 1);
+  return LINEAR_BUCKETS + (msb - LINEAR_BUCKETS_BITS) * SUB_BUCKETS + sub_bucket;
+}
+
+uint32_t LatencyHistogram::get_bucket_upper_bound(size_t index) noexcept
+{
+  if (index < LINEAR_BUCKETS)
+    return (uint32_t) index;
+  if (index >= BUCKETS_COUNT)
+    return UINT32_MAX;
+  index -= LINEAR_BUCKETS;
+  unsigned int shift = (unsigned int) (index / SUB_BUCKETS + LINEAR_BUCKETS_BITS - SUB_BUCKETS_BITS);
+  uint32_t lower_bound = (uint32_t) (SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+  return lower_bound + ((1u << shift) - 1);
+}
+
+void LatencyHistogram::record(uint32_t value_us) noexcept
+{
+  this->buckets_[get_bucket_index(value_us)].increment();
+  this->max_.update_max(value_us);
+}
+
+void LatencyHistogram::record(std::chrono::steady_clock::duration duration) noexcept
+{
+  long long value = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+  if (value < 0)
+    value = 0;
+  else if (value > UINT32_MAX)
+    value = UINT32_MAX;
+  this->record((uint32_t) value);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) noexcept
+{
+  for (size_t i = 0; i < BUCKETS_COUNT; i++)
+  {
+    uint32_t count = other.buckets_[i].get();
+    if (count != 0)
+      this->buckets_[i].increment(count);
+  }
+  this->max_.update_max(other.max_.get());
+}
+
+uint32_t LatencyHistogram::get_count() const noexcept
+{
+  uint32_t result = 0;
+  for (size_t i = 0; i < BUCKETS_COUNT; i++)
+    result += this->buckets_[i].get();
+  return result;
+}
+
+uint32_t LatencyHistogram::get_percentile(float percentile) const noexcept
+{
+  uint32_t total = this->get_count();
+  if (total == 0)
+    return 0;
+  if (percentile < 0.0f)
+    percentile = 0.0f;
+  else if (percentile > 100.0f)
+    percentile = 100.0f;
+  uint32_t target = (uint32_t) ((double) total * percentile / 100.0 + 0.5);
+  if (target == 0)
+    target = 1;
+  uint32_t max_value = this->max_.get();
+  uint32_t accumulated = 0;
+  for (size_t i = 0; i < BUCKETS_COUNT; i++)
+  {
+    accumulated += this->buckets_[i].get();
+    if (accumulated >= target)
+    {
+      uint32_t result = get_bucket_upper_bound(i);
+      return result < max_value ? result : max_value;
+    }
+  }
+  // Shouldn't get here, buckets can only grow between two passes
+  return max_value;
+}
+
+} // haier_protocol
@@ -0,0 +1,151 @@
+#include "utils/payload_delta.h"
+#include <cstring>
+#include <algorithm>
+
+#if (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))) && (defined(__GNUC__) || defined(__clang__))
+#include <emmintrin.h>
+#define PAYLOAD_DELTA_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PAYLOAD_DELTA_NEON
+#endif
+
+namespace haier_protocol
+{
+
+static unsigned int get_lowest_bit_(uint32_t value)
+{
+#if defined(__GNUC__)
+  return __builtin_ctz(value);
+#else
+  unsigned int result = 0;
+  while ((value & 1) == 0)
+  {
+    value >>= 1;
+    result++;
+  }
+  return result;
+#endif
+}
+
+static bool compare_bytes_(const uint8_t* previous, const uint8_t* current, size_t position, size_t count, uint32_t* changed_mask)
+{
+  bool changed = false;
+  for (size_t i = position; i < position + count; i++)
+  {
+    if (previous[i] != current[i])
+    {
+      changed_mask[i / 32] |= 1u << (i % 32);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+bool find_changed_bytes(const uint8_t* previous, const uint8_t* current, size_t size, uint32_t* changed_mask) noexcept
+{
+  memset(changed_mask, 0, ((size + 31) / 32) * sizeof(uint32_t));
+  bool changed = false;
+  size_t position = 0;
+#if defined(PAYLOAD_DELTA_SSE2)
+  for (; position + 16 <= size; position += 16)
+  {
+    __m128i previous_block = _mm_loadu_si128((const __m128i*) (previous + position));
+    __m128i current_block = _mm_loadu_si128((const __m128i*) (current + position));
+    uint32_t equal = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(previous_block, current_block));
+    if (equal != 0xFFFF)
+    {
+      // Blocks start at 0 or 16 bit of the mask word
+      changed_mask[position / 32] |= (~equal & 0xFFFF) << (position % 32);
+      changed = true;
+    }
+  }
+#elif defined(PAYLOAD_DELTA_NEON)
+  for (; position + 16 <= size; position += 16)
+  {
+    uint8x16_t equal = vceqq_u8(vld1q_u8(previous + position), vld1q_u8(current + position));
+    if (vminvq_u8(equal) != 0xFF)
+    {
+      compare_bytes_(previous, current, position, 16, changed_mask);
+      changed = true;
+    }
+  }
+#endif
+  // Machine words for the tail (or for everything without SIMD), bytes only for words that differ
+  for (; position + sizeof(size_t) <= size; position += sizeof(size_t))
+  {
+    size_t previous_word, current_word;
+    memcpy(&previous_word, previous + position, sizeof(size_t));
+    memcpy(&current_word, current + position, sizeof(size_t));
+    if (previous_word != current_word)
+    {
+      compare_bytes_(previous, current, position, sizeof(size_t), changed_mask);
+      changed = true;
+    }
+  }
+  if (compare_bytes_(previous, current, position, size - position, changed_mask))
+    changed = true;
+  return changed;
+}
+
+PayloadDelta::PayloadDelta(const PayloadField* fields, size_t fields_count, size_t payload_size) :
+  fields_(fields),
+  fields_count_(fields_count),
+  payload_size_(std::min(payload_size, MAX_DELTA_PAYLOAD_SIZE)),
+  first_field_(payload_size_, 0),
+  end_field_(payload_size_, 0)
+{
+  for (size_t index = 0; index < fields_count; index++)
+  {
+    const PayloadField& field = fields[index];
+    for (size_t position = field.offset; (position < (size_t) field.offset + field.size) && (position < this->payload_size_); position++)
+    {
+      if (this->first_field_[position] == this->end_field_[position])
+        this->first_field_[position] = (uint16_t) index;
+      this->end_field_[position] = (uint16_t) (index + 1);
+    }
+  }
+}
+
+uint32_t PayloadDelta::get_value(size_t field, const uint8_t* payload) const noexcept
+{
+  const PayloadField& description = this->fields_[field];
+  if (description.size == 1)
+    return (uint32_t) (payload[description.offset] & description.mask) >> get_lowest_bit_(description.mask);
+  uint32_t result = 0;
+  for (size_t i = 0; i < description.size; i++)
+    result = (result << 8) | (payload[description.offset + i] & description.mask);
+  return result;
+}
+
+size_t PayloadDelta::compare(const uint8_t* previous, const uint8_t* current, FieldChange* changes, size_t max_changes) const noexcept
+{
+  uint32_t changed_mask[DELTA_MASK_WORDS];
+  if ((this->payload_size_ == 0) || !find_changed_bytes(previous, current, this->payload_size_, changed_mask))
+    return 0;
+  size_t count = 0;
+  // Multibyte fields are reported once, fields below next_field are done
+  size_t next_field = 0;
+  for (size_t word = 0; word < (this->payload_size_ + 31) / 32; word++)
+  {
+    uint32_t bits = changed_mask[word];
+    while (bits != 0)
+    {
+      size_t position = word * 32 + get_lowest_bit_(bits);
+      bits &= bits - 1;
+      uint8_t difference = previous[position] ^ current[position];
+      for (size_t field = std::max((size_t) this->first_field_[position], next_field); field < this->end_field_[position]; field++)
+      {
+        if ((difference & this->fields_[field].mask) == 0)
+          continue;
+        if (count == max_changes)
+          return count;
+        changes[count++] = { (uint16_t) field, this->get_value(field, previous), this->get_value(field, current) };
+        next_field = field + 1;
+      }
+    }
+  }
+  return count;
+}
+
+} // haier_protocol
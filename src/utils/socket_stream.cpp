@@ -0,0 +1,441 @@
+#include "utils/socket_stream.h"
+
+#if __linux__
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "utils/haier_log.h"
+
+namespace haier_protocol
+{
+
+constexpr int SOCKET_LISTEN_BACKLOG = 4;
+
+static void set_no_delay_(int handle)
+{
+  // Frames are small, they should not wait for more data
+  int flag = 1;
+  setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+}
+
+static bool fill_unix_address_(const char* path, struct sockaddr_un& address)
+{
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if ((path == nullptr) || (strlen(path) >= sizeof(address.sun_path)))
+    return false;
+  strcpy(address.sun_path, path);
+  return true;
+}
+
+SocketStream::SocketStream(size_t buffer_size) :
+  state_(SocketState::CLOSED),
+  handle_(-1),
+  listen_handle_(-1),
+  unix_path_(nullptr),
+  rx_buffer_(buffer_size),
+  tx_buffer_(buffer_size),
+  dropped_bytes_(0)
+{
+}
+
+SocketStream::~SocketStream() noexcept
+{
+  this->close();
+}
+
+void SocketStream::close() noexcept
+{
+  if (this->handle_ >= 0)
+    ::close(this->handle_);
+  this->handle_ = -1;
+  if (this->listen_handle_ >= 0)
+    ::close(this->listen_handle_);
+  this->listen_handle_ = -1;
+  if (this->unix_path_ != nullptr)
+  {
+    unlink(this->unix_path_);
+    delete[] this->unix_path_;
+    this->unix_path_ = nullptr;
+  }
+  this->rx_buffer_.clear();
+  this->tx_buffer_.clear();
+  this->state_ = SocketState::CLOSED;
+}
+
+bool SocketStream::connect_tcp(const char* host, uint16_t port) noexcept
+{
+  this->close();
+  char port_str[8];
+  snprintf(port_str, sizeof(port_str), "%u", (unsigned int) port);
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* addresses = nullptr;
+  if (getaddrinfo(host, port_str, &hints, &addresses) != 0)
+  {
+    HAIER_LOGW("Can't resolve %s", host);
+    return false;
+  }
+  // Only one connection attempt can be in progress, so the first address that doesn't fail right away is used
+  for (struct addrinfo* address = addresses; (address != nullptr) && (this->state_ == SocketState::CLOSED); address = address->ai_next)
+  {
+    int handle = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+    if (handle < 0)
+      continue;
+    set_no_delay_(handle);
+    if (connect(handle, address->ai_addr, address->ai_addrlen) == 0)
+      this->state_ = SocketState::CONNECTED;
+    else if (errno == EINPROGRESS)
+      this->state_ = SocketState::CONNECTING;
+    else
+    {
+      ::close(handle);
+      continue;
+    }
+    this->handle_ = handle;
+  }
+  freeaddrinfo(addresses);
+  if (this->state_ == SocketState::CLOSED)
+  {
+    HAIER_LOGW("Can't connect to %s:%u", host, (unsigned int) port);
+  }
+  return this->state_ != SocketState::CLOSED;
+}
+
+bool SocketStream::connect_unix(const char* path) noexcept
+{
+  this->close();
+  struct sockaddr_un address;
+  if (!fill_unix_address_(path, address))
+    return false;
+  int handle = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (handle < 0)
+    return false;
+  // Local connection is either established or refused right away
+  if (connect(handle, (const struct sockaddr*) &address, sizeof(address)) != 0)
+  {
+    HAIER_LOGW("Can't connect to %s", path);
+    ::close(handle);
+    return false;
+  }
+  this->handle_ = handle;
+  this->state_ = SocketState::CONNECTED;
+  return true;
+}
+
+bool SocketStream::start_listening_(int handle, const void* address, size_t address_size) noexcept
+{
+  if ((bind(handle, (const struct sockaddr*) address, (socklen_t) address_size) != 0) || (listen(handle, SOCKET_LISTEN_BACKLOG) != 0))
+  {
+    ::close(handle);
+    return false;
+  }
+  this->listen_handle_ = handle;
+  this->state_ = SocketState::LISTENING;
+  return true;
+}
+
+bool SocketStream::listen_tcp(uint16_t port, const char* address) noexcept
+{
+  this->close();
+  char port_str[8];
+  snprintf(port_str, sizeof(port_str), "%u", (unsigned int) port);
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  struct addrinfo* addresses = nullptr;
+  if (getaddrinfo(address, port_str, &hints, &addresses) != 0)
+    return false;
+  for (struct addrinfo* item = addresses; (item != nullptr) && (this->state_ == SocketState::CLOSED); item = item->ai_next)
+  {
+    int handle = socket(item->ai_family, item->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, item->ai_protocol);
+    if (handle < 0)
+      continue;
+    int flag = 1;
+    setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    this->start_listening_(handle, item->ai_addr, item->ai_addrlen);
+  }
+  freeaddrinfo(addresses);
+  if (this->state_ == SocketState::CLOSED)
+  {
+    HAIER_LOGW("Can't listen on port %u", (unsigned int) port);
+  }
+  return this->state_ == SocketState::LISTENING;
+}
+
+bool SocketStream::listen_unix(const char* path) noexcept
+{
+  this->close();
+  struct sockaddr_un address;
+  if (!fill_unix_address_(path, address))
+    return false;
+  int handle = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (handle < 0)
+    return false;
+  // Socket file left by previous run would make bind fail, other files are never removed
+  struct stat file_stat;
+  if ((lstat(path, &file_stat) == 0) && S_ISSOCK(file_stat.st_mode))
+    unlink(path);
+  if (!this->start_listening_(handle, &address, sizeof(address)))
+  {
+    HAIER_LOGW("Can't listen on %s", path);
+    return false;
+  }
+  this->unix_path_ = new char[strlen(path) + 1];
+  strcpy(this->unix_path_, path);
+  return true;
+}
+
+uint16_t SocketStream::get_port() const noexcept
+{
+  int handle = this->listen_handle_ >= 0 ? this->listen_handle_ : this->handle_;
+  struct sockaddr_storage address;
+  socklen_t size = sizeof(address);
+  if ((handle < 0) || (getsockname(handle, (struct sockaddr*) &address, &size) != 0))
+    return 0;
+  if (address.ss_family == AF_INET)
+    return ntohs(((const struct sockaddr_in*) &address)->sin_port);
+  if (address.ss_family == AF_INET6)
+    return ntohs(((const struct sockaddr_in6*) &address)->sin6_port);
+  return 0;
+}
+
+int SocketStream::get_file_descriptor() const noexcept
+{
+  switch (this->state_)
+  {
+  case SocketState::CONNECTING:
+  case SocketState::CONNECTED:
+    return this->handle_;
+  case SocketState::LISTENING:
+    return this->listen_handle_;
+  default:
+    return -1;
+  }
+}
+
+bool SocketStream::wants_write() const noexcept
+{
+  return (this->state_ == SocketState::CONNECTING) || ((this->state_ == SocketState::CONNECTED) && !this->tx_buffer_.empty());
+}
+
+bool SocketStream::accept_peer_() noexcept
+{
+  int handle;
+  do
+  {
+    handle = accept4(this->listen_handle_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  } while ((handle < 0) && (errno == EINTR));
+  if (handle < 0)
+    return false;
+  if (this->unix_path_ == nullptr)
+    set_no_delay_(handle);
+  this->handle_ = handle;
+  this->rx_buffer_.clear();
+  this->tx_buffer_.clear();
+  this->state_ = SocketState::CONNECTED;
+  return true;
+}
+
+bool SocketStream::check_connection_() noexcept
+{
+  struct pollfd pfd = { this->handle_, POLLOUT, 0 };
+  if (poll(&pfd, 1, 0) <= 0)
+    return true;
+  int error = 0;
+  socklen_t size = sizeof(error);
+  if ((getsockopt(this->handle_, SOL_SOCKET, SO_ERROR, &error, &size) != 0) || (error != 0))
+  {
+    HAIER_LOGW("Connection failed: %s", strerror(error));
+    this->peer_closed_();
+    return false;
+  }
+  this->state_ = SocketState::CONNECTED;
+  return true;
+}
+
+void SocketStream::peer_closed_() noexcept
+{
+  ::close(this->handle_);
+  this->handle_ = -1;
+  // Received data is still valid, queued data makes no sense for the next peer
+  this->tx_buffer_.clear();
+  this->state_ = this->listen_handle_ >= 0 ? SocketState::LISTENING : SocketState::CLOSED;
+}
+
+size_t SocketStream::receive_() noexcept
+{
+  uint8_t* segment1;
+  uint8_t* segment2;
+  size_t size1, size2;
+  if (this->rx_buffer_.get_free_segments(segment1, size1, segment2, size2) == 0)
+    return 0;
+  struct iovec segments[2] = { { segment1, size1 }, { segment2, size2 } };
+  ssize_t res;
+  do
+  {
+    res = readv(this->handle_, segments, size2 > 0 ? 2 : 1);
+  } while ((res < 0) && (errno == EINTR));
+  if (res > 0)
+    return this->rx_buffer_.commit((size_t) res);
+  if ((res == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+    this->peer_closed_();
+  return 0;
+}
+
+bool SocketStream::send_queued_() noexcept
+{
+  while (!this->tx_buffer_.empty())
+  {
+    const uint8_t* segment1;
+    const uint8_t* segment2;
+    size_t size1, size2;
+    this->tx_buffer_.get_data_segments(segment1, size1, segment2, size2);
+    struct iovec segments[2] = { { (void*) segment1, size1 }, { (void*) segment2, size2 } };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = segments;
+    message.msg_iovlen = size2 > 0 ? 2 : 1;
+    ssize_t res = sendmsg(this->handle_, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (res > 0)
+      this->tx_buffer_.drop((size_t) res);
+    else if ((res < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+      return true;
+    else if ((res < 0) && (errno != EINTR))
+    {
+      this->peer_closed_();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SocketStream::process_events() noexcept
+{
+  switch (this->state_)
+  {
+  case SocketState::LISTENING:
+    if (!this->accept_peer_())
+      return true;
+    break;
+  case SocketState::CONNECTING:
+    if (!this->check_connection_())
+      return false;
+    if (this->state_ != SocketState::CONNECTED)
+      return true;
+    break;
+  case SocketState::CONNECTED:
+    break;
+  default:
+    return false;
+  }
+  if (!this->send_queued_())
+    return false;
+  while (this->receive_() > 0)
+    ;
+  return this->state_ == SocketState::CONNECTED;
+}
+
+long SocketStream::write_some(const uint8_t* data, size_t len) noexcept
+{
+  if (this->state_ == SocketState::CONNECTED)
+  {
+    // Queued data goes first to keep the order
+    if (!this->send_queued_())
+      return -1;
+    if (this->tx_buffer_.empty())
+    {
+      ssize_t res;
+      do
+      {
+        res = send(this->handle_, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+      } while ((res < 0) && (errno == EINTR));
+      if (res > 0)
+      {
+        data += res;
+        len -= res;
+        if (len == 0)
+          return res;
+      }
+      else if ((res < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+      {
+        this->peer_closed_();
+        return -1;
+      }
+      else
+        res = 0;
+      return (long) (res + this->tx_buffer_.push(data, len));
+    }
+  }
+  else if (this->state_ != SocketState::CONNECTING)
+    return -1;
+  return (long) this->tx_buffer_.push(data, len);
+}
+
+void SocketStream::write_array(const uint8_t* data, size_t len) noexcept
+{
+  long res = this->write_some(data, len);
+  if ((res >= 0) && ((size_t) res < len))
+  {
+    HAIER_LOGW("Socket send queue is full, %d bytes dropped", (int) (len - res));
+  }
+  this->dropped_bytes_ += len - (res > 0 ? (size_t) res : 0);
+}
+
+size_t SocketStream::available() noexcept
+{
+  if (this->rx_buffer_.empty())
+    this->process_events();
+  else if (!this->tx_buffer_.empty())
+    this->send_queued_();
+  return this->rx_buffer_.get_size();
+}
+
+size_t SocketStream::read_array(uint8_t* data, size_t len) noexcept
+{
+  return this->rx_buffer_.pop(data, len);
+}
+
+size_t SocketStream::read_into(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept
+{
+  if (this->rx_buffer_.empty())
+  {
+    if ((this->state_ == SocketState::CONNECTED) && this->tx_buffer_.empty())
+    {
+      // Nothing else to do, data goes straight to the caller's buffers
+      struct iovec segments[2] = { { data1, size1 }, { data2, size2 } };
+      ssize_t res;
+      do
+      {
+        res = readv(this->handle_, segments, size2 > 0 ? 2 : 1);
+      } while ((res < 0) && (errno == EINTR));
+      if (res > 0)
+        return (size_t) res;
+      if ((res == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+        this->peer_closed_();
+      return 0;
+    }
+    this->process_events();
+  }
+  size_t result = this->rx_buffer_.pop(data1, size1);
+  if ((result == size1) && (size2 > 0))
+    result += this->rx_buffer_.pop(data2, size2);
+  return result;
+}
+
+} // haier_protocol
+
+#endif // __linux__
@@ -0,0 +1,956 @@
+#include "utils/uring_stream.h"
+
+#if __linux__
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "utils/haier_log.h"
+
+// liburing is not required, the ring is set up with raw system calls. Waiting with timeout
+// needs 5.11 headers (io_uring_getevents_arg), newer features are used when headers have them.
+#if defined(__has_include)
+  #if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+    #include <linux/io_uring.h>
+    #ifdef IORING_FEAT_EXT_ARG
+      #define HAIER_HAS_IO_URING
+    #endif
+    // Register opcodes are enum values, SQE128 flag came with buffer rings in 5.19
+    #ifdef IORING_SETUP_SQE128
+      #define HAIER_HAS_IO_URING_BUFFER_RING
+    #endif
+    #ifdef IORING_RECV_MULTISHOT
+      #define HAIER_HAS_IO_URING_MULTISHOT_RECV
+    #endif
+  #endif
+#endif
+
+namespace haier_protocol
+{
+
+constexpr int NO_SLOT = 0xFFFFFF;
+constexpr uint16_t POOL_BUFFER_GROUP = 0;
+constexpr unsigned int MAX_RING_ENTRIES = 4096;
+constexpr unsigned int MAX_POOL_BUFFERS = 0x8000;
+constexpr int MAX_EPOLL_EVENTS = 64;
+constexpr std::chrono::milliseconds OPERATION_TIMEOUT(1000);
+
+enum UringOperation : uint8_t
+{
+  OP_POLL_IN = 1,
+  OP_READ,
+  OP_POLL_OUT,
+  OP_WRITE,
+  OP_PROVIDE_BUFFERS,
+  OP_CANCEL,
+};
+
+static uint64_t make_user_data_(int slot, UringOperation operation)
+{
+  return ((uint64_t) (uint32_t) slot << 8) | operation;
+}
+
+#ifdef HAIER_HAS_IO_URING
+struct UringReactor::Ring
+{
+  int               handle;
+  void*             sq_ring;
+  size_t            sq_ring_size;
+  void*             cq_ring;
+  size_t            cq_ring_size;
+  io_uring_sqe*     sqes;
+  size_t            sqes_size;
+  unsigned*         sq_head;
+  unsigned*         sq_tail;
+  unsigned*         sq_array;
+  unsigned          sq_mask;
+  unsigned          sq_entries;
+  unsigned          local_tail;     // published to sq_tail by enter_
+  unsigned*         cq_head;
+  unsigned*         cq_tail;
+  unsigned          cq_mask;
+  io_uring_cqe*     cqes;
+#ifdef HAIER_HAS_IO_URING_BUFFER_RING
+  // Pool buffers are returned by writing to this ring, no submission needed
+  io_uring_buf_ring* buffer_ring;
+  size_t            buffer_ring_size;
+  uint16_t          buffer_ring_tail;
+#endif
+  bool              multishot_recv;
+};
+
+static uint32_t get_poll_mask_(uint32_t mask)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return (mask << 16) | (mask >> 16);
+#else
+  return mask;
+#endif
+}
+#else
+struct UringReactor::Ring
+{
+};
+#endif
+
+UringReactor::UringReactor() noexcept :
+  backend_(ReactorBackend::POLLING),
+  ring_(nullptr),
+  pool_(nullptr),
+  pool_count_(0),
+  epoll_handle_(-1)
+{
+}
+
+UringReactor::~UringReactor() noexcept
+{
+  this->close_uring_();
+  if (this->epoll_handle_ >= 0)
+    close(this->epoll_handle_);
+}
+
+ReactorBackend UringReactor::init(unsigned int max_streams, ReactorBackend backend) noexcept
+{
+  this->close_uring_();
+  if (this->epoll_handle_ >= 0)
+    close(this->epoll_handle_);
+  this->epoll_handle_ = -1;
+  this->backend_ = ReactorBackend::POLLING;
+  if (backend == ReactorBackend::IO_URING)
+  {
+    if (this->init_uring_(max_streams))
+    {
+      this->backend_ = ReactorBackend::IO_URING;
+      return this->backend_;
+    }
+    HAIER_LOGI("io_uring is not available, using epoll");
+    backend = ReactorBackend::EPOLL;
+  }
+  if (backend == ReactorBackend::EPOLL)
+  {
+    this->epoll_handle_ = epoll_create1(EPOLL_CLOEXEC);
+    if (this->epoll_handle_ >= 0)
+      this->backend_ = ReactorBackend::EPOLL;
+  }
+  return this->backend_;
+}
+
+bool UringReactor::init_uring_(unsigned int max_streams) noexcept
+{
+#ifdef HAIER_HAS_IO_URING
+  // Every stream has up to 4 entries in flight (poll + read, poll + write)
+  unsigned int entries = 64;
+  while ((entries < max_streams * 4) && (entries < MAX_RING_ENTRIES))
+    entries <<= 1;
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int handle = (int) syscall(__NR_io_uring_setup, entries, &params);
+  if (handle < 0)
+    return false;
+  // Completions are never lost and waiting with timeout doesn't need extra entries
+  if (((params.features & IORING_FEAT_NODROP) == 0) || ((params.features & IORING_FEAT_EXT_ARG) == 0))
+  {
+    close(handle);
+    return false;
+  }
+  this->ring_ = new Ring();
+  Ring& ring = *this->ring_;
+  memset(&ring, 0, sizeof(ring));
+  ring.handle = handle;
+  ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap)
+    ring.sq_ring_size = ring.cq_ring_size = std::max(ring.sq_ring_size, ring.cq_ring_size);
+  ring.sq_ring = mmap(nullptr, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, handle, IORING_OFF_SQ_RING);
+  if (ring.sq_ring == MAP_FAILED)
+    ring.sq_ring = nullptr;
+  if (single_mmap)
+    ring.cq_ring = ring.sq_ring;
+  else
+  {
+    ring.cq_ring = mmap(nullptr, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, handle, IORING_OFF_CQ_RING);
+    if (ring.cq_ring == MAP_FAILED)
+      ring.cq_ring = nullptr;
+  }
+  ring.sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(nullptr, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, handle, IORING_OFF_SQES);
+  ring.sqes = sqes != MAP_FAILED ? (io_uring_sqe*) sqes : nullptr;
+  if ((ring.sq_ring == nullptr) || (ring.cq_ring == nullptr) || (ring.sqes == nullptr))
+  {
+    this->close_uring_();
+    return false;
+  }
+  uint8_t* sq = (uint8_t*) ring.sq_ring;
+  ring.sq_head = (unsigned*) (sq + params.sq_off.head);
+  ring.sq_tail = (unsigned*) (sq + params.sq_off.tail);
+  ring.sq_array = (unsigned*) (sq + params.sq_off.array);
+  ring.sq_mask = *(unsigned*) (sq + params.sq_off.ring_mask);
+  ring.sq_entries = *(unsigned*) (sq + params.sq_off.ring_entries);
+  ring.local_tail = *ring.sq_tail;
+  uint8_t* cq = (uint8_t*) ring.cq_ring;
+  ring.cq_head = (unsigned*) (cq + params.cq_off.head);
+  ring.cq_tail = (unsigned*) (cq + params.cq_off.tail);
+  ring.cq_mask = *(unsigned*) (cq + params.cq_off.ring_mask);
+  ring.cqes = (io_uring_cqe*) (cq + params.cq_off.cqes);
+#ifdef HAIER_HAS_IO_URING_MULTISHOT_RECV
+  // Kernels before 6.0 reject it, streams go back to single shot receive then
+  ring.multishot_recv = true;
+#endif
+  // Two buffers per stream: one is read by transport, another one waits for data
+  this->pool_count_ = 16;
+  while ((this->pool_count_ < max_streams * 2) && (this->pool_count_ < MAX_POOL_BUFFERS))
+    this->pool_count_ <<= 1;
+  this->pool_ = new uint8_t[this->pool_count_ * HAIER_URING_BUFFER_SIZE];
+#ifdef HAIER_HAS_IO_URING_BUFFER_RING
+  ring.buffer_ring_size = this->pool_count_ * sizeof(io_uring_buf);
+  void* buffer_ring = mmap(nullptr, ring.buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer_ring != MAP_FAILED)
+  {
+    io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uint64_t) (uintptr_t) buffer_ring;
+    registration.ring_entries = this->pool_count_;
+    registration.bgid = POOL_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, handle, IORING_REGISTER_PBUF_RING, &registration, 1) == 0)
+    {
+      ring.buffer_ring = (io_uring_buf_ring*) buffer_ring;
+      for (unsigned int i = 0; i < this->pool_count_; i++)
+        this->release_buffer_((uint16_t) i);
+      if (this->check_pool_())
+        return true;
+      // Registered, but reads don't get buffers from it on some kernels
+      HAIER_LOGI("Buffer ring is not usable, buffers are provided by submissions");
+      syscall(__NR_io_uring_register, handle, IORING_UNREGISTER_PBUF_RING, &registration, 1);
+      ring.buffer_ring = nullptr;
+      ring.buffer_ring_tail = 0;
+    }
+    munmap(buffer_ring, ring.buffer_ring_size);
+  }
+#endif
+  // Kernels before 5.19, buffers are provided by submissions
+  io_uring_sqe* sqe = (io_uring_sqe*) this->get_sqe_();
+  if (sqe == nullptr)
+  {
+    this->close_uring_();
+    return false;
+  }
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = (int) this->pool_count_;
+  sqe->addr = (uint64_t) (uintptr_t) this->pool_;
+  sqe->len = HAIER_URING_BUFFER_SIZE;
+  sqe->off = 0;
+  sqe->buf_group = POOL_BUFFER_GROUP;
+  sqe->user_data = make_user_data_(NO_SLOT, OP_PROVIDE_BUFFERS);
+  // Some kernels have io_uring without provided buffers
+  if (!this->check_pool_())
+  {
+    this->close_uring_();
+    return false;
+  }
+  return true;
+#else
+  (void) max_streams;
+  return false;
+#endif
+}
+
+bool UringReactor::check_pool_() noexcept
+{
+#ifdef HAIER_HAS_IO_URING
+  // Read one byte from a pipe the same way streams read
+  Ring& ring = *this->ring_;
+  int pipe_handles[2];
+  if (pipe(pipe_handles) != 0)
+    return false;
+  const uint8_t probe = 0x55;
+  bool result = write(pipe_handles[1], &probe, 1) == 1;
+  io_uring_sqe* sqe = result ? (io_uring_sqe*) this->get_sqe_() : nullptr;
+  if (sqe != nullptr)
+  {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = pipe_handles[0];
+    sqe->off = (uint64_t) -1;
+    sqe->len = HAIER_URING_BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = POOL_BUFFER_GROUP;
+    sqe->user_data = make_user_data_(NO_SLOT, OP_READ);
+    result = false;
+    bool completed = false;
+    auto deadline = std::chrono::steady_clock::now() + OPERATION_TIMEOUT;
+    while (!completed && (std::chrono::steady_clock::now() < deadline) && this->enter_(1, OPERATION_TIMEOUT))
+    {
+      unsigned head = *ring.cq_head;
+      unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != tail; head++)
+      {
+        const io_uring_cqe& cqe = ring.cqes[head & ring.cq_mask];
+        if (cqe.user_data == make_user_data_(NO_SLOT, OP_PROVIDE_BUFFERS))
+        {
+          if (cqe.res < 0)
+            completed = true;
+        }
+        else if (cqe.user_data == make_user_data_(NO_SLOT, OP_READ))
+        {
+          completed = true;
+          result = (cqe.res == 1) && ((cqe.flags & IORING_CQE_F_BUFFER) != 0);
+          if (result)
+            this->release_buffer_((uint16_t) (cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+        }
+      }
+      __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+  }
+  close(pipe_handles[0]);
+  close(pipe_handles[1]);
+  return result;
+#else
+  return false;
+#endif
+}
+
+void UringReactor::close_uring_() noexcept
+{
+#ifdef HAIER_HAS_IO_URING
+  if (this->ring_ != nullptr)
+  {
+    Ring& ring = *this->ring_;
+    if (ring.sqes != nullptr)
+      munmap(ring.sqes, ring.sqes_size);
+    if ((ring.cq_ring != nullptr) && (ring.cq_ring != ring.sq_ring))
+      munmap(ring.cq_ring, ring.cq_ring_size);
+    if (ring.sq_ring != nullptr)
+      munmap(ring.sq_ring, ring.sq_ring_size);
+    close(ring.handle);
+#ifdef HAIER_HAS_IO_URING_BUFFER_RING
+    // Unregistered with the ring
+    if (ring.buffer_ring != nullptr)
+      munmap(ring.buffer_ring, ring.buffer_ring_size);
+#endif
+    delete this->ring_;
+    this->ring_ = nullptr;
+  }
+#endif
+  delete[] this->pool_;
+  this->pool_ = nullptr;
+  this->pool_count_ = 0;
+}
+
+void* UringReactor::get_sqe_(unsigned int count) noexcept
+{
+#ifdef HAIER_HAS_IO_URING
+  Ring& ring = *this->ring_;
+  if (ring.local_tail + count - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) > ring.sq_entries)
+  {
+    this->enter_(0, std::chrono::milliseconds(0));
+    if (ring.local_tail + count - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) > ring.sq_entries)
+    {
+      HAIER_LOGW("io_uring submission queue is full");
+      return nullptr;
+    }
+  }
+  unsigned index = ring.local_tail & ring.sq_mask;
+  io_uring_sqe* sqe = &ring.sqes[index];
+  memset(sqe, 0, sizeof(io_uring_sqe));
+  ring.sq_array[index] = index;
+  ring.local_tail++;
+  return sqe;
+#else
+  (void) count;
+  return nullptr;
+#endif
+}
+
+bool UringReactor::enter_(unsigned int wait_count, std::chrono::milliseconds timeout) noexcept
+{
+#ifdef HAIER_HAS_IO_URING
+  Ring& ring = *this->ring_;
+  __atomic_store_n(ring.sq_tail, ring.local_tail, __ATOMIC_RELEASE);
+  // No need to wait if there are completions already
+  if ((wait_count > 0) && (__atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) != *ring.cq_head))
+    wait_count = 0;
+  struct __kernel_timespec wait_time;
+  wait_time.tv_sec = timeout.count() / 1000;
+  wait_time.tv_nsec = (timeout.count() % 1000) * 1000000;
+  io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = (uint64_t) (uintptr_t) &wait_time;
+  unsigned int flags = wait_count > 0 ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+  long res;
+  do
+  {
+    unsigned int to_submit = ring.local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if ((to_submit == 0) && (wait_count == 0))
+      return true;
+    res = syscall(__NR_io_uring_enter, ring.handle, to_submit, wait_count, flags, flags != 0 ? &arg : nullptr, flags != 0 ? sizeof(arg) : 0);
+  } while ((res < 0) && (errno == EINTR));
+  return (res >= 0) || (errno == ETIME) || (errno == EBUSY);
+#else
+  (void) wait_count;
+  (void) timeout;
+  return false;
+#endif
+}
+
+int UringReactor::attach_(UringStream* stream) noexcept
+{
+  size_t slot = 0;
+  while ((slot < this->streams_.size()) && (this->streams_[slot] != nullptr))
+    slot++;
+  if (slot == this->streams_.size())
+    this->streams_.push_back(stream);
+  else
+    this->streams_[slot] = stream;
+  stream->slot_ = (int) slot;
+  if (this->backend_ == ReactorBackend::IO_URING)
+    this->arm_read_(stream);
+  else
+    this->update_watch_(stream);
+  return (int) slot;
+}
+
+void UringReactor::detach_(UringStream* stream) noexcept
+{
+#ifdef HAIER_HAS_IO_URING
+  if ((this->backend_ == ReactorBackend::IO_URING) && (stream->operations_ > 0))
+  {
+    // Kernel uses the send buffer, cancel everything and wait
+    const UringOperation operations[] = { OP_POLL_IN, OP_READ, OP_POLL_OUT, OP_WRITE };
+    for (UringOperation operation : operations)
+    {
+      io_uring_sqe* sqe = (io_uring_sqe*) this->get_sqe_();
+      if (sqe == nullptr)
+        break;
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = make_user_data_(stream->slot_, operation);
+      sqe->user_data = make_user_data_(NO_SLOT, OP_CANCEL);
+    }
+    auto deadline = std::chrono::steady_clock::now() + OPERATION_TIMEOUT;
+    while ((stream->operations_ > 0) && (std::chrono::steady_clock::now() < deadline))
+    {
+      this->enter_(1, std::chrono::milliseconds(100));
+      this->process_completions_();
+    }
+    if (stream->operations_ > 0)
+    {
+      HAIER_LOGE("Stream operations were not canceled");
+    }
+  }
+#endif
+  for (size_t i = stream->chunk_head_; i < stream->chunks_.size(); i++)
+    this->release_buffer_(stream->chunks_[i].buffer_id);
+  stream->chunks_.clear();
+  stream->chunk_head_ = 0;
+  this->update_watch_(stream);
+  this->streams_[stream->slot_] = nullptr;
+  this->starved_.erase(std::remove(this->starved_.begin(), this->starved_.end(), stream->slot_), this->starved_.end());
+}
+
+void UringReactor::arm_read_(UringStream* stream) noexcept
+{
+#ifdef HAIER_HAS_IO_URING
+  bool multishot = stream->socket_ && this->ring_->multishot_recv;
+  // Single shot read is armed again when transport has read the data
+  if (!stream->open_ || stream->read_armed_ || (!multishot && stream->has_chunks_()))
+    return;
+  io_uring_sqe* sqe;
+  if (stream->socket_)
+  {
+    // Socket receive waits for data in the kernel even if the socket is non-blocking
+    sqe = (io_uring_sqe*) this->get_sqe_();
+    if (sqe == nullptr)
+      return;
+    sqe->opcode = IORING_OP_RECV;
+#ifdef HAIER_HAS_IO_URING_MULTISHOT_RECV
+    sqe->ioprio = multishot ? IORING_RECV_MULTISHOT : 0;
+#endif
+    sqe->len = multishot ? 0 : HAIER_URING_BUFFER_SIZE;
+  }
+  else
+  {
+    // Non-blocking descriptors return EAGAIN instead of waiting, linked poll makes the read wait in the kernel
+    sqe = (io_uring_sqe*) this->get_sqe_(2);
+    if (sqe == nullptr)
+      return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = stream->handle_;
+    sqe->poll32_events = get_poll_mask_(POLLIN);
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = make_user_data_(stream->slot_, OP_POLL_IN);
+    stream->operations_++;
+    sqe = (io_uring_sqe*) this->get_sqe_();
+    sqe->opcode = IORING_OP_READ;
+    sqe->off = (uint64_t) -1;
+    sqe->len = HAIER_URING_BUFFER_SIZE;
+  }
+  sqe->fd = stream->handle_;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = POOL_BUFFER_GROUP;
+  sqe->user_data = make_user_data_(stream->slot_, OP_READ);
+  stream->read_armed_ = true;
+  stream->operations_++;
+#else
+  (void) stream;
+#endif
+}
+
+void UringReactor::arm_write_(UringStream* stream, bool wait_for_space) noexcept
+{
+#ifdef HAIER_HAS_IO_URING
+  if (!stream->open_ || (stream->write_size_ > 0) || stream->tx_buffer_.empty())
+    return;
+  const uint8_t* segment1;
+  const uint8_t* segment2;
+  size_t size1, size2;
+  stream->tx_buffer_.get_data_segments(segment1, size1, segment2, size2);
+  io_uring_sqe* sqe = (io_uring_sqe*) this->get_sqe_(wait_for_space ? 2 : 1);
+  if (sqe == nullptr)
+    return;
+  if (wait_for_space)
+  {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = stream->handle_;
+    sqe->poll32_events = get_poll_mask_(POLLOUT);
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = make_user_data_(stream->slot_, OP_POLL_OUT);
+    stream->operations_++;
+    sqe = (io_uring_sqe*) this->get_sqe_();
+  }
+  if (stream->socket_)
+  {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->msg_flags = MSG_NOSIGNAL;
+  }
+  else
+  {
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->off = (uint64_t) -1;
+  }
+  sqe->fd = stream->handle_;
+  sqe->addr = (uint64_t) (uintptr_t) segment1;
+  sqe->len = (uint32_t) size1;
+  sqe->user_data = make_user_data_(stream->slot_, OP_WRITE);
+  stream->write_size_ = size1;
+  stream->operations_++;
+#else
+  (void) stream;
+  (void) wait_for_space;
+#endif
+}
+
+void UringReactor::release_buffer_(uint16_t buffer_id) noexcept
+{
+#ifdef HAIER_HAS_IO_URING
+  uint8_t* buffer = this->pool_ + buffer_id * HAIER_URING_BUFFER_SIZE;
+#ifdef HAIER_HAS_IO_URING_BUFFER_RING
+  Ring& ring = *this->ring_;
+  if (ring.buffer_ring != nullptr)
+  {
+    io_uring_buf& entry = ring.buffer_ring->bufs[ring.buffer_ring_tail & (this->pool_count_ - 1)];
+    entry.addr = (uint64_t) (uintptr_t) buffer;
+    entry.len = HAIER_URING_BUFFER_SIZE;
+    entry.bid = buffer_id;
+    __atomic_store_n(&ring.buffer_ring->tail, ++ring.buffer_ring_tail, __ATOMIC_RELEASE);
+  }
+  else
+#endif
+  {
+    io_uring_sqe* sqe = (io_uring_sqe*) this->get_sqe_();
+    if (sqe == nullptr)
+      return;
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = (uint64_t) (uintptr_t) buffer;
+    sqe->len = HAIER_URING_BUFFER_SIZE;
+    sqe->off = buffer_id;
+    sqe->buf_group = POOL_BUFFER_GROUP;
+    sqe->user_data = make_user_data_(NO_SLOT, OP_PROVIDE_BUFFERS);
+  }
+  if (!this->starved_.empty())
+  {
+    int slot = this->starved_.back();
+    this->starved_.pop_back();
+    if (this->streams_[slot] != nullptr)
+      this->arm_read_(this->streams_[slot]);
+  }
+#else
+  (void) buffer_id;
+#endif
+}
+
+void UringReactor::process_completions_() noexcept
+{
+#ifdef HAIER_HAS_IO_URING
+  Ring& ring = *this->ring_;
+  unsigned head = *ring.cq_head;
+  unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++)
+  {
+    const io_uring_cqe& cqe = ring.cqes[head & ring.cq_mask];
+    int slot = (int) (cqe.user_data >> 8);
+    UringOperation operation = (UringOperation) (cqe.user_data & 0xFF);
+    int res = cqe.res;
+    if (slot == NO_SLOT)
+    {
+      if ((operation == OP_PROVIDE_BUFFERS) && (res < 0))
+      {
+        HAIER_LOGW("Can't return buffer to the pool, error %d", -res);
+      }
+      continue;
+    }
+    UringStream* stream = (size_t) slot < this->streams_.size() ? this->streams_[slot] : nullptr;
+    if (stream == nullptr)
+      continue;
+    // Multishot operation stays armed
+    bool final = (cqe.flags & IORING_CQE_F_MORE) == 0;
+    if (final)
+      stream->operations_--;
+    switch (operation)
+    {
+    case OP_POLL_IN:
+    case OP_POLL_OUT:
+      // Failed poll cancels the linked operation, descriptor is not usable
+      if ((res < 0) && (res != -ECANCELED))
+        stream->set_closed_();
+      break;
+    case OP_READ:
+      if (final)
+        stream->read_armed_ = false;
+      if ((res > 0) && ((cqe.flags & IORING_CQE_F_BUFFER) != 0))
+      {
+        uint16_t buffer_id = (uint16_t) (cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        if (stream->open_)
+        {
+          if (!stream->has_chunks_())
+            this->ready_.push_back(slot);
+          stream->chunks_.push_back({ buffer_id, 0, (uint16_t) res });
+          // Multishot receive was stopped (completion queue overflow)
+          if (final)
+            this->arm_read_(stream);
+        }
+        else
+          this->release_buffer_(buffer_id);
+      }
+      else if (res == -ENOBUFS)
+        this->starved_.push_back(slot);
+      else if ((res == -EINVAL) && stream->socket_ && ring.multishot_recv)
+      {
+        HAIER_LOGI("Multishot receive is not supported");
+        ring.multishot_recv = false;
+        this->arm_read_(stream);
+      }
+      else if ((res == -EAGAIN) || (res == -ECANCELED) || (res == -EINTR))
+        this->arm_read_(stream);
+      else
+        stream->set_closed_();
+      break;
+    case OP_WRITE:
+      stream->write_size_ = 0;
+      if (res > 0)
+      {
+        stream->tx_buffer_.drop((size_t) res);
+        this->arm_write_(stream, false);
+      }
+      else if (res == -EAGAIN)
+        this->arm_write_(stream, true);
+      else if ((res == -ECANCELED) || (res == -EINTR))
+        this->arm_write_(stream, false);
+      else
+      {
+        stream->tx_buffer_.clear();
+        stream->set_closed_();
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+#endif
+}
+
+unsigned int UringReactor::call_handlers_() noexcept
+{
+  unsigned int called = 0;
+  size_t ready_count = this->ready_.size();
+  for (size_t i = 0; i < ready_count; i++)
+  {
+    UringStream* stream = this->streams_[this->ready_[i]];
+    if ((stream != nullptr) && stream->handler_)
+    {
+      stream->handler_(*stream);
+      called++;
+    }
+  }
+  // Streams with data left in the pool buffer are called again on the next run, without waiting.
+  // Streams that got data while handlers were running (destructor waits for completions) too.
+  size_t kept = 0;
+  for (size_t i = 0; i < this->ready_.size(); i++)
+  {
+    int slot = this->ready_[i];
+    UringStream* stream = this->streams_[slot];
+    if ((stream != nullptr) && ((i >= ready_count) || stream->has_chunks_()))
+      this->ready_[kept++] = slot;
+  }
+  this->ready_.resize(kept);
+  return called;
+}
+
+void UringReactor::update_watch_(UringStream* stream) noexcept
+{
+  if (this->backend_ != ReactorBackend::EPOLL)
+    return;
+  uint32_t events = stream->open_ ? (uint32_t) EPOLLIN | (stream->tx_buffer_.empty() ? 0u : (uint32_t) EPOLLOUT) : 0u;
+  if (events == stream->watch_events_)
+    return;
+  struct epoll_event event = {};
+  event.events = events;
+  event.data.u32 = (uint32_t) stream->slot_;
+  int operation = events == 0 ? EPOLL_CTL_DEL : (stream->watch_events_ == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+  epoll_ctl(this->epoll_handle_, operation, stream->handle_, &event);
+  stream->watch_events_ = events;
+}
+
+unsigned int UringReactor::run_once(std::chrono::milliseconds timeout) noexcept
+{
+  switch (this->backend_)
+  {
+  case ReactorBackend::IO_URING:
+  {
+    this->enter_(this->ready_.empty() ? 1 : 0, timeout);
+    this->process_completions_();
+    unsigned int called = this->call_handlers_();
+    // Answers written by handlers and returned buffers go in one submission
+    this->enter_(0, std::chrono::milliseconds(0));
+    return called;
+  }
+  case ReactorBackend::EPOLL:
+  {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int count;
+    do
+    {
+      count = epoll_wait(this->epoll_handle_, events, MAX_EPOLL_EVENTS, this->ready_.empty() ? (int) timeout.count() : 0);
+    } while ((count < 0) && (errno == EINTR));
+    for (int i = 0; i < count; i++)
+    {
+      UringStream* stream = this->streams_[events[i].data.u32];
+      if (stream == nullptr)
+        continue;
+      if ((events[i].events & EPOLLOUT) != 0)
+      {
+        stream->flush_();
+        this->update_watch_(stream);
+      }
+      if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0)
+        this->ready_.push_back(stream->slot_);
+    }
+    return this->call_handlers_();
+  }
+  default:
+    for (UringStream* stream : this->streams_)
+    {
+      if (stream == nullptr)
+        continue;
+      if (!stream->tx_buffer_.empty())
+        stream->flush_();
+      this->ready_.push_back(stream->slot_);
+    }
+    return this->call_handlers_();
+  }
+}
+
+UringStream::UringStream(UringReactor& reactor, int file_descriptor, size_t tx_buffer_size) noexcept :
+  reactor_(reactor),
+  handle_(file_descriptor),
+  slot_(-1),
+  open_(file_descriptor >= 0),
+  socket_(false),
+  watch_events_(0),
+  handler_(nullptr),
+  chunk_head_(0),
+  read_armed_(false),
+  write_size_(0),
+  operations_(0),
+  tx_buffer_(tx_buffer_size),
+  dropped_bytes_(0)
+{
+  struct stat info;
+  this->socket_ = this->open_ && (fstat(file_descriptor, &info) == 0) && S_ISSOCK(info.st_mode);
+  this->reactor_.attach_(this);
+}
+
+UringStream::~UringStream() noexcept
+{
+  this->open_ = false;
+  this->reactor_.detach_(this);
+}
+
+void UringStream::set_closed_() noexcept
+{
+  if (!this->open_)
+    return;
+  this->open_ = false;
+  this->reactor_.update_watch_(this);
+  // Owner learns about it from the handler
+  this->reactor_.ready_.push_back(this->slot_);
+}
+
+size_t UringStream::available() noexcept
+{
+  if (this->reactor_.backend_ == ReactorBackend::IO_URING)
+  {
+    size_t result = 0;
+    for (size_t i = this->chunk_head_; i < this->chunks_.size(); i++)
+      result += this->chunks_[i].size - this->chunks_[i].offset;
+    return result;
+  }
+  if (!this->open_)
+    return 0;
+  int count = 0;
+  if (ioctl(this->handle_, FIONREAD, &count) != 0)
+    return 0;
+  return count > 0 ? (size_t) count : 0;
+}
+
+size_t UringStream::read_array(uint8_t* data, size_t len) noexcept
+{
+  return this->read_into(data, len, nullptr, 0);
+}
+
+size_t UringStream::read_into(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept
+{
+  if (this->reactor_.backend_ != ReactorBackend::IO_URING)
+    return this->read_direct_(data1, size1, data2, size2);
+  size_t result = 0;
+  while (this->has_chunks_() && ((size1 > 0) || (size2 > 0)))
+  {
+    PoolChunk& chunk = this->chunks_[this->chunk_head_];
+    const uint8_t* source = this->reactor_.pool_ + chunk.buffer_id * HAIER_URING_BUFFER_SIZE + chunk.offset;
+    size_t left = chunk.size - chunk.offset;
+    size_t count1 = std::min(size1, left);
+    size_t count2 = std::min(size2, left - count1);
+    if (count1 > 0)
+      memcpy(data1, source, count1);
+    if (count2 > 0)
+      memcpy(data2, source + count1, count2);
+    data1 += count1;
+    size1 -= count1;
+    if (size1 == 0)
+    {
+      // The first segment is full, continue with the second one
+      data1 = data2 + count2;
+      size1 = size2 - count2;
+      data2 = nullptr;
+      size2 = 0;
+    }
+    else
+    {
+      data2 += count2;
+      size2 -= count2;
+    }
+    chunk.offset += (uint16_t) (count1 + count2);
+    result += count1 + count2;
+    if (chunk.offset == chunk.size)
+    {
+      // Buffer goes back to the pool
+      this->reactor_.release_buffer_(chunk.buffer_id);
+      if (++this->chunk_head_ == this->chunks_.size())
+      {
+        this->chunks_.clear();
+        this->chunk_head_ = 0;
+      }
+    }
+  }
+  this->reactor_.arm_read_(this);
+  return result;
+}
+
+size_t UringStream::read_direct_(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept
+{
+  if (!this->open_)
+    return 0;
+  struct iovec segments[2] = { { data1, size1 }, { data2, size2 } };
+  ssize_t res;
+  do
+  {
+    res = readv(this->handle_, segments, size2 > 0 ? 2 : 1);
+  } while ((res < 0) && (errno == EINTR));
+  if (res > 0)
+    return (size_t) res;
+  if ((res == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+    this->set_closed_();
+  return 0;
+}
+
+void UringStream::write_array(const uint8_t* data, size_t len) noexcept
+{
+  if (!this->open_)
+  {
+    this->dropped_bytes_ += len;
+    return;
+  }
+  size_t accepted = this->tx_buffer_.push(data, len);
+  if (accepted < len)
+  {
+    HAIER_LOGW("Stream send queue is full, %d bytes dropped", (int) (len - accepted));
+    this->dropped_bytes_ += len - accepted;
+  }
+  if (this->reactor_.backend_ == ReactorBackend::IO_URING)
+    this->reactor_.arm_write_(this, false);
+  else
+  {
+    this->flush_();
+    this->reactor_.update_watch_(this);
+  }
+}
+
+void UringStream::flush_() noexcept
+{
+  while (this->open_ && !this->tx_buffer_.empty())
+  {
+    const uint8_t* segment1;
+    const uint8_t* segment2;
+    size_t size1, size2;
+    this->tx_buffer_.get_data_segments(segment1, size1, segment2, size2);
+    struct iovec segments[2] = { { (void*) segment1, size1 }, { (void*) segment2, size2 } };
+    ssize_t res;
+    do
+    {
+      if (this->socket_)
+      {
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = segments;
+        message.msg_iovlen = size2 > 0 ? 2 : 1;
+        res = sendmsg(this->handle_, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+      }
+      else
+        res = writev(this->handle_, segments, size2 > 0 ? 2 : 1);
+    } while ((res < 0) && (errno == EINTR));
+    if (res > 0)
+      this->tx_buffer_.drop((size_t) res);
+    else if ((res < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+      return;
+    else
+    {
+      this->tx_buffer_.clear();
+      this->set_closed_();
+    }
+  }
+}
+
+} // haier_protocol
+
+#endif // __linux__
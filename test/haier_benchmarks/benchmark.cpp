@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <numeric>
+#include "benchmark.h"
+
+#ifndef HAIER_PROTOCOL_VERSION
+#define HAIER_PROTOCOL_VERSION "unknown"
+#endif
+
+namespace
+{
+
+struct BenchmarkInfo
+{
+    std::string         name;
+    BenchmarkFunction   function;
+    size_t              bytes_per_iteration;
+};
+
+std::vector<BenchmarkInfo>& get_benchmarks()
+{
+    static std::vector<BenchmarkInfo> benchmarks;
+    return benchmarks;
+}
+
+double run_sample(const BenchmarkFunction& function, uint64_t iterations)
+{
+    auto start = std::chrono::steady_clock::now();
+    function(iterations);
+    auto end = std::chrono::steady_clock::now();
+    return (double) std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+}
+
+BenchmarkResult run_benchmark(const BenchmarkInfo& info, unsigned int samples, double min_time_ns)
+{
+    BenchmarkResult result;
+    result.name = info.name;
+    result.bytes_per_iteration = info.bytes_per_iteration;
+    // Find number of iterations that takes at least min_time_ns (also works as warm up)
+    uint64_t iterations = 1;
+    double elapsed = run_sample(info.function, iterations);
+    while (elapsed < min_time_ns)
+    {
+        uint64_t next = elapsed > 0 ? (uint64_t) (iterations * min_time_ns * 1.2 / elapsed) : iterations * 10;
+        iterations = std::max(iterations * 2, std::min(next, iterations * 100));
+        elapsed = run_sample(info.function, iterations);
+    }
+    result.iterations = iterations;
+    for (unsigned int i = 0; i < samples; i++)
+        result.samples_ns.push_back(run_sample(info.function, iterations) / iterations);
+    std::vector<double> sorted = result.samples_ns;
+    std::sort(sorted.begin(), sorted.end());
+    result.min_ns = sorted.front();
+    result.median_ns = sorted.size() % 2 == 1 ? sorted[sorted.size() / 2] : (sorted[sorted.size() / 2 - 1] + sorted[sorted.size() / 2]) / 2;
+    result.mean_ns = std::accumulate(sorted.begin(), sorted.end(), 0.0) / sorted.size();
+    return result;
+}
+
+double get_throughput(const BenchmarkResult& result)
+{
+    return result.bytes_per_iteration > 0 ? result.bytes_per_iteration * 1e9 / result.median_ns : 0.0;
+}
+
+void write_json(FILE* file, const std::vector<BenchmarkResult>& results, unsigned int samples, double min_time_ns)
+{
+    char timestamp[32];
+    time_t now = time(nullptr);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    fprintf(file, "{\n");
+    fprintf(file, "  \"library\": \"HaierProtocol\",\n");
+    fprintf(file, "  \"version\": \"%s\",\n", HAIER_PROTOCOL_VERSION);
+#if defined(__VERSION__)
+    fprintf(file, "  \"compiler\": \"%s\",\n", __VERSION__);
+#elif defined(_MSC_VER)
+    fprintf(file, "  \"compiler\": \"MSVC %d\",\n", _MSC_VER);
+#endif
+#if defined(NDEBUG)
+    fprintf(file, "  \"build_type\": \"release\",\n");
+#else
+    fprintf(file, "  \"build_type\": \"debug\",\n");
+#endif
+    fprintf(file, "  \"timestamp\": \"%s\",\n", timestamp);
+    fprintf(file, "  \"samples\": %u,\n", samples);
+    fprintf(file, "  \"min_sample_time_ns\": %.0f,\n", min_time_ns);
+    fprintf(file, "  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchmarkResult& result = results[i];
+        fprintf(file, "    {\n");
+        fprintf(file, "      \"name\": \"%s\",\n", result.name.c_str());
+        fprintf(file, "      \"iterations\": %llu,\n", (unsigned long long) result.iterations);
+        fprintf(file, "      \"bytes_per_iteration\": %u,\n", (unsigned int) result.bytes_per_iteration);
+        fprintf(file, "      \"min_ns\": %.3f,\n", result.min_ns);
+        fprintf(file, "      \"median_ns\": %.3f,\n", result.median_ns);
+        fprintf(file, "      \"mean_ns\": %.3f,\n", result.mean_ns);
+        fprintf(file, "      \"bytes_per_second\": %.0f,\n", get_throughput(result));
+        fprintf(file, "      \"samples_ns\": [");
+        for (size_t j = 0; j < result.samples_ns.size(); j++)
+            fprintf(file, "%s%.3f", j == 0 ? "" : ", ", result.samples_ns[j]);
+        fprintf(file, "]\n");
+        fprintf(file, "    }%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+}
+
+// Filter is a comma separated list of substrings
+bool matches_filter(const std::string& name, const std::string& filter)
+{
+    if (filter.empty())
+        return true;
+    size_t start = 0;
+    while (start <= filter.size())
+    {
+        size_t end = filter.find(',', start);
+        if (end == std::string::npos)
+            end = filter.size();
+        if ((end > start) && (name.find(filter.substr(start, end - start)) != std::string::npos))
+            return true;
+        start = end + 1;
+    }
+    return false;
+}
+
+}
+
+void register_benchmark(const std::string& name, BenchmarkFunction function, size_t bytes_per_iteration)
+{
+    get_benchmarks().push_back({ name, function, bytes_per_iteration });
+}
+
+int run_benchmarks(int argc, char** argv)
+{
+    std::string filter;
+    const char* json_path = nullptr;
+    unsigned int samples = 9;
+    double min_time_ns = 20e6;
+    for (int i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "--filter") == 0) && (i + 1 < argc))
+            filter = argv[++i];
+        else if ((strcmp(argv[i], "--samples") == 0) && (i + 1 < argc))
+            samples = std::max(1, atoi(argv[++i]));
+        else if ((strcmp(argv[i], "--min-time") == 0) && (i + 1 < argc))
+            min_time_ns = std::max(1.0, atof(argv[++i])) * 1e6;
+        else if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc))
+            json_path = argv[++i];
+        else if (strcmp(argv[i], "--list") == 0)
+        {
+            for (const BenchmarkInfo& info : get_benchmarks())
+                printf("%s\n", info.name.c_str());
+            return 0;
+        }
+        else
+        {
+            fprintf(stderr, "Please use: %s [--filter <substring>[,<substring>...]] [--samples <n>] [--min-time <ms>] [--json <path>|-] [--list]\n", argv[0]);
+            return 1;
+        }
+    }
+    // Human readable output goes to stderr if JSON is printed to stdout
+    bool json_to_stdout = (json_path != nullptr) && (strcmp(json_path, "-") == 0);
+    FILE* console = json_to_stdout ? stderr : stdout;
+    std::vector<BenchmarkResult> results;
+    fprintf(console, "%-56s %12s %12s %12s\n", "Benchmark", "Median, ns", "Min, ns", "MB/s");
+    for (const BenchmarkInfo& info : get_benchmarks())
+    {
+        if (!matches_filter(info.name, filter))
+            continue;
+        results.push_back(run_benchmark(info, samples, min_time_ns));
+        const BenchmarkResult& result = results.back();
+        if (result.bytes_per_iteration > 0)
+            fprintf(console, "%-56s %12.1f %12.1f %12.1f\n", result.name.c_str(), result.median_ns, result.min_ns, get_throughput(result) / 1e6);
+        else
+            fprintf(console, "%-56s %12.1f %12.1f %12s\n", result.name.c_str(), result.median_ns, result.min_ns, "-");
+        fflush(console);
+    }
+    if (json_path != nullptr)
+    {
+        FILE* file = json_to_stdout ? stdout : fopen(json_path, "w");
+        if (file == nullptr)
+        {
+            fprintf(stderr, "Can't open %s\n", json_path);
+            return 1;
+        }
+        write_json(file, results, samples, min_time_ns);
+        if (!json_to_stdout)
+            fclose(file);
+    }
+    return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+#include <stdint.h>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Benchmark body, should run the measured operation "iterations" times
+using BenchmarkFunction = std::function<void(uint64_t iterations)>;
+
+struct BenchmarkResult
+{
+    std::string             name;
+    uint64_t                iterations;     // per sample
+    size_t                  bytes_per_iteration;
+    std::vector<double>     samples_ns;     // time per iteration for every sample
+    double                  min_ns;
+    double                  median_ns;
+    double                  mean_ns;
+};
+
+// Register benchmark, bytes_per_iteration is used to calculate throughput (0 if not applicable)
+void register_benchmark(const std::string& name, BenchmarkFunction function, size_t bytes_per_iteration = 0);
+
+// Prevent compiler from optimizing away the value
+template<class T>
+inline void do_not_optimize(const T& value)
+{
+#if defined(__GNUC__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const T* sink;
+    sink = &value;
+#endif
+}
+
+// Command line:
+//   --filter <substrings>  run only benchmarks with name containing one of comma separated substrings
+//   --samples <n>          number of samples per benchmark (default 9)
+//   --min-time <ms>        minimal duration of one sample (default 20)
+//   --json <path>          write results as JSON ("-" for stdout)
+//   --list                 print benchmark names
+int run_benchmarks(int argc, char** argv);
+
+#endif // BENCHMARK_H
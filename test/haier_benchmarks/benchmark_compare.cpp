@@ -0,0 +1,366 @@
+// Compares two haier_benchmarks JSON outputs (baseline and current run).
+// Exit code: 0 - no regressions, 1 - regression found, 2 - wrong arguments or input.
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+constexpr double DEFAULT_TOLERANCE = 0.10;
+// Changes smaller than NOISE_SIGMAS standard deviations of both runs are treated as noise
+constexpr double NOISE_SIGMAS = 3.0;
+// MAD to standard deviation for normal distribution
+constexpr double MAD_SCALE = 1.4826;
+constexpr const char* CALIBRATION_BENCHMARK = "calibration";
+
+struct BenchmarkStats
+{
+    double median_ns;
+    double mad_ns;
+    size_t samples;
+};
+
+using BenchmarkSet = std::map<std::string, BenchmarkStats>;
+
+double get_median(std::vector<double> values)
+{
+    if (values.empty())
+        return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t middle = values.size() / 2;
+    return values.size() % 2 == 1 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+// Minimal reader for the JSON written by haier_benchmarks, only extracts
+// benchmark names and samples. Unknown fields are skipped.
+class JsonReader
+{
+public:
+    explicit JsonReader(const std::string& text) : text_(text), position_(0) {};
+    bool read_results(BenchmarkSet& results);
+private:
+    void skip_spaces_();
+    bool expect_(char c);
+    bool read_string_(std::string& value);
+    bool read_number_(double& value);
+    bool skip_value_();
+    bool read_benchmark_(BenchmarkSet& results);
+    bool read_samples_(std::vector<double>& samples);
+    const std::string& text_;
+    size_t position_;
+};
+
+void JsonReader::skip_spaces_()
+{
+    while ((this->position_ < this->text_.size()) && isspace((unsigned char) this->text_[this->position_]))
+        this->position_++;
+}
+
+bool JsonReader::expect_(char c)
+{
+    this->skip_spaces_();
+    if ((this->position_ < this->text_.size()) && (this->text_[this->position_] == c))
+    {
+        this->position_++;
+        return true;
+    }
+    return false;
+}
+
+bool JsonReader::read_string_(std::string& value)
+{
+    if (!this->expect_('"'))
+        return false;
+    value.clear();
+    while (this->position_ < this->text_.size())
+    {
+        char c = this->text_[this->position_++];
+        if (c == '"')
+            return true;
+        if ((c == '\\') && (this->position_ < this->text_.size()))
+            c = this->text_[this->position_++];
+        value.push_back(c);
+    }
+    return false;
+}
+
+bool JsonReader::read_number_(double& value)
+{
+    this->skip_spaces_();
+    const char* start = this->text_.c_str() + this->position_;
+    char* end;
+    value = strtod(start, &end);
+    if (end == start)
+        return false;
+    this->position_ += end - start;
+    return true;
+}
+
+bool JsonReader::skip_value_()
+{
+    this->skip_spaces_();
+    if (this->position_ >= this->text_.size())
+        return false;
+    char c = this->text_[this->position_];
+    if (c == '"')
+    {
+        std::string dummy;
+        return this->read_string_(dummy);
+    }
+    if ((c == '{') || (c == '['))
+    {
+        char closing = c == '{' ? '}' : ']';
+        this->position_++;
+        if (this->expect_(closing))
+            return true;
+        do
+        {
+            if (c == '{')
+            {
+                std::string key;
+                if (!this->read_string_(key) || !this->expect_(':'))
+                    return false;
+            }
+            if (!this->skip_value_())
+                return false;
+        } while (this->expect_(','));
+        return this->expect_(closing);
+    }
+    // Number, true, false or null
+    while ((this->position_ < this->text_.size()) && (strchr(",}] \t\r\n", this->text_[this->position_]) == nullptr))
+        this->position_++;
+    return true;
+}
+
+bool JsonReader::read_samples_(std::vector<double>& samples)
+{
+    if (!this->expect_('['))
+        return false;
+    if (this->expect_(']'))
+        return true;
+    do
+    {
+        double value;
+        if (!this->read_number_(value))
+            return false;
+        samples.push_back(value);
+    } while (this->expect_(','));
+    return this->expect_(']');
+}
+
+bool JsonReader::read_benchmark_(BenchmarkSet& results)
+{
+    if (!this->expect_('{'))
+        return false;
+    std::string name;
+    std::vector<double> samples;
+    do
+    {
+        std::string key;
+        if (!this->read_string_(key) || !this->expect_(':'))
+            return false;
+        if (key == "name")
+        {
+            if (!this->read_string_(name))
+                return false;
+        }
+        else if (key == "samples_ns")
+        {
+            if (!this->read_samples_(samples))
+                return false;
+        }
+        else if (!this->skip_value_())
+            return false;
+    } while (this->expect_(','));
+    if (!this->expect_('}') || name.empty() || samples.empty())
+        return false;
+    BenchmarkStats& stats = results[name];
+    stats.median_ns = get_median(samples);
+    std::vector<double> deviations;
+    for (double sample : samples)
+        deviations.push_back(std::fabs(sample - stats.median_ns));
+    stats.mad_ns = get_median(deviations);
+    stats.samples = samples.size();
+    return true;
+}
+
+bool JsonReader::read_results(BenchmarkSet& results)
+{
+    if (!this->expect_('{'))
+        return false;
+    do
+    {
+        std::string key;
+        if (!this->read_string_(key) || !this->expect_(':'))
+            return false;
+        if (key == "benchmarks")
+        {
+            if (!this->expect_('['))
+                return false;
+            if (!this->expect_(']'))
+            {
+                do
+                {
+                    if (!this->read_benchmark_(results))
+                        return false;
+                } while (this->expect_(','));
+                if (!this->expect_(']'))
+                    return false;
+            }
+        }
+        else if (!this->skip_value_())
+            return false;
+    } while (this->expect_(','));
+    return this->expect_('}');
+}
+
+bool load_results(const char* path, BenchmarkSet& results)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        fprintf(stderr, "Can't open %s\n", path);
+        return false;
+    }
+    std::stringstream content;
+    content << file.rdbuf();
+    std::string text = content.str();
+    if (!JsonReader(text).read_results(results) || results.empty())
+    {
+        fprintf(stderr, "Can't parse benchmark results in %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+bool has_calibration(const BenchmarkSet& results)
+{
+    auto calibration = results.find(CALIBRATION_BENCHMARK);
+    return (calibration != results.end()) && (calibration->second.median_ns > 0.0);
+}
+
+// Express all results in units of calibration benchmark so runs from
+// different machines can be compared
+void normalize(BenchmarkSet& results)
+{
+    double unit = results[CALIBRATION_BENCHMARK].median_ns;
+    for (auto& item : results)
+    {
+        item.second.median_ns /= unit;
+        item.second.mad_ns /= unit;
+    }
+}
+
+struct Threshold
+{
+    std::string prefix;
+    double tolerance;
+};
+
+double get_tolerance(const std::string& name, const std::vector<Threshold>& thresholds, double default_tolerance)
+{
+    // The longest matching prefix wins
+    const Threshold* best = nullptr;
+    for (const Threshold& threshold : thresholds)
+        if ((name.compare(0, threshold.prefix.size(), threshold.prefix) == 0) && ((best == nullptr) || (threshold.prefix.size() > best->prefix.size())))
+            best = &threshold;
+    return best != nullptr ? best->tolerance : default_tolerance;
+}
+
+void print_usage(const char* app_name)
+{
+    fprintf(stderr, "Please use: %s <baseline.json> <current.json> [--tolerance <ratio>] [--threshold <name_prefix>=<ratio>]... [--no-normalize]\n", app_name);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        print_usage(argv[0]);
+        return 2;
+    }
+    double default_tolerance = DEFAULT_TOLERANCE;
+    std::vector<Threshold> thresholds;
+    bool use_normalization = true;
+    for (int i = 3; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "--tolerance") == 0) && (i + 1 < argc))
+            default_tolerance = atof(argv[++i]);
+        else if ((strcmp(argv[i], "--threshold") == 0) && (i + 1 < argc))
+        {
+            const char* value = argv[++i];
+            const char* separator = strrchr(value, '=');
+            if (separator == nullptr)
+            {
+                print_usage(argv[0]);
+                return 2;
+            }
+            thresholds.push_back({ std::string(value, separator - value), atof(separator + 1) });
+        }
+        else if (strcmp(argv[i], "--no-normalize") == 0)
+            use_normalization = false;
+        else
+        {
+            print_usage(argv[0]);
+            return 2;
+        }
+    }
+    BenchmarkSet baseline;
+    BenchmarkSet current;
+    if (!load_results(argv[1], baseline) || !load_results(argv[2], current))
+        return 2;
+    if (use_normalization && (!has_calibration(baseline) || !has_calibration(current)))
+    {
+        fprintf(stderr, "No \"%s\" benchmark in both files, comparing absolute times\n", CALIBRATION_BENCHMARK);
+        use_normalization = false;
+    }
+    if (use_normalization)
+    {
+        normalize(baseline);
+        normalize(current);
+    }
+    printf("%-48s %12s %12s %9s %9s  %s\n", "Benchmark", "Baseline", "Current", "Change", "Limit", "Result");
+    unsigned int regressions = 0;
+    for (const auto& item : current)
+    {
+        const std::string& name = item.first;
+        if (use_normalization && (name == CALIBRATION_BENCHMARK))
+            continue;
+        auto base = baseline.find(name);
+        if (base == baseline.end())
+        {
+            printf("%-48s %12s %12.4g %9s %9s  new\n", name.c_str(), "-", item.second.median_ns, "-", "-");
+            continue;
+        }
+        const BenchmarkStats& before = base->second;
+        const BenchmarkStats& after = item.second;
+        double change = after.median_ns / before.median_ns - 1.0;
+        double noise = NOISE_SIGMAS * MAD_SCALE * std::sqrt(before.mad_ns * before.mad_ns + after.mad_ns * after.mad_ns) / before.median_ns;
+        double limit = get_tolerance(name, thresholds, default_tolerance) + noise;
+        const char* result = "ok";
+        if (change > limit)
+        {
+            result = "REGRESSION";
+            regressions++;
+        }
+        else if (change < -limit)
+            result = "improved";
+        printf("%-48s %12.4g %12.4g %+8.1f%% %8.1f%%  %s\n", name.c_str(), before.median_ns, after.median_ns, change * 100.0, limit * 100.0, result);
+    }
+    for (const auto& item : baseline)
+        if ((current.find(item.first) == current.end()) && !(use_normalization && (item.first == CALIBRATION_BENCHMARK)))
+            printf("%-48s %12.4g %12s %9s %9s  missing\n", item.first.c_str(), item.second.median_ns, "-", "-", "-");
+    printf("Times in %s, %u regression(s)\n", use_normalization ? "calibration units" : "ns", regressions);
+    return regressions == 0 ? 0 : 1;
+}
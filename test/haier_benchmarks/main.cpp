@@ -0,0 +1,531 @@
+#include <stdint.h>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include "benchmark.h"
+#include "virtual_stream.h"
+#include "utils/circular_buffer.h"
+#include "transport/haier_frame.h"
+#include "transport/protocol_transport.h"
+#include "protocol/haier_protocol.h"
+#include "utils/payload_delta.h"
+#if __linux__
+#include <atomic>
+#include <thread>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "utils/uring_stream.h"
+#include "pty_loopback.h"
+#include "serial_stream.h"
+#endif
+
+// Fixed seed to make inputs the same for every run
+constexpr uint32_t RANDOM_SEED = 0x48414945;
+constexpr size_t MAX_DATA_SIZE = haier_protocol::MAX_FRAME_SIZE - haier_protocol::PURE_HEADER_SIZE;
+constexpr size_t FRAME_DATA_SIZES[] = { 0, 16, 64, 128, MAX_DATA_SIZE };
+constexpr size_t STREAM_SIZE = 4096;
+// Number of bytes that transport gets on every read, similar to UART FIFO
+constexpr size_t STREAM_CHUNK_SIZE = 64;
+
+enum class DataPattern
+{
+    CLEAN,              // no separator bytes in data
+    ESCAPE_HEAVY,       // every second byte is separator byte
+};
+
+std::vector<uint8_t> generate_data(std::mt19937& random, size_t size, DataPattern pattern)
+{
+    std::vector<uint8_t> result(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        if ((pattern == DataPattern::ESCAPE_HEAVY) && (i % 2 == 0))
+            result[i] = haier_protocol::SEPARATOR_BYTE;
+        else
+            result[i] = (uint8_t) (random() % haier_protocol::SEPARATOR_BYTE);
+    }
+    return result;
+}
+
+void append_frame(std::vector<uint8_t>& stream, uint8_t frame_type, const std::vector<uint8_t>& data, bool use_crc)
+{
+    haier_protocol::HaierFrame frame(frame_type, data.data(), (uint8_t) data.size(), use_crc);
+    size_t size = frame.get_buffer_size();
+    size_t pos = stream.size();
+    stream.resize(pos + size);
+    frame.fill_buffer(stream.data() + pos, size);
+}
+
+// Frame as it is after unescaping (what parse_buffer expects)
+std::vector<uint8_t> make_raw_frame(uint8_t frame_type, const std::vector<uint8_t>& data, bool use_crc)
+{
+    std::vector<uint8_t> result;
+    result.push_back(haier_protocol::SEPARATOR_BYTE);
+    result.push_back(haier_protocol::SEPARATOR_BYTE);
+    result.push_back((uint8_t) (haier_protocol::PURE_HEADER_SIZE + data.size()));
+    result.push_back(use_crc ? 0x40 : 0x00);
+    for (int i = 0; i < 5; i++)
+        result.push_back(0);
+    result.push_back(frame_type);
+    result.insert(result.end(), data.begin(), data.end());
+    result.push_back(haier_protocol::checksum(result.data() + haier_protocol::FRAME_SEPARATORS_COUNT, result.size() - haier_protocol::FRAME_SEPARATORS_COUNT));
+    if (use_crc)
+    {
+        uint16_t crc = haier_protocol::crc16(result.data() + haier_protocol::FRAME_SEPARATORS_COUNT, result.size() - haier_protocol::FRAME_SEPARATORS_COUNT - 1);
+        result.push_back((uint8_t) (crc >> 8));
+        result.push_back((uint8_t) (crc & 0xFF));
+    }
+    return result;
+}
+
+enum class StreamPattern
+{
+    CLEAN,
+    ESCAPE_HEAVY,
+    GARBAGE_HEAVY,      // about 75% of bytes are random garbage
+};
+
+std::vector<uint8_t> generate_stream(StreamPattern pattern)
+{
+    std::mt19937 random(RANDOM_SEED);
+    std::vector<uint8_t> result;
+    while (result.size() < STREAM_SIZE)
+    {
+        if (pattern == StreamPattern::GARBAGE_HEAVY)
+        {
+            size_t garbage_size = 64 + random() % 128;
+            for (size_t i = 0; i < garbage_size; i++)
+                result.push_back((uint8_t) random());
+        }
+        size_t data_size = 2 + random() % 62;
+        std::vector<uint8_t> data = generate_data(random, data_size, pattern == StreamPattern::ESCAPE_HEAVY ? DataPattern::ESCAPE_HEAVY : DataPattern::CLEAN);
+        append_frame(result, (uint8_t) (1 + random() % 0x70), data, random() % 4 != 0);
+    }
+    return result;
+}
+
+// Replays recorded stream in fixed size chunks
+class ReplayStream : public haier_protocol::ProtocolStream
+{
+public:
+    explicit ReplayStream(const std::vector<uint8_t>& data) : data_(data) {};
+    size_t available() noexcept override { return std::min(this->limit_, this->data_.size()) - this->position_; };
+    size_t read_array(uint8_t* data, size_t len) noexcept override
+    {
+        len = std::min(len, this->available());
+        memcpy(data, this->data_.data() + this->position_, len);
+        this->position_ += len;
+        return len;
+    };
+    void write_array(const uint8_t* data, size_t len) noexcept override {};
+    bool next_chunk() { this->limit_ = this->position_ + STREAM_CHUNK_SIZE; return this->position_ < this->data_.size(); };
+    void rewind() { this->position_ = 0; this->limit_ = 0; };
+private:
+    const std::vector<uint8_t>& data_;
+    size_t position_{ 0 };
+    size_t limit_{ 0 };
+};
+
+// Pure CPU loop that doesn't depend on library code, benchmark_compare uses it
+// to normalize results from different machines
+void register_calibration_benchmark()
+{
+    register_benchmark("calibration", [](uint64_t iterations) {
+        uint32_t value = RANDOM_SEED;
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            for (int j = 0; j < 256; j++)
+                value = value * 1664525u + 1013904223u;
+            do_not_optimize(value);
+        }
+    });
+}
+
+void register_circular_buffer_benchmarks()
+{
+    register_benchmark("circular_buffer/push_pop/64", [](uint64_t iterations) {
+        CircularBuffer<uint8_t> buffer(256);
+        uint8_t data[64];
+        memset(data, 0x5A, sizeof(data));
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            buffer.push(data, sizeof(data));
+            buffer.pop(data, sizeof(data));
+        }
+        do_not_optimize(data[0]);
+    }, 64);
+    register_benchmark("circular_buffer/push_byte/64", [](uint64_t iterations) {
+        CircularBuffer<uint8_t> buffer(256);
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            for (uint8_t j = 0; j < 64; j++)
+                buffer.push(j);
+            buffer.drop(64);
+        }
+        do_not_optimize(buffer.get_size());
+    }, 64);
+    register_benchmark("circular_buffer/reserve_drop/64", [](uint64_t iterations) {
+        CircularBuffer<uint8_t> buffer(256);
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            size_t size = 64;
+            uint8_t* data = buffer.reserve(size);
+            memset(data, (int) i, size);
+            buffer.drop(size);
+        }
+        do_not_optimize(buffer.get_size());
+    }, 64);
+    register_benchmark("circular_buffer/index/64", [](uint64_t iterations) {
+        CircularBuffer<uint8_t> buffer(256);
+        uint8_t data[64];
+        memset(data, 0x5A, sizeof(data));
+        buffer.drop(200);
+        size_t size = 200;
+        buffer.reserve(size);
+        buffer.drop(200);
+        // Data wraps around the end of the buffer
+        buffer.push(data, sizeof(data));
+        unsigned int sum = 0;
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            for (size_t j = 0; j < sizeof(data); j++)
+                sum += buffer[j];
+            do_not_optimize(sum);
+        }
+    }, 64);
+}
+
+void register_frame_benchmarks()
+{
+    std::mt19937 random(RANDOM_SEED);
+    for (int use_crc = 0; use_crc < 2; use_crc++)
+    {
+        std::string suffix = use_crc ? "/crc" : "/no_crc";
+        for (size_t size : FRAME_DATA_SIZES)
+        {
+            std::vector<uint8_t> data = generate_data(random, size, DataPattern::CLEAN);
+            std::string size_str = std::to_string(size);
+            register_benchmark("frame/construct/" + size_str + suffix, [data, use_crc](uint64_t iterations) {
+                for (uint64_t i = 0; i < iterations; i++)
+                {
+                    haier_protocol::HaierFrame frame(0x01, data.data(), (uint8_t) data.size(), use_crc != 0);
+                    do_not_optimize(frame.get_crc());
+                }
+            }, size);
+            register_benchmark("frame/fill_buffer/" + size_str + suffix, [data, use_crc](uint64_t iterations) {
+                haier_protocol::HaierFrame frame(0x01, data.data(), (uint8_t) data.size(), use_crc != 0);
+                std::vector<uint8_t> buffer(frame.get_buffer_size());
+                for (uint64_t i = 0; i < iterations; i++)
+                {
+                    frame.fill_buffer(buffer.data(), buffer.size());
+                    do_not_optimize(buffer[0]);
+                }
+            }, size);
+            std::vector<uint8_t> raw_frame = make_raw_frame(0x01, data, use_crc != 0);
+            // Header and body are parsed separately, same as transport does
+            register_benchmark("frame/parse_buffer/" + size_str + suffix, [raw_frame](uint64_t iterations) {
+                haier_protocol::FrameError err;
+                for (uint64_t i = 0; i < iterations; i++)
+                {
+                    haier_protocol::HaierFrame frame;
+                    frame.parse_buffer(raw_frame.data(), haier_protocol::FRAME_HEADER_SIZE, err);
+                    frame.parse_buffer(raw_frame.data() + haier_protocol::FRAME_HEADER_SIZE, raw_frame.size() - haier_protocol::FRAME_HEADER_SIZE, err);
+                    do_not_optimize(frame.get_data_size());
+                }
+                if (err != haier_protocol::FrameError::COMPLETE_FRAME)
+                    abort();
+            }, size);
+        }
+    }
+}
+
+void register_checksum_benchmarks()
+{
+    std::mt19937 random(RANDOM_SEED);
+    for (size_t size : { 16, 64, 256 })
+    {
+        std::vector<uint8_t> data = generate_data(random, size, DataPattern::CLEAN);
+        register_benchmark("crc16/" + std::to_string(size), [data](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; i++)
+            {
+                uint16_t crc = haier_protocol::crc16(data.data(), data.size());
+                do_not_optimize(crc);
+            }
+        }, size);
+        register_benchmark("checksum/" + std::to_string(size), [data](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; i++)
+            {
+                uint8_t chk = haier_protocol::checksum(data.data(), data.size());
+                do_not_optimize(chk);
+            }
+        }, size);
+    }
+}
+
+void register_delta_benchmarks()
+{
+    std::mt19937 random(RANDOM_SEED);
+    for (size_t size : { 64, 256 })
+    {
+        std::vector<uint8_t> previous = generate_data(random, size, DataPattern::CLEAN);
+        std::vector<uint8_t> current = previous;
+        std::vector<uint8_t> changed = previous;
+        changed[size / 3] ^= 0x01;
+        changed[size - 2] ^= 0x80;
+        register_benchmark("delta/unchanged/" + std::to_string(size), [previous, current](uint64_t iterations) {
+            uint32_t changed_mask[haier_protocol::DELTA_MASK_WORDS];
+            for (uint64_t i = 0; i < iterations; i++)
+            {
+                bool result = haier_protocol::find_changed_bytes(previous.data(), current.data(), previous.size(), changed_mask);
+                do_not_optimize(result);
+            }
+        }, size);
+        // Byte by byte compare, the way simulators did it before
+        register_benchmark("delta/bytewise/" + std::to_string(size), [previous, changed](uint64_t iterations) {
+            uint32_t changed_mask[haier_protocol::DELTA_MASK_WORDS];
+            for (uint64_t i = 0; i < iterations; i++)
+            {
+                memset(changed_mask, 0, sizeof(changed_mask));
+                for (size_t j = 0; j < previous.size(); j++)
+                {
+                    if (previous[j] != changed[j])
+                        changed_mask[j / 32] |= 1u << (j % 32);
+                }
+                do_not_optimize(changed_mask);
+            }
+        }, size);
+        // Every byte is a field, two of them changed
+        std::vector<haier_protocol::PayloadField> fields;
+        for (size_t j = 0; j < size; j++)
+            fields.push_back({ "byte", (uint16_t) j, 1, 0xFF });
+        register_benchmark("delta/fields/" + std::to_string(size), [previous, changed, fields](uint64_t iterations) {
+            haier_protocol::PayloadDelta delta(fields.data(), fields.size(), previous.size());
+            haier_protocol::FieldChange changes[4];
+            for (uint64_t i = 0; i < iterations; i++)
+            {
+                size_t count = delta.compare(previous.data(), changed.data(), changes, 4);
+                do_not_optimize(count);
+            }
+        }, size);
+    }
+}
+
+void register_transport_benchmarks()
+{
+    const std::pair<const char*, StreamPattern> patterns[] = {
+        { "clean", StreamPattern::CLEAN },
+        { "escape_heavy", StreamPattern::ESCAPE_HEAVY },
+        { "garbage_heavy", StreamPattern::GARBAGE_HEAVY },
+    };
+    for (const auto& pattern : patterns)
+    {
+        // Shared between copies of the lambda
+        std::shared_ptr<std::vector<uint8_t>> stream_data = std::make_shared<std::vector<uint8_t>>(generate_stream(pattern.second));
+        register_benchmark(std::string("transport/process_data/") + pattern.first, [stream_data](uint64_t iterations) {
+            ReplayStream stream(*stream_data);
+            haier_protocol::TransportLevelHandler transport(stream, haier_protocol::MAX_FRAME_SIZE + 10);
+            haier_protocol::TimestampedFrame frame;
+            size_t frames = 0;
+            for (uint64_t i = 0; i < iterations; i++)
+            {
+                stream.rewind();
+                while (stream.next_chunk())
+                {
+                    transport.read_data();
+                    transport.process_data();
+                    while (transport.pop(frame))
+                        frames++;
+                }
+            }
+            do_not_optimize(frames);
+        }, stream_data->size());
+    }
+}
+
+void register_protocol_benchmarks()
+{
+    register_benchmark("protocol/round_trip", [](uint64_t iterations) {
+        VirtualStreamHolder stream_holder;
+        haier_protocol::ProtocolHandler server(stream_holder.get_stream_reference(StreamDirection::DIRECTION_A));
+        haier_protocol::ProtocolHandler client(stream_holder.get_stream_reference(StreamDirection::DIRECTION_B));
+        uint8_t status_data[32];
+        for (size_t i = 0; i < sizeof(status_data); i++)
+            status_data[i] = (uint8_t) i;
+        const haier_protocol::HaierMessage status_message(haier_protocol::FrameType::STATUS, 0x6D01, status_data, sizeof(status_data));
+        server.set_message_handler(haier_protocol::FrameType::CONTROL, [&server, &status_message](haier_protocol::FrameType, const uint8_t*, size_t) {
+            server.send_answer(status_message);
+            return haier_protocol::HandlerError::HANDLER_OK;
+        });
+        size_t answers = 0;
+        client.set_answer_handler(haier_protocol::FrameType::CONTROL, [&answers](haier_protocol::FrameType, haier_protocol::FrameType, const uint8_t*, size_t) {
+            answers++;
+            return haier_protocol::HandlerError::HANDLER_OK;
+        });
+        client.set_cooldown_interval(0);
+        client.set_answer_timeout(10000);
+        const haier_protocol::HaierMessage request(haier_protocol::FrameType::CONTROL, 0x4D01);
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            client.send_message(request, true);
+            client.loop();
+            server.loop();
+            client.loop();
+        }
+        if (answers != iterations)
+            abort();
+    });
+}
+
+#if __linux__
+// Many ports on one host: every port gets a frame and answers it, handlers are called by the reactor.
+// Polling backend calls every transport on every round like a simple loop over SerialStreams.
+void register_stream_benchmarks()
+{
+    constexpr unsigned int PORTS_COUNT = 64;
+    const std::pair<const char*, haier_protocol::ReactorBackend> backends[] = {
+        { "io_uring", haier_protocol::ReactorBackend::IO_URING },
+        { "epoll", haier_protocol::ReactorBackend::EPOLL },
+        { "polling", haier_protocol::ReactorBackend::POLLING },
+    };
+    std::vector<uint8_t> request;
+    std::vector<uint8_t> answer;
+    append_frame(request, (uint8_t) haier_protocol::FrameType::CONTROL, std::vector<uint8_t>(16, 0x11), true);
+    append_frame(answer, (uint8_t) haier_protocol::FrameType::STATUS, std::vector<uint8_t>(32, 0x22), true);
+    for (const auto& backend : backends)
+    {
+        // Skip backends that are not available instead of measuring the fallback under a wrong name
+        haier_protocol::UringReactor probe;
+        if (probe.init(1, backend.second) != backend.second)
+            continue;
+        haier_protocol::ReactorBackend requested = backend.second;
+        register_benchmark(std::string("streams/") + backend.first + "/" + std::to_string(PORTS_COUNT), [requested, request, answer](uint64_t iterations) {
+            haier_protocol::UringReactor reactor;
+            reactor.init(PORTS_COUNT, requested);
+            int peers[PORTS_COUNT];
+            std::vector<std::unique_ptr<haier_protocol::UringStream>> streams;
+            std::vector<std::unique_ptr<haier_protocol::TransportLevelHandler>> transports;
+            uint64_t frames = 0;
+            for (unsigned int i = 0; i < PORTS_COUNT; i++)
+            {
+                int pair[2];
+                if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) != 0)
+                    abort();
+                peers[i] = pair[1];
+                streams.emplace_back(new haier_protocol::UringStream(reactor, pair[0]));
+                transports.emplace_back(new haier_protocol::TransportLevelHandler(*streams.back(), haier_protocol::MAX_FRAME_SIZE + 10));
+                haier_protocol::TransportLevelHandler* transport = transports.back().get();
+                streams.back()->set_data_handler([transport, &frames, &answer](haier_protocol::UringStream& stream) {
+                    transport->read_data();
+                    transport->process_data();
+                    haier_protocol::TimestampedFrame frame;
+                    while (transport->pop(frame))
+                    {
+                        frames++;
+                        stream.write_array(answer.data(), answer.size());
+                    }
+                });
+            }
+            uint8_t drain_buffer[1024];
+            for (uint64_t i = 0; i < iterations; i++)
+            {
+                for (unsigned int port = 0; port < PORTS_COUNT; port++)
+                    if (write(peers[port], request.data(), request.size()) != (ssize_t) request.size())
+                        abort();
+                uint64_t expected = (i + 1) * PORTS_COUNT;
+                while (frames < expected)
+                    reactor.run_once(std::chrono::milliseconds(100));
+                for (unsigned int port = 0; port < PORTS_COUNT; port++)
+                    while (read(peers[port], drain_buffer, sizeof(drain_buffer)) > 0)
+                        ;
+            }
+            transports.clear();
+            for (unsigned int port = 0; port < PORTS_COUNT; port++)
+            {
+                int handle = streams[port]->get_file_descriptor();
+                streams[port].reset();
+                close(handle);
+                close(peers[port]);
+            }
+        }, PORTS_COUNT * request.size());
+    }
+}
+
+// Request and answer through the kernel tty layer: module ProtocolHandler on SerialStream,
+// appliance simulator in its own thread on the other side of pseudo terminal.
+// Paced variants add wire time of real UART, so they show how much the host adds on top of it.
+void register_pty_benchmarks()
+{
+    constexpr uint32_t PACING_BAUD_RATES[] = { 0, 115200, 9600 };
+    constexpr size_t STATUS_DATA_SIZE = 32;
+    for (uint32_t baud_rate : PACING_BAUD_RATES)
+    {
+        std::string name = std::string("e2e/pty/") + (baud_rate > 0 ? std::to_string(baud_rate) : std::string("unpaced"));
+        const std::vector<uint8_t> status_data(STATUS_DATA_SIZE, 0x22);
+        haier_protocol::HaierMessage request(haier_protocol::FrameType::CONTROL, 0x4D01);
+        haier_protocol::HaierMessage status(haier_protocol::FrameType::STATUS, 0x6D01, status_data.data(), status_data.size());
+        // Bytes on the line, both frames
+        std::vector<uint8_t> wire_data;
+        append_frame(wire_data, (uint8_t) haier_protocol::FrameType::CONTROL, { 0x4D, 0x01 }, true);
+        std::vector<uint8_t> status_payload = { 0x6D, 0x01 };
+        status_payload.insert(status_payload.end(), status_data.begin(), status_data.end());
+        append_frame(wire_data, (uint8_t) haier_protocol::FrameType::STATUS, status_payload, true);
+        size_t bytes_per_iteration = wire_data.size();
+        register_benchmark(name, [baud_rate, request, status](uint64_t iterations) {
+            PtyLoopback loopback(baud_rate);
+            if (!loopback.open())
+                abort();
+            SerialStream module_stream(loopback.get_port_path());
+            PtyApplianceStream& appliance_stream = loopback.get_appliance_stream();
+            haier_protocol::ProtocolHandler module(module_stream);
+            haier_protocol::ProtocolHandler appliance(appliance_stream);
+            appliance.set_message_handler(haier_protocol::FrameType::CONTROL, [&appliance, &status](haier_protocol::FrameType, const uint8_t*, size_t) {
+                appliance.send_answer(status);
+                return haier_protocol::HandlerError::HANDLER_OK;
+            });
+            uint64_t answers = 0;
+            module.set_answer_handler(haier_protocol::FrameType::CONTROL, [&answers](haier_protocol::FrameType, haier_protocol::FrameType, const uint8_t*, size_t) {
+                answers++;
+                return haier_protocol::HandlerError::HANDLER_OK;
+            });
+            module.set_cooldown_interval(0);
+            module.set_answer_timeout(10000);
+            std::atomic<bool> running(true);
+            std::thread simulator([&running, &appliance, &appliance_stream]() {
+                while (running)
+                {
+                    appliance_stream.wait_for_data(std::chrono::milliseconds(10));
+                    appliance.loop();
+                }
+            });
+            for (uint64_t i = 0; i < iterations; i++)
+            {
+                module.send_message(request, true);
+                module.loop();
+                while (answers <= i)
+                {
+                    module_stream.wait_for_data(std::chrono::milliseconds(10));
+                    module.loop();
+                }
+            }
+            running = false;
+            simulator.join();
+        }, bytes_per_iteration);
+    }
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    register_calibration_benchmark();
+    register_circular_buffer_benchmarks();
+    register_frame_benchmarks();
+    register_checksum_benchmarks();
+    register_delta_benchmarks();
+    register_transport_benchmarks();
+    register_protocol_benchmarks();
+#if __linux__
+    register_stream_benchmarks();
+    register_pty_benchmarks();
+#endif
+    return run_benchmarks(argc, argv);
+}
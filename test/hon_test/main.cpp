@@ -4,16 +4,56 @@
 #include <cstring>
 #include <thread>
 #include <chrono>
+#include <atomic>
+#include <vector>
 #include "virtual_stream.h"
 #include "protocol/haier_protocol.h"
 #include "hon_packet.h"
 #include "hon_server.h"
+#include "device_state_cache.h"
 #include "console_log.h"
 #include "test_macro.h"
 
 using namespace esphome::haier::hon_protocol;
 
-HvacFullStatus ac_full_state;
+uint8_t ac_full_state[HON_BIG_DATA_SIZE];
+
+// Layout of payload views
+constexpr uint8_t CONTROL_SAMPLE[HonControlView::SIZE] = { 0x09, 0x0C, 0x85, 0x00, 0x22, 0x81, 0x3C, 0xC7, 0x01, 0x80 };
+static_assert(HonControlConstView(CONTROL_SAMPLE).set_point() == 0x09, "set_point");
+static_assert(HonControlConstView(CONTROL_SAMPLE).vertical_swing_mode() == (uint8_t)VerticalSwingMode::AUTO, "vertical_swing_mode");
+static_assert(HonControlConstView(CONTROL_SAMPLE).fan_mode() == (uint8_t)FanMode::FAN_AUTO, "fan_mode");
+static_assert(HonControlConstView(CONTROL_SAMPLE).special_mode() == (uint8_t)SpecialMode::NONE, "special_mode");
+static_assert(HonControlConstView(CONTROL_SAMPLE).ac_mode() == (uint8_t)ConditioningMode::HEAT, "ac_mode");
+static_assert(HonControlConstView(CONTROL_SAMPLE).display_status() == 1, "display_status");
+static_assert(HonControlConstView(CONTROL_SAMPLE).use_fahrenheit() == 1, "use_fahrenheit");
+static_assert(HonControlConstView(CONTROL_SAMPLE).ac_power() == 1, "ac_power");
+static_assert(HonControlConstView(CONTROL_SAMPLE).health_mode() == 0, "health_mode");
+static_assert(HonControlConstView(CONTROL_SAMPLE).beeper_status() == 1, "beeper_status");
+static_assert(HonControlConstView(CONTROL_SAMPLE).target_humidity() == 0x3C, "target_humidity");
+static_assert(HonControlConstView(CONTROL_SAMPLE).horizontal_swing_mode() == (uint8_t)HorizontalSwingMode::AUTO, "horizontal_swing_mode");
+static_assert(HonControlConstView(CONTROL_SAMPLE).human_sensing_status() == 3, "human_sensing_status");
+static_assert(HonControlConstView(CONTROL_SAMPLE).change_filter() == 1, "change_filter");
+static_assert(HonControlConstView(CONTROL_SAMPLE).cleaning_time_status() == 1, "cleaning_time_status");
+constexpr uint8_t SENSORS_SAMPLE[HonSensorsView::SIZE] = { 0x24, 0x32, 0x4A, 0x86, 0x00, 0x83, 0x00, 0x0A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0xE8 };
+static_assert(HonSensorsConstView(SENSORS_SAMPLE).room_temperature() == 0x24, "room_temperature");
+static_assert(HonSensorsConstView(SENSORS_SAMPLE).pm2p5_level() == 2, "pm2p5_level");
+static_assert(HonSensorsConstView(SENSORS_SAMPLE).human_sensing() == 0, "human_sensing");
+static_assert(HonSensorsConstView(SENSORS_SAMPLE).ac_type() == 1, "ac_type");
+static_assert(HonSensorsConstView(SENSORS_SAMPLE).operation_source() == 3, "operation_source");
+static_assert(HonSensorsConstView(SENSORS_SAMPLE).err_confirmation() == 1, "err_confirmation");
+static_assert(HonSensorsConstView(SENSORS_SAMPLE).total_cleaning_time() == 10, "total_cleaning_time");
+static_assert(HonSensorsConstView(SENSORS_SAMPLE).co2_value() == 1000, "co2_value");
+constexpr uint8_t BIG_DATA_SAMPLE[HonBigDataView::SIZE] = { 0x01, 0x2C, 0x44, 0x4A, 0x4A, 0x4A, 0x4A, 0x32, 0x00, 0x7B, 0x01, 0x9D, 0x0F, 0xFF };
+static_assert(HonBigDataConstView(BIG_DATA_SAMPLE).power() == 300, "power");
+static_assert(HonBigDataConstView(BIG_DATA_SAMPLE).compressor_current() == 123, "compressor_current");
+static_assert(HonBigDataConstView(BIG_DATA_SAMPLE).outdoor_fan_status() == 1, "outdoor_fan_status");
+static_assert(HonBigDataConstView(BIG_DATA_SAMPLE).compressor_status() == 1, "compressor_status");
+static_assert(HonBigDataConstView(BIG_DATA_SAMPLE).indoor_fan_status() == 3, "indoor_fan_status");
+static_assert(HonBigDataConstView(BIG_DATA_SAMPLE).four_way_valve_status() == 1, "four_way_valve_status");
+static_assert(HonBigDataConstView(BIG_DATA_SAMPLE).indoor_electric_heating_status() == 2, "indoor_electric_heating_status");
+static_assert(HonBigDataConstView(BIG_DATA_SAMPLE).expansion_valve_open_degree() == 4095, "expansion_valve_open_degree");
+static_assert((HON_SENSORS_OFFSET == 10) && (HON_BIG_DATA_OFFSET == 32) && (HON_BIG_DATA_SIZE == 46), "hOn status layout");
 
 haier_protocol::FrameType expected_answers[][2] = {
 	{haier_protocol::FrameType::GET_DEVICE_VERSION, haier_protocol::FrameType::GET_DEVICE_VERSION_RESPONSE},
@@ -74,14 +114,10 @@ int main(int argc, char** argv) {
 	VirtualStream& server_stream = stream_holder.get_stream_reference(StreamDirection::DIRECTION_A);
 	VirtualStream& client_stream = stream_holder.get_stream_reference(StreamDirection::DIRECTION_B);
 	haier_protocol::ProtocolHandler hon_server(server_stream);
-	hon_server.set_message_handler(haier_protocol::FrameType::GET_DEVICE_VERSION, std::bind(get_device_version_handler, &hon_server, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
-	hon_server.set_message_handler(haier_protocol::FrameType::GET_DEVICE_ID, std::bind(get_device_id_handler, &hon_server, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
-	hon_server.set_message_handler(haier_protocol::FrameType::CONTROL, std::bind(status_request_handler, &hon_server, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
-	hon_server.set_message_handler(haier_protocol::FrameType::GET_ALARM_STATUS, std::bind(alarm_status_handler, &hon_server, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
-	hon_server.set_message_handler(haier_protocol::FrameType::GET_MANAGEMENT_INFORMATION, std::bind(get_management_information_handler, &hon_server, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
-	hon_server.set_message_handler(haier_protocol::FrameType::REPORT_NETWORK_STATUS, std::bind(report_network_status_handler, &hon_server, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+	HonServer hon_appliance;
+	hon_appliance.register_handlers(hon_server);
 	haier_protocol::ProtocolHandler hon_client(client_stream);
-	ac_full_state = get_ac_state_ref();
+	memcpy(ac_full_state, hon_appliance.get_ac_state().data(), HON_BIG_DATA_SIZE);
 	hon_client.set_default_answer_handler(client_answers_handler);
 	hon_client.set_message_handler(haier_protocol::FrameType::STATUS, std::bind(get_status_message_handler, &hon_client, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
 #if defined(RUN_ALL_TESTS) || defined(RUN_TEST1)
@@ -149,16 +185,17 @@ int main(int argc, char** argv) {
 #if defined(RUN_ALL_TESTS) || defined(RUN_TEST7)
 	{
 		TEST_START(7);
-		ac_full_state.control.ac_power = true;
-		ac_full_state.control.ac_mode = (uint8_t) ConditioningMode::HEALTHY_DRY;
-		ac_full_state.control.fan_mode = (uint8_t) FanMode::FAN_MID;
-		ac_full_state.control.horizontal_swing_mode = (uint8_t)HorizontalSwingMode::MAX_LEFT;
-		ac_full_state.control.vertical_swing_mode = (uint8_t)VerticalSwingMode::HEALTH_DOWN;
-		ac_full_state.control.display_status = 0;
-		haier_protocol::HaierMessage control_message(haier_protocol::FrameType::CONTROL, (uint16_t)SubcommandsControl::SET_GROUP_PARAMETERS, (uint8_t*)&ac_full_state.control, sizeof(HaierPacketControl));
+		HonControlView control(ac_full_state);
+		control.set_ac_power(1);
+		control.set_ac_mode((uint8_t) ConditioningMode::HEALTHY_DRY);
+		control.set_fan_mode((uint8_t) FanMode::FAN_MID);
+		control.set_horizontal_swing_mode((uint8_t)HorizontalSwingMode::MAX_LEFT);
+		control.set_vertical_swing_mode((uint8_t)VerticalSwingMode::HEALTH_DOWN);
+		control.set_display_status(0);
+		haier_protocol::HaierMessage control_message(haier_protocol::FrameType::CONTROL, (uint16_t)SubcommandsControl::SET_GROUP_PARAMETERS, control.data(), HonControlView::SIZE);
 		hon_client.send_message(control_message, true);
 		CLIENT_SERVER_LOOP();
-		if (memcmp(&ac_full_state.control, &get_ac_state_ref().control, sizeof(HaierPacketControl)) == 0) {
+		if (memcmp(control.data(), hon_appliance.get_ac_state().data(), HonControlView::SIZE) == 0) {
 			HAIER_LOGI("AC control processed correctly");
 		}
 		else {
@@ -181,6 +218,190 @@ int main(int argc, char** argv) {
 		CLIENT_SERVER_LOOP();
 		TEST_END(1, 0);
 	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST9)
+	{
+		// Request should be recorded in latency histograms
+		TEST_START(9);
+		hon_client.enable_latency_statistics();
+		const haier_protocol::LatencyStatistics* latency = hon_client.get_latency_statistics();
+		uint32_t queue_wait_before = latency->queue_wait.get_count();
+		uint32_t dispatch_delay_before = latency->dispatch_delay.get_count();
+		const haier_protocol::HaierMessage device_request_message(haier_protocol::FrameType::GET_DEVICE_ID);
+		hon_client.send_message(device_request_message, true);
+		CLIENT_SERVER_LOOP();
+		const haier_protocol::LatencyHistogram* answer_latency = latency->answer_latency.find((uint8_t) haier_protocol::FrameType::GET_DEVICE_ID);
+		if ((answer_latency == nullptr) || (answer_latency->get_count() != 1))
+			HAIER_LOGE("Answer latency is not recorded");
+		else if (answer_latency->get_percentile(99.9f) != answer_latency->get_max())
+			HAIER_LOGE("Wrong answer latency percentile");
+		else
+			HAIER_LOGI("Answer latency %uus", answer_latency->get_percentile(50.0f));
+		if (latency->queue_wait.get_count() - queue_wait_before != 1)
+			HAIER_LOGE("Queue wait is not recorded");
+		if (latency->dispatch_delay.get_count() - dispatch_delay_before != 1)
+			HAIER_LOGE("Dispatch delay is not recorded");
+		TEST_END(0, 0);
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST10)
+	{
+		// Server is not running, request with one retry should time out twice
+		TEST_START(10);
+		const haier_protocol::ProtocolStatistics& stats = hon_client.get_statistics();
+		uint32_t sent_before = stats.messages_sent.get();
+		uint32_t retries_before = stats.retries.get();
+		uint32_t timeouts_before = stats.answer_timeouts.get((uint8_t) haier_protocol::FrameType::GET_ALARM_STATUS);
+		const haier_protocol::HaierMessage alarm_status_request_message(haier_protocol::FrameType::GET_ALARM_STATUS);
+		hon_client.send_message(alarm_status_request_message, true, 1);
+		for (int i = 0; i < 4; i++) {
+			hon_client.loop();
+			std::this_thread::sleep_for(std::chrono::milliseconds(450));
+		}
+		if (stats.messages_sent.get() - sent_before != 2)
+			HAIER_LOGE("Wrong number of sent messages: %u", stats.messages_sent.get() - sent_before);
+		if (stats.retries.get() - retries_before != 1)
+			HAIER_LOGE("Wrong number of retries: %u", stats.retries.get() - retries_before);
+		if (stats.answer_timeouts.get((uint8_t) haier_protocol::FrameType::GET_ALARM_STATUS) - timeouts_before != 2)
+			HAIER_LOGE("Wrong number of answer timeouts");
+		if (stats.outgoing_queue_high_water_mark.get() < 1)
+			HAIER_LOGE("Outgoing queue high-water mark is not updated");
+		TEST_END(1, 0);
+	}
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST11)
+	{
+		// State cache: readers never see half updated snapshot, status answers fill sections
+		TEST_START(11);
+		constexpr unsigned int READERS_COUNT = 2;
+		constexpr unsigned int UPDATES_COUNT = 20000;
+		HonStateCache state_cache;
+		if ((state_cache.get_snapshot().version != 0) || state_cache.get_snapshot().is_received((size_t)HonStateSection::CONTROL))
+			HAIER_LOGE("New cache is not empty");
+		std::atomic<bool> writer_done{ false };
+		std::atomic<unsigned int> torn_snapshots{ 0 };
+		std::atomic<unsigned int> snapshots_read{ 0 };
+		std::vector<std::thread> readers;
+		for (unsigned int i = 0; i < READERS_COUNT; i++) {
+			readers.emplace_back([&]() {
+				while (!writer_done) {
+					HonStateCache::Snapshot snapshot = state_cache.get_snapshot();
+					// Every update fills the whole state with the same byte
+					const uint8_t* bytes = (const uint8_t*)&snapshot.state;
+					for (size_t j = 1; j < sizeof(snapshot.state); j++) {
+						if (bytes[j] != bytes[0]) {
+							torn_snapshots++;
+							break;
+						}
+					}
+					snapshots_read++;
+				}
+			});
+		}
+		std::vector<uint8_t> big_data_answer(2 + HON_BIG_DATA_SIZE);
+		big_data_answer[0] = 0x7D;
+		big_data_answer[1] = 0x01;
+		for (unsigned int i = 1; i <= UPDATES_COUNT; i++) {
+			memset(big_data_answer.data() + 2, (uint8_t)i, HON_BIG_DATA_SIZE);
+			state_cache.process_status(big_data_answer.data(), big_data_answer.size());
+		}
+		writer_done = true;
+		for (std::thread& reader : readers)
+			reader.join();
+		if (torn_snapshots != 0)
+			HAIER_LOGE("%u of %u snapshots were inconsistent", torn_snapshots.load(), snapshots_read.load());
+		if (state_cache.get_version() != UPDATES_COUNT)
+			HAIER_LOGE("Wrong cache version %u", state_cache.get_version());
+		HAIER_LOGI("%u snapshots read during %u updates", snapshots_read.load(), UPDATES_COUNT);
+		// Real answers: user data updates control and sensors, big data keeps its old time
+		// Requests of test 10 were sent while the server was not running
+		uint8_t stale_requests[256];
+		while (server_stream.available() > 0)
+			server_stream.read_array(stale_requests, sizeof(stale_requests));
+		HonStateCache answers_cache;
+		answers_cache.register_handler(hon_client, client_answers_handler);
+		// Change handler gets only sections with changed fields
+		unsigned int section_changes[HON_STATE_SECTIONS_COUNT] = { 0 };
+		answers_cache.set_change_handler([&section_changes](size_t section, const haier_protocol::PayloadDelta&, const haier_protocol::FieldChange*, size_t) {
+			section_changes[section]++;
+		});
+		const haier_protocol::HaierMessage status_request_message(haier_protocol::FrameType::CONTROL, (uint16_t)SubcommandsControl::GET_USER_DATA);
+		hon_client.send_message(status_request_message, true);
+		CLIENT_SERVER_LOOP();
+		HonStateCache::Snapshot snapshot = answers_cache.get_snapshot();
+		if (snapshot.version != 1)
+			HAIER_LOGE("Status answer is not cached, version %u", snapshot.version);
+		else if (memcmp(snapshot.state.control, hon_appliance.get_ac_state().data(), HonControlView::SIZE) != 0)
+			HAIER_LOGE("Cached control doesn't match appliance state");
+		if (!snapshot.is_received((size_t)HonStateSection::SENSORS) || snapshot.is_received((size_t)HonStateSection::BIG_DATA))
+			HAIER_LOGE("Wrong sections received by user data answer");
+		if (snapshot.is_stale((size_t)HonStateSection::CONTROL, std::chrono::seconds(1)) || !snapshot.is_stale((size_t)HonStateSection::BIG_DATA, std::chrono::hours(24)))
+			HAIER_LOGE("Wrong staleness of cached sections");
+		// Next request is sent after the cooldown interval
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		const haier_protocol::HaierMessage big_data_request_message(haier_protocol::FrameType::CONTROL, (uint16_t)SubcommandsControl::GET_BIG_DATA);
+		hon_client.send_message(big_data_request_message, true);
+		CLIENT_SERVER_LOOP();
+		snapshot = answers_cache.get_snapshot();
+		if ((snapshot.version != 2) || !snapshot.is_received((size_t)HonStateSection::BIG_DATA))
+			HAIER_LOGE("Big data answer is not cached");
+		if ((section_changes[(size_t)HonStateSection::CONTROL] != 1) || (section_changes[(size_t)HonStateSection::SENSORS] != 1) || (section_changes[(size_t)HonStateSection::BIG_DATA] != 1))
+			HAIER_LOGE("Wrong change events: %u %u %u", section_changes[0], section_changes[1], section_changes[2]);
+		hon_client.set_answer_handler(haier_protocol::FrameType::CONTROL, client_answers_handler);
+		TEST_END(0, 0);
+	}
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST12)
+	{
+		// Views read cached state in place and give the same bytes as bit field structures of this compiler
+		TEST_START(12);
+		HaierPacketControl control;
+		memset(&control, 0, sizeof(control));
+		control.set_point = 0x0A;
+		control.fan_mode = (uint8_t)FanMode::FAN_LOW;
+		control.special_mode = (uint8_t)SpecialMode::PREGNANT;
+		control.ac_mode = (uint8_t)ConditioningMode::FAN;
+		control.pmv_status = 1;
+		control.steri_clean = 1;
+		control.quiet_mode = 1;
+		control.lock_remote = 1;
+		control.horizontal_swing_mode = (uint8_t)HorizontalSwingMode::MAX_RIGHT;
+		control.human_sensing_status = 2;
+		control.energy_saving_status = 1;
+		uint8_t payload[HonControlView::SIZE] = { 0 };
+		HonControlView view(payload);
+		view.set_set_point(0x0A);
+		view.set_fan_mode((uint8_t)FanMode::FAN_LOW);
+		view.set_special_mode((uint8_t)SpecialMode::PREGNANT);
+		view.set_ac_mode((uint8_t)ConditioningMode::FAN);
+		view.set_pmv_status(1);
+		view.set_steri_clean(1);
+		view.set_quiet_mode(1);
+		view.set_lock_remote(1);
+		view.set_horizontal_swing_mode((uint8_t)HorizontalSwingMode::MAX_RIGHT);
+		view.set_human_sensing_status(2);
+		view.set_energy_saving_status(1);
+		if ((sizeof(control) != HonControlView::SIZE) || (memcmp(&control, payload, HonControlView::SIZE) != 0))
+			HAIER_LOGE("Control view doesn't match HaierPacketControl");
+		// Setter changes only bits of its field
+		view.set_ac_mode(0xFF);
+		if ((view.ac_mode() != 0x07) || (view.fan_mode() != (uint8_t)FanMode::FAN_LOW) || (view.special_mode() != (uint8_t)SpecialMode::PREGNANT))
+			HAIER_LOGE("Field setter changed other fields");
+		HonStateCache state_cache;
+		uint8_t status[2 + HON_BIG_DATA_SIZE] = { 0x7D, 0x01 };
+		HonStatusView status_view(status + 2);
+		memcpy(status_view.control().data(), CONTROL_SAMPLE, HonControlView::SIZE);
+		memcpy(status_view.sensors().data(), SENSORS_SAMPLE, HonSensorsView::SIZE);
+		memcpy(status_view.big_data().data(), BIG_DATA_SAMPLE, HonBigDataView::SIZE);
+		state_cache.process_status(status, sizeof(status));
+		HonStateCache::Snapshot snapshot = state_cache.get_snapshot();
+		if ((snapshot.state.get_control().ac_mode() != (uint8_t)ConditioningMode::HEAT) || (snapshot.state.get_sensors().co2_value() != 1000) ||
+			(snapshot.state.get_big_data().power() != 300))
+			HAIER_LOGE("Wrong fields of cached state");
+		TEST_END(0, 0);
+	}
 #endif
 	HAIER_LOGI("All tests successfully finished!");
 }
@@ -1,14 +1,32 @@
 #include <stdint.h>
 #include <iostream>
 #include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <set>
 #include "utils/circular_buffer.h"
 #include "utils/protocol_stream.h"
 #include "utils/haier_log.h"
 #include "utils/circular_buffer.h"
 #include "transport/haier_frame.h"
 #include "transport/protocol_transport.h"
+#include "utils/latency_histogram.h"
 #include "console_log.h"
 #include "test_macro.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "protocol/haier_protocol.h"
+#include "utils/payload_delta.h"
+#include "protocol/poll_scheduler.h"
+#if __linux__
+#include <chrono>
+#include <unistd.h>
+#include "protocol/haier_protocol.h"
+#include "utils/socket_stream.h"
+#include "utils/uring_stream.h"
+#include <sys/socket.h>
+#endif
 
 class TestStream : public haier_protocol::ProtocolStream
 {
@@ -49,6 +67,64 @@ void TestStream::addBuffer(uint8_t* buf, size_t size)
     mBuffer.push(buf, size);
 }
 
+// Keeps everything protocol handler sends, nothing to read
+class CaptureStream : public haier_protocol::ProtocolStream
+{
+public:
+    virtual size_t      available() noexcept { return 0; };
+    virtual size_t      read_array(uint8_t*, size_t) noexcept { return 0; };
+    virtual void        write_array(const uint8_t* data, size_t len) noexcept { mData.insert(mData.end(), data, data + len); };
+    const std::vector<uint8_t>& get_data() const { return mData; };
+private:
+    std::vector<uint8_t> mData;
+};
+
+// One side of in-memory link, the other side reads what this one writes
+class LoopbackStream : public haier_protocol::ProtocolStream
+{
+public:
+    LoopbackStream(CircularBuffer<uint8_t>& tx_buffer, CircularBuffer<uint8_t>& rx_buffer) : mTxBuffer(tx_buffer), mRxBuffer(rx_buffer) {};
+    virtual size_t      available() noexcept { return mRxBuffer.get_size(); };
+    virtual size_t      read_array(uint8_t* data, size_t len) noexcept { return mRxBuffer.pop(data, std::min(len, mRxBuffer.get_size())); };
+    virtual void        write_array(const uint8_t* data, size_t len) noexcept { mTxBuffer.push(data, len); };
+private:
+    CircularBuffer<uint8_t>&    mTxBuffer;
+    CircularBuffer<uint8_t>&    mRxBuffer;
+};
+
+// Shared line of multi-unit bus, everything that one node writes is received by all other nodes
+class BusStream : public haier_protocol::ProtocolStream
+{
+public:
+    explicit BusStream(std::vector<BusStream*>& bus) : mBus(bus), mRxBuffer(1000) { mBus.push_back(this); };
+    virtual size_t      available() noexcept { return mRxBuffer.get_size(); };
+    virtual size_t      read_array(uint8_t* data, size_t len) noexcept { return mRxBuffer.pop(data, std::min(len, mRxBuffer.get_size())); };
+    virtual void        write_array(const uint8_t* data, size_t len) noexcept;
+private:
+    std::vector<BusStream*>&    mBus;
+    CircularBuffer<uint8_t>     mRxBuffer;
+};
+
+void BusStream::write_array(const uint8_t* data, size_t len) noexcept
+{
+    for (BusStream* node : mBus)
+        if (node != this)
+            node->mRxBuffer.push(data, len);
+}
+
+#if __linux__
+void run_loops(haier_protocol::ProtocolHandler& handler1, haier_protocol::ProtocolHandler& handler2, const bool& stop_flag)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (!stop_flag && (std::chrono::steady_clock::now() < deadline))
+    {
+        handler1.loop();
+        handler2.loop();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+#endif
+
 int main()
 {
     haier_protocol::set_log_handler(console_logger);
@@ -156,6 +232,748 @@ int main()
             HAIER_LOGE("Buffers don't match!");
         TEST_END(0, 0);
     }
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST9)
+    {
+        TEST_START(9);
+        haier_protocol::TimestampedFrame tsframe;
+        // Wrong post separator byte, warning should be filtered out by runtime log level
+        uint8_t buffer[] = { 0xFF, 0xFF, 0x0E, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x55, 0xFF, 0x55, 0xFF, 0x54, 0x05, 0xFF, 0x55, 0xFF, 0x55, 0x08, 0xFF, 0x55, 0xD0, 0x8E};
+        haier_protocol::set_log_level(haier_protocol::HaierLogLevel::LEVEL_ERROR);
+        stream.addBuffer(buffer, sizeof(buffer));
+        transport.read_data();
+        transport.process_data();
+        transport.pop(tsframe);
+        // Arguments of the filtered messages shouldn't be evaluated
+        unsigned int evaluations = 0;
+        HAIER_LOGW("Lazy argument %u", ++evaluations);
+        haier_protocol::set_log_level(HAIER_LOG_TAG, haier_protocol::HaierLogLevel::LEVEL_INFO);
+        HAIER_LOGD("Lazy argument %u", ++evaluations);
+        HAIER_LOGI("Lazy argument %u", ++evaluations);
+        haier_protocol::set_log_level(HAIER_LOG_TAG, haier_protocol::HaierLogLevel::LEVEL_VERBOSE);
+        haier_protocol::set_log_level(haier_protocol::HaierLogLevel::LEVEL_VERBOSE);
+        if (evaluations != 1)
+            HAIER_LOGE("Log arguments evaluated %u times, expected 1", evaluations);
+        TEST_END(0, 0);
+    }
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST10)
+    {
+        TEST_START(10);
+        // Hex dump should match byte by byte formatting for all sizes (vectorized and tail parts)
+        uint8_t data[100];
+        char expected[sizeof(data) * 3 + 1];
+        char result[sizeof(data) * 3 + 1];
+        for (size_t i = 0; i < sizeof(data); i++)
+            data[i] = (uint8_t) (i * 73 + 11);
+        for (size_t size = 0; size <= sizeof(data); size++)
+        {
+            size_t pos = 0;
+            expected[0] = '\0';
+            for (size_t i = 0; i < size; i++)
+                pos += snprintf(expected + pos, sizeof(expected) - pos, i == 0 ? "%02X" : " %02X", data[i]);
+            if (buf_to_hex(data, size) != expected)
+                HAIER_LOGE("buf_to_hex mismatch for size %u", (unsigned int) size);
+            if ((buf_to_hex(data, size, result, sizeof(result)) != pos) || (strcmp(result, expected) != 0))
+                HAIER_LOGE("buf_to_hex (caller buffer) mismatch for size %u", (unsigned int) size);
+        }
+        // Truncation to whole bytes
+        if ((buf_to_hex(data, 20, result, 31) != 29) || (strncmp(result, expected, 29) != 0) || (result[29] != '\0'))
+            HAIER_LOGE("buf_to_hex truncation failed");
+        TEST_END(0, 0);
+    }
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST11)
+    {
+        TEST_START(11);
+        haier_protocol::TimestampedFrame tsframe;
+        // Wrong post separator byte should be kept by flight recorder, counted in statistics and fire error trigger
+        uint8_t buffer[] = { 0xFF, 0xFF, 0x0E, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x55, 0xFF, 0x55, 0xFF, 0x54, 0x05, 0xFF, 0x55, 0xFF, 0x55, 0x08, 0xFF, 0x55, 0xD0, 0x8E};
+        unsigned int triggers = 0;
+        transport.get_flight_recorder().set_error_trigger([&triggers](const haier_protocol::FlightRecorder&, const haier_protocol::FlightRecord& record) {
+            if (record.event == haier_protocol::FlightEvent::FRAME_ERROR)
+                ++triggers;
+        });
+        const haier_protocol::TransportStatistics& stats = transport.get_statistics();
+        uint32_t errors_before = stats.frame_errors[(size_t) haier_protocol::FrameError::WRONG_POST_SEPARATOR_BYTE].get();
+        uint32_t bytes_read_before = stats.bytes_read.get();
+        uint32_t events_before = transport.get_flight_recorder().get_events_count();
+        stream.addBuffer(buffer, sizeof(buffer));
+        transport.read_data();
+        transport.process_data();
+        transport.pop(tsframe);
+        transport.get_flight_recorder().reset_error_trigger();
+        haier_protocol::FlightRecord records[haier_protocol::FlightRecorder::get_capacity()];
+        size_t count = transport.get_flight_recorder().snapshot(records, haier_protocol::FlightRecorder::get_capacity());
+        bool found = false;
+        for (size_t i = 0; i < count; i++)
+            if ((records[i].event == haier_protocol::FlightEvent::FRAME_ERROR) && (records[i].error == (uint8_t) haier_protocol::FrameError::WRONG_POST_SEPARATOR_BYTE))
+                found = true;
+        if (transport.get_flight_recorder().get_events_count() == events_before)
+            HAIER_LOGE("No events recorded");
+        if (!found)
+            HAIER_LOGE("Frame error is not found in flight recorder");
+        if (triggers != 1)
+            HAIER_LOGE("Error trigger fired %u times, expected 1", triggers);
+        if (stats.frame_errors[(size_t) haier_protocol::FrameError::WRONG_POST_SEPARATOR_BYTE].get() - errors_before != 1)
+            HAIER_LOGE("Frame error is not counted in statistics");
+        if (stats.bytes_read.get() - bytes_read_before != sizeof(buffer))
+            HAIER_LOGE("Wrong number of bytes read in statistics");
+        if (stats.bytes_dropped.get() == 0)
+            HAIER_LOGE("Dropped bytes are not counted in statistics");
+        transport.get_flight_recorder().dump(haier_protocol::HaierLogLevel::LEVEL_INFO);
+        TEST_END(1, 0);
+    }
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST12)
+    {
+        TEST_START(12);
+        // Bucket bounds should cover the value with less than 12.5% error
+        for (uint32_t value = 1; value != 0; value = value < 0x100 ? value + 1 : value + (value >> 7) + 1)
+        {
+            size_t index = haier_protocol::LatencyHistogram::get_bucket_index(value);
+            uint32_t upper_bound = haier_protocol::LatencyHistogram::get_bucket_upper_bound(index);
+            if ((index >= haier_protocol::LatencyHistogram::BUCKETS_COUNT) || (upper_bound < value) || (upper_bound - value > value / 8) ||
+                ((index > 0) && (haier_protocol::LatencyHistogram::get_bucket_upper_bound(index - 1) >= value)))
+            {
+                HAIER_LOGE("Wrong histogram bucket %u for value %u", (unsigned int) index, value);
+                break;
+            }
+            if (value > UINT32_MAX - (value >> 7) - 1)
+                break;
+        }
+        haier_protocol::LatencyHistogram histogram;
+        if (histogram.get_percentile(50.0f) != 0)
+            HAIER_LOGE("Empty histogram percentile should be 0");
+        for (uint32_t value = 1; value <= 10000; value++)
+            histogram.record(value);
+        uint32_t p50 = histogram.get_percentile(50.0f);
+        uint32_t p99 = histogram.get_percentile(99.0f);
+        uint32_t p999 = histogram.get_percentile(99.9f);
+        if ((histogram.get_count() != 10000) || (p50 < 5000) || (p50 > 5000 + 5000 / 8) || (p99 < 9900) || (p999 < 9990) || (p999 > histogram.get_max()))
+            HAIER_LOGE("Wrong histogram percentiles p50=%u p99=%u p999=%u", p50, p99, p999);
+        haier_protocol::LatencyHistogram merged;
+        merged.record(20000);
+        merged.merge(histogram);
+        if ((merged.get_count() != 10001) || (merged.get_max() != 20000) || (merged.get_percentile(50.0f) != p50))
+            HAIER_LOGE("Wrong merged histogram count=%u max=%u", merged.get_count(), merged.get_max());
+        TEST_END(0, 0);
+    }
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST13)
+    {
+        TEST_START(13);
+        // Free segments when data wraps around the end of circular buffer
+        CircularBuffer<uint8_t> buffer(CircularBuffer<uint8_t>::CIRCULAR_BUFFER_MINIMUM_SIZE);
+        const size_t capacity = buffer.get_capacity();
+        uint8_t data[CircularBuffer<uint8_t>::CIRCULAR_BUFFER_MINIMUM_SIZE];
+        for (size_t i = 0; i < capacity; i++)
+            data[i] = (uint8_t) i;
+        buffer.push(data, capacity - 10);
+        buffer.drop(capacity - 20);
+        uint8_t* segment1;
+        uint8_t* segment2;
+        size_t size1, size2;
+        size_t space = buffer.get_free_segments(segment1, size1, segment2, size2);
+        if ((space != capacity - 10) || (size1 != 10) || (size2 != capacity - 20))
+            HAIER_LOGE("Wrong free segments: space=%d size1=%d size2=%d", (int) space, (int) size1, (int) size2);
+        memcpy(segment1, data, size1);
+        memcpy(segment2, data + size1, 5);
+        if ((buffer.commit(size1 + 5) != size1 + 5) || (buffer.get_size() != 25) || (buffer[10] != 0) || (buffer[24] != 14))
+            HAIER_LOGE("Wrong buffer content after commit");
+        if ((buffer.get_free_segments(segment1, size1, segment2, size2) != capacity - 25) || (size2 != 0) || (buffer.commit(capacity) != capacity - 25))
+            HAIER_LOGE("Wrong free segments after commit");
+        if ((buffer.get_free_segments(segment1, size1, segment2, size2) != 0) || (size1 != 0) || (size2 != 0) || (buffer.commit(1) != 0))
+            HAIER_LOGE("Full buffer should not have free segments");
+        // Stored data starts 20 items before the end and wraps around
+        const uint8_t* data1;
+        const uint8_t* data2;
+        if ((buffer.get_data_segments(data1, size1, data2, size2) != capacity) || (size1 != 20) || (size2 != capacity - 20) || (data1[0] != (uint8_t) (capacity - 20)) || (data2[0] != 10))
+            HAIER_LOGE("Wrong data segments: size1=%d size2=%d", (int) size1, (int) size2);
+        buffer.drop(size1);
+        if ((buffer.get_data_segments(data1, size1, data2, size2) != capacity - 20) || (size1 != capacity - 20) || (size2 != 0))
+            HAIER_LOGE("Wrong data segments after drop");
+        buffer.clear();
+        if ((buffer.get_data_segments(data1, size1, data2, size2) != 0) || (size1 != 0) || (size2 != 0))
+            HAIER_LOGE("Empty buffer should not have data segments");
+        TEST_END(0, 0);
+    }
+#endif
+#if __linux__ && (defined(RUN_ALL_TESTS) || defined(RUN_TEST14))
+    {
+        TEST_START(14);
+        // Socket streams: protocol over Unix and TCP sockets, write queue and reconnection
+        std::string socket_path = "/tmp/haier_test_" + std::to_string(getpid()) + ".sock";
+        haier_protocol::SocketStream appliance_stream;
+        haier_protocol::SocketStream module_stream;
+        // Only socket file left by previous run is removed, not a file that happens to have the same path
+        FILE* file = fopen(socket_path.c_str(), "w");
+        if (file != nullptr)
+            fclose(file);
+        if (appliance_stream.listen_unix(socket_path.c_str()) || (access(socket_path.c_str(), F_OK) != 0))
+            HAIER_LOGE("Regular file was replaced by socket");
+        unlink(socket_path.c_str());
+        if (!appliance_stream.listen_unix(socket_path.c_str()) || !module_stream.connect_unix(socket_path.c_str()))
+            HAIER_LOGE("Can't connect Unix socket %s", socket_path.c_str());
+        haier_protocol::ProtocolHandler module(module_stream);
+        haier_protocol::ProtocolHandler appliance(appliance_stream);
+        unsigned int answers = 0;
+        bool answer_received = false;
+        appliance.set_message_handler(haier_protocol::FrameType::GET_DEVICE_VERSION,
+            [&appliance](haier_protocol::FrameType, const uint8_t*, size_t) {
+                appliance.send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::GET_DEVICE_VERSION_RESPONSE));
+                return haier_protocol::HandlerError::HANDLER_OK;
+            });
+        module.set_answer_handler(haier_protocol::FrameType::GET_DEVICE_VERSION,
+            [&answers, &answer_received](haier_protocol::FrameType, haier_protocol::FrameType type, const uint8_t*, size_t) {
+                answer_received = type == haier_protocol::FrameType::GET_DEVICE_VERSION_RESPONSE;
+                answers++;
+                return haier_protocol::HandlerError::HANDLER_OK;
+            });
+        module.send_message(haier_protocol::HaierMessage(haier_protocol::FrameType::GET_DEVICE_VERSION), true);
+        run_loops(module, appliance, answer_received);
+        if (!answer_received)
+            HAIER_LOGE("No answer over Unix socket");
+        // Client is gone, server waits for the next one
+        module_stream.close();
+        appliance_stream.process_events();
+        if (appliance_stream.get_state() != haier_protocol::SocketState::LISTENING)
+            HAIER_LOGE("Server didn't return to listening state");
+        // The same over TCP, client starts writing before connection is established
+        if (!appliance_stream.listen_tcp(0, "127.0.0.1") || !module_stream.connect_tcp("127.0.0.1", appliance_stream.get_port()))
+            HAIER_LOGE("Can't connect TCP socket");
+        answer_received = false;
+        module.send_message(haier_protocol::HaierMessage(haier_protocol::FrameType::GET_DEVICE_VERSION), true);
+        run_loops(module, appliance, answer_received);
+        if (!answer_received || (answers != 2))
+            HAIER_LOGE("No answer over TCP socket");
+        // Peer doesn't read: kernel buffers fill up, then writes are queued, then the queue is full
+        uint8_t chunk[0x4000];
+        size_t accepted = 0;
+        long res = 0;
+        while (accepted < (64 << 20))
+        {
+            for (size_t i = 0; i < sizeof(chunk); i++)
+                chunk[i] = (uint8_t) ((accepted + i) * 7);
+            res = module_stream.write_some(chunk, sizeof(chunk));
+            if (res <= 0)
+                break;
+            accepted += res;
+        }
+        if ((res != 0) || (module_stream.get_pending_write_size() == 0) || !module_stream.wants_write())
+            HAIER_LOGE("Write was not queued: accepted %u, pending %u", (unsigned int) accepted, (unsigned int) module_stream.get_pending_write_size());
+        module_stream.write_array(chunk, 16);
+        if (module_stream.get_dropped_bytes() != 16)
+            HAIER_LOGE("Wrong number of dropped bytes: %u", (unsigned int) module_stream.get_dropped_bytes());
+        // Queued data arrives in order when the peer reads
+        size_t received_size = 0;
+        bool data_valid = true;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while ((received_size < accepted) && (std::chrono::steady_clock::now() < deadline))
+        {
+            module_stream.process_events();
+            size_t size = appliance_stream.read_into(chunk, sizeof(chunk), nullptr, 0);
+            for (size_t i = 0; i < size; i++)
+                data_valid = data_valid && (chunk[i] == (uint8_t) ((received_size + i) * 7));
+            received_size += size;
+        }
+        if ((received_size != accepted) || !data_valid || (module_stream.get_pending_write_size() != 0))
+            HAIER_LOGE("Queued data was not delivered: %u of %u bytes", (unsigned int) received_size, (unsigned int) accepted);
+        TEST_END(2, 0);
+    }
+#endif
+#if __linux__ && (defined(RUN_ALL_TESTS) || defined(RUN_TEST15))
+    {
+        TEST_START(15);
+        // Shared reactor: frames split between reads, back to back frames, writes and closed peer for every backend
+        constexpr size_t PORTS_COUNT = 4;
+        const haier_protocol::ReactorBackend backends[] = { haier_protocol::ReactorBackend::IO_URING, haier_protocol::ReactorBackend::EPOLL, haier_protocol::ReactorBackend::POLLING };
+        const uint8_t frame_data[] = { 0x6D, 0x01, 0xFF, 0x02, 0x03 };
+        haier_protocol::HaierFrame frame(0x61, frame_data, sizeof(frame_data), true);
+        std::vector<uint8_t> frame_buffer(frame.get_buffer_size());
+        frame.fill_buffer(frame_buffer.data(), frame_buffer.size());
+        for (haier_protocol::ReactorBackend backend : backends)
+        {
+            haier_protocol::UringReactor reactor;
+            haier_protocol::ReactorBackend used_backend = reactor.init(PORTS_COUNT, backend);
+            HAIER_LOGI("Reactor backend %d, requested %d", (int) used_backend, (int) backend);
+            int peers[PORTS_COUNT];
+            std::vector<std::unique_ptr<haier_protocol::UringStream>> streams;
+            std::vector<std::unique_ptr<haier_protocol::TransportLevelHandler>> transports;
+            size_t frames_received[PORTS_COUNT] = { 0 };
+            bool frames_valid = true;
+            for (size_t i = 0; i < PORTS_COUNT; i++)
+            {
+                int pair[2];
+                if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) != 0)
+                    HAIER_LOGE("Can't create socket pair");
+                peers[i] = pair[1];
+                streams.emplace_back(new haier_protocol::UringStream(reactor, pair[0]));
+                transports.emplace_back(new haier_protocol::TransportLevelHandler(*streams.back(), haier_protocol::MAX_FRAME_SIZE + 10));
+                haier_protocol::TransportLevelHandler& transport = *transports.back();
+                size_t& counter = frames_received[i];
+                streams.back()->set_data_handler([&transport, &counter, &frames_valid, &frame_data](haier_protocol::UringStream&) {
+                    transport.read_data();
+                    transport.process_data();
+                    haier_protocol::TimestampedFrame received;
+                    while (transport.pop(received))
+                    {
+                        counter++;
+                        frames_valid = frames_valid && (received.frame.get_frame_type() == 0x61) && (received.frame.get_data_size() == sizeof(frame_data)) &&
+                            (memcmp(received.frame.get_data(), frame_data, sizeof(frame_data)) == 0);
+                    }
+                });
+            }
+            auto run_until = [&reactor](std::function<bool()> condition) {
+                auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+                while (!condition() && (std::chrono::steady_clock::now() < deadline))
+                    reactor.run_once(std::chrono::milliseconds(10));
+            };
+            auto all_received = [&frames_received](size_t count) {
+                for (size_t received : frames_received)
+                    if (received < count)
+                        return false;
+                return true;
+            };
+            for (size_t i = 0; i < PORTS_COUNT; i++)
+                (void) !write(peers[i], frame_buffer.data(), 7);
+            reactor.run_once(std::chrono::milliseconds(10));
+            for (size_t i = 0; i < PORTS_COUNT; i++)
+            {
+                (void) !write(peers[i], frame_buffer.data() + 7, frame_buffer.size() - 7);
+                std::vector<uint8_t> two_frames(frame_buffer);
+                two_frames.insert(two_frames.end(), frame_buffer.begin(), frame_buffer.end());
+                (void) !write(peers[i], two_frames.data(), two_frames.size());
+            }
+            run_until([&all_received]() { return all_received(3); });
+            if (!all_received(3) || !frames_valid)
+                HAIER_LOGE("Frames were not received with backend %d", (int) used_backend);
+            // Writes from all streams
+            for (size_t i = 0; i < PORTS_COUNT; i++)
+                streams[i]->write_array(frame_buffer.data(), frame_buffer.size());
+            std::vector<uint8_t> peer_data[PORTS_COUNT];
+            run_until([&peers, &peer_data, &frame_buffer]() {
+                bool done = true;
+                for (size_t i = 0; i < PORTS_COUNT; i++)
+                {
+                    uint8_t buffer[256];
+                    ssize_t size = read(peers[i], buffer, sizeof(buffer));
+                    if (size > 0)
+                        peer_data[i].insert(peer_data[i].end(), buffer, buffer + size);
+                    done = done && (peer_data[i].size() >= frame_buffer.size());
+                }
+                return done;
+            });
+            for (size_t i = 0; i < PORTS_COUNT; i++)
+                if (peer_data[i] != frame_buffer)
+                    HAIER_LOGE("Stream %u wrote %u bytes instead of %u", (unsigned int) i, (unsigned int) peer_data[i].size(), (unsigned int) frame_buffer.size());
+            // Closed peer is reported to the handler
+            close(peers[0]);
+            run_until([&streams]() { return !streams[0]->is_open(); });
+            if (streams[0]->is_open() || !streams[1]->is_open())
+                HAIER_LOGE("Closed peer was not detected with backend %d", (int) used_backend);
+            transports.clear();
+            for (size_t i = 0; i < PORTS_COUNT; i++)
+            {
+                int handle = streams[i]->get_file_descriptor();
+                streams[i].reset();
+                close(handle);
+                if (i > 0)
+                    close(peers[i]);
+            }
+        }
+        TEST_END(0, 0);
+    }
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST16)
+    {
+        TEST_START(16);
+        // Thread safe message intake: several threads post while another one runs the loop
+        constexpr unsigned int PRODUCERS_COUNT = 4;
+        constexpr unsigned int MESSAGES_PER_PRODUCER = 100;
+        CaptureStream capture_stream;
+        haier_protocol::ProtocolHandler handler(capture_stream);
+        handler.set_cooldown_interval(0);
+        if (handler.post_message_without_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::CONTROL), true))
+            HAIER_LOGE("Message was posted without intake");
+        std::atomic<unsigned int> wakeups(0);
+        handler.enable_message_intake(8, [&wakeups]() { wakeups++; });
+        std::atomic<unsigned int> producers_finished(0);
+        std::atomic<unsigned int> rejected(0);
+        std::vector<std::thread> producers;
+        for (unsigned int producer = 0; producer < PRODUCERS_COUNT; producer++)
+        {
+            producers.emplace_back([&handler, &producers_finished, &rejected, producer]() {
+                for (unsigned int i = 0; i < MESSAGES_PER_PRODUCER; i++)
+                {
+                    const uint8_t data[] = { (uint8_t) producer, (uint8_t) i };
+                    haier_protocol::HaierMessage message(haier_protocol::FrameType::CONTROL, data, sizeof(data));
+                    // Full intake is expected sometimes, producer tries again
+                    while (!handler.post_message_without_answer(message, true))
+                    {
+                        rejected++;
+                        std::this_thread::yield();
+                    }
+                }
+                producers_finished++;
+            });
+        }
+        const unsigned int total = PRODUCERS_COUNT * MESSAGES_PER_PRODUCER;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while ((handler.get_statistics().messages_sent.get() < total) && (std::chrono::steady_clock::now() < deadline))
+            handler.loop();
+        for (std::thread& producer : producers)
+            producer.join();
+        if ((producers_finished != PRODUCERS_COUNT) || (handler.get_statistics().messages_sent.get() != total) || (wakeups != total))
+            HAIER_LOGE("Posted messages were not sent: %u sent, %u wakeups", handler.get_statistics().messages_sent.get(), wakeups.load());
+        // Messages of every producer go out in posting order
+        TestStream parse_stream;
+        haier_protocol::TransportLevelHandler parser(parse_stream, haier_protocol::MAX_FRAME_SIZE + 10);
+        const std::vector<uint8_t>& sent = capture_stream.get_data();
+        unsigned int next_message[PRODUCERS_COUNT] = { 0 };
+        unsigned int frames_count = 0;
+        size_t position = 0;
+        while (position < sent.size())
+        {
+            size_t size = std::min((size_t) 256, sent.size() - position);
+            parse_stream.addBuffer(const_cast<uint8_t*>(sent.data()) + position, size);
+            position += size;
+            // Transport buffer holds only a few frames, read until the chunk is parsed
+            bool frame_found = true;
+            while (frame_found)
+            {
+                parser.read_data();
+                parser.process_data();
+                haier_protocol::TimestampedFrame frame;
+                frame_found = false;
+                while (parser.pop(frame))
+                {
+                    const uint8_t* data = frame.frame.get_data();
+                    if ((frame.frame.get_data_size() != 2) || (data[0] >= PRODUCERS_COUNT) || (data[1] != next_message[data[0]]))
+                        HAIER_LOGE("Unexpected message in position %u", frames_count);
+                    else
+                        next_message[data[0]]++;
+                    frames_count++;
+                    frame_found = true;
+                }
+            }
+        }
+        if (frames_count != total)
+            HAIER_LOGE("Wrong number of frames sent: %u", frames_count);
+        HAIER_LOGI("%u messages posted by %u threads, intake was full %u times", total, PRODUCERS_COUNT, rejected.load());
+        TEST_END(0, 0);
+    }
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST17)
+    {
+        TEST_START(17);
+        // Changed byte mask matches plain byte compare for all sizes and change positions
+        uint8_t previous[haier_protocol::MAX_DELTA_PAYLOAD_SIZE];
+        uint8_t current[haier_protocol::MAX_DELTA_PAYLOAD_SIZE];
+        uint32_t changed_mask[haier_protocol::DELTA_MASK_WORDS];
+        unsigned int mask_errors = 0;
+        for (size_t size = 1; size <= sizeof(previous); size++)
+        {
+            for (size_t i = 0; i < size; i++)
+                previous[i] = (uint8_t)(i * 7 + size);
+            memcpy(current, previous, size);
+            if (haier_protocol::find_changed_bytes(previous, current, size, changed_mask))
+                mask_errors++;
+            // Change first, last and one byte in the middle
+            size_t positions[] = { 0, size / 2, size - 1 };
+            for (size_t position : positions)
+                current[position] ^= 0x10;
+            if (!haier_protocol::find_changed_bytes(previous, current, size, changed_mask))
+                mask_errors++;
+            for (size_t i = 0; i < size; i++)
+            {
+                bool changed = (changed_mask[i / 32] & (1u << (i % 32))) != 0;
+                if (changed != (previous[i] != current[i]))
+                    mask_errors++;
+            }
+        }
+        if (mask_errors != 0)
+            HAIER_LOGE("Changed bytes mask is wrong %u times", mask_errors);
+        // Fields: bit fields share byte 1, 16 bit field is reported once
+        const haier_protocol::PayloadField fields[] = {
+            { "mode", 1, 1, 0x07 },
+            { "power", 1, 1, 0x80 },
+            { "counter", 20, 2, 0xFF },
+            { "last", 39, 1, 0xFF },
+        };
+        haier_protocol::PayloadDelta delta(fields, sizeof(fields) / sizeof(fields[0]), 40);
+        uint8_t old_payload[40] = { 0 };
+        uint8_t new_payload[40] = { 0 };
+        haier_protocol::FieldChange changes[8];
+        if (delta.compare(old_payload, new_payload, changes, 8) != 0)
+            HAIER_LOGE("Changes found in equal payloads");
+        new_payload[1] = 0x05 | 0x40;   // mode changed, power is not, 0x40 is not a field
+        new_payload[20] = 0x12;
+        new_payload[21] = 0x34;
+        new_payload[30] = 0xFF;         // not covered by fields
+        new_payload[39] = 0x01;
+        size_t count = delta.compare(old_payload, new_payload, changes, 8);
+        if ((count != 3) || (changes[0].field != 0) || (changes[0].new_value != 5) || (changes[1].field != 2) || (changes[1].new_value != 0x1234) || (changes[2].field != 3))
+            HAIER_LOGE("Wrong field changes, %u found", (unsigned int)count);
+        if (delta.compare(old_payload, new_payload, changes, 2) != 2)
+            HAIER_LOGE("Changes are not limited");
+        old_payload[1] = 0x80;
+        count = delta.compare(old_payload, new_payload, changes, 8);
+        if ((count != 4) || (changes[1].field != 1) || (changes[1].old_value != 1) || (changes[1].new_value != 0))
+            HAIER_LOGE("Wrong bit field change");
+        TEST_END(0, 0);
+    }
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST18)
+    {
+        TEST_START(18);
+        // Poll scheduler: rates, backoff after timeouts, fast polling after command and bus budget
+        CircularBuffer<uint8_t> buffers[2] = { CircularBuffer<uint8_t>(1000), CircularBuffer<uint8_t>(1000) };
+        LoopbackStream module_stream(buffers[0], buffers[1]);
+        LoopbackStream appliance_stream(buffers[1], buffers[0]);
+        haier_protocol::ProtocolHandler module(module_stream);
+        haier_protocol::ProtocolHandler appliance(appliance_stream);
+        module.set_cooldown_interval(0);
+        module.set_answer_timeout(20);
+        appliance.set_cooldown_interval(0);
+        bool answer_alarms = true;
+        appliance.set_message_handler(haier_protocol::FrameType::CONTROL,
+            [&appliance](haier_protocol::FrameType, const uint8_t*, size_t) {
+                const uint8_t status[20] = { 0x6D, 0x01 };
+                appliance.send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::STATUS, status, sizeof(status)), true);
+                return haier_protocol::HandlerError::HANDLER_OK;
+            });
+        appliance.set_message_handler(haier_protocol::FrameType::GET_ALARM_STATUS,
+            [&appliance, &answer_alarms](haier_protocol::FrameType, const uint8_t*, size_t) {
+                if (answer_alarms)
+                    appliance.send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::GET_ALARM_STATUS_RESPONSE, 0x0F5A), true);
+                else
+                    appliance.no_answer();
+                return haier_protocol::HandlerError::HANDLER_OK;
+            });
+        haier_protocol::PollScheduler scheduler(module, 21);
+        scheduler.set_fast_poll_window(std::chrono::milliseconds(200));
+        haier_protocol::PollId status_poll = scheduler.add_poll(haier_protocol::HaierMessage(haier_protocol::FrameType::CONTROL, 0x4D01), true, std::chrono::milliseconds(50), std::chrono::milliseconds(10));
+        haier_protocol::PollId alarm_poll = scheduler.add_poll(haier_protocol::HaierMessage(haier_protocol::FrameType::GET_ALARM_STATUS), true, std::chrono::milliseconds(50));
+        unsigned int answers = 0;
+        scheduler.register_handlers(
+            [&answers](haier_protocol::FrameType, haier_protocol::FrameType, const uint8_t*, size_t) {
+                answers++;
+                return haier_protocol::HandlerError::HANDLER_OK;
+            },
+            [](haier_protocol::FrameType) { return haier_protocol::HandlerError::HANDLER_OK; });
+        // Polls added at the same moment with the same interval start at different phases
+        haier_protocol::PollScheduler phases(module, 1);
+        for (unsigned int i = 0; i < 8; i++)
+            phases.add_poll(haier_protocol::HaierMessage(haier_protocol::FrameType::CONTROL), true, std::chrono::milliseconds(1000));
+        std::set<long long> first_requests;
+        for (haier_protocol::PollId poll = 0; poll < phases.get_polls_count(); poll++)
+            first_requests.insert(std::chrono::duration_cast<std::chrono::milliseconds>(phases.get_next_request(poll) - phases.get_next_request(0)).count());
+        if (first_requests.size() < 5)
+            HAIER_LOGE("Poll phases are not randomized");
+        auto run_scheduler = [&module, &appliance, &scheduler](std::chrono::milliseconds duration) {
+            std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + duration;
+            while (std::chrono::steady_clock::now() < end)
+            {
+                scheduler.loop();
+                module.loop();
+                appliance.loop();
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        };
+        auto get_sent = [&scheduler](haier_protocol::PollId poll) { return scheduler.get_poll_statistics(poll).requests_sent.get(); };
+        run_scheduler(std::chrono::milliseconds(500));
+        unsigned int status_sent = get_sent(status_poll);
+        unsigned int alarms_sent = get_sent(alarm_poll);
+        // About 10 requests of every poll
+        if ((status_sent < 6) || (status_sent > 12) || (alarms_sent < 6) || (alarms_sent > 12) || (answers != status_sent + alarms_sent))
+            HAIER_LOGE("Wrong poll rate: %u status, %u alarm requests, %u answers", status_sent, alarms_sent, answers);
+        // Alarm poll backs off, status poll continues at its rate
+        answer_alarms = false;
+        run_scheduler(std::chrono::milliseconds(600));
+        unsigned int alarm_timeouts = scheduler.get_poll_statistics(alarm_poll).answer_timeouts.get();
+        if ((alarm_timeouts < 2) || (alarm_timeouts > 5) || (scheduler.get_interval(alarm_poll) < std::chrono::milliseconds(200)))
+            HAIER_LOGE("No backoff: %u timeouts, interval %dms", alarm_timeouts, (int) scheduler.get_interval(alarm_poll).count());
+        if (get_sent(status_poll) - status_sent < 8)
+            HAIER_LOGE("Status poll was slowed down by alarm timeouts");
+        // Command speeds up status poll
+        answer_alarms = true;
+        status_sent = get_sent(status_poll);
+        scheduler.send_command(haier_protocol::HaierMessage(haier_protocol::FrameType::CONTROL, 0x5C01), true);
+        if (scheduler.get_interval(status_poll) != std::chrono::milliseconds(10))
+            HAIER_LOGE("Fast polling is not started");
+        run_scheduler(std::chrono::milliseconds(150));
+        if (get_sent(status_poll) - status_sent < 6)
+            HAIER_LOGE("Only %u status requests after command", get_sent(status_poll) - status_sent);
+        run_scheduler(std::chrono::milliseconds(100));
+        if (scheduler.get_interval(status_poll) != std::chrono::milliseconds(50))
+            HAIER_LOGE("Fast polling is not finished");
+        // 9600 baud, 5% is 48 bytes per second, about one status request with answer
+        scheduler.set_bus_budget(0.05f, 9600);
+        run_scheduler(std::chrono::milliseconds(100));
+        unsigned int total_sent = get_sent(status_poll) + get_sent(alarm_poll);
+        run_scheduler(std::chrono::milliseconds(1000));
+        total_sent = get_sent(status_poll) + get_sent(alarm_poll) - total_sent;
+        if ((total_sent < 1) || (total_sent > 3) || (scheduler.get_budget_waits() == 0))
+            HAIER_LOGE("Bus budget is not respected: %u requests in a second", total_sent);
+        HAIER_LOGI("Status: %u requests, alarms: %u requests %u timeouts, budget waits %u", get_sent(status_poll), get_sent(alarm_poll), alarm_timeouts, scheduler.get_budget_waits());
+        TEST_END(0, 0);
+    }
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST19)
+    {
+        TEST_START(19);
+        // Multi-unit bus: discovery, per-address queues, address filtering and group messages
+        {
+            // Address goes through escaping of 0xFF header bytes
+            CircularBuffer<uint8_t> buffers[2] = { CircularBuffer<uint8_t>(1000), CircularBuffer<uint8_t>(1000) };
+            LoopbackStream tx_stream(buffers[0], buffers[1]);
+            LoopbackStream rx_stream(buffers[1], buffers[0]);
+            haier_protocol::TransportLevelHandler tx_transport(tx_stream, 0);
+            haier_protocol::TransportLevelHandler rx_transport(rx_stream, 0);
+            const uint8_t data[] = { 0x01, 0xFF, 0x02 };
+            tx_transport.send_data(0xFF, data, sizeof(data), true, 0xFF);
+            rx_transport.read_data();
+            rx_transport.process_data();
+            haier_protocol::TimestampedFrame tsframe;
+            if (!rx_transport.pop(tsframe) || (tsframe.frame.get_address() != 0xFF) || (tsframe.frame.get_frame_type() != 0xFF) ||
+                (tsframe.frame.get_data_size() != sizeof(data)) || (memcmp(tsframe.frame.get_data(), data, sizeof(data)) != 0))
+                HAIER_LOGE("Frame address is not transferred");
+        }
+        std::vector<BusStream*> bus;
+        BusStream module_stream(bus);
+        BusStream unit_streams[3] = { BusStream(bus), BusStream(bus), BusStream(bus) };
+        haier_protocol::ProtocolHandler module(module_stream);
+        module.set_cooldown_interval(0);
+        module.set_answer_timeout(50);
+        std::unique_ptr<haier_protocol::ProtocolHandler> units[3];
+        unsigned int requests[3] = { 0, 0, 0 };
+        unsigned int group_commands[3] = { 0, 0, 0 };
+        const uint8_t addresses[] = { 3, 1, 2 };
+        for (uint8_t i = 0; i < 3; i++)
+        {
+            units[i].reset(new haier_protocol::ProtocolHandler(unit_streams[i]));
+            haier_protocol::ProtocolHandler& unit = *units[i];
+            unit.set_cooldown_interval(0);
+            unit.set_address(i + 1);
+            unit.set_message_handler(haier_protocol::FrameType::CONTROL,
+                [&unit, &requests, &group_commands, i](haier_protocol::FrameType, const uint8_t*, size_t) {
+                    if (unit.get_incoming_address() == haier_protocol::BROADCAST_ADDRESS)
+                        group_commands[i]++;
+                    else
+                        requests[i]++;
+                    // Answer to group message is not sent
+                    const uint8_t status[] = { 0x6D, 0x01, (uint8_t) (i + 1) };
+                    unit.send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::STATUS, status, sizeof(status)), true);
+                    return haier_protocol::HandlerError::HANDLER_OK;
+                });
+        }
+        units[0]->set_bus_addresses(addresses, sizeof(addresses));
+        std::vector<uint8_t> answer_order;
+        module.set_answer_handler(haier_protocol::FrameType::CONTROL,
+            [&module, &answer_order](haier_protocol::FrameType, haier_protocol::FrameType message_type, const uint8_t* data, size_t size) {
+                if ((message_type != haier_protocol::FrameType::STATUS) || (size != 3) || (data[2] != module.get_incoming_address()))
+                    return haier_protocol::HandlerError::INVALID_ANSWER;
+                answer_order.push_back(module.get_incoming_address());
+                return haier_protocol::HandlerError::HANDLER_OK;
+            });
+        auto run_bus = [&module, &units]() {
+            for (unsigned int i = 0; i < 200; i++)
+            {
+                module.loop();
+                for (std::unique_ptr<haier_protocol::ProtocolHandler>& unit : units)
+                    unit->loop();
+                if ((module.get_outgoing_queue_size() == 0) && !module.is_waiting_for_answer())
+                    break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        };
+        std::vector<uint8_t> discovered;
+        module.discover_addresses(true, [&discovered](const uint8_t* addresses, size_t count) { discovered.assign(addresses, addresses + count); });
+        run_bus();
+        if ((discovered != std::vector<uint8_t>{ 1, 2, 3 }) || (module.get_known_addresses() != discovered))
+            HAIER_LOGE("Wrong discovery result, %d addresses", (int) discovered.size());
+        // Units take turns, the first one doesn't hold messages for others
+        for (unsigned int i = 0; i < 3; i++)
+            module.send_message_to(1, haier_protocol::HaierMessage(haier_protocol::FrameType::CONTROL, 0x4D01), true);
+        module.send_message_to(2, haier_protocol::HaierMessage(haier_protocol::FrameType::CONTROL, 0x4D01), true);
+        module.send_message_to(3, haier_protocol::HaierMessage(haier_protocol::FrameType::CONTROL, 0x4D01), true);
+        if ((module.get_outgoing_queue_size() != 5) || (module.get_outgoing_queue_size(1) != 3) || (module.get_outgoing_queue_size(2) != 1))
+            HAIER_LOGE("Wrong outgoing queue sizes");
+        run_bus();
+        if (answer_order != std::vector<uint8_t>{ 1, 2, 3, 1, 1 })
+            HAIER_LOGE("Wrong order of answers, %d answers", (int) answer_order.size());
+        if ((requests[0] != 3) || (requests[1] != 1) || (requests[2] != 1))
+            HAIER_LOGE("Units got frames of other units: %u %u %u", requests[0], requests[1], requests[2]);
+        if ((units[1]->get_transport_statistics().frames_filtered.get() == 0) || (module.get_statistics().answer_timeouts.get_total() != 0))
+            HAIER_LOGE("Frames are not filtered by address");
+        // Group message goes as one frame, every unit handles it and nobody answers
+        uint32_t frames_sent = module.get_transport_statistics().frames_sent.get();
+        uint32_t answers_received = module.get_statistics().answers_received.get();
+        module.send_group_message(haier_protocol::HaierMessage(haier_protocol::FrameType::CONTROL, 0x5D01), true);
+        run_bus();
+        for (unsigned int i = 0; i < 10; i++)
+        {
+            module.loop();
+            for (std::unique_ptr<haier_protocol::ProtocolHandler>& unit : units)
+                unit->loop();
+        }
+        if ((group_commands[0] != 1) || (group_commands[1] != 1) || (group_commands[2] != 1))
+            HAIER_LOGE("Group message is not received by all units");
+        if ((module.get_transport_statistics().frames_sent.get() != frames_sent + 1) || (module.get_statistics().answers_received.get() != answers_received) ||
+            (module.get_transport_statistics().frames_parsed.get() != 6))
+            HAIER_LOGE("Units answered group message");
+        // Addressed and group messages posted from another thread keep their addresses
+        module.enable_message_intake(4);
+        std::thread poster([&module]() {
+            if (!module.post_message_to(2, haier_protocol::HaierMessage(haier_protocol::FrameType::CONTROL, 0x4D01), true) ||
+                !module.post_group_message(haier_protocol::HaierMessage(haier_protocol::FrameType::CONTROL, 0x5D01), true))
+                HAIER_LOGE("Message was not posted");
+        });
+        poster.join();
+        run_bus();
+        for (unsigned int i = 0; i < 10; i++)
+        {
+            module.loop();
+            for (std::unique_ptr<haier_protocol::ProtocolHandler>& unit : units)
+                unit->loop();
+        }
+        if ((requests[0] != 3) || (requests[1] != 2) || (requests[2] != 1) || (answer_order.back() != 2))
+            HAIER_LOGE("Posted message is not delivered to its unit: %u %u %u", requests[0], requests[1], requests[2]);
+        if ((group_commands[0] != 2) || (group_commands[1] != 2) || (group_commands[2] != 2) || (module.get_transport_statistics().frames_parsed.get() != 7))
+            HAIER_LOGE("Posted group message is not broadcast");
+        TEST_END(0, 0);
+    }
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST20)
+    {
+        TEST_START(20);
+        // Frame split between two reads keeps the time its start was received
+        CircularBuffer<uint8_t> buffer(1000);
+        CircularBuffer<uint8_t> unused(1000);
+        LoopbackStream stream(unused, buffer);
+        haier_protocol::TransportLevelHandler transport(stream, 0);
+        const uint8_t data[] = { 0x6D, 0x01, 0x10, 0x20, 0x30, 0x40, 0x50, 0x60 };
+        haier_protocol::HaierFrame frame(0x02, data, sizeof(data), true);
+        std::vector<uint8_t> frame_buffer(frame.get_buffer_size());
+        frame.fill_buffer(frame_buffer.data(), frame_buffer.size());
+        // Header is parsed with the first part, the rest of the frame comes later
+        const size_t first_part = frame_buffer.size() - 4;
+        auto start_time = std::chrono::steady_clock::now();
+        buffer.push(frame_buffer.data(), first_part);
+        transport.read_data();
+        transport.process_data();
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        buffer.push(frame_buffer.data() + first_part, frame_buffer.size() - first_part);
+        transport.read_data();
+        transport.process_data();
+        haier_protocol::TimestampedFrame tsframe;
+        if (!transport.pop(tsframe))
+            HAIER_LOGE("Split frame was dropped");
+        else if ((tsframe.timestamp < start_time) || (tsframe.complete_timestamp - tsframe.timestamp < std::chrono::milliseconds(5)))
+            HAIER_LOGE("Wrong frame start time");
+        TEST_END(0, 0);
+    }
 #endif
     HAIER_LOGI("All tests successfully finished!");
 }
\ No newline at end of file
@@ -8,12 +8,34 @@
 #include "protocol/haier_protocol.h"
 #include "smartair2_packet.h"
 #include "smartair2_server.h"
+#include "device_state_cache.h"
 #include "console_log.h"
 #include "test_macro.h"
 
 using namespace esphome::haier::smartair2_protocol;
 
-HaierPacketControl ac_full_state;
+uint8_t ac_full_state[SmartAir2ControlView::SIZE];
+
+// Layout of payload view
+constexpr uint8_t CONTROL_SAMPLE[SmartAir2ControlView::SIZE] = { 0x00, 0x1A, 0x00, 0x38, 0x00, 0x7F, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+	0x00, 0x03, 0x00, 0x01, 0x88, 0x51, 0x00, 0x2A, 0x00, 0x00, 0x00, 0x09 };
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).room_temperature() == 26, "room_temperature");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).room_humidity() == 56, "room_humidity");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).cntrl() == 0x7F, "cntrl");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).ac_mode() == (uint8_t)ConditioningMode::COOL, "ac_mode");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).fan_mode() == (uint8_t)FanMode::FAN_AUTO, "fan_mode");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).swing_both() == 1, "swing_both");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).use_fahrenheit() == 1, "use_fahrenheit");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).lock_remote() == 1, "lock_remote");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).ac_power() == 1, "ac_power");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).health_mode() == 0, "health_mode");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).compressor() == 1, "compressor");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).ten_degree() == 1, "ten_degree");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).use_swing_bits() == 0, "use_swing_bits");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).turbo_mode() == 1, "turbo_mode");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).horizontal_swing() == 1, "horizontal_swing");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).display_status() == 1, "display_status");
+static_assert(SmartAir2ControlConstView(CONTROL_SAMPLE).set_point() == 9, "set_point");
 
 haier_protocol::FrameType expected_answers[][2] = {
 	{haier_protocol::FrameType::GET_DEVICE_VERSION, haier_protocol::FrameType::GET_DEVICE_VERSION_RESPONSE},
@@ -47,11 +69,10 @@ int main(int argc, char** argv) {
 	VirtualStream& server_stream = stream_holder.get_stream_reference(StreamDirection::DIRECTION_A);
 	VirtualStream& client_stream = stream_holder.get_stream_reference(StreamDirection::DIRECTION_B);
 	haier_protocol::ProtocolHandler smartair2_server(server_stream);
-	smartair2_server.set_message_handler(haier_protocol::FrameType::GET_DEVICE_VERSION, std::bind(unsupported_message_handler, &smartair2_server, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
-	smartair2_server.set_message_handler(haier_protocol::FrameType::CONTROL, std::bind(status_request_handler, &smartair2_server, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
-	smartair2_server.set_message_handler(haier_protocol::FrameType::REPORT_NETWORK_STATUS, std::bind(report_network_status_handler, &smartair2_server, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+	SmartAir2Server smartair2_appliance;
+	smartair2_appliance.register_handlers(smartair2_server);
 	haier_protocol::ProtocolHandler smartair2_client(client_stream);
-	ac_full_state = get_ac_state_ref();
+	memcpy(ac_full_state, smartair2_appliance.get_ac_state().data(), SmartAir2ControlView::SIZE);
 	smartair2_client.set_default_answer_handler(client_answers_handler);
 #if defined(RUN_ALL_TESTS) || defined(RUN_TEST1)
 	{
@@ -121,16 +142,17 @@ int main(int argc, char** argv) {
 #if defined(RUN_ALL_TESTS) || defined(RUN_TEST5)
 	{
 		TEST_START(5);
-		ac_full_state.ac_power = true;
-		ac_full_state.ac_mode = (uint8_t)ConditioningMode::COOL;
-		ac_full_state.display_status = 0;
-		haier_protocol::HaierMessage control_message(haier_protocol::FrameType::CONTROL, 0x4D5F, (uint8_t*)&ac_full_state, sizeof(HaierPacketControl));
+		SmartAir2ControlView control(ac_full_state);
+		control.set_ac_power(1);
+		control.set_ac_mode((uint8_t)ConditioningMode::COOL);
+		control.set_display_status(0);
+		haier_protocol::HaierMessage control_message(haier_protocol::FrameType::CONTROL, 0x4D5F, control.data(), SmartAir2ControlView::SIZE);
 		smartair2_client.send_message(control_message, false);
 		smartair2_client.loop();
 		smartair2_server.loop();
 		smartair2_client.loop();
 		smartair2_server.loop();
-		if (memcmp(&ac_full_state, &get_ac_state_ref(), sizeof(HaierPacketControl)) == 0) {
+		if (memcmp(control.data(), smartair2_appliance.get_ac_state().data(), SmartAir2ControlView::SIZE) == 0) {
 			HAIER_LOGI("AC control processed correctly");
 		}
 		else {
@@ -138,6 +160,57 @@ int main(int argc, char** argv) {
 		}
 		TEST_END(0, 0);
 	}
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST6)
+	{
+		// Status answer is published to the state cache
+		TEST_START(6);
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		SmartAir2StateCache state_cache;
+		state_cache.register_handler(smartair2_client, client_answers_handler);
+		const haier_protocol::HaierMessage status_request_message(haier_protocol::FrameType::CONTROL, 0x4D01);
+		smartair2_client.send_message(status_request_message, false);
+		smartair2_client.loop();
+		smartair2_server.loop();
+		smartair2_client.loop();
+		smartair2_server.loop();
+		SmartAir2StateCache::Snapshot snapshot = state_cache.get_snapshot();
+		if (snapshot.version != 1)
+			HAIER_LOGE("Status answer is not cached, version %u", snapshot.version);
+		else if (memcmp(snapshot.state.control, smartair2_appliance.get_ac_state().data(), SmartAir2ControlView::SIZE) != 0)
+			HAIER_LOGE("Cached control doesn't match appliance state");
+		if (snapshot.is_stale((size_t)SmartAir2StateSection::CONTROL, std::chrono::seconds(1)))
+			HAIER_LOGE("Fresh state is reported as stale");
+		smartair2_client.remove_answer_handler(haier_protocol::FrameType::CONTROL);
+		TEST_END(0, 0);
+	}
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST7)
+	{
+		// View gives the same bytes as bit field structure of this compiler
+		TEST_START(7);
+		HaierPacketControl control;
+		memset(&control, 0, sizeof(control));
+		control.use_fahrenheit = 1;
+		control.lock_remote = 1;
+		control.health_mode = 1;
+		control.ten_degree = 1;
+		control.quiet_mode = 1;
+		control.vertical_swing = 1;
+		control.set_point = 0x0B;
+		uint8_t payload[SmartAir2ControlView::SIZE] = { 0 };
+		SmartAir2ControlView view(payload);
+		view.set_use_fahrenheit(1);
+		view.set_lock_remote(1);
+		view.set_health_mode(1);
+		view.set_ten_degree(1);
+		view.set_quiet_mode(1);
+		view.set_vertical_swing(1);
+		view.set_set_point(0x0B);
+		if ((sizeof(control) != SmartAir2ControlView::SIZE) || (memcmp(&control, payload, SmartAir2ControlView::SIZE) != 0))
+			HAIER_LOGE("Control view doesn't match HaierPacketControl");
+		TEST_END(0, 0);
+	}
 #endif
 	HAIER_LOGI("All tests successfully finished!");
 }
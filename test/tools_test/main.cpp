@@ -0,0 +1,376 @@
+﻿#include <stdint.h>
+#include <cstring>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "transport/haier_frame.h"
+#include "protocol/haier_protocol.h"
+#include "shard_runtime.h"
+#include "frame_batcher.h"
+#include "console_log.h"
+#include "test_macro.h"
+#if __linux__
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include "serial_stream.h"
+#include "pty_loopback.h"
+#endif
+
+// Counts tasks that reached the device and checks that everything runs on the owner shard
+class CountingDevice : public ShardDevice
+{
+public:
+	CountingDevice(ShardRuntime& runtime, DeviceId id, unsigned int forwarded_tasks) : mRuntime(runtime), mId(id), mForwardedTasks(forwarded_tasks) {};
+	virtual void loop(std::chrono::steady_clock::time_point) override;
+	void run_task();
+	unsigned int get_tasks_run() const { return mTasksRun; };
+	unsigned int get_wrong_shard_calls() const { return mWrongShardCalls; };
+private:
+	void check_shard_();
+	ShardRuntime&               mRuntime;
+	DeviceId                    mId;
+	unsigned int                mForwardedTasks;
+	bool                        mForwarded{ false };
+	std::atomic<unsigned int>   mTasksRun{ 0 };
+	std::atomic<unsigned int>   mWrongShardCalls{ 0 };
+};
+
+void CountingDevice::check_shard_()
+{
+	if (mRuntime.get_current_shard() != (int)mRuntime.get_device_shard(mId))
+		mWrongShardCalls++;
+}
+
+void CountingDevice::loop(std::chrono::steady_clock::time_point)
+{
+	check_shard_();
+	if (mForwarded)
+		return;
+	// First round sends tasks to all other devices, most of them live on other shards
+	mForwarded = true;
+	for (DeviceId device = 0; device < mRuntime.get_devices_count(); device++)
+	{
+		if (device == mId)
+			continue;
+		for (unsigned int i = 0; i < mForwardedTasks; i++)
+			mRuntime.post(device, [](ShardDevice& target) { static_cast<CountingDevice&>(target).run_task(); });
+	}
+}
+
+void CountingDevice::run_task()
+{
+	check_shard_();
+	mTasksRun++;
+}
+
+#if __linux__
+// Appliance side of pseudo terminal, SerialStream is opened on the other side
+class PtyMasterStream : public haier_protocol::ProtocolStream
+{
+public:
+	PtyMasterStream() : mHandle(posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK)) {};
+	~PtyMasterStream() { if (mHandle >= 0) close(mHandle); };
+	bool open_pair() { return (mHandle >= 0) && (grantpt(mHandle) == 0) && (unlockpt(mHandle) == 0); };
+	std::string get_slave_path() const { return ptsname(mHandle); };
+	// Master and slave share terminal settings
+	speed_t get_speed() const;
+	virtual size_t      available() noexcept { return read_array(nullptr, 0); };
+	virtual size_t      read_array(uint8_t* data, size_t len) noexcept;
+	virtual void        write_array(const uint8_t* data, size_t len) noexcept { (void) !write(mHandle, data, len); };
+	virtual uint32_t    get_baud_rate() const noexcept { return mBaudRate; };
+	virtual bool        supports_baud_rate(uint32_t) const noexcept { return true; };
+	virtual bool        set_baud_rate(uint32_t baud_rate) noexcept { mBaudRate = baud_rate; return true; };
+private:
+	int mHandle;
+	uint32_t mBaudRate{ haier_protocol::DEFAULT_BAUD_RATE };
+	CircularBuffer<uint8_t> mBuffer{ 2000 };
+};
+
+speed_t PtyMasterStream::get_speed() const
+{
+	struct termios tty;
+	return tcgetattr(mHandle, &tty) == 0 ? cfgetospeed(&tty) : B0;
+}
+
+size_t PtyMasterStream::read_array(uint8_t* data, size_t len) noexcept
+{
+	uint8_t tmp[256];
+	ssize_t res = read(mHandle, tmp, sizeof(tmp));
+	if (res > 0)
+		mBuffer.push(tmp, (size_t) res);
+	if (len > mBuffer.get_size())
+		len = mBuffer.get_size();
+	return data != nullptr ? mBuffer.pop(data, len) : mBuffer.get_size();
+}
+
+void run_loops(haier_protocol::ProtocolHandler& handler1, haier_protocol::ProtocolHandler& handler2, const bool& stop_flag)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+	while (!stop_flag && (std::chrono::steady_clock::now() < deadline))
+	{
+		handler1.loop();
+		handler2.loop();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+#endif
+
+int main() {
+	haier_protocol::set_log_handler(console_logger);
+	HAIER_LOGI("Haier protocol tools tests");
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST1)
+	{
+		TEST_START(1);
+		// Sharded runtime: tasks from other shards and from outside reach every device on its own shard
+		constexpr unsigned int SHARDS_COUNT = 4;
+		constexpr unsigned int DEVICES_COUNT = 8;
+		constexpr unsigned int FORWARDED_TASKS = 16;
+		constexpr unsigned int EXTERNAL_TASKS = 100;
+		ShardRuntime runtime(SHARDS_COUNT);
+		std::vector<CountingDevice*> devices;
+		for (DeviceId id = 0; id < DEVICES_COUNT; id++)
+		{
+			devices.push_back(new CountingDevice(runtime, id, FORWARDED_TASKS));
+			runtime.add_device(std::unique_ptr<ShardDevice>(devices.back()));
+		}
+		if (runtime.get_device_shard(5) != 1)
+			HAIER_LOGE("Devices are not spread round robin, device 5 is on shard %u", runtime.get_device_shard(5));
+		if (runtime.get_current_shard() != -1)
+			HAIER_LOGE("Test thread is reported as shard %d", runtime.get_current_shard());
+		runtime.start(std::chrono::milliseconds(1), false);
+		unsigned int retries = 0;
+		for (unsigned int i = 0; i < EXTERNAL_TASKS; i++)
+		{
+			for (DeviceId id = 0; id < DEVICES_COUNT; id++)
+			{
+				// Mailbox can be full for a moment, shard empties it on the next round
+				while (!runtime.post(id, [](ShardDevice& target) { static_cast<CountingDevice&>(target).run_task(); }))
+				{
+					retries++;
+					std::this_thread::yield();
+				}
+			}
+		}
+		const unsigned int expected = EXTERNAL_TASKS + (DEVICES_COUNT - 1) * FORWARDED_TASKS;
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		bool done = false;
+		while (!done && (std::chrono::steady_clock::now() < deadline))
+		{
+			done = true;
+			for (CountingDevice* device : devices)
+				done = done && (device->get_tasks_run() >= expected);
+			if (!done)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		runtime.stop();
+		uint64_t rounds = 0;
+		for (unsigned int shard = 0; shard < SHARDS_COUNT; shard++)
+			rounds += runtime.get_statistics(shard).rounds;
+		for (DeviceId id = 0; id < DEVICES_COUNT; id++)
+		{
+			if (devices[id]->get_tasks_run() != expected)
+				HAIER_LOGE("Device %u got %u tasks instead of %u", id, devices[id]->get_tasks_run(), expected);
+			if (devices[id]->get_wrong_shard_calls() != 0)
+				HAIER_LOGE("Device %u was called %u times from wrong thread", id, devices[id]->get_wrong_shard_calls());
+		}
+		HAIER_LOGI("%u tasks run on %u shards in %llu rounds, %u retries", expected * DEVICES_COUNT, SHARDS_COUNT, (unsigned long long)rounds, retries);
+		TEST_END(0, 0);
+	}
+#endif
+#if defined(RUN_ALL_TESTS) || defined(RUN_TEST2)
+	{
+		TEST_START(2);
+		// Frame batching: batches are sent only as a whole, frames wait in the parser while there is no space
+		constexpr size_t FRAMES_COUNT = 5;
+		std::vector<std::vector<uint8_t>> frames;
+		// Record sizes differ if escaping adds bytes
+		size_t record_offsets[FRAMES_COUNT + 1] = { 0 };
+		for (uint8_t i = 0; i < FRAMES_COUNT; i++)
+		{
+			const uint8_t data[] = { 0x6D, 0x01, i, 0x10, 0x20, 0x30, 0x40, 0x50 };
+			haier_protocol::HaierFrame frame(0x02, data, sizeof(data), true);
+			frames.emplace_back(frame.get_buffer_size());
+			frame.fill_buffer(frames.back().data(), frames.back().size());
+			record_offsets[i + 1] = record_offsets[i] + FRAME_RECORD_HEADER_SIZE + frames.back().size();
+		}
+		// Two records in a batch, the third one doesn't fit
+		FrameBatcher batcher(record_offsets[2] + record_offsets[1] / 2, std::chrono::hours(1), true);
+		for (const std::vector<uint8_t>& frame : frames)
+			batcher.push_input(frame.data(), frame.size());
+		size_t space = record_offsets[2] - 1;
+		std::vector<uint8_t> sent;
+		unsigned int batches = 0;
+		unsigned int sent_frames = 0;
+		auto send = [&space, &sent, &batches, &sent_frames](const uint8_t* data, size_t size, std::chrono::steady_clock::time_point, unsigned int frames_count) {
+			if (size > space)
+				return false;
+			sent.insert(sent.end(), data, data + size);
+			space -= size;
+			batches++;
+			sent_frames += frames_count;
+			return true;
+		};
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		batcher.collect(now, send);
+		if (!sent.empty() || (batcher.get_batch_size() != record_offsets[2]))
+			HAIER_LOGE("Batch is sent partially or lost, %d bytes sent, %d bytes kept", (int) sent.size(), (int) batcher.get_batch_size());
+		// Nothing new is parsed, kept batch and waiting frames go out when there is space
+		space = 1000;
+		batcher.collect(now, send);
+		if ((batches != 2) || (sent.size() != record_offsets[4]) || (batcher.get_batch_size() != record_offsets[5] - record_offsets[4]))
+			HAIER_LOGE("Waiting frames are not sent, %u batches, %d bytes", batches, (int) sent.size());
+		if (!batcher.flush(now + std::chrono::hours(2), send) || !batcher.empty())
+			HAIER_LOGE("Batch is not sent after flush interval");
+		if ((sent_frames != FRAMES_COUNT) || (sent.size() != record_offsets[FRAMES_COUNT]))
+			HAIER_LOGE("Wrong number of sent frames: %u", sent_frames);
+		else
+		{
+			for (size_t i = 0; i < FRAMES_COUNT; i++)
+			{
+				const uint8_t* record = sent.data() + record_offsets[i];
+				if ((((size_t) record[0] << 8) + record[1] != frames[i].size()) || (memcmp(record + FRAME_RECORD_HEADER_SIZE, frames[i].data(), frames[i].size()) != 0))
+					HAIER_LOGE("Frame record %d is broken", (int) i);
+			}
+		}
+		TEST_END(0, 0);
+	}
+#endif
+#if __linux__ && (defined(RUN_ALL_TESTS) || defined(RUN_TEST3))
+	{
+		TEST_START(3);
+		// Baud rate negotiation over pseudo terminal
+		PtyMasterStream appliance_stream;
+		if (!appliance_stream.open_pair())
+			HAIER_LOGE("Can't open pseudo terminal");
+		SerialStream module_stream(appliance_stream.get_slave_path());
+		haier_protocol::ProtocolHandler module(module_stream);
+		haier_protocol::ProtocolHandler appliance(appliance_stream);
+		module.set_max_baud_rate(115200);
+		uint32_t answered_rate = 0;
+		bool answer_received = false;
+		appliance.set_answer_handler(haier_protocol::FrameType::CHANGE_BAUD_RATE,
+			[&answered_rate, &answer_received, &appliance](haier_protocol::FrameType, haier_protocol::FrameType type, const uint8_t* data, size_t size) {
+				answer_received = true;
+				if ((type != haier_protocol::FrameType::CHANGE_BAUD_RATE_RESPONSE) || (size != 4))
+					return haier_protocol::HandlerError::INVALID_ANSWER;
+				answered_rate = ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) | data[3];
+				if (answered_rate != appliance.get_baud_rate())
+					appliance.set_baud_rate(answered_rate);
+				return haier_protocol::HandlerError::HANDLER_OK;
+			});
+		const uint8_t fast_rate[] = { 0x00, 0x01, 0xC2, 0x00 };     // 115200
+		appliance.send_message(haier_protocol::HaierMessage(haier_protocol::FrameType::CHANGE_BAUD_RATE, fast_rate, sizeof(fast_rate)), true);
+		run_loops(module, appliance, answer_received);
+		if ((answered_rate != 115200) || (module.get_baud_rate() != 115200) || (appliance_stream.get_speed() != B115200))
+			HAIER_LOGE("Baud rate was not changed: answer %u, port %u", answered_rate, module.get_baud_rate());
+		// Above maximum, should be rejected with warning and answered with current rate
+		answer_received = false;
+		const uint8_t too_fast_rate[] = { 0x00, 0x0E, 0x10, 0x00 };  // 921600
+		appliance.send_message(haier_protocol::HaierMessage(haier_protocol::FrameType::CHANGE_BAUD_RATE, too_fast_rate, sizeof(too_fast_rate)), true);
+		run_loops(module, appliance, answer_received);
+		if ((answered_rate != 115200) || (module.get_baud_rate() != 115200))
+			HAIER_LOGE("Wrong answer to unsupported baud rate: %u", answered_rate);
+		// Communication continues at the new rate
+		bool version_received = false;
+		appliance.set_message_handler(haier_protocol::FrameType::GET_DEVICE_VERSION,
+			[&appliance](haier_protocol::FrameType, const uint8_t*, size_t) {
+				appliance.send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::GET_DEVICE_VERSION_RESPONSE));
+				return haier_protocol::HandlerError::HANDLER_OK;
+			});
+		module.set_answer_handler(haier_protocol::FrameType::GET_DEVICE_VERSION,
+			[&version_received](haier_protocol::FrameType, haier_protocol::FrameType type, const uint8_t*, size_t) {
+				version_received = type == haier_protocol::FrameType::GET_DEVICE_VERSION_RESPONSE;
+				return haier_protocol::HandlerError::HANDLER_OK;
+			});
+		module.send_message(haier_protocol::HaierMessage(haier_protocol::FrameType::GET_DEVICE_VERSION), true);
+		run_loops(module, appliance, version_received);
+		if (!version_received)
+			HAIER_LOGE("No answer after baud rate change");
+		TEST_END(1, 0);
+	}
+#endif
+#if __linux__ && (defined(RUN_ALL_TESTS) || defined(RUN_TEST4))
+	{
+		TEST_START(4);
+		// Pseudo terminal loopback: real SerialStream against simulator, with and without line pacing
+		{
+			PtyLoopback loopback;
+			if (!loopback.open())
+				HAIER_LOGE("Can't open pseudo terminal loopback");
+			SerialStream module_stream(loopback.get_port_path());
+			haier_protocol::ProtocolHandler module(module_stream);
+			haier_protocol::ProtocolHandler appliance(loopback.get_appliance_stream());
+			unsigned int answers = 0;
+			bool answer_received = false;
+			appliance.set_message_handler(haier_protocol::FrameType::GET_DEVICE_VERSION,
+				[&appliance](haier_protocol::FrameType, const uint8_t*, size_t) {
+					appliance.send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::GET_DEVICE_VERSION_RESPONSE));
+					return haier_protocol::HandlerError::HANDLER_OK;
+				});
+			module.set_answer_handler(haier_protocol::FrameType::GET_DEVICE_VERSION,
+				[&answers, &answer_received](haier_protocol::FrameType, haier_protocol::FrameType type, const uint8_t*, size_t) {
+					answer_received = type == haier_protocol::FrameType::GET_DEVICE_VERSION_RESPONSE;
+					answers++;
+					return haier_protocol::HandlerError::HANDLER_OK;
+				});
+			module.send_message(haier_protocol::HaierMessage(haier_protocol::FrameType::GET_DEVICE_VERSION), true);
+			run_loops(module, appliance, answer_received);
+			if (!answer_received || (answers != 1))
+				HAIER_LOGE("No answer over pseudo terminal loopback");
+		}
+		{
+			constexpr uint32_t LINE_BAUD_RATE = 19200;
+			constexpr size_t BLOCK_SIZE = 96;
+			PtyLoopback loopback(LINE_BAUD_RATE);
+			if (!loopback.open())
+				HAIER_LOGE("Can't open pseudo terminal loopback");
+			SerialStream module_stream(loopback.get_port_path());
+			PtyApplianceStream& appliance_stream = loopback.get_appliance_stream();
+			const auto wire_time = loopback.get_wire_time(BLOCK_SIZE);
+			uint8_t block[BLOCK_SIZE];
+			for (size_t i = 0; i < BLOCK_SIZE; i++)
+				block[i] = (uint8_t) i;
+			// Module to appliance: bytes arrive one by one, the last one after the whole block time
+			uint8_t received[BLOCK_SIZE];
+			size_t received_size = 0;
+			size_t first_chunk_size = 0;
+			auto start = std::chrono::steady_clock::now();
+			module_stream.write_array(block, BLOCK_SIZE);
+			while ((received_size < BLOCK_SIZE) && appliance_stream.wait_for_data(std::chrono::seconds(1)))
+			{
+				size_t size = appliance_stream.read_array(received + received_size, BLOCK_SIZE - received_size);
+				if (first_chunk_size == 0)
+					first_chunk_size = size;
+				received_size += size;
+			}
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			if ((received_size != BLOCK_SIZE) || (memcmp(received, block, BLOCK_SIZE) != 0))
+				HAIER_LOGE("Paced block was not received by appliance, size %u", (unsigned int) received_size);
+			if ((elapsed < wire_time) || (first_chunk_size == BLOCK_SIZE))
+				HAIER_LOGE("Block was received by appliance faster than line allows: %lld us",
+					(long long) std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+			// Appliance to module
+			received_size = 0;
+			start = std::chrono::steady_clock::now();
+			appliance_stream.write_array(block, BLOCK_SIZE);
+			while ((received_size < BLOCK_SIZE) && module_stream.wait_for_data(std::chrono::seconds(1)))
+				received_size += module_stream.read_array(received + received_size, BLOCK_SIZE - received_size);
+			elapsed = std::chrono::steady_clock::now() - start;
+			if ((received_size != BLOCK_SIZE) || (memcmp(received, block, BLOCK_SIZE) != 0))
+				HAIER_LOGE("Paced block was not received by module, size %u", (unsigned int) received_size);
+			if (elapsed < wire_time)
+				HAIER_LOGE("Block was received by module faster than line allows: %lld us",
+					(long long) std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+			HAIER_LOGI("Block of %u bytes at %u baud: wire time %lld us, received in %lld us", (unsigned int) BLOCK_SIZE, LINE_BAUD_RATE,
+				(long long) std::chrono::duration_cast<std::chrono::microseconds>(wire_time).count(),
+				(long long) std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+			if (loopback.get_dropped_bytes() != 0)
+				HAIER_LOGE("Loopback dropped %llu bytes", (unsigned long long) loopback.get_dropped_bytes());
+		}
+		TEST_END(0, 0);
+	}
+#endif
+	HAIER_LOGI("All tests successfully finished!");
+}
@@ -0,0 +1,251 @@
+#include "pty_loopback.h"
+
+#if __linux__
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define BUFFER_SIZE 4096
+
+// 8N1: start bit, 8 data bits and stop bit
+constexpr unsigned int BITS_PER_BYTE = 10;
+// Pump wakes up at least this often to check running_
+constexpr std::chrono::milliseconds PUMP_IDLE_TIMEOUT(100);
+
+size_t PtyLoopback::PacedQueue::push(const uint8_t* bytes, size_t size, Clock::time_point now, std::chrono::nanoseconds byte_time) {
+    size = this->data.push(bytes, size);
+    if (size == 0)
+        return 0;
+    // Next byte starts after the previous one is on the wire
+    Clock::time_point start = std::max(now, this->line_free);
+    this->line_free = start + byte_time * size;
+    this->segments.push_back({ start, size, byte_time });
+    return size;
+}
+
+size_t PtyLoopback::PacedQueue::update(Clock::time_point now) {
+    while (!this->segments.empty()) {
+        Segment& segment = this->segments.front();
+        size_t count = segment.size;
+        if (segment.byte_time.count() > 0) {
+            if (now < segment.start)
+                break;
+            count = std::min(count, (size_t)((now - segment.start) / segment.byte_time));
+            if (count == 0)
+                break;
+        }
+        this->ready += count;
+        segment.start += segment.byte_time * count;
+        segment.size -= count;
+        if (segment.size > 0)
+            break;
+        this->segments.pop_front();
+    }
+    return this->ready;
+}
+
+PtyLoopback::Clock::time_point PtyLoopback::PacedQueue::get_next_release() const {
+    if (this->segments.empty())
+        return Clock::time_point::max();
+    return this->segments.front().start + this->segments.front().byte_time;
+}
+
+PtyLoopback::PtyLoopback(uint32_t pacing_baud_rate) :
+    paced_(pacing_baud_rate > 0),
+    baud_rate_(pacing_baud_rate > 0 ? pacing_baud_rate : haier_protocol::DEFAULT_BAUD_RATE),
+    to_appliance_(BUFFER_SIZE),
+    to_module_(BUFFER_SIZE),
+    appliance_stream_(*this) {
+}
+
+PtyLoopback::~PtyLoopback() {
+    this->close();
+}
+
+bool PtyLoopback::open() {
+    if (this->is_open())
+        return true;
+    this->master_handle_ = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (this->master_handle_ < 0)
+        return false;
+    if ((grantpt(this->master_handle_) != 0) || (unlockpt(this->master_handle_) != 0)) {
+        this->close();
+        return false;
+    }
+    this->port_path_ = ptsname(this->master_handle_);
+    this->slave_handle_ = ::open(this->port_path_.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    this->wake_handle_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct termios tty;
+    if ((this->slave_handle_ < 0) || (this->wake_handle_ < 0) || (tcgetattr(this->slave_handle_, &tty) != 0)) {
+        this->close();
+        return false;
+    }
+    // No echo or line editing until SerialStream sets up the port
+    cfmakeraw(&tty);
+    tcsetattr(this->slave_handle_, TCSANOW, &tty);
+    this->running_ = true;
+    this->pump_thread_ = std::thread(&PtyLoopback::pump_, this);
+    return true;
+}
+
+void PtyLoopback::close() {
+    if (this->pump_thread_.joinable()) {
+        this->running_ = false;
+        this->wake_pump_();
+        this->pump_thread_.join();
+    }
+    for (int* handle : { &this->master_handle_, &this->slave_handle_, &this->wake_handle_ }) {
+        if (*handle >= 0)
+            ::close(*handle);
+        *handle = -1;
+    }
+    this->port_path_.clear();
+}
+
+void PtyLoopback::set_baud_rate(uint32_t baud_rate) {
+    if (baud_rate > 0)
+        this->baud_rate_ = baud_rate;
+}
+
+std::chrono::nanoseconds PtyLoopback::get_wire_time(size_t size) const {
+    if (!this->paced_)
+        return std::chrono::nanoseconds(0);
+    return std::chrono::nanoseconds((uint64_t)size * BITS_PER_BYTE * 1000000000ull / this->baud_rate_);
+}
+
+void PtyLoopback::wake_pump_() {
+    uint64_t value = 1;
+    (void) !write(this->wake_handle_, &value, sizeof(value));
+}
+
+size_t PtyLoopback::read_ready_(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    size_t ready = this->to_appliance_.update(Clock::now());
+    size1 = std::min(size1, ready);
+    size2 = std::min(size2, ready - size1);
+    size_t result = this->to_appliance_.data.pop(data1, size1);
+    if (size2 > 0)
+        result += this->to_appliance_.data.pop(data2, size2);
+    this->to_appliance_.ready -= result;
+    return result;
+}
+
+void PtyLoopback::pump_() {
+    uint8_t buffer[BUFFER_SIZE];
+    bool wait_for_space = false;
+    while (this->running_) {
+        Clock::time_point next_release;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            next_release = this->to_module_.get_next_release();
+        }
+        Clock::duration timeout = PUMP_IDLE_TIMEOUT;
+        if (next_release != Clock::time_point::max())
+            timeout = std::max(Clock::duration(0), std::min(timeout, next_release - Clock::now()));
+        struct timespec wait_time;
+        auto timeout_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+        wait_time.tv_sec = (time_t)(timeout_ns / 1000000000);
+        wait_time.tv_nsec = (long)(timeout_ns % 1000000000);
+        // Module side bytes wait in the kernel while simulator buffer is full
+        bool has_space;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            has_space = this->to_appliance_.data.get_space() > 0;
+        }
+        struct pollfd handles[2] = {
+            { this->master_handle_, (short)((has_space ? POLLIN : 0) | (wait_for_space ? POLLOUT : 0)), 0 },
+            { this->wake_handle_, POLLIN, 0 },
+        };
+        if ((ppoll(handles, 2, &wait_time, nullptr) < 0) && (errno != EINTR))
+            break;
+        if ((handles[1].revents & POLLIN) != 0) {
+            uint64_t value;
+            (void) !read(this->wake_handle_, &value, sizeof(value));
+        }
+        if ((handles[0].revents & POLLIN) != 0) {
+            std::unique_lock<std::mutex> lock(this->mutex_);
+            size_t size = std::min(sizeof(buffer), this->to_appliance_.data.get_space());
+            lock.unlock();
+            ssize_t res = read(this->master_handle_, buffer, size);
+            if (res > 0) {
+                lock.lock();
+                this->to_appliance_.push(buffer, (size_t)res, Clock::now(), this->get_wire_time(1));
+                lock.unlock();
+                this->data_condition_.notify_all();
+            }
+        }
+        // Bytes that reached the end of the line go to the module side
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        PacedQueue& queue = this->to_module_;
+        wait_for_space = false;
+        while (queue.update(Clock::now()) > 0) {
+            const uint8_t* segment1;
+            const uint8_t* segment2;
+            size_t size1, size2;
+            queue.data.get_data_segments(segment1, size1, segment2, size2);
+            ssize_t res = write(this->master_handle_, segment1, std::min(size1, queue.ready));
+            if (res <= 0) {
+                wait_for_space = (res < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+                break;
+            }
+            queue.data.drop((size_t)res);
+            queue.ready -= (size_t)res;
+        }
+    }
+}
+
+size_t PtyApplianceStream::available() noexcept {
+    std::lock_guard<std::mutex> lock(this->owner_.mutex_);
+    return this->owner_.to_appliance_.update(PtyLoopback::Clock::now());
+}
+
+size_t PtyApplianceStream::read_array(uint8_t* data, size_t len) noexcept {
+    return this->owner_.read_ready_(data, len, nullptr, 0);
+}
+
+size_t PtyApplianceStream::read_into(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept {
+    return this->owner_.read_ready_(data1, size1, data2, size2);
+}
+
+void PtyApplianceStream::write_array(const uint8_t* data, size_t len) noexcept {
+    if (!this->owner_.is_open())
+        return;
+    size_t accepted;
+    {
+        std::lock_guard<std::mutex> lock(this->owner_.mutex_);
+        accepted = this->owner_.to_module_.push(data, len, PtyLoopback::Clock::now(), this->owner_.get_wire_time(1));
+    }
+    this->owner_.dropped_bytes_ += len - accepted;
+    this->owner_.wake_pump_();
+}
+
+uint32_t PtyApplianceStream::get_baud_rate() const noexcept {
+    return this->owner_.get_baud_rate();
+}
+
+bool PtyApplianceStream::set_baud_rate(uint32_t baud_rate) noexcept {
+    if (!this->supports_baud_rate(baud_rate))
+        return false;
+    this->owner_.set_baud_rate(baud_rate);
+    return true;
+}
+
+bool PtyApplianceStream::wait_for_data(std::chrono::microseconds timeout) noexcept {
+    auto deadline = PtyLoopback::Clock::now() + timeout;
+    std::unique_lock<std::mutex> lock(this->owner_.mutex_);
+    while (this->owner_.to_appliance_.update(PtyLoopback::Clock::now()) == 0) {
+        // Bytes on the wire are released by time, new bytes wake the condition
+        auto wake_time = std::min(deadline, this->owner_.to_appliance_.get_next_release());
+        if (PtyLoopback::Clock::now() >= deadline)
+            return false;
+        this->owner_.data_condition_.wait_until(lock, wake_time);
+    }
+    return true;
+}
+
+#endif // __linux__
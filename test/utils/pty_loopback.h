@@ -0,0 +1,111 @@
+#ifndef PTY_LOOPBACK
+#define PTY_LOOPBACK
+#include <stdint.h>
+#include <cstddef>
+#include "utils/protocol_stream.h"
+
+// Pseudo terminals are available on Linux only, on other platforms this header is empty
+#if __linux__
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "utils/circular_buffer.h"
+
+class PtyLoopback;
+
+// Simulator (appliance) side of the loopback
+class PtyApplianceStream : public haier_protocol::ProtocolStream {
+public:
+    PtyApplianceStream() = delete;
+    PtyApplianceStream& operator=(const PtyApplianceStream&) = delete;
+    size_t available() noexcept override;
+    size_t read_array(uint8_t* data, size_t len) noexcept override;
+    void write_array(const uint8_t* data, size_t len) noexcept override;
+    size_t read_into(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept override;
+    // Baud rate of the simulated line, the simulator follows CHANGE_BAUD_RATE requests with it
+    uint32_t get_baud_rate() const noexcept override;
+    bool supports_baud_rate(uint32_t baud_rate) const noexcept override { return baud_rate > 0; };
+    bool set_baud_rate(uint32_t baud_rate) noexcept override;
+    // Wait until there is data to read or timeout expires, return true if data is available
+    bool wait_for_data(std::chrono::microseconds timeout) noexcept;
+protected:
+    friend class PtyLoopback;
+    explicit PtyApplianceStream(PtyLoopback& owner) : owner_(owner) {};
+private:
+    PtyLoopback& owner_;
+};
+
+// Pseudo terminal pair that replaces USB adapter and appliance in end to end tests and benchmarks.
+// Module side opens the real SerialStream on get_port_path(), simulator (ProtocolHandler with
+// appliance handlers) works with get_appliance_stream(). A pump thread moves bytes between pty
+// master and simulator, so data goes through the kernel tty layer like with a real port.
+// With pacing baud rate > 0 both directions are paced like 8N1 line: every byte takes 10 bit times
+// and becomes available to the other side only when it is "received" completely.
+// Pacing baud rate 0 disables pacing, bytes are delivered as soon as the kernel passes them.
+class PtyLoopback {
+public:
+    explicit PtyLoopback(uint32_t pacing_baud_rate = 0);
+    PtyLoopback(const PtyLoopback&) = delete;
+    PtyLoopback& operator=(const PtyLoopback&) = delete;
+    ~PtyLoopback();
+    // Create pseudo terminal pair and start pump thread
+    bool open();
+    void close();
+    bool is_open() const { return master_handle_ >= 0; };
+    const std::string& get_port_path() const { return port_path_; };
+    PtyApplianceStream& get_appliance_stream() { return appliance_stream_; };
+    bool is_paced() const { return paced_; };
+    uint32_t get_baud_rate() const { return baud_rate_; };
+    // Applies to bytes sent after the call, bytes on the wire keep their timing
+    void set_baud_rate(uint32_t baud_rate);
+    // Time that size bytes take on the line at current baud rate, 0 without pacing
+    std::chrono::nanoseconds get_wire_time(size_t size) const;
+    // Bytes that didn't fit to the simulator buffers
+    uint64_t get_dropped_bytes() const { return dropped_bytes_; };
+private:
+    friend class PtyApplianceStream;
+    using Clock = std::chrono::steady_clock;
+    // Bytes that were sent to the line, released to the receiver byte by byte at line speed
+    struct PacedQueue {
+        struct Segment {
+            Clock::time_point start;
+            size_t size;
+            std::chrono::nanoseconds byte_time;
+        };
+        explicit PacedQueue(size_t capacity) : data(capacity) {};
+        size_t push(const uint8_t* bytes, size_t size, Clock::time_point now, std::chrono::nanoseconds byte_time);
+        // Move completely received bytes to ready, return the number of ready bytes
+        size_t update(Clock::time_point now);
+        // Time when the next byte is received, time_point::max() if the line is idle
+        Clock::time_point get_next_release() const;
+        CircularBuffer<uint8_t> data;
+        std::deque<Segment> segments;
+        size_t ready{ 0 };
+        Clock::time_point line_free;
+    };
+    void pump_();
+    size_t read_ready_(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2);
+    void wake_pump_();
+    int master_handle_{ -1 };
+    // Keeps the slave open, otherwise master reports hang up until SerialStream opens the port
+    int slave_handle_{ -1 };
+    int wake_handle_{ -1 };
+    std::string port_path_;
+    const bool paced_;
+    std::atomic<uint32_t> baud_rate_;
+    std::atomic<uint64_t> dropped_bytes_{ 0 };
+    std::atomic<bool> running_{ false };
+    std::mutex mutex_;
+    std::condition_variable data_condition_;
+    PacedQueue to_appliance_;
+    PacedQueue to_module_;
+    PtyApplianceStream appliance_stream_;
+    std::thread pump_thread_;
+};
+
+#endif // __linux__
+#endif // PTY_LOOPBACK
@@ -13,6 +13,12 @@ size_t VirtualStream::available() noexcept {
 size_t VirtualStream::read_array(uint8_t* data, size_t len) noexcept {
 	return this->rx_buffer_.pop(data, len);
 }
+size_t VirtualStream::read_into(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept {
+	size_t result = this->rx_buffer_.pop(data1, size1);
+	if ((result == size1) && (size2 > 0))
+		result += this->rx_buffer_.pop(data2, size2);
+	return result;
+}
 void VirtualStream::write_array(const uint8_t* data, size_t len) noexcept {
 	this->tx_buffer_.push(data, len);
 }
@@ -18,6 +18,7 @@ public:
     size_t available() noexcept override;
     size_t read_array(uint8_t* data, size_t len) noexcept override;
     void write_array(const uint8_t* data, size_t len) noexcept override;
+    size_t read_into(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept override;
 protected:
     friend class VirtualStreamHolder;
     VirtualStream(CircularBuffer<uint8_t>& tx_buffer, CircularBuffer<uint8_t>& rx_buffer);
@@ -0,0 +1,404 @@
+#if _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+#include <stdint.h>
+#include <cstring>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "console_log.h"
+#include "hon_server.h"
+#include "shard_runtime.h"
+#include "smartair2_server.h"
+#include "utils/circular_buffer.h"
+#include "utils/protocol_stream.h"
+#include "protocol/haier_protocol.h"
+#include "protocol/poll_scheduler.h"
+
+// Simulates many appliances in one process to find out how many of them one host
+// can drive. Every appliance is connected to its own client ProtocolHandler with
+// in-process streams, clients poll appliances with PollScheduler and send random commands.
+// Devices are spread over shards of ShardRuntime (one event loop per core), commands
+// are issued by a random peer device and travel to the owner shard through its mailbox.
+// With --scale the same swarm is run with 1, 2, 4... shards up to all cores.
+
+using namespace esphome::haier;
+
+constexpr size_t STREAM_BUFFER_SIZE = 1024;
+constexpr float REPORTED_PERCENTILES[] = { 50.0f, 90.0f, 99.0f, 99.9f };
+
+struct SwarmConfig {
+  unsigned int hon_count{ 1 };
+  unsigned int smartair2_count{ 0 };
+  unsigned int duration_s{ 10 };
+  unsigned int poll_interval_ms{ 1000 };
+  unsigned int answer_timeout_ms{ 200 };
+  unsigned int cooldown_ms{ 400 };
+  unsigned int shards{ 1 };          // 0 - one shard per core
+  unsigned int loop_interval_ms{ 1 };
+  float command_ratio{ 0.1f };       // commands per poll interval
+  float bus_budget{ 0.0f };          // share of 9600 baud link for requests, 0 - unlimited
+  bool pin_threads{ true };
+  bool scale{ false };
+  unsigned int scale_max_shards{ 0 }; // 0 - all cores
+};
+
+enum class ApplianceType {
+  HON,
+  SMARTAIR2,
+};
+
+// One direction of in-process connection
+class LoopbackStream : public haier_protocol::ProtocolStream {
+public:
+  LoopbackStream(CircularBuffer<uint8_t>& tx_buffer, CircularBuffer<uint8_t>& rx_buffer) : tx_buffer_(tx_buffer), rx_buffer_(rx_buffer) {};
+  size_t available() noexcept override { return this->rx_buffer_.get_size(); };
+  size_t read_array(uint8_t* data, size_t len) noexcept override { return this->rx_buffer_.pop(data, len); };
+  void write_array(const uint8_t* data, size_t len) noexcept override { this->tx_buffer_.push(data, len); };
+  size_t read_into(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept override {
+    size_t result = this->rx_buffer_.pop(data1, size1);
+    if ((result == size1) && (size2 > 0))
+      result += this->rx_buffer_.pop(data2, size2);
+    return result;
+  };
+private:
+  CircularBuffer<uint8_t>& tx_buffer_;
+  CircularBuffer<uint8_t>& rx_buffer_;
+};
+
+// Appliance with its client, all objects are used only from the thread of its shard
+class SwarmDevice : public ShardDevice {
+public:
+  SwarmDevice(ApplianceType type, DeviceId id, const SwarmConfig& config, ShardRuntime& runtime);
+  void loop(std::chrono::steady_clock::time_point now) override;
+  ApplianceType get_type() const { return this->type_; };
+  const haier_protocol::ProtocolHandler& get_client() const { return this->client_; };
+  unsigned int get_commands_sent() const { return this->commands_sent_; };
+  unsigned int get_commands_dropped() const { return this->commands_dropped_; };
+  unsigned int get_polls_sent() const;
+  // Time between posting a command and its start on the owner shard
+  const haier_protocol::LatencyHistogram& get_mailbox_latency() const { return this->mailbox_latency_; };
+private:
+  void post_command_();
+  // Runs on the shard of this device
+  void send_command_(std::chrono::steady_clock::time_point posted);
+  ApplianceType type_;
+  DeviceId id_;
+  const SwarmConfig& config_;
+  ShardRuntime& runtime_;
+  CircularBuffer<uint8_t> buffers_[2];
+  LoopbackStream appliance_stream_;
+  LoopbackStream client_stream_;
+  haier_protocol::ProtocolHandler appliance_;
+  haier_protocol::ProtocolHandler client_;
+  haier_protocol::PollScheduler scheduler_;
+  std::unique_ptr<HonServer> hon_server_;
+  std::unique_ptr<SmartAir2Server> smartair2_server_;
+  std::mt19937 random_;
+  std::chrono::steady_clock::time_point next_command_;
+  haier_protocol::LatencyHistogram mailbox_latency_;
+  unsigned int commands_sent_{ 0 };
+  unsigned int commands_dropped_{ 0 };
+};
+
+SwarmDevice::SwarmDevice(ApplianceType type, DeviceId id, const SwarmConfig& config, ShardRuntime& runtime) :
+  type_(type),
+  id_(id),
+  config_(config),
+  runtime_(runtime),
+  buffers_{ CircularBuffer<uint8_t>(STREAM_BUFFER_SIZE), CircularBuffer<uint8_t>(STREAM_BUFFER_SIZE) },
+  appliance_stream_(buffers_[0], buffers_[1]),
+  client_stream_(buffers_[1], buffers_[0]),
+  appliance_(appliance_stream_),
+  client_(client_stream_),
+  scheduler_(client_, (uint32_t) id),
+  random_(id) {
+  if (type == ApplianceType::HON) {
+    this->hon_server_.reset(new HonServer());
+    this->hon_server_->register_handlers(this->appliance_);
+  } else {
+    this->smartair2_server_.reset(new SmartAir2Server());
+    this->smartair2_server_->register_handlers(this->appliance_);
+  }
+  this->client_.set_answer_timeout(config.answer_timeout_ms);
+  this->client_.set_cooldown_interval(config.cooldown_ms);
+  this->client_.enable_latency_statistics();
+  haier_protocol::AnswerHandler answer_handler = [](haier_protocol::FrameType, haier_protocol::FrameType, const uint8_t*, size_t) {
+    return haier_protocol::HandlerError::HANDLER_OK;
+  };
+  this->client_.set_default_answer_handler(answer_handler);
+  // Status at poll interval (4 times faster after commands), hOn big data and alarms less often
+  std::chrono::milliseconds poll_interval(config.poll_interval_ms);
+  if (type == ApplianceType::HON) {
+    this->scheduler_.add_poll(haier_protocol::HaierMessage(haier_protocol::FrameType::CONTROL, (uint16_t) hon_protocol::SubcommandsControl::GET_USER_DATA), true, poll_interval, poll_interval / 4);
+    this->scheduler_.add_poll(haier_protocol::HaierMessage(haier_protocol::FrameType::CONTROL, (uint16_t) hon_protocol::SubcommandsControl::GET_BIG_DATA), true, poll_interval * 5);
+    this->scheduler_.add_poll(haier_protocol::HaierMessage(haier_protocol::FrameType::GET_ALARM_STATUS), true, poll_interval * 10);
+  } else {
+    this->scheduler_.add_poll(haier_protocol::HaierMessage(haier_protocol::FrameType::CONTROL, 0x4D01), false, poll_interval, poll_interval / 4);
+  }
+  this->scheduler_.set_bus_budget(config.bus_budget);
+  this->scheduler_.register_handlers(answer_handler);
+  this->next_command_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(this->random_() % (config.poll_interval_ms + 1));
+}
+
+unsigned int SwarmDevice::get_polls_sent() const {
+  unsigned int result = 0;
+  for (haier_protocol::PollId poll = 0; poll < this->scheduler_.get_polls_count(); poll++)
+    result += this->scheduler_.get_poll_statistics(poll).requests_sent.get();
+  return result;
+}
+
+void SwarmDevice::post_command_() {
+  if (std::uniform_real_distribution<float>(0.0f, 1.0f)(this->random_) >= this->config_.command_ratio)
+    return;
+  // Command for a random peer, usually it lives on another shard
+  DeviceId target = this->id_;
+  size_t devices_count = this->runtime_.get_devices_count();
+  if (devices_count > 1)
+    target = (DeviceId) ((this->id_ + 1 + this->random_() % (devices_count - 1)) % devices_count);
+  std::chrono::steady_clock::time_point posted = std::chrono::steady_clock::now();
+  if (!this->runtime_.post(target, [posted](ShardDevice& device) { static_cast<SwarmDevice&>(device).send_command_(posted); }))
+    this->commands_dropped_++;
+}
+
+void SwarmDevice::send_command_(std::chrono::steady_clock::time_point posted) {
+  this->mailbox_latency_.record(std::chrono::steady_clock::now() - posted);
+  if (this->type_ == ApplianceType::HON) {
+    uint8_t parameter = (uint8_t) (this->random_() % 2 == 0 ? hon_protocol::DataParameters::SET_POINT : hon_protocol::DataParameters::AC_POWER);
+    uint16_t value = (uint16_t) (parameter == (uint8_t) hon_protocol::DataParameters::SET_POINT ? this->random_() % 15 : this->random_() % 2);
+    uint8_t data[2] = { (uint8_t) (value >> 8), (uint8_t) (value & 0xFF) };
+    this->scheduler_.send_command(haier_protocol::HaierMessage(haier_protocol::FrameType::CONTROL, (uint16_t) hon_protocol::SubcommandsControl::SET_SINGLE_PARAMETER + parameter, data, sizeof(data)), true);
+  } else {
+    // SmartAir2 commands: 0x4D01 - status, 0x4D02 - power on, 0x4D03 - power off
+    uint16_t subcommand = this->random_() % 2 == 0 ? 0x4D02 : 0x4D03;
+    this->scheduler_.send_command(haier_protocol::HaierMessage(haier_protocol::FrameType::CONTROL, subcommand), false);
+  }
+  this->commands_sent_++;
+}
+
+void SwarmDevice::loop(std::chrono::steady_clock::time_point now) {
+  if (now >= this->next_command_) {
+    this->post_command_();
+    this->next_command_ += std::chrono::milliseconds(this->config_.poll_interval_ms);
+    if (this->next_command_ < now)
+      this->next_command_ = now;
+  }
+  this->scheduler_.loop(now);
+  this->client_.loop();
+  this->appliance_.loop();
+  if (this->hon_server_ != nullptr)
+    this->hon_server_->process_alarms(&this->appliance_);
+}
+
+double get_process_cpu_time() {
+#if _WIN32
+  FILETIME creation_time, exit_time, kernel_time, user_time;
+  GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time);
+  auto to_seconds = [](const FILETIME& time) {
+    return (double) (((uint64_t) time.dwHighDateTime << 32) | time.dwLowDateTime) / 1e7;
+  };
+  return to_seconds(kernel_time) + to_seconds(user_time);
+#else
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#endif
+}
+
+void add_answer_latency(haier_protocol::LatencyHistogram& histogram, const haier_protocol::ProtocolHandler& client) {
+  const haier_protocol::FrameTypeTable<haier_protocol::LatencyHistogram>& answer_latency = client.get_latency_statistics()->answer_latency;
+  for (size_t i = 0; i < answer_latency.get_types_count(); i++)
+    histogram.merge(answer_latency.get_at(i));
+  histogram.merge(answer_latency.get_other());
+}
+
+struct SwarmTotals {
+  unsigned int devices_count{ 0 };
+  unsigned long long frames{ 0 };
+  unsigned long long polls{ 0 };
+  unsigned long long commands{ 0 };
+  unsigned long long commands_dropped{ 0 };
+  unsigned long long answers{ 0 };
+  unsigned long long retries{ 0 };
+  unsigned long long timeouts{ 0 };
+  unsigned long long frame_errors{ 0 };
+  uint32_t worst_p99{ 0 };
+  haier_protocol::LatencyHistogram answer_latency;
+  haier_protocol::LatencyHistogram mailbox_latency;
+};
+
+// Devices of one type or all devices if type is nullptr
+void collect_totals(SwarmTotals& totals, const std::vector<SwarmDevice*>& devices, const ApplianceType* type) {
+  for (const SwarmDevice* device : devices) {
+    if ((type != nullptr) && (device->get_type() != *type))
+      continue;
+    const haier_protocol::ProtocolHandler& client = device->get_client();
+    const haier_protocol::ProtocolStatistics& statistics = client.get_statistics();
+    const haier_protocol::TransportStatistics& transport_statistics = client.get_transport_statistics();
+    totals.devices_count++;
+    totals.frames += transport_statistics.frames_sent.get() + transport_statistics.frames_parsed.get();
+    for (size_t i = 0; i < haier_protocol::FRAME_ERRORS_COUNT; i++)
+      totals.frame_errors += transport_statistics.frame_errors[i].get();
+    totals.polls += device->get_polls_sent();
+    totals.commands += device->get_commands_sent();
+    totals.commands_dropped += device->get_commands_dropped();
+    totals.answers += statistics.answers_received.get();
+    totals.retries += statistics.retries.get();
+    totals.timeouts += statistics.answer_timeouts.get_total();
+    haier_protocol::LatencyHistogram device_latency;
+    add_answer_latency(device_latency, client);
+    if (device_latency.get_percentile(99.0f) > totals.worst_p99)
+      totals.worst_p99 = device_latency.get_percentile(99.0f);
+    totals.answer_latency.merge(device_latency);
+    totals.mailbox_latency.merge(device->get_mailbox_latency());
+  }
+}
+
+void print_latency(const haier_protocol::LatencyHistogram& histogram) {
+  for (float percentile : REPORTED_PERCENTILES)
+    std::cout << "p" << percentile << "=" << histogram.get_percentile(percentile) << "us ";
+  std::cout << "max=" << histogram.get_max() << "us";
+}
+
+void print_report(const char* title, const std::vector<SwarmDevice*>& devices, ApplianceType type, double duration_s) {
+  SwarmTotals totals;
+  collect_totals(totals, devices, &type);
+  if (totals.devices_count == 0)
+    return;
+  std::cout << title << ": " << totals.devices_count << " devices" << std::endl;
+  std::cout << "  frames/s:        " << (unsigned long long) (totals.frames / duration_s) << std::endl;
+  std::cout << "  requests:        " << totals.polls << " polls, " << totals.commands << " commands" << std::endl;
+  std::cout << "  answers:         " << totals.answers << std::endl;
+  std::cout << "  retries:         " << totals.retries << std::endl;
+  std::cout << "  answer timeouts: " << totals.timeouts << std::endl;
+  std::cout << "  frame errors:    " << totals.frame_errors << std::endl;
+  std::cout << "  answer latency:  ";
+  print_latency(totals.answer_latency);
+  std::cout << ", worst device p99=" << totals.worst_p99 << "us" << std::endl;
+  std::cout << "  mailbox latency: ";
+  print_latency(totals.mailbox_latency);
+  std::cout << ", " << totals.commands_dropped << " commands dropped" << std::endl;
+}
+
+// Create swarm on shards_count shards, run it for configured time, return real duration
+double run_swarm(const SwarmConfig& config, unsigned int shards_count, std::unique_ptr<ShardRuntime>& runtime, std::vector<SwarmDevice*>& devices, double& cpu_time) {
+  runtime.reset(new ShardRuntime(shards_count));
+  devices.clear();
+  for (unsigned int i = 0; i < config.hon_count + config.smartair2_count; i++) {
+    SwarmDevice* device = new SwarmDevice(i < config.hon_count ? ApplianceType::HON : ApplianceType::SMARTAIR2, i, config, *runtime);
+    runtime->add_device(std::unique_ptr<ShardDevice>(device));
+    devices.push_back(device);
+  }
+  double cpu_start = get_process_cpu_time();
+  std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+  runtime->start(std::chrono::milliseconds(config.loop_interval_ms), config.pin_threads);
+  std::this_thread::sleep_until(start_time + std::chrono::seconds(config.duration_s));
+  runtime->stop();
+  cpu_time = get_process_cpu_time() - cpu_start;
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+void run_scaling(const SwarmConfig& config) {
+  unsigned int max_shards = config.scale_max_shards > 0 ? config.scale_max_shards : ShardRuntime::get_cores_count();
+  std::vector<unsigned int> steps;
+  for (unsigned int shards_count = 1; shards_count < max_shards; shards_count *= 2)
+    steps.push_back(shards_count);
+  steps.push_back(max_shards);
+  std::cout << "Scaling " << config.hon_count << " hOn and " << config.smartair2_count << " SmartAir2 appliances from 1 to " << max_shards << " shard(s), " <<
+    config.duration_s << "s per step, " << ShardRuntime::get_cores_count() << " core(s)" << std::endl;
+  std::cout << "shards  frames/s  answer p50/p99/max, us  mailbox p50/p99, us  timeouts  CPU, %" << std::endl;
+  auto latency = [](uint32_t p50, uint32_t p99, uint32_t max) {
+    std::string text = std::to_string(p50) + "/" + std::to_string(p99);
+    return max > 0 ? text + "/" + std::to_string(max) : text;
+  };
+  for (unsigned int shards_count : steps) {
+    std::unique_ptr<ShardRuntime> runtime;
+    std::vector<SwarmDevice*> devices;
+    double cpu_time;
+    double duration_s = run_swarm(config, shards_count, runtime, devices, cpu_time);
+    SwarmTotals totals;
+    collect_totals(totals, devices, nullptr);
+    std::cout << std::setw(6) << shards_count << std::setw(10) << (unsigned long long) (totals.frames / duration_s) <<
+      std::setw(24) << latency(totals.answer_latency.get_percentile(50.0f), totals.answer_latency.get_percentile(99.0f), totals.answer_latency.get_max()) <<
+      std::setw(21) << latency(totals.mailbox_latency.get_percentile(50.0f), totals.mailbox_latency.get_percentile(99.0f), 0) <<
+      std::setw(10) << totals.timeouts << std::setw(8) << (unsigned int) (cpu_time * 100.0 / duration_s) << std::endl;
+  }
+}
+
+bool parse_arguments(int argc, char** argv, SwarmConfig& config) {
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc)
+      return false;
+    const char* name = argv[i];
+    const char* value = argv[++i];
+    if (strcmp(name, "--hon") == 0)
+      config.hon_count = atoi(value);
+    else if (strcmp(name, "--smartair2") == 0)
+      config.smartair2_count = atoi(value);
+    else if (strcmp(name, "--duration") == 0)
+      config.duration_s = atoi(value);
+    else if (strcmp(name, "--poll-interval") == 0)
+      config.poll_interval_ms = atoi(value);
+    else if (strcmp(name, "--command-ratio") == 0)
+      config.command_ratio = (float) atof(value);
+    else if (strcmp(name, "--bus-budget") == 0)
+      config.bus_budget = (float) atof(value);
+    else if (strcmp(name, "--answer-timeout") == 0)
+      config.answer_timeout_ms = atoi(value);
+    else if (strcmp(name, "--cooldown") == 0)
+      config.cooldown_ms = atoi(value);
+    else if ((strcmp(name, "--shards") == 0) || (strcmp(name, "--threads") == 0))
+      config.shards = atoi(value);
+    else if (strcmp(name, "--loop-interval") == 0)
+      config.loop_interval_ms = atoi(value);
+    else if (strcmp(name, "--pin") == 0)
+      config.pin_threads = atoi(value) != 0;
+    else if (strcmp(name, "--scale") == 0) {
+      config.scale = true;
+      config.scale_max_shards = atoi(value);
+    } else
+      return false;
+  }
+  return (config.hon_count + config.smartair2_count > 0) && (config.duration_s > 0) && (config.poll_interval_ms > 0);
+}
+
+int main(int argc, char** argv) {
+  SwarmConfig config;
+  if (!parse_arguments(argc, argv, config)) {
+    std::cout << "Please use: appliance_swarm [--hon <n>] [--smartair2 <n>] [--duration <s>] [--poll-interval <ms>] [--command-ratio <0..1>]" << std::endl;
+    std::cout << "                            [--answer-timeout <ms>] [--cooldown <ms>] [--shards <n, 0 - all cores>] [--loop-interval <ms>]" << std::endl;
+    std::cout << "                            [--pin <0|1>] [--scale <max shards, 0 - all cores>] [--bus-budget <0..1, 0 - unlimited>]" << std::endl;
+    return 1;
+  }
+  // console_logger is not thread safe, appliances log only warnings and errors
+  std::mutex log_mutex;
+  haier_protocol::set_log_handler([&log_mutex](haier_protocol::HaierLogLevel level, const char* tag, const char* message) {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    console_logger(level, tag, "%s", message);
+  });
+  haier_protocol::set_log_level(haier_protocol::HaierLogLevel::LEVEL_WARNING);
+  if (config.scale) {
+    run_scaling(config);
+    return 0;
+  }
+  unsigned int shards_count = config.shards > 0 ? config.shards : ShardRuntime::get_cores_count();
+  std::cout << "Running " << config.hon_count << " hOn and " << config.smartair2_count << " SmartAir2 appliances on " << shards_count << " shard(s) for " << config.duration_s << "s" << std::endl;
+  std::unique_ptr<ShardRuntime> runtime;
+  std::vector<SwarmDevice*> devices;
+  double cpu_time;
+  double duration_s = run_swarm(config, shards_count, runtime, devices, cpu_time);
+  print_report("hOn", devices, ApplianceType::HON, duration_s);
+  print_report("SmartAir2", devices, ApplianceType::SMARTAIR2, duration_s);
+  std::cout << "CPU: " << (unsigned int) (cpu_time * 100.0 / duration_s) << "% of one core, " <<
+    (unsigned int) (cpu_time * 1e6 / duration_s / devices.size()) << "us/s per device" << std::endl;
+  return 0;
+}
\ No newline at end of file
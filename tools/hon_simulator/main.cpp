@@ -6,7 +6,8 @@
 #include <string>
 
 using namespace esphome::haier::hon_protocol;
-HvacFullStatus& ac_state = get_ac_state_ref();
+HonServer hon_server;
+HonStatusView ac_state = hon_server.get_ac_state();
 
 enum class PiringMode {
   NONE = 0,
@@ -21,9 +22,9 @@ bool _reset_alarm{ false };
 void preloop(haier_protocol::ProtocolHandler* handler) {
   if (_toggle_ac_power) {
     _toggle_ac_power = false;
-    if (!is_in_configuration_mode()) {
-      uint8_t ac_power = ac_state.control.ac_power;
-      ac_state.control.ac_power = ac_power == 1 ? 0 : 1;
+    if (!hon_server.is_in_configuration_mode()) {
+      uint8_t ac_power = ac_state.control().ac_power();
+      ac_state.control().set_ac_power(ac_power == 1 ? 0 : 1);
       HAIER_LOGI("AC power is %s", ac_power == 1 ? "Off" : "On");
     } else {
       HAIER_LOGW("Can't change AC power when in configuration mode!");
@@ -31,85 +32,75 @@ void preloop(haier_protocol::ProtocolHandler* handler) {
   }
   if (_pairing_mode == PiringMode::HON_PAIRING) {
     _pairing_mode = PiringMode::NONE;
-    if (!is_in_configuration_mode()) {
+    if (!hon_server.is_in_configuration_mode()) {
       HAIER_LOGI("Entering hOn pairing mode");
-      ac_state.control.set_point = 0x0E;
-      ac_state.control.vertical_swing_mode = (uint8_t) VerticalSwingMode::MAX_UP;
-      ac_state.control.fan_mode = (uint8_t)FanMode::FAN_LOW;
-      ac_state.control.special_mode = (uint8_t)SpecialMode::NONE;
-      ac_state.control.ac_mode = (uint8_t)ConditioningMode::COOL;
-      ac_state.control.ten_degree = 0;
-      ac_state.control.display_status = 1;
-      ac_state.control.half_degree = 0;
-      ac_state.control.intelligence_status = 0;
-      ac_state.control.pmv_status = 0;
-      ac_state.control.use_fahrenheit = 0;
-      ac_state.control.ac_power = 1;
-      ac_state.control.health_mode = 1;
-      ac_state.control.electric_heating_status = 0;
-      ac_state.control.fast_mode = 0;
-      ac_state.control.quiet_mode = 0;
-      ac_state.control.sleep_mode = 0;
-      ac_state.control.lock_remote = 0;
-      ac_state.control.beeper_status = 0;
-      ac_state.control.horizontal_swing_mode = (uint8_t)HorizontalSwingMode::CENTER;
-      ac_state.control.fresh_air_status = 0;
-      ac_state.control.humidification_status = 0;
-      ac_state.control.pm2p5_cleaning_status = 1;
-      ac_state.control.ch2o_cleaning_status = 1;
-      ac_state.control.self_cleaning_status = 0;
-      ac_state.control.light_status = 0;
-      ac_state.control.energy_saving_status = 0;
-      ac_state.control.cleaning_time_status = 0;
+      ac_state.control().set_set_point(0x0E);
+      ac_state.control().set_vertical_swing_mode((uint8_t) VerticalSwingMode::MAX_UP);
+      ac_state.control().set_fan_mode((uint8_t)FanMode::FAN_LOW);
+      ac_state.control().set_special_mode((uint8_t)SpecialMode::NONE);
+      ac_state.control().set_ac_mode((uint8_t)ConditioningMode::COOL);
+      ac_state.control().set_ten_degree(0);
+      ac_state.control().set_display_status(1);
+      ac_state.control().set_half_degree(0);
+      ac_state.control().set_intelligence_status(0);
+      ac_state.control().set_pmv_status(0);
+      ac_state.control().set_use_fahrenheit(0);
+      ac_state.control().set_ac_power(1);
+      ac_state.control().set_health_mode(1);
+      ac_state.control().set_electric_heating_status(0);
+      ac_state.control().set_fast_mode(0);
+      ac_state.control().set_quiet_mode(0);
+      ac_state.control().set_sleep_mode(0);
+      ac_state.control().set_lock_remote(0);
+      ac_state.control().set_beeper_status(0);
+      ac_state.control().set_horizontal_swing_mode((uint8_t)HorizontalSwingMode::CENTER);
+      ac_state.control().set_fresh_air_status(0);
+      ac_state.control().set_humidification_status(0);
+      ac_state.control().set_pm2p5_cleaning_status(1);
+      ac_state.control().set_ch2o_cleaning_status(1);
+      ac_state.control().set_self_cleaning_status(0);
+      ac_state.control().set_light_status(0);
+      ac_state.control().set_energy_saving_status(0);
+      ac_state.control().set_cleaning_time_status(0);
     }
   }
   if (_trigger_random_alarm) {
     _trigger_random_alarm = false;
     size_t r = esphome::haier::hon_protocol::HON_ALARM_COUNT -   std::rand() % (esphome::haier::hon_protocol::HON_ALARM_COUNT);
     HAIER_LOGI("Random alarm triggered. Alarm code %d", r);
-    start_alarm(r);
+    hon_server.start_alarm(r);
   }
   if (_reset_alarm) {
     _reset_alarm = false;
     HAIER_LOGI("Reseting all alarms");
-    reset_alarms();
+    hon_server.reset_alarms();
   }
-  process_alarms(handler);
+  hon_server.process_alarms(handler);
 }
 
 int main(int argc, char** argv) {
-  if (argc == 2) {
+  if ((argc == 2) || (argc == 3)) {
     std::srand(std::time(nullptr));
-    message_handlers mhandlers;
-    mhandlers[haier_protocol::FrameType::GET_DEVICE_VERSION] = get_device_version_handler;
-    mhandlers[haier_protocol::FrameType::GET_DEVICE_ID] = get_device_id_handler;
-    mhandlers[haier_protocol::FrameType::CONTROL] = status_request_handler;
-    mhandlers[haier_protocol::FrameType::GET_ALARM_STATUS] = alarm_status_handler;
-    mhandlers[haier_protocol::FrameType::GET_MANAGEMENT_INFORMATION] = get_management_information_handler;
-    mhandlers[haier_protocol::FrameType::REPORT_NETWORK_STATUS] = report_network_status_handler;
-    mhandlers[haier_protocol::FrameType::STOP_FAULT_ALARM] = stop_alarm_handler;
-    answer_handlers ahandlers;
-    ahandlers[haier_protocol::FrameType::ALARM_STATUS] = alarm_status_report_answer_handler;
     keyboard_handlers khandlers;
     khandlers['1'] = []() { _toggle_ac_power = true; };
     khandlers['2'] = []() { _pairing_mode = PiringMode::HON_PAIRING; };
     khandlers['3'] = []() {
-      ac_state.control.self_cleaning_status = false;
-      ac_state.control.steri_clean = false; 
+      ac_state.control().set_self_cleaning_status(false);
+      ac_state.control().set_steri_clean(false); 
     };
     khandlers['4'] = []() {
-      ac_state.control.quiet_mode = 1 - ac_state.control.quiet_mode;
-      HAIER_LOGI("Quiet mode is %s", ac_state.control.quiet_mode  == 1 ? "On" : "Off");
+      ac_state.control().set_quiet_mode(1 - ac_state.control().quiet_mode());
+      HAIER_LOGI("Quiet mode is %s", ac_state.control().quiet_mode()  == 1 ? "On" : "Off");
     };
     khandlers['5'] = []() {
-      ac_state.control.health_mode = 1 - ac_state.control.health_mode;
-      HAIER_LOGI("Health mode is %s", ac_state.control.health_mode == 1 ? "On" : "Off");
+      ac_state.control().set_health_mode(1 - ac_state.control().health_mode());
+      HAIER_LOGI("Health mode is %s", ac_state.control().health_mode() == 1 ? "On" : "Off");
     };
     khandlers['a'] = []() { _trigger_random_alarm = true; };
     khandlers['s'] = []() { _reset_alarm = true; };
-    simulator_main("hOn HVAC simulator", argv[1], mhandlers, ahandlers, khandlers, preloop);
+    simulator_main("hOn HVAC simulator", argv[1], std::bind(&HonServer::register_handlers, &hon_server, std::placeholders::_1), khandlers, preloop, argc == 3 ? argv[2] : nullptr);
   }
   else {
-    std::cout << "Please use: hon_simulator <port>" << std::endl;
+    std::cout << "Please use: hon_simulator <port> [<metrics_port> | unix:<metrics_socket>]" << std::endl;
   }
 }
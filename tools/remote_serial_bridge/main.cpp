@@ -1,192 +1,960 @@
 ﻿#if _WIN32
 #define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
 #include <ws2tcpip.h>
 #else
-#include <cstring>
-//#include <stdlib.h>
-//#include <string.h>
-#include <unistd.h>
-//#include <sys/types.h> 
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
-//#include <netinet/in.h>
-#include <netdb.h> 
+#include <unistd.h>
 #endif
+#include <stdint.h>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <string>
 #include <thread>
+#include <vector>
 #include "console_log.h"
+#include "frame_batcher.h"
 #include "serial_stream.h"
+#include "utils/circular_buffer.h"
+#include "utils/latency_histogram.h"
+#include "transport/protocol_transport.h"
+
+// Relays bytes between local serial ports and remote TCP servers so appliances
+// can be reached over network. Every port has its own connection and all of them
+// are served by one event loop (epoll on Linux). Data is forwarded as soon as it
+// arrives. Buffers are bounded: when one side can't take more data the bridge
+// stops reading from the other one, so TCP flow control pushes back to the server.
+// Lost connections and ports are reopened with growing delay.
+// Observers connected to --observe port get a read-only copy of the traffic.
+// They are not authenticated, so the port listens only on loopback unless
+// another address is given with --observer-bind.
+//
+// In frame mode (--frames) data from serial port is parsed by the library
+// transport and only whole frames are sent to the server. Frames that come
+// one after another within flush interval are sent together in one segment.
+// With --timestamps every frame is prefixed with 10 bytes header: frame size
+// (16 bit) and time when frame start was received (64 bit, microseconds since
+// Unix epoch), both big endian. Server to serial direction is always raw.
+
+constexpr size_t DEFAULT_BUFFER_SIZE = 4096;
+constexpr const char* DEFAULT_TCP_PORT = "8888";
+constexpr const char* DEFAULT_OBSERVER_BIND = "127.0.0.1";
+constexpr size_t MAX_OBSERVERS = 8;
+constexpr size_t READ_CHUNK_SIZE = 1024;
+// Batch should fit in one segment of typical mobile network
+constexpr size_t MAX_BATCH_SIZE = 1400;
+constexpr std::chrono::milliseconds MIN_RECONNECT_DELAY(500);
+constexpr std::chrono::milliseconds MAX_RECONNECT_DELAY(10000);
+constexpr std::chrono::milliseconds MAX_WAIT_TIME(100);
+constexpr float REPORTED_PERCENTILES[] = { 50.0f, 99.0f };
 
-bool app_exiting{ false };
+#if _WIN32
+using native_socket = SOCKET;
+#define close_socket(s) closesocket(s)
+#define SEND_FLAGS 0
+#else
+using native_socket = int;
+constexpr native_socket INVALID_SOCKET = -1;
+#define close_socket(s) close(s)
+#define SEND_FLAGS MSG_NOSIGNAL
+#endif
 
-#define SERIAL_BUFFER_SIZE 2048
-#define SOCKET_BUFFER_SIZE 2048
+volatile std::sig_atomic_t app_exiting{ 0 };
 
-static uint8_t serial_buffer[SERIAL_BUFFER_SIZE];
-static uint8_t socket_buffer[SOCKET_BUFFER_SIZE];
+void signal_handler(int) {
+  app_exiting = 1;
+}
+
+namespace {
 
+int get_socket_error() {
 #if _WIN32
-  using TcpSocket = SOCKET;
+  return WSAGetLastError();
 #else
-  using TcpSocket = int;
-  constexpr int INVALID_SOCKET=-1;
-  constexpr int SOCKET_ERROR=-1;
+  return errno;
 #endif
+}
 
+bool is_would_block(int error) {
 #if _WIN32
-TcpSocket open_socket(char* addr, unsigned int port) {
-  WSADATA wsaData;
-  TcpSocket socket_res = INVALID_SOCKET;
-  struct addrinfo* result = NULL,
-    * ptr = NULL,
-    hints;
-  int res = WSAStartup(MAKEWORD(2, 2), &wsaData);
-  if (res != 0) {
-    HAIER_LOGE("WSAStartup failed with error: %d", res);
-    return INVALID_SOCKET;
+  return error == WSAEWOULDBLOCK;
+#else
+  return (error == EAGAIN) || (error == EWOULDBLOCK) || (error == EINPROGRESS) || (error == EINTR);
+#endif
+}
+
+bool set_socket_options(native_socket s) {
+#if _WIN32
+  u_long mode = 1;
+  if (ioctlsocket(s, FIONBIO, &mode) != 0)
+    return false;
+#else
+  int flags = fcntl(s, F_GETFL, 0);
+  if ((flags < 0) || (fcntl(s, F_SETFL, flags | O_NONBLOCK) != 0))
+    return false;
+#endif
+  int one = 1;
+  // Frames are small and latency sensitive, don't wait to coalesce them
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+  setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, (const char*)&one, sizeof(one));
+  return true;
+}
+
+// Return number of bytes sent, 0 if socket is busy or -1 on error
+long send_some(native_socket s, const uint8_t* data, size_t size) {
+  int res = send(s, (const char*)data, (int)size, SEND_FLAGS);
+  if (res >= 0)
+    return res;
+  return is_would_block(get_socket_error()) ? 0 : -1;
+}
+
+constexpr uint32_t POLL_READ = 1;
+constexpr uint32_t POLL_WRITE = 2;
+constexpr uint32_t POLL_ERROR = 4;
+
+struct PollEvent {
+  void* owner;
+  uint32_t events;
+};
+
+// epoll on Linux. Windows can't wait on serial ports and sockets together,
+// there sockets are checked with WSAPoll and serial ports are polled every 1ms.
+class Poller {
+public:
+  Poller();
+  Poller(const Poller&) = delete;
+  Poller& operator=(const Poller&) = delete;
+  ~Poller();
+  bool is_valid() const;
+  // handle is file descriptor or socket, owner identifies it in events
+  bool add(intptr_t handle, void* owner, uint32_t events, bool is_socket);
+  bool modify(intptr_t handle, void* owner, uint32_t events);
+  void remove(intptr_t handle, void* owner);
+  size_t wait(PollEvent* events, size_t max_events, std::chrono::milliseconds timeout);
+private:
+#if __linux__
+  int epoll_handle_;
+#else
+  struct Item {
+    intptr_t handle;
+    void* owner;
+    uint32_t events;
+    bool is_socket;
+  };
+  std::vector<Item> items_;
+#endif
+};
+
+#if __linux__
+uint32_t to_epoll_events(uint32_t events) {
+  return ((events & POLL_READ) != 0 ? (uint32_t)EPOLLIN : 0) | ((events & POLL_WRITE) != 0 ? (uint32_t)EPOLLOUT : 0);
+}
+
+Poller::Poller() : epoll_handle_(epoll_create1(EPOLL_CLOEXEC)) {
+}
+
+Poller::~Poller() {
+  if (epoll_handle_ >= 0)
+    close(epoll_handle_);
+}
+
+bool Poller::is_valid() const {
+  return epoll_handle_ >= 0;
+}
+
+bool Poller::add(intptr_t handle, void* owner, uint32_t events, bool) {
+  struct epoll_event event = {};
+  event.events = to_epoll_events(events);
+  event.data.ptr = owner;
+  return epoll_ctl(epoll_handle_, EPOLL_CTL_ADD, (int)handle, &event) == 0;
+}
+
+bool Poller::modify(intptr_t handle, void* owner, uint32_t events) {
+  struct epoll_event event = {};
+  event.events = to_epoll_events(events);
+  event.data.ptr = owner;
+  return epoll_ctl(epoll_handle_, EPOLL_CTL_MOD, (int)handle, &event) == 0;
+}
+
+void Poller::remove(intptr_t handle, void*) {
+  epoll_ctl(epoll_handle_, EPOLL_CTL_DEL, (int)handle, nullptr);
+}
+
+size_t Poller::wait(PollEvent* events, size_t max_events, std::chrono::milliseconds timeout) {
+  constexpr size_t MAX_EPOLL_EVENTS = 32;
+  struct epoll_event epoll_events[MAX_EPOLL_EVENTS];
+  int count = epoll_wait(epoll_handle_, epoll_events, (int)std::min(max_events, MAX_EPOLL_EVENTS), (int)timeout.count());
+  if (count <= 0)
+    return 0;
+  for (int i = 0; i < count; i++) {
+    uint32_t flags = epoll_events[i].events;
+    events[i].owner = epoll_events[i].data.ptr;
+    events[i].events = ((flags & EPOLLIN) != 0 ? POLL_READ : 0) | ((flags & EPOLLOUT) != 0 ? POLL_WRITE : 0) |
+                       ((flags & (EPOLLERR | EPOLLHUP)) != 0 ? POLL_ERROR : 0);
+  }
+  return (size_t)count;
+}
+#else
+Poller::Poller() {
+}
+
+Poller::~Poller() {
+}
+
+bool Poller::is_valid() const {
+  return true;
+}
+
+bool Poller::add(intptr_t handle, void* owner, uint32_t events, bool is_socket) {
+  items_.push_back({ handle, owner, events, is_socket });
+  return true;
+}
+
+bool Poller::modify(intptr_t, void* owner, uint32_t events) {
+  for (Item& item : items_)
+    if (item.owner == owner) {
+      item.events = events;
+      return true;
+    }
+  return false;
+}
+
+void Poller::remove(intptr_t, void* owner) {
+  for (auto it = items_.begin(); it != items_.end(); ++it)
+    if (it->owner == owner) {
+      items_.erase(it);
+      return;
+    }
+}
+
+size_t Poller::wait(PollEvent* events, size_t max_events, std::chrono::milliseconds timeout) {
+  std::vector<WSAPOLLFD> fds;
+  std::vector<const Item*> socket_items;
+  bool has_serial = false;
+  for (const Item& item : items_) {
+    if (!item.is_socket) {
+      has_serial = true;
+    } else if (item.events != 0) {
+      WSAPOLLFD fd = {};
+      fd.fd = (SOCKET)item.handle;
+      fd.events = ((item.events & POLL_READ) != 0 ? POLLRDNORM : 0) | ((item.events & POLL_WRITE) != 0 ? POLLWRNORM : 0);
+      fds.push_back(fd);
+      socket_items.push_back(&item);
+    }
+  }
+  if (has_serial)
+    timeout = std::min(timeout, std::chrono::milliseconds(1));
+  if (fds.empty())
+    std::this_thread::sleep_for(timeout);
+  else if (WSAPoll(fds.data(), (ULONG)fds.size(), (INT)timeout.count()) < 0)
+    return 0;
+  size_t count = 0;
+  for (size_t i = 0; (i < fds.size()) && (count < max_events); i++) {
+    if (fds[i].revents == 0)
+      continue;
+    events[count].owner = socket_items[i]->owner;
+    events[count].events = ((fds[i].revents & (POLLRDNORM | POLLHUP)) != 0 ? POLL_READ : 0) | ((fds[i].revents & POLLWRNORM) != 0 ? POLL_WRITE : 0) |
+                           ((fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) != 0 ? POLL_ERROR : 0);
+    count++;
+  }
+  // Serial ports are non-blocking, reading or writing them is cheap when nothing is pending
+  for (const Item& item : items_)
+    if (!item.is_socket && (item.events != 0) && (count < max_events))
+      events[count++] = { item.owner, item.events };
+  return count;
+}
+#endif
+
+// Bounded byte queue, remembers when data arrived to measure time it spends in the bridge
+class RelayBuffer {
+public:
+  explicit RelayBuffer(size_t capacity) : data_(capacity) {};
+  bool empty() const { return data_.empty(); };
+  size_t get_space() const { return data_.get_space(); };
+  size_t push(const uint8_t* data, size_t size, std::chrono::steady_clock::time_point now);
+  // writer(data, size) returns number of bytes written, 0 if destination is busy or -1 on error
+  template<class Writer>
+  long flush(Writer writer, haier_protocol::LatencyHistogram* latency);
+  void clear();
+private:
+  struct Mark {
+    uint64_t end;
+    std::chrono::steady_clock::time_point time;
+  };
+  CircularBuffer<uint8_t> data_;
+  std::deque<Mark> marks_;
+  uint64_t pushed_{ 0 };
+  uint64_t popped_{ 0 };
+};
+
+size_t RelayBuffer::push(const uint8_t* data, size_t size, std::chrono::steady_clock::time_point now) {
+  size = data_.push(data, size);
+  if (size > 0) {
+    pushed_ += size;
+    marks_.push_back({ pushed_, now });
+  }
+  return size;
+}
+
+template<class Writer>
+long RelayBuffer::flush(Writer writer, haier_protocol::LatencyHistogram* latency) {
+  long total = 0;
+  while (!data_.empty()) {
+    const uint8_t* segment1;
+    const uint8_t* segment2;
+    size_t size1, size2;
+    data_.get_data_segments(segment1, size1, segment2, size2);
+    long res = writer(segment1, size1);
+    if (res < 0)
+      return -1;
+    data_.drop((size_t)res);
+    total += res;
+    if ((size_t)res < size1)
+      break;
+  }
+  popped_ += total;
+  std::chrono::steady_clock::time_point now = latency != nullptr ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+  while (!marks_.empty() && (marks_.front().end <= popped_)) {
+    if (latency != nullptr)
+      latency->record(now - marks_.front().time);
+    marks_.pop_front();
+  }
+  return total;
+}
+
+void RelayBuffer::clear() {
+  data_.clear();
+  marks_.clear();
+  popped_ = pushed_;
+}
+
+struct BridgeOptions {
+  size_t buffer_size{ DEFAULT_BUFFER_SIZE };
+  bool frame_mode{ false };
+  std::chrono::milliseconds flush_interval{ 0 };
+  bool timestamps{ false };
+  std::string observer_bind{ DEFAULT_OBSERVER_BIND };
+};
+
+enum class WatchKind {
+  SERIAL,
+  REMOTE,
+  LISTENER,
+  OBSERVER,
+};
+
+struct Link;
+struct Observer;
+
+// Identifies handle in poller events
+struct Watch {
+  WatchKind kind;
+  Link* link;
+  Observer* observer;
+  uint32_t events;
+};
+
+struct Observer {
+  Observer(Link* link, native_socket s, size_t buffer_size) : socket(s), watch{ WatchKind::OBSERVER, link, this, 0 }, buffer(buffer_size) {};
+  native_socket socket;
+  Watch watch;
+  RelayBuffer buffer;
+  bool closed{ false };
+};
+
+struct LinkStatistics {
+  uint64_t serial_bytes{ 0 };       // serial -> remote
+  uint64_t remote_bytes{ 0 };       // remote -> serial
+  uint64_t serial_dropped{ 0 };     // received from serial while remote is not connected
+  uint64_t observer_dropped{ 0 };   // not sent to slow observers
+  unsigned int reconnects{ 0 };
+  unsigned int serial_reopens{ 0 };
+  uint64_t frames{ 0 };             // frame mode only
+  uint64_t batches{ 0 };
+  uint64_t parser_dropped{ 0 };     // not a part of any valid frame
+  haier_protocol::LatencyHistogram serial_to_remote;
+  haier_protocol::LatencyHistogram remote_to_serial;
+};
+
+struct Link {
+  Link(const std::string& serial_path, const std::string& host, const std::string& tcp_port, size_t buffer_size) :
+    serial_path(serial_path), host(host), tcp_port(tcp_port), buffer_size(buffer_size), to_remote(buffer_size), to_serial(buffer_size) {};
+  Link(const Link&) = delete;
+  Link& operator=(const Link&) = delete;
+  const std::string serial_path;
+  const std::string host;
+  const std::string tcp_port;
+  const size_t buffer_size;
+  std::unique_ptr<SerialStream> serial;
+  Watch serial_watch{ WatchKind::SERIAL, this, nullptr, 0 };
+  std::chrono::steady_clock::time_point serial_retry_time;
+  native_socket remote{ INVALID_SOCKET };
+  bool remote_connected{ false };
+  Watch remote_watch{ WatchKind::REMOTE, this, nullptr, 0 };
+  std::chrono::steady_clock::time_point remote_retry_time;
+  std::chrono::milliseconds remote_retry_delay{ MIN_RECONNECT_DELAY };
+  unsigned int address_index{ 0 };    // next address to try if host has several
+  native_socket listener{ INVALID_SOCKET };
+  Watch listener_watch{ WatchKind::LISTENER, this, nullptr, 0 };
+  std::list<Observer> observers;
+  RelayBuffer to_remote;
+  RelayBuffer to_serial;
+  std::unique_ptr<FrameBatcher> batcher;
+  LinkStatistics statistics;
+};
+
+class Bridge {
+public:
+  explicit Bridge(const BridgeOptions& options) : options_(options) {};
+  bool is_valid() const { return poller_.is_valid(); };
+  bool add_link(const std::string& serial_path, const std::string& host, const std::string& tcp_port, const std::string& observer_port);
+  void run(std::chrono::seconds statistics_interval);
+  void print_statistics() const;
+  void close_all();
+private:
+  intptr_t get_serial_handle_(const Link& link) const;
+  void open_serial_(Link& link, std::chrono::steady_clock::time_point now);
+  void close_serial_(Link& link, std::chrono::steady_clock::time_point now);
+  void connect_remote_(Link& link, std::chrono::steady_clock::time_point now);
+  void close_remote_(Link& link, std::chrono::steady_clock::time_point now);
+  void accept_observer_(Link& link);
+  void close_observer_(Observer& observer);
+  void process_serial_(Link& link, uint32_t events, std::chrono::steady_clock::time_point now);
+  void process_remote_(Link& link, uint32_t events, std::chrono::steady_clock::time_point now);
+  void process_observer_(Observer& observer, uint32_t events);
+  void flush_serial_(Link& link, std::chrono::steady_clock::time_point now);
+  void flush_remote_(Link& link, std::chrono::steady_clock::time_point now);
+  void copy_to_observers_(Link& link, const uint8_t* data, size_t size, std::chrono::steady_clock::time_point now);
+  void collect_frames_(Link& link, std::chrono::steady_clock::time_point now);
+  bool send_batch_(Link& link, const uint8_t* data, size_t size, std::chrono::steady_clock::time_point first_frame, unsigned int frames);
+  void update_watches_(Link& link);
+  void update_watch_(Watch& watch, intptr_t handle, uint32_t events);
+  const BridgeOptions options_;
+  Poller poller_;
+  std::vector<std::unique_ptr<Link>> links_;
+};
+
+bool Bridge::add_link(const std::string& serial_path, const std::string& host, const std::string& tcp_port, const std::string& observer_port) {
+  links_.emplace_back(new Link(serial_path, host, tcp_port, options_.buffer_size));
+  Link& link = *links_.back();
+  if (options_.frame_mode)
+    link.batcher.reset(new FrameBatcher(MAX_BATCH_SIZE, options_.flush_interval, options_.timestamps));
+  if (observer_port.empty())
+    return true;
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* address;
+  if (getaddrinfo(options_.observer_bind.c_str(), observer_port.c_str(), &hints, &address) != 0) {
+    HAIER_LOGE("Wrong observer address %s port %s", options_.observer_bind.c_str(), observer_port.c_str());
+    return false;
+  }
+  link.listener = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+  bool success = link.listener != INVALID_SOCKET;
+  if (success) {
+    int one = 1;
+    setsockopt(link.listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+    success = (bind(link.listener, address->ai_addr, (int)address->ai_addrlen) == 0) && (listen(link.listener, (int)MAX_OBSERVERS) == 0) &&
+              set_socket_options(link.listener) && poller_.add((intptr_t)link.listener, &link.listener_watch, POLL_READ, true);
+  }
+  freeaddrinfo(address);
+  if (!success) {
+    HAIER_LOGE("Can't listen for observers on %s port %s, error %d", options_.observer_bind.c_str(), observer_port.c_str(), get_socket_error());
+    return false;
   }
-  memset(&hints, 0, sizeof(hints));
+  link.listener_watch.events = POLL_READ;
+  HAIER_LOGI("Observers of %s can connect to %s port %s", serial_path.c_str(), options_.observer_bind.c_str(), observer_port.c_str());
+  return true;
+}
+
+intptr_t Bridge::get_serial_handle_(const Link& link) const {
+#if __linux__
+  return link.serial->get_file_descriptor();
+#else
+  return 0;
+#endif
+}
+
+void Bridge::open_serial_(Link& link, std::chrono::steady_clock::time_point now) {
+  link.serial.reset(new SerialStream(link.serial_path));
+  if (!link.serial->is_valid() || !poller_.add(get_serial_handle_(link), &link.serial_watch, 0, false)) {
+    HAIER_LOGW("Can't open port %s", link.serial_path.c_str());
+    link.serial.reset();
+    link.serial_retry_time = now + MAX_RECONNECT_DELAY;
+    return;
+  }
+  link.serial_watch.events = 0;
+  HAIER_LOGI("Port %s opened", link.serial_path.c_str());
+}
+
+void Bridge::close_serial_(Link& link, std::chrono::steady_clock::time_point now) {
+  if (link.serial == nullptr)
+    return;
+  HAIER_LOGW("Port %s closed", link.serial_path.c_str());
+  poller_.remove(get_serial_handle_(link), &link.serial_watch);
+  link.serial.reset();
+  link.to_serial.clear();
+  link.serial_retry_time = now + MIN_RECONNECT_DELAY;
+  link.statistics.serial_reopens++;
+}
+
+void Bridge::connect_remote_(Link& link, std::chrono::steady_clock::time_point now) {
+  struct addrinfo hints = {};
   hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_protocol = IPPROTO_TCP;
-  // Resolve the server address and port
-  res = getaddrinfo(addr, std::to_string(port).c_str(), &hints, &result);
+  struct addrinfo* addresses;
+  int res = getaddrinfo(link.host.c_str(), link.tcp_port.c_str(), &hints, &addresses);
   if (res != 0) {
-    HAIER_LOGE("getaddrinfo failed with error: %d", res);
-    WSACleanup();
-    return INVALID_SOCKET;
-  }
-  for (ptr = result; ptr != NULL; ptr = ptr->ai_next) {
-    // Create a TcpSocket for connecting to server
-    socket_res = socket(ptr->ai_family, ptr->ai_socktype,
-      ptr->ai_protocol);
-    if (socket_res == INVALID_SOCKET) {
-      HAIER_LOGE("socket failed with error: %ld", WSAGetLastError());
-      WSACleanup();
-      return INVALID_SOCKET;
-    }
-    // Connect to server.
-    res = connect(socket_res, ptr->ai_addr, (int)ptr->ai_addrlen);
-    if (res == SOCKET_ERROR) {
-      closesocket(socket_res);
-      socket_res = INVALID_SOCKET;
+    HAIER_LOGW("Can't resolve %s: %s", link.host.c_str(), gai_strerror(res));
+  } else {
+    // Try addresses one by one on every reconnect
+    unsigned int count = 0;
+    for (struct addrinfo* ptr = addresses; ptr != nullptr; ptr = ptr->ai_next)
+      count++;
+    struct addrinfo* address = addresses;
+    for (unsigned int i = link.address_index++ % count; i > 0; i--)
+      address = address->ai_next;
+    link.remote = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if ((link.remote != INVALID_SOCKET) && set_socket_options(link.remote) &&
+        ((connect(link.remote, address->ai_addr, (int)address->ai_addrlen) == 0) || is_would_block(get_socket_error())) &&
+        poller_.add((intptr_t)link.remote, &link.remote_watch, POLL_WRITE, true)) {
+      link.remote_watch.events = POLL_WRITE;
+      freeaddrinfo(addresses);
+      return;
+    }
+    HAIER_LOGW("Can't connect to %s:%s, error %d", link.host.c_str(), link.tcp_port.c_str(), get_socket_error());
+    if (link.remote != INVALID_SOCKET)
+      close_socket(link.remote);
+    link.remote = INVALID_SOCKET;
+    freeaddrinfo(addresses);
+  }
+  link.remote_retry_time = now + link.remote_retry_delay;
+  link.remote_retry_delay = std::min(link.remote_retry_delay * 2, MAX_RECONNECT_DELAY);
+}
+
+void Bridge::close_remote_(Link& link, std::chrono::steady_clock::time_point now) {
+  if (link.remote == INVALID_SOCKET)
+    return;
+  if (link.remote_connected) {
+    HAIER_LOGW("Connection to %s:%s closed", link.host.c_str(), link.tcp_port.c_str());
+    link.statistics.reconnects++;
+  }
+  poller_.remove((intptr_t)link.remote, &link.remote_watch);
+  close_socket(link.remote);
+  link.remote = INVALID_SOCKET;
+  link.remote_connected = false;
+  // Stale data makes no sense for appliance or server after reconnect
+  link.to_remote.clear();
+  link.to_serial.clear();
+  if (link.batcher != nullptr) {
+    link.statistics.parser_dropped += link.batcher->get_parser_dropped();
+    link.batcher.reset(new FrameBatcher(MAX_BATCH_SIZE, options_.flush_interval, options_.timestamps));
+  }
+  link.remote_retry_time = now + link.remote_retry_delay;
+  link.remote_retry_delay = std::min(link.remote_retry_delay * 2, MAX_RECONNECT_DELAY);
+}
+
+void Bridge::accept_observer_(Link& link) {
+  native_socket s = accept(link.listener, nullptr, nullptr);
+  if (s == INVALID_SOCKET)
+    return;
+  if ((link.observers.size() >= MAX_OBSERVERS) || !set_socket_options(s)) {
+    HAIER_LOGW("Observer of %s rejected", link.serial_path.c_str());
+    close_socket(s);
+    return;
+  }
+  link.observers.emplace_back(&link, s, link.buffer_size);
+  Observer& observer = link.observers.back();
+  if (!poller_.add((intptr_t)s, &observer.watch, POLL_READ, true)) {
+    close_socket(s);
+    link.observers.pop_back();
+    return;
+  }
+  observer.watch.events = POLL_READ;
+  HAIER_LOGI("Observer of %s connected, %d total", link.serial_path.c_str(), (int)link.observers.size());
+}
+
+// Observers are removed from the list after all events of the current wait are processed
+void Bridge::close_observer_(Observer& observer) {
+  if (observer.closed)
+    return;
+  poller_.remove((intptr_t)observer.socket, &observer.watch);
+  close_socket(observer.socket);
+  observer.closed = true;
+}
+
+void Bridge::copy_to_observers_(Link& link, const uint8_t* data, size_t size, std::chrono::steady_clock::time_point now) {
+  for (Observer& observer : link.observers) {
+    if (observer.closed)
+      continue;
+    // Slow observer should never hold the relay, it just misses data
+    if (observer.buffer.get_space() < size) {
+      link.statistics.observer_dropped += size;
       continue;
     }
-    break;
+    observer.buffer.push(data, size, now);
+    if (observer.buffer.flush([&observer](const uint8_t* d, size_t s) { return send_some(observer.socket, d, s); }, nullptr) < 0)
+      close_observer_(observer);
   }
-  freeaddrinfo(result);
-  return socket_res;
 }
 
-void close_socket(TcpSocket& socket) {
-  if (socket != INVALID_SOCKET)
-    closesocket(socket);
-  WSACleanup();
+void Bridge::flush_serial_(Link& link, std::chrono::steady_clock::time_point now) {
+  SerialStream* serial = link.serial.get();
+  if (link.to_serial.flush([serial](const uint8_t* d, size_t s) { return serial->write_some(d, s); }, &link.statistics.remote_to_serial) < 0)
+    close_serial_(link, now);
 }
 
-int read_socket(TcpSocket& socket, uint8_t *buffer, size_t buffer_size) {
-  unsigned long size;
-  ioctlsocket(socket, FIONREAD, &size);
-  if (size > 0) {
-    int res = recv(socket, (char*)socket_buffer, SOCKET_BUFFER_SIZE, 0);
-    if (res > 0)
-      return res;
+void Bridge::flush_remote_(Link& link, std::chrono::steady_clock::time_point now) {
+  native_socket remote = link.remote;
+  if (link.to_remote.flush([remote](const uint8_t* d, size_t s) { return send_some(remote, d, s); }, &link.statistics.serial_to_remote) < 0)
+    close_remote_(link, now);
+}
+
+void Bridge::process_serial_(Link& link, uint32_t events, std::chrono::steady_clock::time_point now) {
+  if (link.serial == nullptr)
+    return;
+  if ((events & POLL_READ) != 0) {
+    uint8_t buffer[READ_CHUNK_SIZE];
+    size_t size = sizeof(buffer);
+    if (link.remote_connected)
+      size = std::min(size, link.batcher != nullptr ? link.batcher->get_input_space() : link.to_remote.get_space());
+    size = size > 0 ? link.serial->read_into(buffer, size, nullptr, 0) : 0;
+    if (size > 0) {
+      HAIER_BUFD("SERIAL>>", buffer, size);
+      if (link.remote_connected) {
+        link.statistics.serial_bytes += size;
+        if (link.batcher != nullptr) {
+          link.batcher->push_input(buffer, size);
+          collect_frames_(link, now);
+        } else {
+          link.to_remote.push(buffer, size, now);
+          flush_remote_(link, now);
+        }
+      } else {
+        // Nobody to forward to, old frames would only confuse server after reconnect
+        link.statistics.serial_dropped += size;
+      }
+      copy_to_observers_(link, buffer, size, now);
+    }
+  }
+  if ((events & POLL_ERROR) != 0) {
+    close_serial_(link, now);
+    return;
+  }
+  if (((events & POLL_WRITE) != 0) && !link.to_serial.empty())
+    flush_serial_(link, now);
+}
+
+void Bridge::process_remote_(Link& link, uint32_t events, std::chrono::steady_clock::time_point now) {
+  if (link.remote == INVALID_SOCKET)
+    return;
+  if (!link.remote_connected) {
+    if ((events & (POLL_WRITE | POLL_ERROR)) == 0)
+      return;
+    int error = 0;
+    socklen_t error_size = sizeof(error);
+    if ((getsockopt(link.remote, SOL_SOCKET, SO_ERROR, (char*)&error, &error_size) != 0) || (error != 0)) {
+      HAIER_LOGW("Can't connect to %s:%s, error %d", link.host.c_str(), link.tcp_port.c_str(), error);
+      close_remote_(link, now);
+      return;
+    }
+    HAIER_LOGI("Connected to %s:%s", link.host.c_str(), link.tcp_port.c_str());
+    link.remote_connected = true;
+    link.remote_retry_delay = MIN_RECONNECT_DELAY;
+    return;
+  }
+  if ((events & (POLL_READ | POLL_ERROR)) != 0) {
+    uint8_t buffer[READ_CHUNK_SIZE];
+    size_t size = std::min(sizeof(buffer), link.to_serial.get_space());
+    if (size > 0) {
+      int res = recv(link.remote, (char*)buffer, (int)size, 0);
+      if ((res == 0) || ((res < 0) && !is_would_block(get_socket_error()))) {
+        close_remote_(link, now);
+        return;
+      }
+      if (res > 0) {
+        HAIER_BUFD("SOCKET>>", buffer, res);
+        link.statistics.remote_bytes += res;
+        if (link.serial != nullptr) {
+          link.to_serial.push(buffer, res, now);
+          flush_serial_(link, now);
+        }
+        copy_to_observers_(link, buffer, res, now);
+      }
+    }
+  }
+  if ((link.remote != INVALID_SOCKET) && ((events & POLL_WRITE) != 0) && !link.to_remote.empty()) {
+    flush_remote_(link, now);
+    // Batch that didn't fit is sent when there is space
+    if ((link.remote != INVALID_SOCKET) && (link.batcher != nullptr))
+      collect_frames_(link, now);
   }
-  return 0;
 }
 
-int write_socket(TcpSocket& socket, uint8_t* buffer, size_t buffer_size) {
-  return send(socket, (char*)buffer, buffer_size, 0);
+void Bridge::process_observer_(Observer& observer, uint32_t events) {
+  if (observer.closed)
+    return;
+  if ((events & (POLL_READ | POLL_ERROR)) != 0) {
+    // Observers are read-only, everything they send is ignored
+    uint8_t buffer[READ_CHUNK_SIZE];
+    int res = recv(observer.socket, (char*)buffer, (int)sizeof(buffer), 0);
+    if ((res == 0) || ((res < 0) && !is_would_block(get_socket_error()))) {
+      close_observer_(observer);
+      return;
+    }
+  }
+  if (((events & POLL_WRITE) != 0) && (observer.buffer.flush([&observer](const uint8_t* d, size_t s) { return send_some(observer.socket, d, s); }, nullptr) < 0))
+    close_observer_(observer);
 }
 
-int get_last_error() {
-  return WSAGetLastError();
+void Bridge::collect_frames_(Link& link, std::chrono::steady_clock::time_point now) {
+  link.batcher->collect(now, [this, &link](const uint8_t* data, size_t size, std::chrono::steady_clock::time_point first_frame, unsigned int frames) {
+    return send_batch_(link, data, size, first_frame, frames);
+  });
+  flush_remote_(link, now);
 }
 
-#else
-TcpSocket open_socket(char* addr, unsigned int port) {
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd < 0)
-    return INVALID_SOCKET;
-  struct hostent *server;
-  server = gethostbyname(addr);
-  if (server == NULL)
-    return INVALID_SOCKET;
-  struct sockaddr_in server_addr;
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(port);
-  memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
-  if (connect(sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) 
-    return INVALID_SOCKET;
-  return sockfd;
+// Batch is pushed as a whole or not at all, a part of it would break the records
+bool Bridge::send_batch_(Link& link, const uint8_t* data, size_t size, std::chrono::steady_clock::time_point first_frame, unsigned int frames) {
+  if (link.to_remote.get_space() < size)
+    return false;
+  link.to_remote.push(data, size, first_frame);
+  link.statistics.frames += frames;
+  link.statistics.batches++;
+  return true;
 }
 
-void close_socket(TcpSocket srv_socket) {
-  close(srv_socket);
+void Bridge::update_watch_(Watch& watch, intptr_t handle, uint32_t events) {
+  if (watch.events != events) {
+    poller_.modify(handle, &watch, events);
+    watch.events = events;
+  }
 }
 
-int read_socket(TcpSocket& socket, uint8_t* buffer, size_t buffer_size) {
-  return read(socket, buffer, buffer_size);
+// Backpressure: stop reading from a side when the buffer to the other side is full
+void Bridge::update_watches_(Link& link) {
+  size_t min_space = link.batcher != nullptr ? MAX_BATCH_SIZE : 1;
+  if (link.serial != nullptr)
+    update_watch_(link.serial_watch, get_serial_handle_(link),
+                  ((!link.remote_connected || (link.to_remote.get_space() >= min_space)) ? POLL_READ : 0) | (!link.to_serial.empty() ? POLL_WRITE : 0));
+  if (link.remote != INVALID_SOCKET) {
+    if (link.remote_connected)
+      update_watch_(link.remote_watch, (intptr_t)link.remote,
+                    ((link.to_serial.get_space() > 0) ? POLL_READ : 0) | (!link.to_remote.empty() ? POLL_WRITE : 0));
+    else
+      update_watch_(link.remote_watch, (intptr_t)link.remote, POLL_WRITE);
+  }
+  for (auto it = link.observers.begin(); it != link.observers.end();) {
+    if (it->closed) {
+      HAIER_LOGI("Observer of %s disconnected", link.serial_path.c_str());
+      it = link.observers.erase(it);
+    } else {
+      update_watch_(it->watch, (intptr_t)it->socket, POLL_READ | (!it->buffer.empty() ? POLL_WRITE : 0));
+      ++it;
+    }
+  }
 }
 
-int write_socket(TcpSocket& socket, uint8_t* buffer, size_t buffer_size) {
-  return write(socket, buffer, buffer_size);
+void Bridge::run(std::chrono::seconds statistics_interval) {
+  constexpr size_t MAX_EVENTS = 32;
+  PollEvent events[MAX_EVENTS];
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point statistics_time = now + statistics_interval;
+  while (!app_exiting) {
+    int kb = get_kb_hit();
+    if (kb == 27)
+      break;
+    // Reopen closed ports and connections
+    std::chrono::steady_clock::time_point next_retry = now + MAX_WAIT_TIME;
+    for (auto& link : links_) {
+      if ((link->serial == nullptr) && (now >= link->serial_retry_time))
+        open_serial_(*link, now);
+      if ((link->remote == INVALID_SOCKET) && (now >= link->remote_retry_time))
+        connect_remote_(*link, now);
+      if (link->serial == nullptr)
+        next_retry = std::min(next_retry, link->serial_retry_time);
+      if (link->remote == INVALID_SOCKET)
+        next_retry = std::min(next_retry, link->remote_retry_time);
+      // Batch that waits for space is sent when remote becomes writable
+      if ((link->batcher != nullptr) && !link->batcher->empty() && (link->to_remote.get_space() >= link->batcher->get_batch_size()))
+        next_retry = std::min(next_retry, link->batcher->get_deadline());
+      update_watches_(*link);
+    }
+    auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(next_retry - now);
+    size_t count = poller_.wait(events, MAX_EVENTS, std::max(timeout, std::chrono::milliseconds::zero()));
+    now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+      Watch* watch = (Watch*)events[i].owner;
+      switch (watch->kind) {
+      case WatchKind::SERIAL:
+        process_serial_(*watch->link, events[i].events, now);
+        break;
+      case WatchKind::REMOTE:
+        process_remote_(*watch->link, events[i].events, now);
+        break;
+      case WatchKind::LISTENER:
+        accept_observer_(*watch->link);
+        break;
+      case WatchKind::OBSERVER:
+        process_observer_(*watch->observer, events[i].events);
+        break;
+      }
+    }
+    for (auto& link : links_)
+      if ((link->batcher != nullptr) && link->remote_connected && !link->batcher->empty() && (now >= link->batcher->get_deadline()))
+        collect_frames_(*link, now);
+    if ((statistics_interval.count() > 0) && (now >= statistics_time)) {
+      print_statistics();
+      statistics_time = now + statistics_interval;
+    }
+  }
 }
 
-int get_last_error() {
-  return 0;
+void Bridge::print_statistics() const {
+  for (const auto& link : links_) {
+    const LinkStatistics& stats = link->statistics;
+    HAIER_LOGI("%s <-> %s:%s %s, observers: %d, reconnects: %u, port reopens: %u", link->serial_path.c_str(), link->host.c_str(), link->tcp_port.c_str(),
+               link->remote_connected ? "connected" : "disconnected", (int)link->observers.size(), stats.reconnects, stats.serial_reopens);
+    HAIER_LOGI("  serial->remote: %llu bytes, dropped %llu, latency p50 %uus p99 %uus", (unsigned long long)stats.serial_bytes, (unsigned long long)stats.serial_dropped,
+               stats.serial_to_remote.get_percentile(REPORTED_PERCENTILES[0]), stats.serial_to_remote.get_percentile(REPORTED_PERCENTILES[1]));
+    HAIER_LOGI("  remote->serial: %llu bytes, latency p50 %uus p99 %uus, observers missed %llu bytes", (unsigned long long)stats.remote_bytes,
+               stats.remote_to_serial.get_percentile(REPORTED_PERCENTILES[0]), stats.remote_to_serial.get_percentile(REPORTED_PERCENTILES[1]),
+               (unsigned long long)stats.observer_dropped);
+    if (link->batcher != nullptr) {
+      uint64_t parser_dropped = stats.parser_dropped + link->batcher->get_parser_dropped();
+      HAIER_LOGI("  frames: %llu in %llu segments, %llu bytes dropped by parser", (unsigned long long)stats.frames, (unsigned long long)stats.batches,
+                 (unsigned long long)parser_dropped);
+    }
+  }
 }
 
-#endif
+void Bridge::close_all() {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  for (auto& link : links_) {
+    for (Observer& observer : link->observers)
+      close_observer_(observer);
+    link->observers.clear();
+    if (link->listener != INVALID_SOCKET)
+      close_socket(link->listener);
+    link->listener = INVALID_SOCKET;
+    close_remote_(*link, now);
+    if (link->serial != nullptr) {
+      poller_.remove(get_serial_handle_(*link), &link->serial_watch);
+      link->serial.reset();
+    }
+  }
+}
+
+// Split "host:port" or "[ipv6]:port", port is optional
+void parse_address(const std::string& address, std::string& host, std::string& port) {
+  size_t separator = address.rfind(':');
+  bool is_bracketed = !address.empty() && (address[0] == '[');
+  size_t closing = address.find(']');
+  if (is_bracketed && (closing != std::string::npos)) {
+    host = address.substr(1, closing - 1);
+    port = (separator != std::string::npos) && (separator > closing) ? address.substr(separator + 1) : DEFAULT_TCP_PORT;
+  } else if ((separator != std::string::npos) && (address.find(':') == separator)) {
+    host = address.substr(0, separator);
+    port = address.substr(separator + 1);
+  } else {
+    // No port or bare IPv6 address
+    host = address;
+    port = DEFAULT_TCP_PORT;
+  }
+}
+
+void print_usage(const char* app_name) {
+  std::cout << "Please use: " << app_name << " [--observe <tcp_port> [--observer-bind <address>]] [--buffer <bytes>] [--frames <flush_ms> [--timestamps]] [--stats <seconds>] <serial_port> <host>[:<tcp_port>] [<serial_port> <host>[:<tcp_port>]...]" << std::endl;
+  std::cout << "  Every serial port is relayed to its own server, default TCP port is " << DEFAULT_TCP_PORT << std::endl;
+  std::cout << "  --observe  accept read-only observers, N-th port listens on tcp_port + N" << std::endl;
+  std::cout << "  --observer-bind  address for observer ports, default " << DEFAULT_OBSERVER_BIND << " (observers are not authenticated)" << std::endl;
+  std::cout << "  --buffer   buffer size for every direction, default " << DEFAULT_BUFFER_SIZE << std::endl;
+  std::cout << "  --frames   send only whole frames, frames received within flush_ms are sent together" << std::endl;
+  std::cout << "  --timestamps  add size and receive time (us since epoch) before every frame, 2 + 8 bytes big endian" << std::endl;
+  std::cout << "  --stats    statistics print interval, default 60 (0 - only on exit)" << std::endl;
+  std::cout << "  Press ESC to exit" << std::endl;
+}
+
+}
 
 int main(int argc, char** argv) {
   haier_protocol::set_log_handler(console_logger);
-  if (argc == 3) {
-    HAIER_LOGI("Opening socket");
-    TcpSocket remote_socket = open_socket(argv[2], 8888);
-    if (remote_socket == INVALID_SOCKET) {
-      HAIER_LOGE("Failed to connect to server %s", argv[2]);
-      close_socket(remote_socket);
+  BridgeOptions options;
+  long observer_port = 0;
+  long statistics_interval = 60;
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; i++) {
+    if ((strcmp(argv[i], "--observe") == 0) && (i + 1 < argc))
+      observer_port = atol(argv[++i]);
+    else if ((strcmp(argv[i], "--observer-bind") == 0) && (i + 1 < argc))
+      options.observer_bind = argv[++i];
+    else if ((strcmp(argv[i], "--buffer") == 0) && (i + 1 < argc))
+      options.buffer_size = (size_t)std::max(1L, atol(argv[++i]));
+    else if ((strcmp(argv[i], "--frames") == 0) && (i + 1 < argc)) {
+      options.frame_mode = true;
+      options.flush_interval = std::chrono::milliseconds(std::max(0L, atol(argv[++i])));
+    } else if (strcmp(argv[i], "--timestamps") == 0)
+      options.timestamps = true;
+    else if ((strcmp(argv[i], "--stats") == 0) && (i + 1 < argc))
+      statistics_interval = std::max(0L, atol(argv[++i]));
+    else if (argv[i][0] == '-') {
+      print_usage(argv[0]);
       return 1;
+    } else
+      positional.push_back(argv[i]);
+  }
+  if (positional.empty() || (positional.size() % 2 != 0) || (options.timestamps && !options.frame_mode)) {
+    print_usage(argv[0]);
+    return 1;
+  }
+#if _WIN32
+  WSADATA wsa_data;
+  int res = WSAStartup(MAKEWORD(2, 2), &wsa_data);
+  if (res != 0) {
+    HAIER_LOGE("WSAStartup failed with error: %d", res);
+    return 1;
+  }
+#endif
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+  int result = 0;
+  if (options.frame_mode)
+    options.buffer_size = std::max(options.buffer_size, MAX_BATCH_SIZE);
+  {
+    Bridge bridge(options);
+    if (!bridge.is_valid()) {
+      HAIER_LOGE("Can't create event loop");
+      result = 1;
     }
-    HAIER_LOGI("Opening port %s", argv[1]);
-    haier_protocol::set_log_handler(console_logger);
-    SerialStream serial_stream(argv[1]);
-    if (!serial_stream.is_valid()) {
-      HAIER_LOGE("Can't open port %s", argv[1]);
-      return 1;
+    for (size_t i = 0; (result == 0) && (i < positional.size()); i += 2) {
+      std::string host, port;
+      parse_address(positional[i + 1], host, port);
+      std::string observe = observer_port > 0 ? std::to_string(observer_port + i / 2) : std::string();
+      if (!bridge.add_link(positional[i], host, port, observe))
+        result = 1;
     }
-    int res;
-    while (!app_exiting) {
-      int kb = get_kb_hit();
-      if (kb != NO_KB_HIT) {
-        if (kb == 27)
-          app_exiting = true;
-      } else {
-        unsigned long size = serial_stream.available();
-        size = serial_stream.read_array(serial_buffer, size);
-        if (size > 0) {
-          HAIER_BUFD("SERIAL>>", serial_buffer, size);
-          res = write_socket(remote_socket, serial_buffer, size);
-          if (res < 0) {
-            HAIER_LOGE("send failed with error: %d", get_last_error());
-            close_socket(remote_socket);
-            return 1;
-          }
-        }
-        res = read_socket(remote_socket, socket_buffer, SOCKET_BUFFER_SIZE);
-        if (res > 0) {
-          HAIER_BUFD("SOCKET>>", socket_buffer, res);
-          serial_stream.write_array(socket_buffer, res);
-        } else if (res < 0) {
-          HAIER_LOGE("recv failed with error: %d", get_last_error());
-          close_socket(remote_socket);
-          return 1;
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-      }
+    if (result == 0) {
+      bridge.run(std::chrono::seconds(statistics_interval));
+      bridge.print_statistics();
     }
-    close_socket(remote_socket);
-  } else {
-    HAIER_LOGE("Please use: %s <remote_port> <local_port>", argv[0]);
+    bridge.close_all();
   }
+#if _WIN32
+  WSACleanup();
+#endif
+  return result;
 }
@@ -7,7 +7,8 @@
 
 using namespace esphome::haier::smartair2_protocol;
 
-HaierPacketControl& ac_state = get_ac_state_ref();
+SmartAir2Server smartair2_server;
+SmartAir2ControlView ac_state = smartair2_server.get_ac_state();
 
 const haier_protocol::HaierMessage INVALID_MSG(haier_protocol::FrameType::INVALID, 0x0000);
 const haier_protocol::HaierMessage CONFIRM_MSG(haier_protocol::FrameType::CONFIRM);
@@ -17,33 +18,27 @@ bool start_pairing{ false };
 void preloop(haier_protocol::ProtocolHandler* handler) {
   if (toggle_ac_power) {
     toggle_ac_power = false;
-    uint8_t ac_power = ac_state.ac_power;
-    ac_state.ac_power = ac_power == 1 ? 0 : 1;
+    uint8_t ac_power = ac_state.ac_power();
+    ac_state.set_ac_power(ac_power == 1 ? 0 : 1);
     HAIER_LOGI("AC power is %s", ac_power == 1 ? "Off" : "On");
   }
   if (start_pairing) {
     start_pairing = false;
-    ac_state.ac_power = 1;
-    ac_state.set_point = 14;
-    ac_state.ac_mode = (uint8_t) esphome::haier::smartair2_protocol::ConditioningMode::COOL;
-    ac_state.fan_mode = (uint8_t) esphome::haier::smartair2_protocol::FanMode::FAN_LOW;
+    ac_state.set_ac_power(1);
+    ac_state.set_set_point(14);
+    ac_state.set_ac_mode((uint8_t) esphome::haier::smartair2_protocol::ConditioningMode::COOL);
+    ac_state.set_fan_mode((uint8_t) esphome::haier::smartair2_protocol::FanMode::FAN_LOW);
     HAIER_LOGI("Start pairing");
   }
 }
 
 int main(int argc, char** argv) {
-  if (argc == 2) {
-    message_handlers mhandlers;
-    mhandlers[haier_protocol::FrameType::GET_DEVICE_VERSION] = unsupported_message_handler;
-    mhandlers[haier_protocol::FrameType::GET_DEVICE_ID] = unsupported_message_handler;
-    mhandlers[haier_protocol::FrameType::CONTROL] = status_request_handler;
-    mhandlers[haier_protocol::FrameType::REPORT_NETWORK_STATUS] = report_network_status_handler;
-
+  if ((argc == 2) || (argc == 3)) {
     keyboard_handlers khandlers;
     khandlers['1'] = []() { toggle_ac_power = true; };
     khandlers['2'] = []() { start_pairing = true; };
-    simulator_main("SmartAir2 HVAC simulator", argv[1], mhandlers, khandlers, preloop);
+    simulator_main("SmartAir2 HVAC simulator", argv[1], std::bind(&SmartAir2Server::register_handlers, &smartair2_server, std::placeholders::_1), khandlers, preloop, argc == 3 ? argv[2] : nullptr);
   } else {
-    std::cout << "Please use: smartair2_simulator <port>" << std::endl;
+    std::cout << "Please use: smartair2_simulator <port> [<metrics_port> | unix:<metrics_socket>]" << std::endl;
   }
 }
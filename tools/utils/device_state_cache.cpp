@@ -0,0 +1,48 @@
+#include "device_state_cache.h"
+#include "packet_fields.h"
+
+namespace {
+
+// Status payload follows 2 bytes of subcommand
+constexpr size_t SUBCOMMAND_SIZE = 2;
+
+}
+
+bool HonStateCache::process_status(const uint8_t* data, size_t size) {
+  if (size < SUBCOMMAND_SIZE)
+    return false;
+  uint16_t subcommand = (uint16_t) ((data[0] << 8) | data[1]);
+  const uint8_t* payload = data + SUBCOMMAND_SIZE;
+  size_t payload_size = size - SUBCOMMAND_SIZE;
+  bool big_data;
+  switch (subcommand) {
+  case 0x6D01:
+  case 0x6D5F:
+    big_data = false;
+    break;
+  case 0x7D01:
+    big_data = true;
+    break;
+  default:
+    return false;
+  }
+  if (payload_size < HON_SENSORS_OFFSET + HonSensorsView::SIZE)
+    return false;
+  if (big_data && (payload_size < HON_BIG_DATA_SIZE))
+    return false;
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  this->update_section_((size_t) HonStateSection::CONTROL, get_hon_control_delta(), this->pending_.state.control, payload, now);
+  this->update_section_((size_t) HonStateSection::SENSORS, get_hon_sensors_delta(), this->pending_.state.sensors, payload + HON_SENSORS_OFFSET, now);
+  if (big_data)
+    this->update_section_((size_t) HonStateSection::BIG_DATA, get_hon_big_data_delta(), this->pending_.state.big_data, payload + HON_BIG_DATA_OFFSET, now);
+  this->publish_();
+  return true;
+}
+
+bool SmartAir2StateCache::process_status(const uint8_t* data, size_t size) {
+  if ((size < SUBCOMMAND_SIZE + SmartAir2ControlView::SIZE) || (data[0] != 0x6D))
+    return false;
+  this->update_section_((size_t) SmartAir2StateSection::CONTROL, get_smartair2_control_delta(), this->pending_.state.control, data + SUBCOMMAND_SIZE, std::chrono::steady_clock::now());
+  this->publish_();
+  return true;
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include "protocol/haier_protocol.h"
+#include "utils/payload_delta.h"
+#include "utils/seqlock.h"
+#include "packet_views.h"
+
+// Last known appliance state decoded from STATUS answers. Protocol thread fills the cache
+// from the answer handler and publishes every update as a new snapshot, any number of
+// threads can read consistent snapshots without locks and without requests to the appliance.
+// Consumers that need to react on changes set change handler and get only the fields that changed.
+
+// State is made of sections that come with different answers, every section has its own
+// receive time. Default time_point means that section was never received.
+template<class State, size_t SECTIONS_COUNT>
+struct StateSnapshot {
+  State state;
+  // Number of updates published before this snapshot, 0 - nothing received yet
+  uint32_t version;
+  std::chrono::steady_clock::time_point updated[SECTIONS_COUNT];
+  bool is_received(size_t section) const { return this->updated[section] != std::chrono::steady_clock::time_point(); };
+  // duration::max() if section was never received
+  std::chrono::steady_clock::duration get_age(size_t section, std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) const {
+    return this->is_received(section) ? now - this->updated[section] : std::chrono::steady_clock::duration::max();
+  };
+  bool is_stale(size_t section, std::chrono::steady_clock::duration max_age, std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) const {
+    return this->get_age(section, now) > max_age;
+  };
+};
+
+constexpr size_t MAX_SECTION_CHANGES = 64;
+
+// Fields of one section that changed, called from the protocol thread before new snapshot is published.
+// When section is received for the first time all its fields are reported with old value 0.
+using StateChangeHandler = std::function<void(size_t section, const haier_protocol::PayloadDelta& layout, const haier_protocol::FieldChange* changes, size_t count)>;
+
+template<class State, size_t SECTIONS_COUNT>
+class DeviceStateCache {
+public:
+  using Snapshot = StateSnapshot<State, SECTIONS_COUNT>;
+  DeviceStateCache() : pending_(), snapshot_(pending_) {};
+  DeviceStateCache(const DeviceStateCache&) = delete;
+  DeviceStateCache& operator=(const DeviceStateCache&) = delete;
+  virtual ~DeviceStateCache() {};
+  // Any thread
+  Snapshot get_snapshot() const {
+    Snapshot snapshot;
+    this->snapshot_.load(snapshot);
+    return snapshot;
+  };
+  uint32_t get_version() const { return this->snapshot_.get_version(); };
+  void set_change_handler(StateChangeHandler handler) { this->change_handler_ = handler; };
+  // Decode STATUS answer data (subcommand and payload) and publish new snapshot,
+  // return false if data doesn't contain known state. Protocol thread only.
+  virtual bool process_status(const uint8_t* data, size_t size) = 0;
+  // CONTROL answers update the cache and then go to next_handler
+  void register_handler(haier_protocol::ProtocolHandler& protocol_handler, haier_protocol::AnswerHandler next_handler = haier_protocol::default_answer_handler) {
+    protocol_handler.set_answer_handler(haier_protocol::FrameType::CONTROL,
+      [this, next_handler](haier_protocol::FrameType request_type, haier_protocol::FrameType message_type, const uint8_t* data, size_t size) {
+        if (message_type == haier_protocol::FrameType::STATUS)
+          this->process_status(data, size);
+        return next_handler(request_type, message_type, data, size);
+      });
+  };
+protected:
+  // Writer's copy, sections are updated in place and then published together
+  Snapshot pending_;
+  void publish_() {
+    this->pending_.version++;
+    this->snapshot_.store(this->pending_);
+  };
+  // Report changed fields of the section and copy payload to the writer's copy
+  template<class Section>
+  void update_section_(size_t section, const haier_protocol::PayloadDelta& layout, Section& cached, const uint8_t* payload, std::chrono::steady_clock::time_point now) {
+    if (this->change_handler_) {
+      haier_protocol::FieldChange changes[MAX_SECTION_CHANGES];
+      size_t count = 0;
+      if (this->pending_.is_received(section)) {
+        count = layout.compare((const uint8_t*) &cached, payload, changes, MAX_SECTION_CHANGES);
+      } else {
+        for (; (count < layout.get_fields_count()) && (count < MAX_SECTION_CHANGES); count++)
+          changes[count] = { (uint16_t) count, 0, layout.get_value(count, payload) };
+      }
+      if (count > 0)
+        this->change_handler_(section, layout, changes, count);
+    }
+    memcpy(&cached, payload, sizeof(Section));
+    this->pending_.updated[section] = now;
+  };
+private:
+  haier_protocol::Seqlock<Snapshot> snapshot_;
+  StateChangeHandler change_handler_;
+};
+
+enum class HonStateSection : uint8_t {
+  CONTROL = 0,
+  SENSORS,
+  BIG_DATA,
+};
+
+constexpr size_t HON_STATE_SECTIONS_COUNT = 3;
+
+// Sections are kept as received payloads, fields are read through views
+struct HonState {
+  uint8_t control[HonControlView::SIZE];
+  uint8_t sensors[HonSensorsView::SIZE];
+  uint8_t big_data[HonBigDataView::SIZE];
+  HonControlConstView get_control() const { return HonControlConstView(this->control); };
+  HonSensorsConstView get_sensors() const { return HonSensorsConstView(this->sensors); };
+  HonBigDataConstView get_big_data() const { return HonBigDataConstView(this->big_data); };
+};
+
+// User data answers (0x6D01, 0x6D5F) update control and sensors,
+// big data answer (0x7D01) updates all sections
+class HonStateCache : public DeviceStateCache<HonState, HON_STATE_SECTIONS_COUNT> {
+public:
+  bool process_status(const uint8_t* data, size_t size) override;
+};
+
+enum class SmartAir2StateSection : uint8_t {
+  CONTROL = 0,
+};
+
+constexpr size_t SMARTAIR2_STATE_SECTIONS_COUNT = 1;
+
+struct SmartAir2State {
+  uint8_t control[SmartAir2ControlView::SIZE];
+  SmartAir2ControlConstView get_control() const { return SmartAir2ControlConstView(this->control); };
+};
+
+// Every SmartAir2 status answer carries complete control packet
+class SmartAir2StateCache : public DeviceStateCache<SmartAir2State, SMARTAIR2_STATE_SECTIONS_COUNT> {
+public:
+  bool process_status(const uint8_t* data, size_t size) override;
+};
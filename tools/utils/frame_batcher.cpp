@@ -0,0 +1,24 @@
+#include "frame_batcher.h"
+
+void FrameBatcher::add_record_() {
+  size_t frame_size = next_frame_.frame.get_buffer_size();
+  size_t header_size = timestamps_ ? FRAME_RECORD_HEADER_SIZE : 0;
+  if (batch_.empty()) {
+    batch_start_ = next_frame_.complete_timestamp;
+    deadline_ = next_frame_.complete_timestamp + flush_interval_;
+  }
+  size_t position = batch_.size();
+  batch_.resize(position + header_size + frame_size);
+  uint8_t* record = batch_.data() + position;
+  if (timestamps_) {
+    // Frame start in wall clock time, so the server can calculate one way latency
+    auto start_time = std::chrono::system_clock::now() - std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::steady_clock::now() - next_frame_.timestamp);
+    uint64_t timestamp = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(start_time.time_since_epoch()).count();
+    record[0] = (uint8_t)(frame_size >> 8);
+    record[1] = (uint8_t)frame_size;
+    for (size_t i = 0; i < 8; i++)
+      record[2 + i] = (uint8_t)(timestamp >> (56 - i * 8));
+  }
+  next_frame_.frame.fill_buffer(record + header_size, frame_size);
+  batch_frames_++;
+}
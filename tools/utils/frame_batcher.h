@@ -0,0 +1,105 @@
+#ifndef FRAME_BATCHER_H
+#define FRAME_BATCHER_H
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+#include "utils/circular_buffer.h"
+#include "transport/protocol_transport.h"
+
+// Serial data for the frame parser
+class ByteQueueStream : public haier_protocol::ProtocolStream {
+public:
+  explicit ByteQueueStream(size_t size) : buffer_(size) {};
+  size_t get_space() const { return buffer_.get_space(); };
+  size_t push(const uint8_t* data, size_t size) { return buffer_.push(data, size); };
+  size_t available() noexcept override { return buffer_.get_size(); };
+  size_t read_array(uint8_t* data, size_t len) noexcept override { return buffer_.pop(data, len); };
+  void write_array(const uint8_t*, size_t) noexcept override {};
+  size_t read_into(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept override {
+    size_t result = buffer_.pop(data1, size1);
+    if ((result == size1) && (size2 > 0))
+      result += buffer_.pop(data2, size2);
+    return result;
+  };
+private:
+  CircularBuffer<uint8_t> buffer_;
+};
+
+constexpr size_t FRAME_RECORD_HEADER_SIZE = 10;
+constexpr size_t FRAME_INPUT_BUFFER_SIZE = 1024;
+
+// Collects frames parsed from serial data into batches. With timestamps every frame is
+// prefixed with 10 bytes header: frame size (16 bit) and time when frame start was received
+// (64 bit, microseconds since Unix epoch), both big endian.
+// Batch is sent when the next frame doesn't fit or flush interval has passed since its first
+// frame. It is always sent as a whole: part of a batch would break the record framing, so when
+// the destination has no space the batch is kept and parsed frames wait in the parser.
+class FrameBatcher {
+public:
+  FrameBatcher(size_t max_batch_size, std::chrono::milliseconds flush_interval, bool timestamps) :
+    input_(FRAME_INPUT_BUFFER_SIZE), transport_(input_, FRAME_INPUT_BUFFER_SIZE), max_batch_size_(max_batch_size),
+    flush_interval_(flush_interval), timestamps_(timestamps) {};
+  FrameBatcher(const FrameBatcher&) = delete;
+  FrameBatcher& operator=(const FrameBatcher&) = delete;
+  size_t get_input_space() const { return input_.get_space(); };
+  size_t push_input(const uint8_t* data, size_t size) { return input_.push(data, size); };
+  // send(data, size, first_frame_time, frames) pushes the whole batch and returns true,
+  // or returns false without pushing anything if there is no space for it
+  template<class Sender>
+  void collect(std::chrono::steady_clock::time_point now, Sender send);
+  // Sends the batch if flush interval has passed
+  template<class Sender>
+  bool flush(std::chrono::steady_clock::time_point now, Sender send);
+  bool empty() const { return batch_.empty(); };
+  size_t get_batch_size() const { return batch_.size(); };
+  std::chrono::steady_clock::time_point get_deadline() const { return deadline_; };
+  uint64_t get_parser_dropped() const { return transport_.get_statistics().bytes_dropped.get(); };
+private:
+  void add_record_();
+  template<class Sender>
+  bool send_batch_(Sender& send);
+  ByteQueueStream input_;
+  haier_protocol::TransportLevelHandler transport_;
+  const size_t max_batch_size_;
+  const std::chrono::milliseconds flush_interval_;
+  const bool timestamps_;
+  std::vector<uint8_t> batch_;
+  unsigned int batch_frames_{ 0 };
+  std::chrono::steady_clock::time_point batch_start_;   // first frame of the batch parsed
+  std::chrono::steady_clock::time_point deadline_;
+  haier_protocol::TimestampedFrame next_frame_;         // parsed, but doesn't fit into the kept batch
+  bool has_next_frame_{ false };
+};
+
+template<class Sender>
+void FrameBatcher::collect(std::chrono::steady_clock::time_point now, Sender send) {
+  transport_.read_data();
+  transport_.process_data();
+  while (has_next_frame_ || transport_.pop(next_frame_)) {
+    has_next_frame_ = true;
+    size_t record_size = (timestamps_ ? FRAME_RECORD_HEADER_SIZE : 0) + next_frame_.frame.get_buffer_size();
+    if ((batch_.size() + record_size > max_batch_size_) && !send_batch_(send))
+      return;
+    add_record_();
+    has_next_frame_ = false;
+  }
+  flush(now, send);
+}
+
+template<class Sender>
+bool FrameBatcher::flush(std::chrono::steady_clock::time_point now, Sender send) {
+  return !batch_.empty() && (now >= deadline_) && send_batch_(send);
+}
+
+template<class Sender>
+bool FrameBatcher::send_batch_(Sender& send) {
+  if (batch_.empty())
+    return true;
+  if (!send(batch_.data(), batch_.size(), batch_start_, batch_frames_))
+    return false;
+  batch_.clear();
+  batch_frames_ = 0;
+  return true;
+}
+
+#endif // FRAME_BATCHER_H
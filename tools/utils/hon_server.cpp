@@ -1,145 +1,140 @@
 ﻿#include <cstring>
 #include "hon_server.h"
 #include "hon_packet.h"
+#include "packet_fields.h"
 
 using namespace esphome::haier::hon_protocol;
 
+namespace {
+
 const uint8_t double_zero_bytes[]{ 0x00, 0x00 };
-HvacFullStatus ac_status;
-bool config_mode{ false };
 const haier_protocol::HaierMessage INVALID_MSG(haier_protocol::FrameType::INVALID, double_zero_bytes, 2);
 const haier_protocol::HaierMessage CONFIRM_MSG(haier_protocol::FrameType::CONFIRM);
-uint8_t alarm_status_buf[ALARM_BUF_SIZE] = { 0x00 }; // Alarm mask (no alarms)
-
-uint8_t communication_status{ 0xFF };
-std::chrono::steady_clock::time_point last_alarm_message;
-bool alarm_paused;
-bool alarm_stopped;
 
 constexpr size_t SHORT_ALARM_REPORT_INTERVAL_MS = 300;
 constexpr size_t LONG_ALARM_REPORT_INTERVAL_MS = 5000;
 
-bool has_active_alarms() {
-  for (int i = 0; i < ALARM_BUF_SIZE; i++)
-    if (alarm_status_buf[i] != 0)
-      return true;
-  return false;
+void init_ac_state(HonStatusView state) {
+  memset(state.data(), 0, HonStatusView::SIZE);
+  state.control().set_set_point(25 - 16);
+  state.control().set_vertical_swing_mode((uint8_t)VerticalSwingMode::AUTO);
+  state.control().set_fan_mode((uint8_t)FanMode::FAN_AUTO);
+  state.control().set_special_mode((uint8_t)SpecialMode::NONE);
+  state.control().set_ac_mode((uint8_t)ConditioningMode::AUTO);
+  state.control().set_ten_degree(0);
+  state.control().set_display_status(1);
+  state.control().set_half_degree(0);
+  state.control().set_intelligence_status(0);
+  state.control().set_pmv_status(0);
+  state.control().set_use_fahrenheit(0);
+  state.control().set_ac_power(0);
+  state.control().set_health_mode(0);
+  state.control().set_electric_heating_status(0);
+  state.control().set_fast_mode(0);
+  state.control().set_quiet_mode(0);
+  state.control().set_sleep_mode(0);
+  state.control().set_lock_remote(0);
+  state.control().set_beeper_status(0);
+  state.control().set_target_humidity(0);
+  state.control().set_horizontal_swing_mode((uint8_t)HorizontalSwingMode::AUTO);
+  state.control().set_human_sensing_status(0);
+  state.control().set_change_filter(0);
+  state.control().set_fresh_air_status(0);
+  state.control().set_humidification_status(0);
+  state.control().set_pm2p5_cleaning_status(0);
+  state.control().set_ch2o_cleaning_status(0);
+  state.control().set_self_cleaning_status(0);
+  state.control().set_light_status(1);
+  state.control().set_energy_saving_status(0);
+  state.control().set_cleaning_time_status(0);
+  state.sensors().set_room_temperature(18 * 2);
+  state.sensors().set_room_humidity(0);
+  state.sensors().set_outdoor_temperature(10 + 64);
+  state.sensors().set_pm2p5_level(0);
+  state.sensors().set_air_quality(0);
+  state.sensors().set_human_sensing(0);
+  state.sensors().set_ac_type(0);
+  state.sensors().set_error_status(0);
+  state.sensors().set_operation_source(3);
+  state.sensors().set_operation_mode_hk(0);
+  state.sensors().set_err_confirmation(0);
+  state.sensors().set_total_cleaning_time(0);
+  state.sensors().set_indoor_pm2p5_value(0);
+  state.sensors().set_outdoor_pm2p5_value(0);
+  state.sensors().set_ch2o_value(0);
+  state.sensors().set_voc_value(0);
+  state.sensors().set_co2_value(0);
+  state.big_data().set_power(0);
+  state.big_data().set_indoor_coil_temperature(state.sensors().room_temperature() + 40);
+  state.big_data().set_outdoor_out_air_temperature(state.sensors().outdoor_temperature());
+  state.big_data().set_outdoor_coil_temperature(state.sensors().outdoor_temperature());
+  state.big_data().set_outdoor_in_air_temperature(state.sensors().outdoor_temperature());
+  state.big_data().set_outdoor_defrost_temperature(state.sensors().outdoor_temperature());
+  state.big_data().set_compressor_frequency(0);
+  state.big_data().set_compressor_current(0);
+  state.big_data().set_outdoor_fan_status(0);
+  state.big_data().set_defrost_status(0);
+  state.big_data().set_compressor_status(0);
+  state.big_data().set_indoor_fan_status(0);
+  state.big_data().set_four_way_valve_status(0);
+  state.big_data().set_indoor_electric_heating_status(0);
+  state.big_data().set_expansion_valve_open_degree(0);
+}
+
 }
 
-void init_ac_state(HvacFullStatus& state) {
-  memset(&state, 0, sizeof(HvacFullStatus));
-  state.control.set_point = 25 - 16;
-  state.control.vertical_swing_mode = (uint8_t)VerticalSwingMode::AUTO;
-  state.control.fan_mode = (uint8_t)FanMode::FAN_AUTO;
-  state.control.special_mode = (uint8_t)SpecialMode::NONE;
-  state.control.ac_mode = (uint8_t)ConditioningMode::AUTO;
-  state.control.ten_degree = 0;
-  state.control.display_status = 1;
-  state.control.half_degree = 0;
-  state.control.intelligence_status = 0;
-  state.control.pmv_status = 0;
-  state.control.use_fahrenheit = 0;
-  state.control.ac_power = 0;
-  state.control.health_mode = 0;
-  state.control.electric_heating_status = 0;
-  state.control.fast_mode = 0;
-  state.control.quiet_mode = 0;
-  state.control.sleep_mode = 0;
-  state.control.lock_remote = 0;
-  state.control.beeper_status = 0;
-  state.control.target_humidity = 0;
-  state.control.horizontal_swing_mode = (uint8_t)HorizontalSwingMode::AUTO;
-  state.control.human_sensing_status = 0;
-  state.control.change_filter = 0;
-  state.control.fresh_air_status = 0;
-  state.control.humidification_status = 0;
-  state.control.pm2p5_cleaning_status = 0;
-  state.control.ch2o_cleaning_status = 0;
-  state.control.self_cleaning_status = 0;
-  state.control.light_status = 1;
-  state.control.energy_saving_status = 0;
-  state.control.cleaning_time_status = 0;
-  state.sensors.room_temperature = 18 * 2;
-  state.sensors.room_humidity = 0;
-  state.sensors.outdoor_temperature = 10 + 64;
-  state.sensors.pm2p5_level = 0;
-  state.sensors.air_quality = 0;
-  state.sensors.human_sensing = 0;
-  state.sensors.ac_type = 0;
-  state.sensors.error_status = 0;
-  state.sensors.operation_source = 3;
-  state.sensors.operation_mode_hk = 0;
-  state.sensors.err_confirmation = 0;
-  state.sensors.total_cleaning_time = 0;
-  state.sensors.indoor_pm2p5_value = 0;
-  state.sensors.outdoor_pm2p5_value = 0;
-  state.sensors.ch2o_value = 0;
-  state.sensors.voc_value = 0;
-  state.sensors.co2_value = 0;
-  state.big_data.power[0] = 0;
-  state.big_data.power[0] = 0;
-  state.big_data.indoor_coil_temperature = state.sensors.room_temperature + 40;
-  state.big_data.outdoor_out_air_temperature = state.sensors.outdoor_temperature;
-  state.big_data.outdoor_coil_temperature = state.sensors.outdoor_temperature;
-  state.big_data.outdoor_in_air_temperature = state.sensors.outdoor_temperature;
-  state.big_data.outdoor_defrost_temperature = state.sensors.outdoor_temperature;
-  state.big_data.compressor_frequency = 0;
-  state.big_data.compressor_current[0] = 0;
-  state.big_data.compressor_current[1] = 0;
-  state.big_data.outdoor_fan_status = 0;
-  state.big_data.defrost_status = 0;
-  state.big_data.compressor_status = 0;
-  state.big_data.indoor_fan_status = 0;
-  state.big_data.four_way_valve_status = 0;
-  state.big_data.indoor_electric_heating_status = 0;
-  state.big_data.expansion_valve_open_degree[0] = 0;
-  state.big_data.expansion_valve_open_degree[1] = 0;
-  last_alarm_message = std::chrono::steady_clock::now();
-  alarm_paused = false;
-  alarm_stopped = true;
+HonServer::HonServer() {
+  init_ac_state(this->get_ac_state());
+  this->last_alarm_message_ = std::chrono::steady_clock::now();
 }
 
-bool is_in_configuration_mode() {
-  return config_mode;
+void HonServer::register_handlers(haier_protocol::ProtocolHandler& protocol_handler) {
+  using namespace std::placeholders;
+  protocol_handler.set_message_handler(haier_protocol::FrameType::GET_DEVICE_VERSION, std::bind(&HonServer::get_device_version_handler, this, &protocol_handler, _1, _2, _3));
+  protocol_handler.set_message_handler(haier_protocol::FrameType::GET_DEVICE_ID, std::bind(&HonServer::get_device_id_handler, this, &protocol_handler, _1, _2, _3));
+  protocol_handler.set_message_handler(haier_protocol::FrameType::CONTROL, std::bind(&HonServer::status_request_handler, this, &protocol_handler, _1, _2, _3));
+  protocol_handler.set_message_handler(haier_protocol::FrameType::GET_ALARM_STATUS, std::bind(&HonServer::alarm_status_handler, this, &protocol_handler, _1, _2, _3));
+  protocol_handler.set_message_handler(haier_protocol::FrameType::GET_MANAGEMENT_INFORMATION, std::bind(&HonServer::get_management_information_handler, this, &protocol_handler, _1, _2, _3));
+  protocol_handler.set_message_handler(haier_protocol::FrameType::REPORT_NETWORK_STATUS, std::bind(&HonServer::report_network_status_handler, this, &protocol_handler, _1, _2, _3));
+  protocol_handler.set_message_handler(haier_protocol::FrameType::STOP_FAULT_ALARM, std::bind(&HonServer::stop_alarm_handler, this, &protocol_handler, _1, _2, _3));
+  protocol_handler.set_answer_handler(haier_protocol::FrameType::ALARM_STATUS, std::bind(&HonServer::alarm_status_report_answer_handler, this, &protocol_handler, _1, _2, _3, _4));
 }
 
-void process_alarms(haier_protocol::ProtocolHandler* protocol_handler)
+bool HonServer::has_active_alarms() const {
+  for (int i = 0; i < ALARM_BUF_SIZE; i++)
+    if (this->alarm_status_buf_[i] != 0)
+      return true;
+  return false;
+}
+
+void HonServer::process_alarms(haier_protocol::ProtocolHandler* protocol_handler)
 {
-  if (!alarm_stopped && !protocol_handler->is_waiting_for_answer() && (protocol_handler->get_outgoing_queue_size() == 0)) {
+  if (!this->alarm_stopped_ && !protocol_handler->is_waiting_for_answer() && (protocol_handler->get_outgoing_queue_size() == 0)) {
     std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
-    if (( alarm_paused && (std::chrono::duration_cast<std::chrono::milliseconds>(now - last_alarm_message).count() > LONG_ALARM_REPORT_INTERVAL_MS)) ||
-        (!alarm_paused && (std::chrono::duration_cast<std::chrono::milliseconds>(now - last_alarm_message).count() > SHORT_ALARM_REPORT_INTERVAL_MS))) {
-      alarm_paused = false;
-      protocol_handler->send_message(haier_protocol::HaierMessage(haier_protocol::FrameType::ALARM_STATUS, 0x0F5A, alarm_status_buf, sizeof(alarm_status_buf)), true);
-      last_alarm_message = now;
+    if (( this->alarm_paused_ && (std::chrono::duration_cast<std::chrono::milliseconds>(now - this->last_alarm_message_).count() > LONG_ALARM_REPORT_INTERVAL_MS)) ||
+        (!this->alarm_paused_ && (std::chrono::duration_cast<std::chrono::milliseconds>(now - this->last_alarm_message_).count() > SHORT_ALARM_REPORT_INTERVAL_MS))) {
+      this->alarm_paused_ = false;
+      protocol_handler->send_message(haier_protocol::HaierMessage(haier_protocol::FrameType::ALARM_STATUS, 0x0F5A, this->alarm_status_buf_, sizeof(this->alarm_status_buf_)), true);
+      this->last_alarm_message_ = now;
     }
   }
 }
 
-HvacFullStatus& get_ac_state_ref() {
-  static bool _first_run = true;
-  if (_first_run) {
-    _first_run = false;
-    init_ac_state(ac_status);
-  }
-  return ac_status;
-}
-
-bool start_alarm(uint8_t alarm_id) {
+bool HonServer::start_alarm(uint8_t alarm_id) {
   if (alarm_id >= esphome::haier::hon_protocol::HON_ALARM_COUNT)
     return false;
-  alarm_paused = false;
-  alarm_stopped = false;
-  alarm_status_buf[ALARM_BUF_SIZE - 1 - (uint8_t)(alarm_id / 8)] |= (1 << (alarm_id % 8));
+  this->alarm_paused_ = false;
+  this->alarm_stopped_ = false;
+  this->alarm_status_buf_[ALARM_BUF_SIZE - 1 - (uint8_t)(alarm_id / 8)] |= (1 << (alarm_id % 8));
   return true;
 }
 
-void reset_alarms() {
-  memset(alarm_status_buf, 0, sizeof(ALARM_BUF_SIZE));
-  alarm_paused = false;
+void HonServer::reset_alarms() {
+  memset(this->alarm_status_buf_, 0, sizeof(this->alarm_status_buf_));
+  this->alarm_paused_ = false;
 }
 
-haier_protocol::HandlerError get_device_version_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size) {
+haier_protocol::HandlerError HonServer::get_device_version_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size) {
   if (type == haier_protocol::FrameType::GET_DEVICE_VERSION) {
     if ((size == 0) || (size == 2)) {
       static const uint8_t device_version_info_buf[]{
@@ -165,7 +160,7 @@ haier_protocol::HandlerError get_device_version_handler(haier_protocol::Protocol
   }
 }
 
-haier_protocol::HandlerError get_device_id_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size) {
+haier_protocol::HandlerError HonServer::get_device_id_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size) {
   if (type == haier_protocol::FrameType::GET_DEVICE_ID) {
     if (size == 0) {
       static const uint8_t device_id_buf[] = { 0x20, 0x20, 0x62, 0x84, 0x20, 0xD2, 0x85, 0x34, 0x02, 0x12, 0x71, 0xFB, 0xE0, 0xF4, 0x0D, 0x00,
@@ -184,7 +179,7 @@ haier_protocol::HandlerError get_device_id_handler(haier_protocol::ProtocolHandl
   }
 }
 
-haier_protocol::HandlerError status_request_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size) {
+haier_protocol::HandlerError HonServer::status_request_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size) {
   if (type == haier_protocol::FrameType::CONTROL) {
     if (size < 2) {
       protocol_handler->send_answer(INVALID_MSG);
@@ -197,29 +192,31 @@ haier_protocol::HandlerError status_request_handler(haier_protocol::ProtocolHand
         protocol_handler->send_answer(INVALID_MSG);
         return haier_protocol::HandlerError::WRONG_MESSAGE_STRUCTURE;
       }
-      protocol_handler->send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::STATUS, 0x6D01, (uint8_t*)&ac_status, USER_DATA_SIZE));
+      protocol_handler->send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::STATUS, 0x6D01, this->ac_status_, HON_USER_DATA_SIZE));
       return haier_protocol::HandlerError::HANDLER_OK;
     case (uint16_t)SubcommandsControl::GET_BIG_DATA:
       if (size != 2) {
         protocol_handler->send_answer(INVALID_MSG);
         return haier_protocol::HandlerError::WRONG_MESSAGE_STRUCTURE;
       }
-      protocol_handler->send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::STATUS, 0x7D01, (uint8_t*)&ac_status, BIG_DATA_SIZE));
+      protocol_handler->send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::STATUS, 0x7D01, this->ac_status_, HON_BIG_DATA_SIZE));
       return haier_protocol::HandlerError::HANDLER_OK;
     case (uint16_t)SubcommandsControl::SET_GROUP_PARAMETERS:
-      if (size - 2 != sizeof(HaierPacketControl)) {
-        HAIER_LOGW("Wrong control packet size, expected %d, received %d", sizeof(HaierPacketControl), size - 2);
+      if (size - 2 != HonControlView::SIZE) {
+        HAIER_LOGW("Wrong control packet size, expected %d, received %d", HonControlView::SIZE, size - 2);
         protocol_handler->send_answer(INVALID_MSG);
         return haier_protocol::HandlerError::WRONG_MESSAGE_STRUCTURE;
       }
-      for (unsigned int i = 0; i < sizeof(HaierPacketControl); i++) {
-        uint8_t& cbyte = ((uint8_t*)&ac_status)[i];
-        if (cbyte != buffer[2 + i]) {
-          HAIER_LOGI("Byte #%d changed 0x%02X => 0x%02X", i + 10, cbyte, buffer[2 + i]);
-          cbyte = buffer[2 + i];
+      {
+        const haier_protocol::PayloadDelta& delta = get_hon_control_delta();
+        haier_protocol::FieldChange changes[HonControlView::SIZE * 8];
+        size_t count = delta.compare(this->ac_status_, buffer + 2, changes, sizeof(changes) / sizeof(changes[0]));
+        for (size_t i = 0; i < count; i++) {
+          HAIER_LOGI("%s changed %u => %u", delta.get_field(changes[i].field).name, changes[i].old_value, changes[i].new_value);
         }
+        memcpy(this->ac_status_, buffer + 2, HonControlView::SIZE);
       }
-      protocol_handler->send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::STATUS, 0x6D5F, (uint8_t*)&ac_status, USER_DATA_SIZE));
+      protocol_handler->send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::STATUS, 0x6D5F, this->ac_status_, HON_USER_DATA_SIZE));
       return haier_protocol::HandlerError::HANDLER_OK;
     default:
       if ((subcommand & 0xFF00) == (uint16_t)SubcommandsControl::SET_SINGLE_PARAMETER) {
@@ -230,7 +227,7 @@ haier_protocol::HandlerError status_request_handler(haier_protocol::ProtocolHand
         }
         uint8_t parameter = buffer[1];
         uint16_t value = (buffer[2] << 8) + buffer[3];
-        return process_single_parameter(protocol_handler, parameter, value);
+        return this->process_single_parameter(protocol_handler, parameter, value);
       }
       else {
         protocol_handler->send_answer(INVALID_MSG);
@@ -243,10 +240,10 @@ haier_protocol::HandlerError status_request_handler(haier_protocol::ProtocolHand
   }
 }
 
-haier_protocol::HandlerError alarm_status_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size) {
+haier_protocol::HandlerError HonServer::alarm_status_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size) {
   if (type == haier_protocol::FrameType::GET_ALARM_STATUS) {
     if (size == 0) {
-      protocol_handler->send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::GET_ALARM_STATUS_RESPONSE, 0x0F5A, alarm_status_buf, sizeof(alarm_status_buf)));
+      protocol_handler->send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::GET_ALARM_STATUS_RESPONSE, 0x0F5A, this->alarm_status_buf_, sizeof(this->alarm_status_buf_)));
       return haier_protocol::HandlerError::HANDLER_OK;
     } else {
       protocol_handler->send_answer(INVALID_MSG);
@@ -258,7 +255,7 @@ haier_protocol::HandlerError alarm_status_handler(haier_protocol::ProtocolHandle
   }
 }
 
-haier_protocol::HandlerError get_management_information_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size) {
+haier_protocol::HandlerError HonServer::get_management_information_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size) {
   if (type == haier_protocol::FrameType::GET_MANAGEMENT_INFORMATION) {
     if (size == 0) {
       static const uint8_t management_information_buf[] = { 
@@ -280,14 +277,14 @@ haier_protocol::HandlerError get_management_information_handler(haier_protocol::
   }
 }
 
-haier_protocol::HandlerError report_network_status_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size) {
+haier_protocol::HandlerError HonServer::report_network_status_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size) {
   if (type == haier_protocol::FrameType::REPORT_NETWORK_STATUS) {
     if (size == 4) {
       uint8_t st = buffer[1];
-      config_mode = st == 3;
-      if (!config_mode && (ac_status.control.set_point == 0x0E))
-        ac_status.control.set_point = 0x0D;
-      if (st != communication_status) {
+      this->config_mode_ = st == 3;
+      if (!this->config_mode_ && (this->get_ac_state().control().set_point() == 0x0E))
+        this->get_ac_state().control().set_set_point(0x0D);
+      if (st != this->communication_status_) {
         switch (st) {
         case 0:
           HAIER_LOGI("Network status: Communication is normal");
@@ -305,7 +302,7 @@ haier_protocol::HandlerError report_network_status_handler(haier_protocol::Proto
           HAIER_LOGW("Network status:  Unknown status 0x02X", st);
           break;
         }
-        communication_status = st;
+        this->communication_status_ = st;
       }
       protocol_handler->send_answer(CONFIRM_MSG);
       return haier_protocol::HandlerError::HANDLER_OK;
@@ -319,14 +316,14 @@ haier_protocol::HandlerError report_network_status_handler(haier_protocol::Proto
   }
 }
 
-haier_protocol::HandlerError alarm_status_report_answer_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType request_type, haier_protocol::FrameType message_type, const uint8_t* data, size_t data_size) {
+haier_protocol::HandlerError HonServer::alarm_status_report_answer_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType request_type, haier_protocol::FrameType message_type, const uint8_t* data, size_t data_size) {
   if (request_type == haier_protocol::FrameType::ALARM_STATUS) {
     if (message_type == haier_protocol::FrameType::CONFIRM) {
       if (data_size == 0) {
-        if (!has_active_alarms())
-          alarm_stopped = true;
+        if (!this->has_active_alarms())
+          this->alarm_stopped_ = true;
         else
-          alarm_paused = true;
+          this->alarm_paused_ = true;
         return haier_protocol::HandlerError::HANDLER_OK;
       }
       else
@@ -339,11 +336,11 @@ haier_protocol::HandlerError alarm_status_report_answer_handler(haier_protocol::
     return haier_protocol::HandlerError::UNEXPECTED_MESSAGE;
 }
 
-haier_protocol::HandlerError stop_alarm_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size) {
+haier_protocol::HandlerError HonServer::stop_alarm_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size) {
   if (type == haier_protocol::FrameType::STOP_FAULT_ALARM) {
     if (size == 0) {
       HAIER_LOGI("Stop alarm message received.");
-      alarm_stopped = true;
+      this->alarm_stopped_ = true;
       protocol_handler->send_answer(CONFIRM_MSG);
       return haier_protocol::HandlerError::HANDLER_OK;
     }
@@ -358,15 +355,16 @@ haier_protocol::HandlerError stop_alarm_handler(haier_protocol::ProtocolHandler*
   }
 }
 
-haier_protocol::HandlerError process_single_parameter(haier_protocol::ProtocolHandler* protocol_handler, uint8_t parameter, uint16_t value)
+haier_protocol::HandlerError HonServer::process_single_parameter(haier_protocol::ProtocolHandler* protocol_handler, uint8_t parameter, uint16_t value)
 {
   #define SET_IF_DIFFERENT(VALUE, FIELD) \
       do { \
-        if (ac_status.control.FIELD != VALUE) { \
+        if (control.FIELD() != VALUE) { \
           HAIER_LOGI(#FIELD" <= %u", VALUE); \
-          ac_status.control.FIELD = VALUE; \
+          control.set_##FIELD(VALUE); \
         } \
       } while (0)
+  HonControlView control = this->get_ac_state().control();
   haier_protocol::HandlerError result = haier_protocol::HandlerError::HANDLER_OK;
   switch (parameter) {
     case (uint8_t)DataParameters::AC_POWER:
@@ -440,7 +438,7 @@ haier_protocol::HandlerError process_single_parameter(haier_protocol::ProtocolHa
       break;
   }
   if (result == haier_protocol::HandlerError::HANDLER_OK) {
-    protocol_handler->send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::STATUS, 0x6D01, (uint8_t*)&ac_status, USER_DATA_SIZE));
+    protocol_handler->send_answer(haier_protocol::HaierMessage(haier_protocol::FrameType::STATUS, 0x6D01, this->ac_status_, HON_USER_DATA_SIZE));
   }
   else {
     protocol_handler->send_answer(INVALID_MSG);
@@ -1,48 +1,56 @@
 ﻿#pragma once
 
 #include <stdint.h>
+#include <chrono>
 #include "protocol/haier_protocol.h"
 #include "hon_packet.h"
-
-constexpr size_t SENSORS_SPARE_SIZE = 4;
-
-struct HvacFullStatus {
-  esphome::haier::hon_protocol::HaierPacketControl control;
-  esphome::haier::hon_protocol::HaierPacketSensors sensors;
-  uint8_t spare[SENSORS_SPARE_SIZE];
-  esphome::haier::hon_protocol::HaierPacketBigData big_data;
-};
+#include "packet_views.h"
 
 constexpr size_t ALARM_BUF_SIZE = 8;
 
-constexpr size_t USER_DATA_SIZE = sizeof(esphome::haier::hon_protocol::HaierPacketControl) + sizeof(esphome::haier::hon_protocol::HaierPacketSensors) + SENSORS_SPARE_SIZE;
-
-constexpr size_t BIG_DATA_SIZE = sizeof(HvacFullStatus);
+// Simulated hOn appliance, every instance has its own state so several
+// appliances can run in one process
+class HonServer {
+public:
+  HonServer();
+  // Register all message and answer handlers of the appliance
+  void register_handlers(haier_protocol::ProtocolHandler& protocol_handler);
 
-void process_alarms(haier_protocol::ProtocolHandler* protocol_handler);
+  void process_alarms(haier_protocol::ProtocolHandler* protocol_handler);
 
-HvacFullStatus& get_ac_state_ref();
+  // State is kept as big data answer payload
+  HonStatusView get_ac_state() { return HonStatusView(this->ac_status_); }
 
-bool start_alarm(uint8_t alarm_id);
+  bool start_alarm(uint8_t alarm_id);
 
-void reset_alarms();
+  void reset_alarms();
 
-bool is_in_configuration_mode();
+  bool is_in_configuration_mode() const { return this->config_mode_; }
 
-haier_protocol::HandlerError get_device_version_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
+  haier_protocol::HandlerError get_device_version_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
 
-haier_protocol::HandlerError get_device_id_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
+  haier_protocol::HandlerError get_device_id_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
 
-haier_protocol::HandlerError status_request_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
+  haier_protocol::HandlerError status_request_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
 
-haier_protocol::HandlerError alarm_status_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
+  haier_protocol::HandlerError alarm_status_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
 
-haier_protocol::HandlerError get_management_information_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
+  haier_protocol::HandlerError get_management_information_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
 
-haier_protocol::HandlerError report_network_status_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
+  haier_protocol::HandlerError report_network_status_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
 
-haier_protocol::HandlerError stop_alarm_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
+  haier_protocol::HandlerError stop_alarm_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
 
-haier_protocol::HandlerError process_single_parameter(haier_protocol::ProtocolHandler* protocol_handler, uint8_t parameter, uint16_t value);
+  haier_protocol::HandlerError process_single_parameter(haier_protocol::ProtocolHandler* protocol_handler, uint8_t parameter, uint16_t value);
 
-haier_protocol::HandlerError alarm_status_report_answer_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType request_type, haier_protocol::FrameType message_type, const uint8_t* data, size_t data_size);
\ No newline at end of file
+  haier_protocol::HandlerError alarm_status_report_answer_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType request_type, haier_protocol::FrameType message_type, const uint8_t* data, size_t data_size);
+private:
+  bool has_active_alarms() const;
+  uint8_t ac_status_[HON_BIG_DATA_SIZE];
+  bool config_mode_{ false };
+  uint8_t alarm_status_buf_[ALARM_BUF_SIZE] = { 0x00 }; // Alarm mask (no alarms)
+  uint8_t communication_status_{ 0xFF };
+  std::chrono::steady_clock::time_point last_alarm_message_;
+  bool alarm_paused_{ false };
+  bool alarm_stopped_{ true };
+};
\ No newline at end of file
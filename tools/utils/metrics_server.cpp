@@ -0,0 +1,357 @@
+#if _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <cstdlib>
+#include "metrics_server.h"
+
+#if _WIN32
+#pragma comment(lib, "ws2_32.lib")
+using native_socket = SOCKET;
+#define close_socket(s) closesocket((native_socket) (s))
+#define SEND_FLAGS 0
+#else
+using native_socket = int;
+#define close_socket(s) close((native_socket) (s))
+#define SEND_FLAGS MSG_NOSIGNAL
+#endif
+
+namespace
+{
+
+// Collects output in fixed size chunk, no allocations while rendering
+class ChunkWriter
+{
+public:
+  explicit ChunkWriter(std::function<void(const char*, size_t)>& output) : output_(output) {};
+  ~ChunkWriter() { this->flush(); };
+  void printf(const char* format, ...);
+  void flush();
+private:
+  std::function<void(const char*, size_t)>& output_;
+  char buffer_[METRICS_CHUNK_SIZE];
+  size_t size_{ 0 };
+};
+
+void ChunkWriter::printf(const char* format, ...)
+{
+  for (int attempt = 0; attempt < 2; attempt++) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(this->buffer_ + this->size_, METRICS_CHUNK_SIZE - this->size_, format, args);
+    va_end(args);
+    if (len < 0)
+      return;
+    if (this->size_ + len < METRICS_CHUNK_SIZE) {
+      this->size_ += len;
+      return;
+    }
+    // Doesn't fit, send what we have and try again with empty chunk
+    this->flush();
+  }
+}
+
+void ChunkWriter::flush()
+{
+  if (this->size_ > 0)
+    this->output_(this->buffer_, this->size_);
+  this->size_ = 0;
+}
+
+struct CounterMetric
+{
+  const char* name;
+  const char* help;
+  haier_protocol::StatCounter haier_protocol::TransportStatistics::* transport_counter;
+  haier_protocol::StatCounter haier_protocol::ProtocolStatistics::* protocol_counter;
+};
+
+const CounterMetric COUNTERS[] = {
+  { "haier_transport_bytes_read", "Bytes read from the stream", &haier_protocol::TransportStatistics::bytes_read, nullptr },
+  { "haier_transport_bytes_dropped", "Bytes dropped as garbage or because of errors", &haier_protocol::TransportStatistics::bytes_dropped, nullptr },
+  { "haier_transport_frames_parsed", "Incoming frames parsed", &haier_protocol::TransportStatistics::frames_parsed, nullptr },
+  { "haier_transport_frames_sent", "Frames sent", &haier_protocol::TransportStatistics::frames_sent, nullptr },
+  { "haier_transport_buffer_overflows", "Frames lost because of buffer overflow", &haier_protocol::TransportStatistics::buffer_overflows, nullptr },
+  { "haier_transport_frame_timeouts", "Frames lost because of timeout", &haier_protocol::TransportStatistics::frame_timeouts, nullptr },
+  { "haier_transport_frames_filtered", "Frames for other units of multi-unit bus", &haier_protocol::TransportStatistics::frames_filtered, nullptr },
+  { "haier_protocol_frames_dropped", "Extra incoming frames dropped in idle state", nullptr, &haier_protocol::ProtocolStatistics::frames_dropped },
+  { "haier_protocol_messages_sent", "Requests sent including retries", nullptr, &haier_protocol::ProtocolStatistics::messages_sent },
+  { "haier_protocol_retries", "Request retries", nullptr, &haier_protocol::ProtocolStatistics::retries },
+  { "haier_protocol_answers_received", "Answers received", nullptr, &haier_protocol::ProtocolStatistics::answers_received },
+};
+
+const char* const FRAME_ERROR_NAMES[haier_protocol::FRAME_ERRORS_COUNT] = {
+  "complete_frame", "header_only", "frame_separator_wrong", "header_too_small", "frame_too_big", "frame_too_small",
+  "data_size_wrong", "checksum_wrong", "crc_wrong", "wrong_post_separator_byte", "unknown_data"
+};
+
+// Exported buckets end at powers of two microseconds, the last one is about a minute
+constexpr unsigned int MAX_EXPORTED_BUCKET_BITS = 26;
+
+// Cumulative histogram buckets can be aggregated over devices and scrapes, unlike quantiles.
+// LatencyHistogram has 8 buckets per power of two, only the last one of every power is exported.
+void render_histogram(ChunkWriter& writer, const char* name, const char* labels, const haier_protocol::LatencyHistogram& histogram)
+{
+  using haier_protocol::LatencyHistogram;
+  if (histogram.get_count() == 0)
+    return;
+  const size_t last_exported = LatencyHistogram::LINEAR_BUCKETS + (MAX_EXPORTED_BUCKET_BITS - LatencyHistogram::LINEAR_BUCKETS_BITS) * LatencyHistogram::SUB_BUCKETS - 1;
+  uint32_t max_value = histogram.get_max();
+  uint32_t accumulated = 0;
+  // Values are not kept, the sum uses middle of the bucket (relative error is below 6.25%)
+  double sum = 0;
+  for (size_t i = 0; i < LatencyHistogram::BUCKETS_COUNT; i++) {
+    uint32_t count = histogram.get_bucket_count(i);
+    if (count != 0) {
+      uint32_t lower_bound = i > 0 ? LatencyHistogram::get_bucket_upper_bound(i - 1) + 1 : 0;
+      uint32_t upper_bound = LatencyHistogram::get_bucket_upper_bound(i);
+      sum += count * ((double) lower_bound + (upper_bound < max_value ? upper_bound : max_value)) / 2.0;
+      accumulated += count;
+    }
+    bool power_end = (i + 1 >= LatencyHistogram::LINEAR_BUCKETS) && ((i + 1 - LatencyHistogram::LINEAR_BUCKETS) % LatencyHistogram::SUB_BUCKETS == 0);
+    if (power_end && (i <= last_exported))
+      writer.printf("%s_bucket{%s,le=\"%.6f\"} %u\n", name, labels, LatencyHistogram::get_bucket_upper_bound(i) / 1000000.0, accumulated);
+  }
+  // Buckets are read one by one while they can change, +Inf and count use the same total
+  writer.printf("%s_bucket{%s,le=\"+Inf\"} %u\n", name, labels, accumulated);
+  writer.printf("%s_sum{%s} %.6f\n", name, labels, sum / 1000000.0);
+  writer.printf("%s_count{%s} %u\n", name, labels, accumulated);
+}
+
+std::string escape_label(const std::string& value)
+{
+  std::string result;
+  for (char c : value) {
+    if ((c == '\\') || (c == '"'))
+      result.push_back('\\');
+    if (c == '\n')
+      result.append("\\n");
+    else
+      result.push_back(c);
+  }
+  return result;
+}
+
+}
+
+MetricsServer::~MetricsServer() {
+  this->stop();
+}
+
+void MetricsServer::register_handler(const haier_protocol::ProtocolHandler& handler, const std::string& port, const std::string& device) {
+  this->registrations_.push_back({ &handler, std::string("port=\"").append(escape_label(port)).append("\",device=\"").append(escape_label(device)).append("\"") });
+}
+
+void MetricsServer::render(std::function<void(const char*, size_t)> output) const {
+  ChunkWriter writer(output);
+  for (const CounterMetric& counter : COUNTERS) {
+    writer.printf("# TYPE %s counter\n# HELP %s %s.\n", counter.name, counter.name, counter.help);
+    for (const Registration& reg : this->registrations_) {
+      uint32_t value = counter.transport_counter != nullptr ?
+        (reg.handler->get_transport_statistics().*counter.transport_counter).get() :
+        (reg.handler->get_statistics().*counter.protocol_counter).get();
+      writer.printf("%s_total{%s} %u\n", counter.name, reg.labels.c_str(), value);
+    }
+  }
+  writer.printf("# TYPE haier_transport_frame_errors counter\n# HELP haier_transport_frame_errors Frame parsing errors.\n");
+  for (const Registration& reg : this->registrations_) {
+    const haier_protocol::TransportStatistics& stats = reg.handler->get_transport_statistics();
+    // First two are not errors
+    for (size_t i = (size_t) haier_protocol::FrameError::FRAME_SEPARATOR_WRONG; i < haier_protocol::FRAME_ERRORS_COUNT; i++)
+      writer.printf("haier_transport_frame_errors_total{%s,error=\"%s\"} %u\n", reg.labels.c_str(), FRAME_ERROR_NAMES[i], stats.frame_errors[i].get());
+  }
+  writer.printf("# TYPE haier_protocol_answer_timeouts counter\n# HELP haier_protocol_answer_timeouts Answer timeouts by request frame type.\n");
+  for (const Registration& reg : this->registrations_) {
+    const haier_protocol::FrameTypeCounters& timeouts = reg.handler->get_statistics().answer_timeouts;
+    size_t count = timeouts.get_types_count();
+    for (size_t i = 0; i < count; i++)
+      writer.printf("haier_protocol_answer_timeouts_total{%s,frame_type=\"0x%02X\"} %u\n", reg.labels.c_str(), timeouts.get_type_at(i), timeouts.get_at(i).get());
+    writer.printf("haier_protocol_answer_timeouts_total{%s,frame_type=\"other\"} %u\n", reg.labels.c_str(), timeouts.get_other().get());
+  }
+  writer.printf("# TYPE haier_protocol_outgoing_queue_high_water_mark gauge\n# HELP haier_protocol_outgoing_queue_high_water_mark Maximum size of the outgoing queue.\n");
+  for (const Registration& reg : this->registrations_)
+    writer.printf("haier_protocol_outgoing_queue_high_water_mark{%s} %u\n", reg.labels.c_str(), reg.handler->get_statistics().outgoing_queue_high_water_mark.get());
+  writer.printf("# TYPE haier_protocol_answer_latency_seconds histogram\n# HELP haier_protocol_answer_latency_seconds Time from request sent till answer start.\n");
+  // Registration labels have no length limit, so frame type is appended to a string
+  std::string labels;
+  char frame_type[24];
+  for (const Registration& reg : this->registrations_) {
+    const haier_protocol::LatencyStatistics* latency = reg.handler->get_latency_statistics();
+    if (latency == nullptr)
+      continue;
+    size_t count = latency->answer_latency.get_types_count();
+    for (size_t i = 0; i < count; i++) {
+      snprintf(frame_type, sizeof(frame_type), ",frame_type=\"0x%02X\"", latency->answer_latency.get_type_at(i));
+      labels.assign(reg.labels).append(frame_type);
+      render_histogram(writer, "haier_protocol_answer_latency_seconds", labels.c_str(), latency->answer_latency.get_at(i));
+    }
+    labels.assign(reg.labels).append(",frame_type=\"other\"");
+    render_histogram(writer, "haier_protocol_answer_latency_seconds", labels.c_str(), latency->answer_latency.get_other());
+  }
+  writer.printf("# TYPE haier_protocol_queue_wait_seconds histogram\n# HELP haier_protocol_queue_wait_seconds Time from adding to outgoing queue till first transmission.\n");
+  for (const Registration& reg : this->registrations_)
+    if (reg.handler->get_latency_statistics() != nullptr)
+      render_histogram(writer, "haier_protocol_queue_wait_seconds", reg.labels.c_str(), reg.handler->get_latency_statistics()->queue_wait);
+  writer.printf("# TYPE haier_protocol_dispatch_delay_seconds histogram\n# HELP haier_protocol_dispatch_delay_seconds Time from incoming frame parsed till handler call.\n");
+  for (const Registration& reg : this->registrations_)
+    if (reg.handler->get_latency_statistics() != nullptr)
+      render_histogram(writer, "haier_protocol_dispatch_delay_seconds", reg.labels.c_str(), reg.handler->get_latency_statistics()->dispatch_delay);
+  writer.printf("# EOF\n");
+}
+
+bool MetricsServer::start(const std::string& address) {
+  if (this->running_)
+    return false;
+#if _WIN32
+  WSADATA wsa_data;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+    return false;
+  this->wsa_started_ = true;
+#endif
+  const std::string unix_prefix = "unix:";
+  if (address.rfind(unix_prefix, 0) == 0) {
+#if _WIN32
+    HAIER_LOGE("Unix domain sockets are not supported on Windows");
+    this->stop();
+    return false;
+#else
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::string path = address.substr(unix_prefix.size());
+    if (path.empty() || (path.size() >= sizeof(addr.sun_path))) {
+      HAIER_LOGE("Wrong metrics socket path %s", path.c_str());
+      return false;
+    }
+    strcpy(addr.sun_path, path.c_str());
+    // Socket left by previous run would make bind fail, other files are never removed
+    struct stat file_stat;
+    if ((lstat(path.c_str(), &file_stat) == 0) && S_ISSOCK(file_stat.st_mode))
+      unlink(path.c_str());
+    this->listen_socket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((this->listen_socket_ == -1) || (bind((native_socket) this->listen_socket_, (sockaddr*) &addr, sizeof(addr)) != 0)) {
+      HAIER_LOGE("Can't bind metrics socket %s", path.c_str());
+      this->stop();
+      return false;
+    }
+    this->unix_path_ = path;
+#endif
+  } else {
+    int port = atoi(address.c_str());
+    if ((port <= 0) || (port > 0xFFFF)) {
+      HAIER_LOGE("Wrong metrics port %s", address.c_str());
+      this->stop();
+      return false;
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t) port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    this->listen_socket_ = (intptr_t) socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    if (this->listen_socket_ != -1)
+      setsockopt((native_socket) this->listen_socket_, SOL_SOCKET, SO_REUSEADDR, (const char*) &reuse, sizeof(reuse));
+    if ((this->listen_socket_ == -1) || (bind((native_socket) this->listen_socket_, (sockaddr*) &addr, sizeof(addr)) != 0)) {
+      HAIER_LOGE("Can't bind metrics port %d", port);
+      this->stop();
+      return false;
+    }
+  }
+  if (listen((native_socket) this->listen_socket_, 4) != 0) {
+    HAIER_LOGE("Can't listen on metrics socket");
+    this->stop();
+    return false;
+  }
+  this->running_ = true;
+  this->server_thread_ = std::thread(&MetricsServer::server_loop_, this);
+  HAIER_LOGI("Serving metrics on %s", address.c_str());
+  return true;
+}
+
+void MetricsServer::stop() {
+  this->running_ = false;
+  if (this->server_thread_.joinable())
+    this->server_thread_.join();
+  if (this->listen_socket_ != -1) {
+    close_socket(this->listen_socket_);
+    this->listen_socket_ = -1;
+  }
+#if _WIN32
+  if (this->wsa_started_) {
+    WSACleanup();
+    this->wsa_started_ = false;
+  }
+#else
+  if (!this->unix_path_.empty()) {
+    unlink(this->unix_path_.c_str());
+    this->unix_path_.clear();
+  }
+#endif
+}
+
+void MetricsServer::server_loop_() {
+  while (this->running_) {
+    fd_set read_set;
+    FD_ZERO(&read_set);
+    FD_SET((native_socket) this->listen_socket_, &read_set);
+    // Short timeout to check if we need to stop
+    timeval timeout{ 0, 200000 };
+    if (select((int) this->listen_socket_ + 1, &read_set, nullptr, nullptr, &timeout) <= 0)
+      continue;
+    intptr_t client = (intptr_t) accept((native_socket) this->listen_socket_, nullptr, nullptr);
+    if (client == -1)
+      continue;
+    this->serve_client_(client);
+    close_socket(client);
+  }
+}
+
+void MetricsServer::serve_client_(intptr_t client) const {
+  // Request content is not important, waiting for the end of headers
+  char request[1024];
+  size_t request_size = 0;
+  while (request_size < sizeof(request) - 1) {
+    fd_set read_set;
+    FD_ZERO(&read_set);
+    FD_SET((native_socket) client, &read_set);
+    timeval timeout{ 1, 0 };
+    if (select((int) client + 1, &read_set, nullptr, nullptr, &timeout) <= 0)
+      return;
+    int received = recv((native_socket) client, request + request_size, (int) (sizeof(request) - 1 - request_size), 0);
+    if (received <= 0)
+      return;
+    request_size += received;
+    request[request_size] = '\0';
+    if (strstr(request, "\r\n\r\n") != nullptr)
+      break;
+  }
+  std::function<void(const char*, size_t)> send_all = [client](const char* data, size_t size) {
+    while (size > 0) {
+      int sent = send((native_socket) client, data, (int) size, SEND_FLAGS);
+      if (sent <= 0)
+        return;
+      data += sent;
+      size -= sent;
+    }
+  };
+  if (strncmp(request, "GET ", 4) != 0) {
+    static const char bad_request[] = "HTTP/1.1 405 Method Not Allowed\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+    send_all(bad_request, sizeof(bad_request) - 1);
+    return;
+  }
+  static const char header[] = "HTTP/1.1 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\nConnection: close\r\n\r\n";
+  send_all(header, sizeof(header) - 1);
+  this->render(send_all);
+}
@@ -0,0 +1,48 @@
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include "protocol/haier_protocol.h"
+
+#define METRICS_CHUNK_SIZE 4096
+
+// Serves OpenMetrics text endpoint with statistics of registered protocol handlers.
+// Address can be TCP port on loopback interface ("9100") or Unix domain
+// socket ("unix:/tmp/haier.sock", not available on Windows).
+// Handlers should be registered (and latency statistics enabled) before start
+// and should outlive the server.
+class MetricsServer
+{
+public:
+    MetricsServer() = default;
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+    ~MetricsServer();
+    void register_handler(const haier_protocol::ProtocolHandler& handler, const std::string& port, const std::string& device);
+    bool start(const std::string& address);
+    void stop();
+    // Render all metrics, output is called for every filled chunk
+    void render(std::function<void(const char*, size_t)> output) const;
+private:
+    struct Registration
+    {
+        const haier_protocol::ProtocolHandler* handler;
+        std::string labels;     // already escaped: port="...",device="..."
+    };
+    void server_loop_();
+    void serve_client_(intptr_t client) const;
+    std::vector<Registration>   registrations_;
+    std::thread                 server_thread_;
+    std::atomic<bool>           running_{ false };
+    intptr_t                    listen_socket_{ -1 };   // SOCKET on Windows, file descriptor otherwise
+    std::string                 unix_path_;
+#if _WIN32
+    bool                        wsa_started_{ false };
+#endif
+};
+
+#endif // METRICS_SERVER_H
@@ -0,0 +1,132 @@
+#include "packet_fields.h"
+#include <cstddef>
+#include "packet_views.h"
+
+namespace {
+
+// Field tables follow the views, change detection and field access use the same layout
+#define VIEW_FIELD(VIEW, NAME) { #NAME, VIEW::NAME##_field::offset, VIEW::NAME##_field::size, VIEW::NAME##_field::mask }
+
+const haier_protocol::PayloadField HON_CONTROL_FIELDS[] = {
+  VIEW_FIELD(HonControlView, set_point),
+  VIEW_FIELD(HonControlView, vertical_swing_mode),
+  VIEW_FIELD(HonControlView, fan_mode),
+  VIEW_FIELD(HonControlView, special_mode),
+  VIEW_FIELD(HonControlView, ac_mode),
+  VIEW_FIELD(HonControlView, ten_degree),
+  VIEW_FIELD(HonControlView, display_status),
+  VIEW_FIELD(HonControlView, half_degree),
+  VIEW_FIELD(HonControlView, intelligence_status),
+  VIEW_FIELD(HonControlView, pmv_status),
+  VIEW_FIELD(HonControlView, use_fahrenheit),
+  VIEW_FIELD(HonControlView, steri_clean),
+  VIEW_FIELD(HonControlView, ac_power),
+  VIEW_FIELD(HonControlView, health_mode),
+  VIEW_FIELD(HonControlView, electric_heating_status),
+  VIEW_FIELD(HonControlView, fast_mode),
+  VIEW_FIELD(HonControlView, quiet_mode),
+  VIEW_FIELD(HonControlView, sleep_mode),
+  VIEW_FIELD(HonControlView, lock_remote),
+  VIEW_FIELD(HonControlView, beeper_status),
+  VIEW_FIELD(HonControlView, target_humidity),
+  VIEW_FIELD(HonControlView, horizontal_swing_mode),
+  VIEW_FIELD(HonControlView, human_sensing_status),
+  VIEW_FIELD(HonControlView, change_filter),
+  VIEW_FIELD(HonControlView, fresh_air_status),
+  VIEW_FIELD(HonControlView, humidification_status),
+  VIEW_FIELD(HonControlView, pm2p5_cleaning_status),
+  VIEW_FIELD(HonControlView, ch2o_cleaning_status),
+  VIEW_FIELD(HonControlView, self_cleaning_status),
+  VIEW_FIELD(HonControlView, light_status),
+  VIEW_FIELD(HonControlView, energy_saving_status),
+  VIEW_FIELD(HonControlView, cleaning_time_status),
+};
+
+const haier_protocol::PayloadField HON_SENSORS_FIELDS[] = {
+  VIEW_FIELD(HonSensorsView, room_temperature),
+  VIEW_FIELD(HonSensorsView, room_humidity),
+  VIEW_FIELD(HonSensorsView, outdoor_temperature),
+  VIEW_FIELD(HonSensorsView, pm2p5_level),
+  VIEW_FIELD(HonSensorsView, air_quality),
+  VIEW_FIELD(HonSensorsView, human_sensing),
+  VIEW_FIELD(HonSensorsView, ac_type),
+  VIEW_FIELD(HonSensorsView, error_status),
+  VIEW_FIELD(HonSensorsView, operation_source),
+  VIEW_FIELD(HonSensorsView, operation_mode_hk),
+  VIEW_FIELD(HonSensorsView, err_confirmation),
+  VIEW_FIELD(HonSensorsView, total_cleaning_time),
+  VIEW_FIELD(HonSensorsView, indoor_pm2p5_value),
+  VIEW_FIELD(HonSensorsView, outdoor_pm2p5_value),
+  VIEW_FIELD(HonSensorsView, ch2o_value),
+  VIEW_FIELD(HonSensorsView, voc_value),
+  VIEW_FIELD(HonSensorsView, co2_value),
+};
+
+const haier_protocol::PayloadField HON_BIG_DATA_FIELDS[] = {
+  VIEW_FIELD(HonBigDataView, power),
+  VIEW_FIELD(HonBigDataView, indoor_coil_temperature),
+  VIEW_FIELD(HonBigDataView, outdoor_out_air_temperature),
+  VIEW_FIELD(HonBigDataView, outdoor_coil_temperature),
+  VIEW_FIELD(HonBigDataView, outdoor_in_air_temperature),
+  VIEW_FIELD(HonBigDataView, outdoor_defrost_temperature),
+  VIEW_FIELD(HonBigDataView, compressor_frequency),
+  VIEW_FIELD(HonBigDataView, compressor_current),
+  VIEW_FIELD(HonBigDataView, outdoor_fan_status),
+  VIEW_FIELD(HonBigDataView, defrost_status),
+  VIEW_FIELD(HonBigDataView, compressor_status),
+  VIEW_FIELD(HonBigDataView, indoor_fan_status),
+  VIEW_FIELD(HonBigDataView, four_way_valve_status),
+  VIEW_FIELD(HonBigDataView, indoor_electric_heating_status),
+  VIEW_FIELD(HonBigDataView, expansion_valve_open_degree),
+};
+
+const haier_protocol::PayloadField SMARTAIR2_CONTROL_FIELDS[] = {
+  VIEW_FIELD(SmartAir2ControlView, room_temperature),
+  VIEW_FIELD(SmartAir2ControlView, room_humidity),
+  VIEW_FIELD(SmartAir2ControlView, cntrl),
+  VIEW_FIELD(SmartAir2ControlView, ac_mode),
+  VIEW_FIELD(SmartAir2ControlView, fan_mode),
+  VIEW_FIELD(SmartAir2ControlView, swing_both),
+  VIEW_FIELD(SmartAir2ControlView, use_fahrenheit),
+  VIEW_FIELD(SmartAir2ControlView, lock_remote),
+  VIEW_FIELD(SmartAir2ControlView, ac_power),
+  VIEW_FIELD(SmartAir2ControlView, health_mode),
+  VIEW_FIELD(SmartAir2ControlView, compressor),
+  VIEW_FIELD(SmartAir2ControlView, ten_degree),
+  VIEW_FIELD(SmartAir2ControlView, use_swing_bits),
+  VIEW_FIELD(SmartAir2ControlView, turbo_mode),
+  VIEW_FIELD(SmartAir2ControlView, quiet_mode),
+  VIEW_FIELD(SmartAir2ControlView, horizontal_swing),
+  VIEW_FIELD(SmartAir2ControlView, vertical_swing),
+  VIEW_FIELD(SmartAir2ControlView, display_status),
+  VIEW_FIELD(SmartAir2ControlView, set_point),
+};
+
+#undef VIEW_FIELD
+
+template<size_t N>
+haier_protocol::PayloadDelta make_delta(const haier_protocol::PayloadField (&fields)[N], size_t payload_size) {
+  return haier_protocol::PayloadDelta(fields, N, payload_size);
+}
+
+}
+
+const haier_protocol::PayloadDelta& get_hon_control_delta() {
+  static const haier_protocol::PayloadDelta delta = make_delta(HON_CONTROL_FIELDS, HonControlView::SIZE);
+  return delta;
+}
+
+const haier_protocol::PayloadDelta& get_hon_sensors_delta() {
+  static const haier_protocol::PayloadDelta delta = make_delta(HON_SENSORS_FIELDS, HonSensorsView::SIZE);
+  return delta;
+}
+
+const haier_protocol::PayloadDelta& get_hon_big_data_delta() {
+  static const haier_protocol::PayloadDelta delta = make_delta(HON_BIG_DATA_FIELDS, HonBigDataView::SIZE);
+  return delta;
+}
+
+const haier_protocol::PayloadDelta& get_smartair2_control_delta() {
+  static const haier_protocol::PayloadDelta delta = make_delta(SMARTAIR2_CONTROL_FIELDS, SmartAir2ControlView::SIZE);
+  return delta;
+}
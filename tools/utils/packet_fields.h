@@ -0,0 +1,10 @@
+#pragma once
+
+#include "utils/payload_delta.h"
+
+// Field layouts of status packets for change detection, built from the views of packet_views.h
+
+const haier_protocol::PayloadDelta& get_hon_control_delta();
+const haier_protocol::PayloadDelta& get_hon_sensors_delta();
+const haier_protocol::PayloadDelta& get_hon_big_data_delta();
+const haier_protocol::PayloadDelta& get_smartair2_control_delta();
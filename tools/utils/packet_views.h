@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include "utils/payload_view.h"
+
+// Views of hOn and SmartAir2 packets, offsets are from the start of the packet (after subcommand).
+// Bit positions are the ones that GCC/MSVC give to bit fields of hon_packet.h and smartair2_packet.h
+// structures, views give the same bytes on any compiler and work right on the frame data.
+// HonControlView can change the payload, HonControlConstView is read only (the same for other views).
+
+template<class Byte>
+class BasicHonControlView : public haier_protocol::PayloadView<Byte> {
+public:
+  static constexpr size_t SIZE = 10;
+  explicit constexpr BasicHonControlView(Byte* payload) noexcept : haier_protocol::PayloadView<Byte>(payload) {};
+  HAIER_PAYLOAD_FIELD(set_point, haier_protocol::BitsField<0>);
+  HAIER_PAYLOAD_FIELD(vertical_swing_mode, haier_protocol::BitsField<1, 0x0F>);
+  HAIER_PAYLOAD_FIELD(fan_mode, haier_protocol::BitsField<2, 0x07>);
+  HAIER_PAYLOAD_FIELD(special_mode, haier_protocol::BitsField<2, 0x18>);
+  HAIER_PAYLOAD_FIELD(ac_mode, haier_protocol::BitsField<2, 0xE0>);
+  HAIER_PAYLOAD_FIELD(ten_degree, haier_protocol::BitsField<4, 0x01>);
+  HAIER_PAYLOAD_FIELD(display_status, haier_protocol::BitsField<4, 0x02>);
+  HAIER_PAYLOAD_FIELD(half_degree, haier_protocol::BitsField<4, 0x04>);
+  HAIER_PAYLOAD_FIELD(intelligence_status, haier_protocol::BitsField<4, 0x08>);
+  HAIER_PAYLOAD_FIELD(pmv_status, haier_protocol::BitsField<4, 0x10>);
+  HAIER_PAYLOAD_FIELD(use_fahrenheit, haier_protocol::BitsField<4, 0x20>);
+  HAIER_PAYLOAD_FIELD(steri_clean, haier_protocol::BitsField<4, 0x80>);
+  HAIER_PAYLOAD_FIELD(ac_power, haier_protocol::BitsField<5, 0x01>);
+  HAIER_PAYLOAD_FIELD(health_mode, haier_protocol::BitsField<5, 0x02>);
+  HAIER_PAYLOAD_FIELD(electric_heating_status, haier_protocol::BitsField<5, 0x04>);
+  HAIER_PAYLOAD_FIELD(fast_mode, haier_protocol::BitsField<5, 0x08>);
+  HAIER_PAYLOAD_FIELD(quiet_mode, haier_protocol::BitsField<5, 0x10>);
+  HAIER_PAYLOAD_FIELD(sleep_mode, haier_protocol::BitsField<5, 0x20>);
+  HAIER_PAYLOAD_FIELD(lock_remote, haier_protocol::BitsField<5, 0x40>);
+  HAIER_PAYLOAD_FIELD(beeper_status, haier_protocol::BitsField<5, 0x80>);
+  HAIER_PAYLOAD_FIELD(target_humidity, haier_protocol::BitsField<6>);
+  HAIER_PAYLOAD_FIELD(horizontal_swing_mode, haier_protocol::BitsField<7, 0x07>);
+  HAIER_PAYLOAD_FIELD(human_sensing_status, haier_protocol::BitsField<7, 0xC0>);
+  HAIER_PAYLOAD_FIELD(change_filter, haier_protocol::BitsField<8, 0x01>);
+  HAIER_PAYLOAD_FIELD(fresh_air_status, haier_protocol::BitsField<9, 0x01>);
+  HAIER_PAYLOAD_FIELD(humidification_status, haier_protocol::BitsField<9, 0x02>);
+  HAIER_PAYLOAD_FIELD(pm2p5_cleaning_status, haier_protocol::BitsField<9, 0x04>);
+  HAIER_PAYLOAD_FIELD(ch2o_cleaning_status, haier_protocol::BitsField<9, 0x08>);
+  HAIER_PAYLOAD_FIELD(self_cleaning_status, haier_protocol::BitsField<9, 0x10>);
+  HAIER_PAYLOAD_FIELD(light_status, haier_protocol::BitsField<9, 0x20>);
+  HAIER_PAYLOAD_FIELD(energy_saving_status, haier_protocol::BitsField<9, 0x40>);
+  HAIER_PAYLOAD_FIELD(cleaning_time_status, haier_protocol::BitsField<9, 0x80>);
+};
+
+using HonControlView = BasicHonControlView<uint8_t>;
+using HonControlConstView = BasicHonControlView<const uint8_t>;
+
+template<class Byte>
+class BasicHonSensorsView : public haier_protocol::PayloadView<Byte> {
+public:
+  static constexpr size_t SIZE = 18;
+  explicit constexpr BasicHonSensorsView(Byte* payload) noexcept : haier_protocol::PayloadView<Byte>(payload) {};
+  HAIER_PAYLOAD_FIELD(room_temperature, haier_protocol::BitsField<0>);
+  HAIER_PAYLOAD_FIELD(room_humidity, haier_protocol::BitsField<1>);
+  HAIER_PAYLOAD_FIELD(outdoor_temperature, haier_protocol::BitsField<2>);
+  HAIER_PAYLOAD_FIELD(pm2p5_level, haier_protocol::BitsField<3, 0x03>);
+  HAIER_PAYLOAD_FIELD(air_quality, haier_protocol::BitsField<3, 0x0C>);
+  HAIER_PAYLOAD_FIELD(human_sensing, haier_protocol::BitsField<3, 0x30>);
+  HAIER_PAYLOAD_FIELD(ac_type, haier_protocol::BitsField<3, 0x80>);
+  HAIER_PAYLOAD_FIELD(error_status, haier_protocol::BitsField<4>);
+  HAIER_PAYLOAD_FIELD(operation_source, haier_protocol::BitsField<5, 0x03>);
+  HAIER_PAYLOAD_FIELD(operation_mode_hk, haier_protocol::BitsField<5, 0x0C>);
+  HAIER_PAYLOAD_FIELD(err_confirmation, haier_protocol::BitsField<5, 0x80>);
+  HAIER_PAYLOAD_FIELD(total_cleaning_time, haier_protocol::Uint16Field<6>);
+  HAIER_PAYLOAD_FIELD(indoor_pm2p5_value, haier_protocol::Uint16Field<8>);
+  HAIER_PAYLOAD_FIELD(outdoor_pm2p5_value, haier_protocol::Uint16Field<10>);
+  HAIER_PAYLOAD_FIELD(ch2o_value, haier_protocol::Uint16Field<12>);
+  HAIER_PAYLOAD_FIELD(voc_value, haier_protocol::Uint16Field<14>);
+  HAIER_PAYLOAD_FIELD(co2_value, haier_protocol::Uint16Field<16>);
+};
+
+using HonSensorsView = BasicHonSensorsView<uint8_t>;
+using HonSensorsConstView = BasicHonSensorsView<const uint8_t>;
+
+template<class Byte>
+class BasicHonBigDataView : public haier_protocol::PayloadView<Byte> {
+public:
+  static constexpr size_t SIZE = 14;
+  explicit constexpr BasicHonBigDataView(Byte* payload) noexcept : haier_protocol::PayloadView<Byte>(payload) {};
+  HAIER_PAYLOAD_FIELD(power, haier_protocol::Uint16Field<0>);
+  HAIER_PAYLOAD_FIELD(indoor_coil_temperature, haier_protocol::BitsField<2>);
+  HAIER_PAYLOAD_FIELD(outdoor_out_air_temperature, haier_protocol::BitsField<3>);
+  HAIER_PAYLOAD_FIELD(outdoor_coil_temperature, haier_protocol::BitsField<4>);
+  HAIER_PAYLOAD_FIELD(outdoor_in_air_temperature, haier_protocol::BitsField<5>);
+  HAIER_PAYLOAD_FIELD(outdoor_defrost_temperature, haier_protocol::BitsField<6>);
+  HAIER_PAYLOAD_FIELD(compressor_frequency, haier_protocol::BitsField<7>);
+  HAIER_PAYLOAD_FIELD(compressor_current, haier_protocol::Uint16Field<8>);
+  HAIER_PAYLOAD_FIELD(outdoor_fan_status, haier_protocol::BitsField<10, 0x03>);
+  HAIER_PAYLOAD_FIELD(defrost_status, haier_protocol::BitsField<10, 0x0C>);
+  HAIER_PAYLOAD_FIELD(compressor_status, haier_protocol::BitsField<11, 0x03>);
+  HAIER_PAYLOAD_FIELD(indoor_fan_status, haier_protocol::BitsField<11, 0x0C>);
+  HAIER_PAYLOAD_FIELD(four_way_valve_status, haier_protocol::BitsField<11, 0x30>);
+  HAIER_PAYLOAD_FIELD(indoor_electric_heating_status, haier_protocol::BitsField<11, 0xC0>);
+  HAIER_PAYLOAD_FIELD(expansion_valve_open_degree, haier_protocol::Uint16Field<12>);
+};
+
+using HonBigDataView = BasicHonBigDataView<uint8_t>;
+using HonBigDataConstView = BasicHonBigDataView<const uint8_t>;
+
+// hOn status payload: control and sensors (user data answer), big data answer adds big data section
+constexpr size_t HON_SENSORS_OFFSET = HonControlView::SIZE;
+constexpr size_t HON_SENSORS_SPARE_SIZE = 4;
+constexpr size_t HON_BIG_DATA_OFFSET = HON_SENSORS_OFFSET + HonSensorsView::SIZE + HON_SENSORS_SPARE_SIZE;
+constexpr size_t HON_USER_DATA_SIZE = HON_BIG_DATA_OFFSET;
+constexpr size_t HON_BIG_DATA_SIZE = HON_BIG_DATA_OFFSET + HonBigDataView::SIZE;
+
+template<class Byte>
+class BasicHonStatusView : public haier_protocol::PayloadView<Byte> {
+public:
+  static constexpr size_t SIZE = HON_BIG_DATA_SIZE;
+  explicit constexpr BasicHonStatusView(Byte* payload) noexcept : haier_protocol::PayloadView<Byte>(payload) {};
+  constexpr BasicHonControlView<Byte> control() const noexcept { return BasicHonControlView<Byte>(this->payload_); };
+  constexpr BasicHonSensorsView<Byte> sensors() const noexcept { return BasicHonSensorsView<Byte>(this->payload_ + HON_SENSORS_OFFSET); };
+  // Only in big data answer
+  constexpr BasicHonBigDataView<Byte> big_data() const noexcept { return BasicHonBigDataView<Byte>(this->payload_ + HON_BIG_DATA_OFFSET); };
+};
+
+using HonStatusView = BasicHonStatusView<uint8_t>;
+using HonStatusConstView = BasicHonStatusView<const uint8_t>;
+
+template<class Byte>
+class BasicSmartAir2ControlView : public haier_protocol::PayloadView<Byte> {
+public:
+  static constexpr size_t SIZE = 24;
+  explicit constexpr BasicSmartAir2ControlView(Byte* payload) noexcept : haier_protocol::PayloadView<Byte>(payload) {};
+  HAIER_PAYLOAD_FIELD(room_temperature, haier_protocol::BitsField<1>);
+  HAIER_PAYLOAD_FIELD(room_humidity, haier_protocol::BitsField<3>);
+  HAIER_PAYLOAD_FIELD(cntrl, haier_protocol::BitsField<5>);
+  HAIER_PAYLOAD_FIELD(ac_mode, haier_protocol::BitsField<11>);
+  HAIER_PAYLOAD_FIELD(fan_mode, haier_protocol::BitsField<13>);
+  HAIER_PAYLOAD_FIELD(swing_both, haier_protocol::BitsField<15>);
+  HAIER_PAYLOAD_FIELD(use_fahrenheit, haier_protocol::BitsField<16, 0x08>);
+  HAIER_PAYLOAD_FIELD(lock_remote, haier_protocol::BitsField<16, 0x80>);
+  HAIER_PAYLOAD_FIELD(ac_power, haier_protocol::BitsField<17, 0x01>);
+  HAIER_PAYLOAD_FIELD(health_mode, haier_protocol::BitsField<17, 0x08>);
+  HAIER_PAYLOAD_FIELD(compressor, haier_protocol::BitsField<17, 0x10>);
+  HAIER_PAYLOAD_FIELD(ten_degree, haier_protocol::BitsField<17, 0x40>);
+  HAIER_PAYLOAD_FIELD(use_swing_bits, haier_protocol::BitsField<19, 0x01>);
+  HAIER_PAYLOAD_FIELD(turbo_mode, haier_protocol::BitsField<19, 0x02>);
+  HAIER_PAYLOAD_FIELD(quiet_mode, haier_protocol::BitsField<19, 0x04>);
+  HAIER_PAYLOAD_FIELD(horizontal_swing, haier_protocol::BitsField<19, 0x08>);
+  HAIER_PAYLOAD_FIELD(vertical_swing, haier_protocol::BitsField<19, 0x10>);
+  HAIER_PAYLOAD_FIELD(display_status, haier_protocol::BitsField<19, 0x20>);
+  HAIER_PAYLOAD_FIELD(set_point, haier_protocol::BitsField<23>);
+};
+
+using SmartAir2ControlView = BasicSmartAir2ControlView<uint8_t>;
+using SmartAir2ControlConstView = BasicSmartAir2ControlView<const uint8_t>;
@@ -1,10 +1,37 @@
 #include "serial_stream.h"
 #include <iostream>
+#include "utils/haier_log.h"
 
 #if __linux__
+#include <cerrno>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
+
+constexpr int SERIAL_WRITE_TIMEOUT_MS = 100;
+
+namespace {
+
+speed_t get_speed(uint32_t baud_rate) {
+  switch (baud_rate) {
+  case 9600: return B9600;
+  case 19200: return B19200;
+  case 38400: return B38400;
+  case 57600: return B57600;
+  case 115200: return B115200;
+  case 230400: return B230400;
+  case 460800: return B460800;
+  case 921600: return B921600;
+  default: return B0;
+  }
+}
+
+}
+#else
+constexpr uint32_t SUPPORTED_BAUD_RATES[] = { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600 };
 #endif
 
 SerialStream::SerialStream(const std::string& port_path) : buffer_(SERIAL_BUFFER_SIZE) {
@@ -18,7 +45,7 @@ SerialStream::SerialStream(const std::string& port_path) : buffer_(SERIAL_BUFFER
         DCB serialParams = { 0 };
         serialParams.DCBlength = sizeof(serialParams);
         GetCommState(handle_, &serialParams);
-        serialParams.BaudRate = 9600;
+        serialParams.BaudRate = baud_rate_;
         serialParams.ByteSize = 8;
         serialParams.fBinary = 1;
         serialParams.fRtsControl = 0;
@@ -39,10 +66,11 @@ SerialStream::SerialStream(const std::string& port_path) : buffer_(SERIAL_BUFFER
         SetCommTimeouts(handle_, &timeout);
     }
 #else
-    handle_ = open(port_path.c_str(), O_RDWR | O_NOCTTY );
+    handle_ = open(port_path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
     if (is_valid()) {
       struct termios tty;
       if (tcgetattr(handle_, &tty) != 0) {
+        close(handle_);
         handle_ = -1;
         return;
       }
@@ -63,12 +91,24 @@ SerialStream::SerialStream(const std::string& port_path) : buffer_(SERIAL_BUFFER
       tty.c_oflag &= ~ONLCR;
       tty.c_cc[VTIME] = 0;
       tty.c_cc[VMIN] = 0;
-      cfsetispeed(&tty, B9600);
-      cfsetospeed(&tty, B9600);
+      cfsetispeed(&tty, get_speed(baud_rate_));
+      cfsetospeed(&tty, get_speed(baud_rate_));
       if (tcsetattr(handle_, TCSANOW, &tty) != 0) {
+        close(handle_);
         handle_ = -1;
         return;
       }
+      // If epoll is not available wait_for_data works as a simple delay
+      epoll_handle_ = epoll_create1(EPOLL_CLOEXEC);
+      if (epoll_handle_ >= 0) {
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = handle_;
+        if (epoll_ctl(epoll_handle_, EPOLL_CTL_ADD, handle_, &event) != 0) {
+          close(epoll_handle_);
+          epoll_handle_ = -1;
+        }
+      }
     }
 #endif
 }
@@ -81,6 +121,9 @@ SerialStream::~SerialStream() {
 #else
     close(handle_);
     handle_ = -1;
+    if (epoll_handle_ >= 0)
+      close(epoll_handle_);
+    epoll_handle_ = -1;
 #endif
   }
 }
@@ -93,32 +136,39 @@ bool SerialStream::is_valid() const {
 #endif
 };
 
-size_t SerialStream::available() noexcept {
-    if (!is_valid())
+size_t SerialStream::fill_buffer_() noexcept {
+    uint8_t* segment1;
+    uint8_t* segment2;
+    size_t size1, size2;
+    if (buffer_.get_free_segments(segment1, size1, segment2, size2) == 0)
         return 0;
-    if (buffer_.empty())
-    {
-        static uint8_t tmp_buf[SERIAL_BUFFER_SIZE];
-        unsigned long size;
-        int status;
 #if _WIN32
-        status = ReadFile(handle_, tmp_buf, SERIAL_BUFFER_SIZE, &size, nullptr);
+    DWORD size;
+    size_t total = 0;
+    if (ReadFile(handle_, segment1, (DWORD)size1, &size, nullptr)) {
+        total = size;
+        if ((size == size1) && (size2 > 0) && ReadFile(handle_, segment2, (DWORD)size2, &size, nullptr))
+            total += size;
+    }
+    return buffer_.commit(total);
 #else
-        status = read(handle_, tmp_buf, SERIAL_BUFFER_SIZE);
-        if (status >= 0) {
-            size = status;
-            status = 1;
-        }
-        else {
-            status = 0;
-            size = 0;
-        }
+    struct iovec segments[2] = { { segment1, size1 }, { segment2, size2 } };
+    ssize_t res;
+    do {
+        res = readv(handle_, segments, size2 > 0 ? 2 : 1);
+    } while ((res < 0) && (errno == EINTR));
+    // EAGAIN means there is no data yet
+    if (res <= 0)
+        return 0;
+    return buffer_.commit((size_t)res);
 #endif
-        if ((status != 0) && (size > 0))
-            buffer_.push(tmp_buf, size);
-        else
-            return 0;
-    }
+}
+
+size_t SerialStream::available() noexcept {
+    if (!is_valid())
+        return 0;
+    if (buffer_.empty())
+        fill_buffer_();
     return buffer_.get_size();
 };
 size_t SerialStream::read_array(uint8_t* data, size_t len) noexcept {
@@ -129,13 +179,134 @@ size_t SerialStream::read_array(uint8_t* data, size_t len) noexcept {
         len = av;
     return buffer_.pop(data, len);
 }
+size_t SerialStream::read_into(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept {
+    if (!is_valid())
+        return 0;
+    // Data left from available() calls goes first
+    if (!buffer_.empty()) {
+        size_t result = buffer_.pop(data1, size1);
+        if ((result == size1) && (size2 > 0))
+            result += buffer_.pop(data2, size2);
+        return result;
+    }
+#if _WIN32
+    DWORD size;
+    size_t result = 0;
+    if (ReadFile(handle_, data1, (DWORD)size1, &size, nullptr)) {
+        result = size;
+        if ((size == size1) && (size2 > 0) && ReadFile(handle_, data2, (DWORD)size2, &size, nullptr))
+            result += size;
+    }
+    return result;
+#else
+    // One system call, data goes straight to the caller's buffers
+    struct iovec segments[2] = { { data1, size1 }, { data2, size2 } };
+    ssize_t res;
+    do {
+        res = readv(handle_, segments, size2 > 0 ? 2 : 1);
+    } while ((res < 0) && (errno == EINTR));
+    return res > 0 ? (size_t)res : 0;
+#endif
+}
+
 void SerialStream::write_array(const uint8_t* data, size_t len) noexcept {
     if (!is_valid())
         return;
 #if _WIN32
     WriteFile(handle_, data, len, nullptr, nullptr);
 #else
-    write(handle_, data, len);
+    // Port is non-blocking so write can be partial when kernel buffer is full
+    while (len > 0) {
+        ssize_t res = write(handle_, data, len);
+        if (res > 0) {
+            data += res;
+            len -= res;
+        } else if ((res < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            struct pollfd pfd = { handle_, POLLOUT, 0 };
+            if (poll(&pfd, 1, SERIAL_WRITE_TIMEOUT_MS) <= 0) {
+                HAIER_LOGW("Serial port write timeout, %d bytes dropped", (int)len);
+                return;
+            }
+        } else if ((res < 0) && (errno != EINTR))
+            return;
+    }
+#endif
+}
+
+long SerialStream::write_some(const uint8_t* data, size_t len) noexcept {
+    if (!is_valid())
+        return -1;
+#if _WIN32
+    DWORD size;
+    if (!WriteFile(handle_, data, (DWORD)len, &size, nullptr))
+        return -1;
+    return (long)size;
+#else
+    ssize_t res;
+    do {
+        res = write(handle_, data, len);
+    } while ((res < 0) && (errno == EINTR));
+    if (res < 0)
+        return (errno == EAGAIN) || (errno == EWOULDBLOCK) ? 0 : -1;
+    return (long)res;
 #endif
 }
 
+bool SerialStream::wait_for_data(std::chrono::milliseconds timeout) noexcept {
+    if (!buffer_.empty())
+        return true;
+#if __linux__
+    if (is_valid() && (epoll_handle_ >= 0)) {
+        struct epoll_event event;
+        if (epoll_wait(epoll_handle_, &event, 1, (int)timeout.count()) <= 0)
+            return false;
+        return available() > 0;
+    }
+#endif
+    std::this_thread::sleep_for(timeout);
+    return available() > 0;
+}
+
+bool SerialStream::supports_baud_rate(uint32_t baud_rate) const noexcept {
+#if _WIN32
+    for (uint32_t rate : SUPPORTED_BAUD_RATES)
+        if (rate == baud_rate)
+            return true;
+    return false;
+#else
+    return get_speed(baud_rate) != B0;
+#endif
+}
+
+bool SerialStream::set_baud_rate(uint32_t baud_rate) noexcept {
+    if (!is_valid() || !supports_baud_rate(baud_rate))
+        return false;
+    if (baud_rate == baud_rate_)
+        return true;
+#if _WIN32
+    // Wait till the last frame is sent at the old rate
+    FlushFileBuffers(handle_);
+    DCB serialParams = { 0 };
+    serialParams.DCBlength = sizeof(serialParams);
+    if (!GetCommState(handle_, &serialParams))
+        return false;
+    serialParams.BaudRate = baud_rate;
+    if (!SetCommState(handle_, &serialParams))
+        return false;
+#else
+    struct termios tty;
+    if (tcgetattr(handle_, &tty) != 0)
+        return false;
+    cfsetispeed(&tty, get_speed(baud_rate));
+    cfsetospeed(&tty, get_speed(baud_rate));
+    // TCSADRAIN applies new settings after the last frame is sent at the old rate
+    int res;
+    do {
+        res = tcsetattr(handle_, TCSADRAIN, &tty);
+    } while ((res != 0) && (errno == EINTR));
+    if (res != 0)
+        return false;
+#endif
+    baud_rate_ = baud_rate;
+    return true;
+}
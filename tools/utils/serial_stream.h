@@ -2,6 +2,7 @@
 #define SERIAL_STREAM
 #include <string>
 #include <thread>
+#include <chrono>
 #include "utils/protocol_stream.h"
 #include "utils/circular_buffer.h"
 
@@ -23,13 +24,29 @@ public:
     size_t available() noexcept override;
     size_t read_array(uint8_t* data, size_t len) noexcept override;
     void write_array(const uint8_t* data, size_t len) noexcept override;
+    size_t read_into(uint8_t* data1, size_t size1, uint8_t* data2, size_t size2) noexcept override;
+    // Write without waiting, return the number of bytes accepted by the port or -1 on error
+    long write_some(const uint8_t* data, size_t len) noexcept;
+#if __linux__
+    // For event loops that wait on several ports
+    int get_file_descriptor() const noexcept { return handle_; };
+#endif
+    // Wait until there is data to read or timeout expires, return true if data is available
+    bool wait_for_data(std::chrono::milliseconds timeout) noexcept;
+    uint32_t get_baud_rate() const noexcept override { return baud_rate_; };
+    bool supports_baud_rate(uint32_t baud_rate) const noexcept override;
+    bool set_baud_rate(uint32_t baud_rate) noexcept override;
 private:
+    // Read from the port straight into the free space of buffer_
+    size_t fill_buffer_() noexcept;
 #if __linux__
   int handle_{ -1 };
+  int epoll_handle_{ -1 };
 #elif _WIN32
   HANDLE handle_{ INVALID_HANDLE_VALUE };
 #endif
     CircularBuffer<uint8_t> buffer_;
+    uint32_t baud_rate_{ haier_protocol::DEFAULT_BAUD_RATE };
     std::thread read_thread_;
 };
 
@@ -0,0 +1,175 @@
+#include "shard_runtime.h"
+#include <algorithm>
+
+#if _WIN32
+#include <windows.h>
+#elif __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+
+struct CurrentShard {
+  const ShardRuntime* runtime{ nullptr };
+  int index{ -1 };
+};
+
+thread_local CurrentShard current_shard;
+
+bool pin_current_thread(unsigned int core) {
+#if _WIN32
+  return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << core) != 0;
+#elif __linux__
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(core, &cpu_set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0;
+#else
+  (void) core;
+  return false;
+#endif
+}
+
+}
+
+ShardRuntime::Shard::Shard(unsigned int index, unsigned int shards_count, size_t mailbox_size) :
+  index(index),
+  external_inbox(mailbox_size) {
+  for (unsigned int source = 0; source < shards_count; source++)
+    this->inbox.emplace_back(new haier_protocol::SpscQueue<Task>(mailbox_size));
+}
+
+ShardRuntime::ShardRuntime(unsigned int shards_count, size_t mailbox_size) {
+  if (shards_count == 0)
+    shards_count = ShardRuntime::get_cores_count();
+  for (unsigned int index = 0; index < shards_count; index++)
+    this->shards_.emplace_back(new Shard(index, shards_count, mailbox_size));
+}
+
+ShardRuntime::~ShardRuntime() {
+  this->stop();
+}
+
+unsigned int ShardRuntime::get_cores_count() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+DeviceId ShardRuntime::add_device(std::unique_ptr<ShardDevice> device, int shard) {
+  unsigned int shards_count = this->get_shards_count();
+  unsigned int index = shard < 0 ? (unsigned int) this->devices_.size() % shards_count : (unsigned int) shard % shards_count;
+  this->shards_[index]->devices.push_back(device.get());
+  this->devices_.push_back({ std::move(device), index });
+  return (DeviceId) this->devices_.size() - 1;
+}
+
+bool ShardRuntime::start(std::chrono::microseconds loop_interval, bool pin_threads) {
+  if (this->running_)
+    return false;
+  this->running_ = true;
+  for (auto& shard : this->shards_)
+    shard->thread = std::thread(&ShardRuntime::shard_loop_, this, std::ref(*shard), loop_interval, pin_threads);
+  return true;
+}
+
+void ShardRuntime::stop() {
+  if (!this->running_)
+    return;
+  this->running_ = false;
+  for (auto& shard : this->shards_) {
+    this->wake_(*shard);
+    if (shard->thread.joinable())
+      shard->thread.join();
+  }
+}
+
+int ShardRuntime::get_current_shard() const {
+  return current_shard.runtime == this ? current_shard.index : -1;
+}
+
+bool ShardRuntime::post(DeviceId device, DeviceTask task) {
+  if (device >= this->devices_.size())
+    return false;
+  Shard& destination = *this->shards_[this->devices_[device].shard];
+  int source = this->get_current_shard();
+  if (source == (int) destination.index) {
+    // Owner shard, nothing to send
+    task(*this->devices_[device].device);
+    destination.statistics.tasks_run.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+  bool result;
+  if (source >= 0)
+    result = destination.inbox[source]->emplace(Task{ device, std::move(task) });
+  else
+    result = destination.external_inbox.emplace(Task{ device, std::move(task) });
+  if (!result) {
+    destination.statistics.tasks_rejected.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  this->wake_(destination);
+  return true;
+}
+
+void ShardRuntime::wake_(Shard& shard) {
+  shard.wakeup_pending.store(true);
+  // Mutex is touched only if the shard really sleeps
+  if (shard.sleeping.load()) {
+    std::lock_guard<std::mutex> lock(shard.wakeup_mutex);
+    shard.wakeup_condition.notify_one();
+  }
+}
+
+bool ShardRuntime::run_tasks_(Shard& shard) {
+  uint64_t count = 0;
+  Task task;
+  for (auto& mailbox : shard.inbox) {
+    while (mailbox->pop(task)) {
+      task.task(*this->devices_[task.device].device);
+      count++;
+    }
+  }
+  while (shard.external_inbox.pop(task)) {
+    task.task(*this->devices_[task.device].device);
+    count++;
+  }
+  if (count > 0)
+    shard.statistics.tasks_run.fetch_add(count, std::memory_order_relaxed);
+  return count > 0;
+}
+
+void ShardRuntime::shard_loop_(Shard& shard, std::chrono::microseconds loop_interval, bool pin_thread) {
+  using Clock = std::chrono::steady_clock;
+  if (pin_thread)
+    pin_current_thread(shard.index % ShardRuntime::get_cores_count());
+  current_shard.runtime = this;
+  current_shard.index = (int) shard.index;
+  Clock::time_point next_round = Clock::now();
+  while (this->running_) {
+    // Cleared before the mailboxes are checked, so no task that arrives later is missed
+    shard.wakeup_pending.store(false);
+    bool has_tasks = this->run_tasks_(shard);
+    Clock::time_point now = Clock::now();
+    // Devices that just got a task can answer it right away
+    if (has_tasks || (now >= next_round)) {
+      for (ShardDevice* device : shard.devices)
+        device->loop(now);
+      shard.statistics.rounds.fetch_add(1, std::memory_order_relaxed);
+      if (now >= next_round) {
+        next_round += loop_interval;
+        // Rounds that were missed are skipped, not run back to back
+        if (next_round <= now)
+          next_round = now + loop_interval;
+      }
+    }
+    shard.sleeping.store(true);
+    {
+      std::unique_lock<std::mutex> lock(shard.wakeup_mutex);
+      shard.wakeup_condition.wait_until(lock, next_round, [this, &shard]() {
+        return shard.wakeup_pending.load() || !this->running_;
+      });
+    }
+    shard.sleeping.store(false);
+  }
+  current_shard = CurrentShard();
+}
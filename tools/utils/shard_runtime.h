@@ -0,0 +1,100 @@
+#ifndef SHARD_RUNTIME_H
+#define SHARD_RUNTIME_H
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "utils/mpsc_queue.h"
+#include "utils/spsc_queue.h"
+
+// Shared-nothing runtime for hosts that drive many devices: every shard is a thread
+// (pinned to its own core if possible) with its own event loop that owns a fixed subset
+// of devices. A device (ProtocolHandler with its streams, timers and servers) is used
+// only by the thread of its shard, so nothing is locked and no cache lines are shared
+// between cores on the hot path.
+// Work for a device on another shard is sent as a task: shards use one SPSC mailbox
+// per (source, destination) pair, other threads share one MPSC mailbox per shard.
+
+// Everything that lives on one shard
+class ShardDevice {
+public:
+  virtual ~ShardDevice() {};
+  // Called from the shard thread every loop interval (and after tasks were run),
+  // usually runs ProtocolHandler::loop of the device handlers
+  virtual void loop(std::chrono::steady_clock::time_point now) = 0;
+};
+
+using DeviceId = unsigned int;
+// Runs on the shard that owns the device
+using DeviceTask = std::function<void(ShardDevice&)>;
+
+constexpr size_t DEFAULT_MAILBOX_SIZE = 256;
+
+struct ShardStatistics {
+  std::atomic<uint64_t> rounds{ 0 };
+  std::atomic<uint64_t> tasks_run{ 0 };
+  std::atomic<uint64_t> tasks_rejected{ 0 };   // destination mailbox was full
+};
+
+class ShardRuntime {
+public:
+  // shards_count 0 means one shard per core
+  explicit ShardRuntime(unsigned int shards_count = 0, size_t mailbox_size = DEFAULT_MAILBOX_SIZE);
+  ShardRuntime(const ShardRuntime&) = delete;
+  ShardRuntime& operator=(const ShardRuntime&) = delete;
+  ~ShardRuntime();
+  unsigned int get_shards_count() const { return (unsigned int) this->shards_.size(); };
+  // Only before start. Devices are spread over shards round robin unless shard is given
+  DeviceId add_device(std::unique_ptr<ShardDevice> device, int shard = -1);
+  size_t get_devices_count() const { return this->devices_.size(); };
+  unsigned int get_device_shard(DeviceId device) const { return this->devices_[device].shard; };
+  // Device object for the code that runs on its shard (or after stop)
+  ShardDevice& get_device(DeviceId device) { return *this->devices_[device].device; };
+  // pin_threads: bind shard N to core N (Linux and Windows), shards_count should not exceed cores count
+  bool start(std::chrono::microseconds loop_interval, bool pin_threads = true);
+  void stop();
+  bool is_running() const { return this->running_; };
+  // Any thread. Tasks for a device on the calling shard are run right away,
+  // others go to the mailbox of the owner shard. Return false if the mailbox is full.
+  bool post(DeviceId device, DeviceTask task);
+  // Shard of the calling thread, -1 if it is not a shard thread of this runtime
+  int get_current_shard() const;
+  const ShardStatistics& get_statistics(unsigned int shard) const { return this->shards_[shard]->statistics; };
+  static unsigned int get_cores_count();
+private:
+  struct Task {
+    DeviceId device;
+    DeviceTask task;
+  };
+  struct Shard {
+    Shard(unsigned int index, unsigned int shards_count, size_t mailbox_size);
+    unsigned int index;
+    std::vector<ShardDevice*> devices;
+    // inbox[source] is written only by shard source
+    std::vector<std::unique_ptr<haier_protocol::SpscQueue<Task>>> inbox;
+    haier_protocol::MpscQueue<Task> external_inbox;
+    std::atomic<bool> sleeping{ false };
+    std::atomic<bool> wakeup_pending{ false };
+    std::mutex wakeup_mutex;
+    std::condition_variable wakeup_condition;
+    ShardStatistics statistics;
+    std::thread thread;
+  };
+  struct DeviceSlot {
+    std::unique_ptr<ShardDevice> device;
+    unsigned int shard;
+  };
+  void shard_loop_(Shard& shard, std::chrono::microseconds loop_interval, bool pin_thread);
+  bool run_tasks_(Shard& shard);
+  void wake_(Shard& shard);
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::vector<DeviceSlot> devices_;
+  std::atomic<bool> running_{ false };
+};
+
+#endif // SHARD_RUNTIME_H
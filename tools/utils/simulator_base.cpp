@@ -1,25 +1,37 @@
 #include "simulator_base.h"
 #include "console_log.h"
 #include "serial_stream.h"
+#include "metrics_server.h"
 #include <thread>
 #include <iostream>
 
 bool app_exiting{ false };
 int last_key_pressed{ 0 };
 
-void protocol_loop(haier_protocol::ProtocolHandler* handler, protocol_preloop ploop) {
+void protocol_loop(haier_protocol::ProtocolHandler* handler, SerialStream* stream, protocol_preloop ploop) {
   while (!app_exiting) {
     ploop(handler);
     handler->loop();
-    std::this_thread::sleep_for(std::chrono::milliseconds(3));
+    // Wake up as soon as new data arrives, timeout keeps timers and preloop going
+    stream->wait_for_data(std::chrono::milliseconds(3));
   }
 }
 
-void simulator_main(const char* app_name, const char* port_name, message_handlers mhandlers, keyboard_handlers khandlers, protocol_preloop ploop) {
-  simulator_main(app_name, port_name, mhandlers, answer_handlers(), khandlers, ploop);
+void simulator_main(const char* app_name, const char* port_name, message_handlers mhandlers, keyboard_handlers khandlers, protocol_preloop ploop, const char* metrics_address) {
+  simulator_main(app_name, port_name, mhandlers, answer_handlers(), khandlers, ploop, metrics_address);
 }
 
-void simulator_main(const char* app_name, const char* port_name, message_handlers mhandlers, answer_handlers ahandlers, keyboard_handlers khandlers, protocol_preloop ploop) {
+void simulator_main(const char* app_name, const char* port_name, message_handlers mhandlers, answer_handlers ahandlers, keyboard_handlers khandlers, protocol_preloop ploop, const char* metrics_address) {
+  protocol_setup setup = [&mhandlers, &ahandlers](haier_protocol::ProtocolHandler& protocol_handler) {
+    for (auto it = mhandlers.begin(); it != mhandlers.end(); it++)
+      protocol_handler.set_message_handler(it->first, std::bind(it->second, &protocol_handler, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+    for (auto it = ahandlers.begin(); it != ahandlers.end(); it++)
+      protocol_handler.set_answer_handler(it->first, std::bind(it->second, &protocol_handler, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
+  };
+  simulator_main(app_name, port_name, setup, khandlers, ploop, metrics_address);
+}
+
+void simulator_main(const char* app_name, const char* port_name, protocol_setup setup, keyboard_handlers khandlers, protocol_preloop ploop, const char* metrics_address) {
   haier_protocol::set_log_handler(console_logger);
   SerialStream serial_stream(port_name);
   if (!serial_stream.is_valid()) {
@@ -28,11 +40,14 @@ void simulator_main(const char* app_name, const char* port_name, message_handler
   }
   haier_protocol::ProtocolHandler protocol_handler(serial_stream);
   protocol_handler.set_answer_timeout(1000);
-  for (auto it = mhandlers.begin(); it != mhandlers.end(); it++)
-    protocol_handler.set_message_handler(it->first, std::bind(it->second, &protocol_handler, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
-  for (auto it = ahandlers.begin(); it != ahandlers.end(); it++)
-    protocol_handler.set_answer_handler(it->first, std::bind(it->second, &protocol_handler, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
-  std::thread protocol_thread(std::bind(&protocol_loop, &protocol_handler, ploop));
+  setup(protocol_handler);
+  MetricsServer metrics_server;
+  if (metrics_address != nullptr) {
+    protocol_handler.enable_latency_statistics();
+    metrics_server.register_handler(protocol_handler, port_name, app_name);
+    metrics_server.start(metrics_address);
+  }
+  std::thread protocol_thread(std::bind(&protocol_loop, &protocol_handler, &serial_stream, ploop));
 #if _WIN32
   SetConsoleTitle(std::string(app_name).append(", port=").append(port_name).append(". Press ESC to exit").c_str());
 #endif
@@ -55,4 +70,5 @@ void simulator_main(const char* app_name, const char* port_name, message_handler
     std::this_thread::sleep_for(std::chrono::milliseconds(10));
   }
   protocol_thread.join();
+  metrics_server.stop();
 }
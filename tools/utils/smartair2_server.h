@@ -3,11 +3,24 @@
 #include <stdint.h>
 #include "protocol/haier_protocol.h"
 #include "smartair2_packet.h"
+#include "packet_views.h"
 
-esphome::haier::smartair2_protocol::HaierPacketControl& get_ac_state_ref();
+// Simulated SmartAir2 appliance, every instance has its own state so several
+// appliances can run in one process
+class SmartAir2Server {
+public:
+  SmartAir2Server();
+  // Register all message handlers of the appliance
+  void register_handlers(haier_protocol::ProtocolHandler& protocol_handler);
 
-haier_protocol::HandlerError status_request_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
+  // State is kept as status answer payload
+  SmartAir2ControlView get_ac_state() { return SmartAir2ControlView(this->ac_status_); }
 
-haier_protocol::HandlerError report_network_status_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
+  haier_protocol::HandlerError status_request_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
 
-haier_protocol::HandlerError unsupported_message_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
\ No newline at end of file
+  haier_protocol::HandlerError report_network_status_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
+
+  haier_protocol::HandlerError unsupported_message_handler(haier_protocol::ProtocolHandler* protocol_handler, haier_protocol::FrameType type, const uint8_t* buffer, size_t size);
+private:
+  uint8_t ac_status_[SmartAir2ControlView::SIZE];
+};
\ No newline at end of file